@@ -0,0 +1,128 @@
+#pragma once
+
+#ifndef __SYLAR_COMPUTE_H__
+#define __SYLAR_COMPUTE_H__
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <type_traits>
+#include <utility>
+#include "scheduler.h"
+#include "singleton.h"
+
+namespace sylar
+{
+    // 无参调用 F 的结果类型. std::result_of 在 C++17 废弃, C++20 移除(SYLAR_COROUTINE 构建)
+#if __cplusplus >= 201703L
+    template <class F>
+    using InvokeResult = std::invoke_result_t<F &>;
+#else
+    template <class F>
+    using InvokeResult = decltype(std::declval<F &>()());
+#endif
+
+    /**
+     * @brief 计算线程池, 不带 epoll 的 Scheduler
+     * @details 压缩, 哈希, 加解密这类耗 CPU 的步骤不应该占住 IOManager 的线程.
+     *          协程调用 offload 把函数交给这里执行, 自己挂起, 完成后回到原来的调度器和线程上继续.
+     *          空闲的线程等待信号量, 不像 Scheduler::idle 那样空转.
+     *          函数在这里执行时关闭 hook, 其中的阻塞调用直接阻塞计算线程
+     */
+    class ComputePool : public Scheduler
+    {
+    public:
+        typedef std::shared_ptr<ComputePool> ptr;
+
+        struct Stat
+        {
+            uint64_t threads = 0;
+            // 交给线程池执行的函数
+            uint64_t submitted = 0;
+            uint64_t completed = 0;
+            // 不在任务协程中(或者已经在本线程池中)直接执行的函数
+            uint64_t inlined = 0;
+            // 提交时所有线程都在执行, 需要排队的次数
+            uint64_t saturated = 0;
+            // 当前正在执行和排队的函数
+            uint64_t running = 0;
+            uint64_t queued = 0;
+            // 排队的最大长度
+            uint64_t queueMax = 0;
+            // 排队和执行的总耗时
+            uint64_t waitNs = 0;
+            uint64_t runNs = 0;
+        };
+
+        /**
+         * @param[in] threads 线程数, 为 0 时取 compute.threads
+         * @param[in] name 线程池名称, 线程名为 name_序号
+         */
+        ComputePool(size_t threads = 0, const std::string &name = "compute");
+        ~ComputePool();
+
+        /**
+         * @brief 在线程池上执行 fn, 挂起当前协程直到完成, 之后在原来的线程上返回
+         * @details 不在调度器的任务协程中(调度协程, idle 协程, use_caller 线程 stop 之前的主协程)
+         *          或者已经在本线程池中时直接执行. fn 抛出的异常在调用者的协程中重新抛出.
+         *          挂起的协程不计入原来调度器的任务, 调度器需要在它返回之后再停止
+         */
+        void run(const std::function<void()> &fn);
+
+        // 执行 fn 并返回它的结果
+        template <class F>
+        typename std::enable_if<!std::is_void<InvokeResult<F>>::value, InvokeResult<F>>::type
+        offload(F fn)
+        {
+            typedef InvokeResult<F> R;
+            // 结果不一定可以默认构造, 在线程池上构造
+            std::unique_ptr<R> result;
+            run([&fn, &result]()
+                { result.reset(new R(fn())); });
+            return std::move(*result);
+        }
+
+        template <class F>
+        typename std::enable_if<std::is_void<InvokeResult<F>>::value>::type
+        offload(F fn)
+        {
+            run(fn);
+        }
+
+        void getStat(Stat &stat) const;
+        std::string dumpStat() const;
+
+    protected:
+        void tickle() override;
+        void idle() override;
+
+    private:
+        struct Task;
+        void execute(Task *task);
+
+    private:
+        Semaphore m_sem;
+        std::atomic<uint64_t> m_submitted = {0};
+        std::atomic<uint64_t> m_completed = {0};
+        std::atomic<uint64_t> m_inlined = {0};
+        std::atomic<uint64_t> m_saturated = {0};
+        std::atomic<uint64_t> m_running = {0};
+        std::atomic<uint64_t> m_queued = {0};
+        std::atomic<uint64_t> m_queueMax = {0};
+        std::atomic<uint64_t> m_waitNs = {0};
+        std::atomic<uint64_t> m_runNs = {0};
+    };
+
+    // 默认的计算线程池, 线程数为 compute.threads
+    typedef Singleton<ComputePool> ComputeMgr;
+
+    // 在默认的计算线程池上执行 fn 并返回它的结果
+    template <class F>
+    InvokeResult<F> Offload(F fn)
+    {
+        return ComputeMgr::GetInstance()->offload(std::move(fn));
+    }
+}
+
+#endif
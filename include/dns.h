@@ -0,0 +1,133 @@
+#pragma once
+
+#ifndef __SYLAR_DNS_H__
+#define __SYLAR_DNS_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "address.h"
+#include "thread.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace sylar
+{
+    class Scheduler;
+    class Fiber;
+
+    /**
+     * @brief 协程友好的 DNS 解析器
+     * @details 通过 hook 之后的 UDP socket 直接向 DNS 服务器查询 A/AAAA 记录,
+     *          等待应答时只挂起当前协程. 结果按记录的 TTL 缓存(不超过 dns.cache.max_ttl),
+     *          不存在的域名按 dns.cache.negative_ttl 缓存. 同一个域名同时只有一个查询在进行,
+     *          其他协程挂起等待它的结果. 先查 /etc/hosts, 服务器取 dns.servers,
+     *          为空时取 /etc/resolv.conf 中的 nameserver. 短域名按 dns.search
+     *          (为空时取 /etc/resolv.conf 中的 search/domain 和 ndots) 加上搜索域查询
+     */
+    class DnsResolver : Noncopyable
+    {
+    public:
+        typedef Mutex MutexType;
+
+        /**
+         * @brief 解析的结果
+         */
+        enum Status
+        {
+            // 得到了地址
+            OK = 0,
+            // 服务器应答了但是没有地址(域名不存在, 没有这个类型的记录, 或者命中了这样的缓存)
+            NOT_FOUND,
+            // 没有服务器给出可用的应答(超时, 出错, 应答被截断), 可以换其他方式再查
+            NO_ANSWER
+        };
+
+        struct Stat
+        {
+            // 发往服务器的查询(一个域名的 A 和 AAAA 算一次)
+            uint64_t queries = 0;
+            // 命中缓存(包括 /etc/hosts)
+            uint64_t cacheHits = 0;
+            // 等待其他协程正在进行的查询
+            uint64_t coalesced = 0;
+            // 超时, 服务器出错或者应答被截断
+            uint64_t failures = 0;
+            // 域名不存在
+            uint64_t nxdomains = 0;
+            // 缓存的条目数
+            uint64_t cacheSize = 0;
+        };
+
+        DnsResolver();
+
+        /**
+         * @brief 解析主机名, 得到的地址端口为 0
+         * @param[in] host 主机名, 不能是数字地址
+         * @param[in] family AF_INET, AF_INET6 或者 AF_UNSPEC(IPv4 在前)
+         * @param[out] result 解析得到的地址, 与缓存共享, 修改之前需要复制
+         * @return 加上各个搜索域都没有地址时, 只要有一次没有得到应答就返回 NO_ANSWER, 否则返回 NOT_FOUND
+         */
+        Status resolve(const std::string &host, int family, std::vector<IPAddress::ptr> &result);
+        // 是否有可用的 DNS 服务器
+        bool isAvailable();
+        // 设置 DNS 服务器, 格式为 ip, ip:port 或者 [ipv6]:port
+        void setServers(const std::vector<std::string> &servers);
+        // 设置搜索域, 为空时取 /etc/resolv.conf 中的 search/domain
+        void setSearch(const std::vector<std::string> &search);
+        void clearCache();
+
+        void getStat(Stat &stat);
+        std::string dumpStat();
+
+    private:
+        // 缓存的结果, 地址为空表示域名不存在
+        struct Entry
+        {
+            std::vector<IPAddress::ptr> addrs;
+            // 过期时间, 单调时钟 ms
+            uint64_t expire = 0;
+        };
+        // 正在进行的查询, 等待它的协程在查询结束后被调度
+        struct Pending
+        {
+            std::vector<std::pair<Scheduler *, std::shared_ptr<Fiber> > > waiters;
+            std::vector<IPAddress::ptr> addrs;
+            Status status = NO_ANSWER;
+        };
+        /**
+         * @brief 向一个服务器查询
+         * @param[out] ttl 记录中最小的 TTL(秒)
+         * @param[out] nxdomain 域名不存在
+         * @return 得到应答返回 true(包括域名不存在), 超时, 出错或者应答被截断(TC)返回 false
+         */
+        bool query(const IPAddress::ptr &server, const std::string &name, int family,
+                   std::vector<IPAddress::ptr> &result, uint32_t &ttl, bool &nxdomain);
+        // 查询一个完整的域名: 缓存, 等待正在进行的查询, 或者自己查询
+        Status resolveName(const std::string &name, int family, std::vector<IPAddress::ptr> &result);
+        // 依次向各个服务器查询, 并写入缓存; 没有得到应答时不缓存
+        Status lookup(const std::string &name, int family, const std::string &key,
+                    std::vector<IPAddress::ptr> &result);
+        void loadHosts();
+        void loadResolvConf(std::vector<std::string> &servers, std::vector<std::string> &search, int &ndots);
+
+    private:
+        MutexType m_mutex;
+        std::vector<IPAddress::ptr> m_servers;
+        std::vector<std::string> m_search;
+        // 点的个数不少于 ndots 的域名先按原样查询
+        int m_ndots = 1;
+        // /etc/hosts 中的地址
+        std::map<std::string, std::vector<IPAddress::ptr> > m_hosts;
+        // key 为 "域名/family"
+        std::map<std::string, Entry> m_cache;
+        std::map<std::string, std::shared_ptr<Pending> > m_pending;
+        Stat m_stat;
+    };
+
+    typedef Singleton<DnsResolver> DnsResolverMgr;
+}
+
+#endif
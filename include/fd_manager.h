@@ -2,26 +2,33 @@
 #define __FD_MANAGER_H__
 
 #include <memory>
+#include <atomic>
 #include <iomanager.h>
 #include "thread.h"
 #include "singleton.h"
 
 namespace sylar
 {
+    class FdManager;
+
     /*
         每一个句柄fd 的类，每一个对象保存着一个句柄
         句柄分为filefd，和scokfd
+        由 FdManager 按句柄号分配, 不会释放: 句柄关闭后记录保留, 句柄号被复用时原地重新初始化,
+        所以拿到的指针一直有效. 关心句柄号是否被复用的调用者比较 getGeneration
     */
-    class FdCtx : public std::enable_shared_from_this<FdCtx>
+    class FdCtx : Noncopyable
     {
+        friend class FdManager;
         public:
-            typedef std::shared_ptr<FdCtx> ptr;
             FdCtx(int fd);
             ~FdCtx();
 
             bool init();
             bool isInit() const {return m_isInit;}
             bool isSocket() const {return m_isSocket;}
+            // 是否为普通文件或者块设备, 读写不能由 epoll 等待
+            bool isFile() const {return m_isFile;}
             bool isClose() const {return m_isClosed;}
 
             void setUserNonblock(bool v) {m_userNonblock = v;}
@@ -32,6 +39,28 @@ namespace sylar
 
             void setTimeout(int type, uint64_t v);
             uint64_t getTimeout(int type);
+            // 记录每次被 FdManager 创建(句柄号被复用)时加一
+            uint32_t getGeneration() const {return m_generation.load(std::memory_order_acquire);}
+
+            /**
+             * @brief 阻塞读写(以及 connect)的超时定时器, 每个方向一个, 嵌入在 FdCtx 中
+             * @details 同一个方向同时只有一个协程等待, 等待时加入 IOManager, 唤醒后取消, 不分配内存
+             */
+            struct IoTimeout
+            {
+                // 必须是第一个成员, 回调中由节点转换回 IoTimeout
+                TimerNode node;
+                IOManager* iom = nullptr;
+                int fd = -1;
+                IOManager::Event event = IOManager::NONE;
+                // 到期时置为 ETIMEDOUT
+                int cancelled = 0;
+            };
+            // event 为 IOManager::READ 或者 IOManager::WRITE
+            IoTimeout* getIoTimeout(IOManager::Event event)
+            {
+                return event == IOManager::READ ? &m_ioTimeouts[0] : &m_ioTimeouts[1];
+            }
 
         /* 针对文件描述符fd的状态解释 */
         private:
@@ -39,6 +68,8 @@ namespace sylar
             bool m_isInit: 1;
             // 是否是socket
             bool m_isSocket: 1;
+            // 是否是普通文件(或者块设备)
+            bool m_isFile: 1;
             // 是否是系统设置的nonblock  
             bool m_sysNonblock: 1;
             // 是否是用户设置的nonblock
@@ -50,27 +81,52 @@ namespace sylar
             uint64_t m_recvTimeout;
             // 发送超时时间
             uint64_t m_sendTimeout;
-            // 句柄fd 与 io相关，需要一个iomanager的对象
-            sylar::IOManager* m_iomanager;
+            // 读, 写两个方向的超时定时器
+            IoTimeout m_ioTimeouts[2];
+            // 是否由 FdManager 创建并且还没有删除
+            std::atomic<bool> m_inUse = {false};
+            std::atomic<uint32_t> m_generation = {0};
     };
 
     /*
         Fdmanager 用来管理所有的句柄fd
+        FdCtx 按句柄号放在分块的数组中, 每块 CHUNK_SIZE 个, 第一次用到时分配, 之后不会移动或者释放.
+        查询不加锁: 两次原子读(块指针, 是否在使用), 不复制智能指针; 只有创建和删除加锁
     */
     class FdManager{
         public:
-            typedef RWMutex RWMutexType;
+            typedef Mutex MutexType;
+            static const int CHUNK_BITS = 8;
+            static const int CHUNK_SIZE = 1 << CHUNK_BITS;
+            // 最多管理的句柄数. 更大的句柄号没有 FdCtx, 创建时记录错误并设置 EMFILE,
+            // hook 的 socket/accept/dup/open 关闭这样的句柄并以 EMFILE 失败;
+            // RLIMIT_NOFILE 超过它时在创建 FdManager 时告警
+            static const int MAX_CHUNKS = 4096;
+            static const int MAX_FDS = CHUNK_SIZE * MAX_CHUNKS;
+
             FdManager();
+            ~FdManager();
             /*
-                获取fd所对应的FdCtx智能指针， 
+                获取fd所对应的FdCtx，
                 如果fd不存在(auto_create = true)，那么就自动创建一个FdCtx对象
             */ 
-            FdCtx::ptr get(int fd, bool auto_create = false);
+            FdCtx* get(int fd, bool auto_create = false);
+            /*
+                句柄刚由内核创建(hook 的 socket/accept/dup/open), 总是重新初始化记录.
+                句柄号在 hook 之外被关闭时记录没有删除, 旧的记录和等待状态由 generation 的改变作废
+            */
+            FdCtx* create(int fd);
             void del(int fd);
         
         private:
-            RWMutexType m_mutex;
-            std::vector<FdCtx::ptr> m_datas;
+            struct Chunk;
+            Chunk* getChunk(int idx, bool auto_create);
+            // 调用者持有 m_mutex
+            void reinit(FdCtx* ctx);
+
+        private:
+            MutexType m_mutex;
+            std::atomic<Chunk*> m_chunks[MAX_CHUNKS];
     };
 
     typedef Singleton<FdManager> FdMgr;
@@ -5,6 +5,8 @@
 
 // #include <memory>
 #include "thread.h"
+#include "fiber_profiler.h"
+#include "util.h"
 #include <functional>
 #include <ucontext.h>
 
@@ -16,6 +18,7 @@ namespace sylar
     {
         // 识别不了Scheduler, 需要提前添加声明 class Scheduler
         friend class Scheduler;
+        friend class FiberRegistry;
         public:
             typedef std::shared_ptr<Fiber> ptr;
 
@@ -50,6 +53,37 @@ namespace sylar
             // 得到Id
             uint64_t getId() const {return m_id;}
             State getState() const {return m_state;}
+            // 协程入口
+            const FiberEntry& getEntry() const {return m_entry;}
+            // 栈大小
+            uint64_t getStackSize() const {return m_stacksize;}
+            // 栈的高水位, 未开启 fiber.stack_profile 时返回0
+            uint64_t getStackUsed() const;
+            // 以下统计需要开启 fiber.accounting, 单位 ns
+            uint64_t getCpuTime() const {return m_counter.cpu;}
+            uint64_t getExecTime() const {return m_counter.exec;}
+            uint64_t getSwapCount() const {return m_counter.swaps;}
+            uint64_t getReadyWaitTime() const {return m_counter.readyWait;}
+            // 标签, 用于按请求类型聚合统计, reset 时清空
+            const std::string& getTag() const {return m_tag;}
+            void setTag(const std::string& v) {m_tag = v;}
+            // 标记进入调度队列的时间
+            void setReadyTime(uint64_t v) {m_readyTs = v;}
+            // IOManager 观察到等待的事件就绪的时间, 用于统计就绪到恢复执行的延迟
+            void setWakeTime(uint64_t v) {m_wakeTs = v;}
+            uint64_t getWakeTime() const {return m_wakeTs;}
+            // 最近一次执行该协程的线程ID, 由调度器在切入前记录, 用于唤醒时的线程亲和
+            void setLastThread(int v) {m_lastThread = v;}
+            int getLastThread() const {return m_lastThread;}
+            // 记录在 IOManager 上等待的句柄和事件, 开启 fiber.registry 时有效
+            void setWait(int fd, uint32_t event)
+            {
+                if (m_trace)
+                {
+                    m_trace->waitFd = fd;
+                    m_trace->waitEvent = event;
+                }
+            }
         public:
             // 获得当前协程ID
             static uint64_t GetFiberId();
@@ -61,18 +95,57 @@ namespace sylar
             static void YieldToReady();
             // 协程切换到后台，并且设置为hold状态
             static void YieldToHold();
+            static const char* StateToString(State state);
+            // 设置当前协程的标签
+            static void SetTag(const std::string& tag);
             //总协程数量
             static uint64_t TotalFibers();
             // 主执行函数
             static void MainFunc();
             static void CallerMainFunc();
         private:
+            void setState(State v)
+            {
+                m_state = v;
+                if (m_trace)
+                {
+                    m_trace->stateTs = GetMonotonicNS();
+                }
+            }
+            // 登记到 FiberRegistry
+            void registerTrace();
+            // 记录栈的高水位并重新填充 canary
+            void profileStack();
+            // 新入口需要的栈比当前的大时重新分配, 返回是否重新分配
+            bool growStack();
+            // 把运行统计按标签汇总并清零
+            void profileCpu();
+            // 切入前后的统计
+            void beginAccount(uint64_t& wall, uint64_t& cpu);
+            void endAccount(uint64_t wall, uint64_t cpu);
             uint64_t m_id = 0;
             uint64_t m_stacksize = 0;
             State m_state = INIT;   // 除了Fiber()无参的构造函数产生的主协程初始化状态为EXEC，其他都为INIT
             ucontext_t m_ctx;
             void* m_stack = nullptr;
             std::function<void()> m_cb;
+            // 协程入口, 用于统计聚合
+            FiberEntry m_entry;
+            // 栈大小是否由外部指定, 外部指定的不做自动调整
+            bool m_fixedStack = false;
+            // 栈是否填充了 canary
+            bool m_stackPainted = false;
+            // 栈是否由 mmap 分配并带有保护页(自动调整大小的栈)
+            bool m_guardStack = false;
+            // 运行统计
+            std::string m_tag;
+            FiberCpuProfiler::Counter m_counter;
+            // 进入调度队列的时间
+            uint64_t m_readyTs = 0;
+            uint64_t m_wakeTs = 0;
+            int m_lastThread = -1;
+            // 调试信息, 开启 fiber.registry 时分配
+            std::unique_ptr<FiberTrace> m_trace;
     };
 }
 
@@ -0,0 +1,211 @@
+#pragma once
+
+#ifndef __SYLAR_FIBER_PROFILER_H__
+#define __SYLAR_FIBER_PROFILER_H__
+
+#include <functional>
+#include <typeinfo>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <stdint.h>
+#include "thread.h"
+#include "singleton.h"
+
+namespace sylar
+{
+    /**
+     * @brief 协程入口标识
+     * @details 由回调函数的类型(lambda/bind/函数指针)与函数地址组成,
+     *          用于按入口函数聚合协程的运行数据, 构造时不做任何字符串处理
+     */
+    struct FiberEntry
+    {
+        const std::type_info* type = nullptr;
+        const void* fn = nullptr;
+
+        bool operator<(const FiberEntry& rhs) const;
+        bool operator==(const FiberEntry& rhs) const;
+        // 转换成可读的名称(demangle 之后的类型名或者符号名)
+        std::string toString() const;
+        // 根据回调函数生成入口标识
+        static FiberEntry FromCallback(const std::function<void()>& cb);
+    };
+
+    /**
+     * @brief 协程栈使用量统计
+     * @details 开启 fiber.stack_profile 后, 协程栈在创建时填充 canary,
+     *          协程结束或者 reset 时从栈底向上扫描未被改写的区域, 得到栈的高水位,
+     *          并按入口函数聚合. 开启 fiber.stack_auto_size 后, 新建协程会根据
+     *          该入口的最大使用量 + headroom 决定栈大小, 栈用 mmap 分配并带有保护页
+     */
+    class FiberStackProfiler
+    {
+    public:
+        typedef Mutex MutexType;
+
+        struct Stat
+        {
+            std::string entry;        // 入口函数
+            uint64_t samples = 0;     // 采样次数
+            uint64_t max = 0;         // 最大使用量
+            uint64_t p99 = 0;         // p99 使用量
+            uint64_t stacksize = 0;   // 最近一次的栈大小
+            uint64_t recommended = 0; // 建议的栈大小, 0 表示样本不足
+        };
+
+        FiberStackProfiler();
+
+        // 是否开启了栈统计
+        static bool IsEnabled();
+        // 是否开启了按入口自动调整栈大小
+        static bool IsAutoSize();
+        // 用 canary 填充栈
+        static void Paint(void* stack, size_t size);
+        // 返回栈已经使用过的字节数(高水位)
+        static size_t Measure(const void* stack, size_t size);
+
+        // 记录一次协程栈的高水位
+        void record(const FiberEntry& entry, size_t used, size_t stacksize);
+        // 获得入口的栈大小, 样本不足时返回 def
+        size_t getStackSize(const FiberEntry& entry, size_t def);
+        void getStats(std::vector<Stat>& stats);
+        std::string toString();
+        void clear();
+
+    private:
+        struct Sample
+        {
+            uint64_t count = 0;
+            uint64_t max = 0;
+            uint64_t stacksize = 0;
+            // 最近的样本, 环形覆盖
+            std::vector<uint32_t> ring;
+            size_t pos = 0;
+            // 缓存的 p99, 每隔一定数量的样本重新计算
+            uint64_t p99 = 0;
+            uint64_t dirty = 0;
+        };
+        uint64_t calcP99(Sample& s);
+        size_t recommend(Sample& s, size_t def);
+
+    private:
+        MutexType m_mutex;
+        std::map<FiberEntry, Sample> m_entries;
+    };
+
+    typedef Singleton<FiberStackProfiler> FiberStackProfilerMgr;
+
+    /**
+     * @brief 协程 cpu 时间和切换次数统计
+     * @details 开启 fiber.accounting 后, 协程在 swapIn/call 前后记录线程 cpu 时间和
+     *          单调时钟, 在调度队列中等待的时间由 Scheduler 入队时打点.
+     *          协程结束或者 reset 时按标签聚合, 没有设置标签的按入口函数聚合
+     */
+    class FiberCpuProfiler
+    {
+    public:
+        typedef Mutex MutexType;
+
+        struct Counter
+        {
+            uint64_t fibers = 0;    // 任务数量
+            uint64_t cpu = 0;       // cpu 时间 ns
+            uint64_t exec = 0;      // 处于 EXEC 的墙上时间 ns
+            uint64_t swaps = 0;     // 切入次数
+            uint64_t readyWait = 0; // 可运行但在队列中等待的时间 ns
+        };
+
+        struct Stat
+        {
+            std::string tag;
+            Counter counter;
+        };
+
+        // 是否开启了统计
+        static bool IsEnabled();
+
+        void record(const std::string& tag, const FiberEntry& entry, const Counter& counter);
+        void getStats(std::vector<Stat>& stats);
+        std::string toString();
+        void clear();
+
+    private:
+        static void Add(Counter& dst, const Counter& src);
+
+    private:
+        MutexType m_mutex;
+        std::map<std::string, Counter> m_tags;
+        std::map<FiberEntry, Counter> m_entries;
+    };
+
+    typedef Singleton<FiberCpuProfiler> FiberCpuProfilerMgr;
+
+    class Fiber;
+
+    /**
+     * @brief 协程的调试信息, 开启 fiber.registry 后创建的协程才会分配
+     */
+    struct FiberTrace
+    {
+        static const int MAX_CREATE_FRAMES = 12;
+        static const int MAX_HOLD_FRAMES = 24;
+
+        uint64_t createTs = 0;  // 创建时间 ns
+        uint64_t stateTs = 0;   // 进入当前状态的时间 ns
+        int waitFd = -1;        // 在 IOManager 上等待的句柄
+        uint32_t waitEvent = 0; // 在 IOManager 上等待的事件
+        int createSize = 0;
+        void* create[MAX_CREATE_FRAMES]; // 创建位置的调用栈
+        int holdSize = 0;
+        void* hold[MAX_HOLD_FRAMES];     // 最近一次 YieldToHold 的调用栈
+    };
+
+    /**
+     * @brief 存活协程的注册表
+     * @details 开启 fiber.registry 后, 协程创建时登记, 析构时注销,
+     *          dump 可以列出所有协程的状态, 停留时间, 等待的句柄以及 HOLD 协程的调用栈
+     */
+    class FiberRegistry
+    {
+    public:
+        typedef Mutex MutexType;
+
+        struct Info
+        {
+            uint64_t id = 0;
+            std::string state;
+            uint64_t stateMs = 0;   // 处于当前状态的时间
+            uint64_t ageMs = 0;     // 创建至今的时间
+            int waitFd = -1;
+            uint32_t waitEvent = 0;
+            std::string entry;
+            std::string createSite;
+            std::string holdStack;
+        };
+
+        // 是否开启了注册表
+        static bool IsEnabled();
+        // HOLD 时是否记录调用栈
+        static bool IsCaptureHoldStack();
+
+        void add(Fiber* fiber);
+        void del(Fiber* fiber);
+        size_t size();
+        /**
+         * @brief 获取所有存活协程的信息
+         * @param[in] with_stack 是否解析创建位置和 HOLD 协程的调用栈
+         */
+        void getInfos(std::vector<Info>& infos, bool with_stack = false);
+        std::string dump(bool with_stack = true);
+
+    private:
+        MutexType m_mutex;
+        std::set<Fiber*> m_fibers;
+    };
+
+    typedef Singleton<FiberRegistry> FiberRegistryMgr;
+}
+
+#endif
@@ -0,0 +1,82 @@
+#pragma once
+
+#ifndef __SYLAR_FILE_IO_H__
+#define __SYLAR_FILE_IO_H__
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <list>
+#include <atomic>
+#include <sys/types.h>
+#include "thread.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace sylar
+{
+    /**
+     * @brief 普通文件 I/O 的阻塞线程池
+     * @details epoll 不能等待普通文件, 读写总是就绪, 但是可能阻塞在磁盘上.
+     *          hook 之后协程中的 open/fsync, 以及不小于 file_io.threshold 的文件读写
+     *          在这里的线程上执行, 当前协程挂起直到完成, 工作线程继续调度其他协程
+     */
+    class FileIoPool : Noncopyable
+    {
+    public:
+        typedef Mutex MutexType;
+
+        struct Stat
+        {
+            uint64_t threads = 0;
+            // 交给线程池执行的调用
+            uint64_t submitted = 0;
+            uint64_t completed = 0;
+            // 小于阈值直接在工作线程上执行的读写
+            uint64_t inlined = 0;
+            // 排队的最大长度
+            uint64_t queueMax = 0;
+            // 排队和执行的总耗时
+            uint64_t waitNs = 0;
+            uint64_t runNs = 0;
+        };
+
+        // 线程数为 file_io.threads, 创建时读取
+        FileIoPool();
+        ~FileIoPool();
+
+        /**
+         * @brief 在线程池上执行 fn, 挂起当前协程直到完成
+         * @details fn 中需要调用原始的系统调用(read_f 等), 不在调度器的任务协程中时直接执行
+         * @return fn 的返回值, errno 为 fn 执行之后的值
+         */
+        ssize_t run(const std::function<ssize_t()> &fn);
+        // 记录一次小于阈值直接执行的读写
+        void addInline() { m_inlined.fetch_add(1, std::memory_order_relaxed); }
+
+        void getStat(Stat &stat) const;
+        std::string dumpStat() const;
+
+    private:
+        struct Task;
+        void worker();
+
+    private:
+        MutexType m_mutex;
+        Semaphore m_sem;
+        std::list<Task *> m_tasks;
+        std::vector<Thread::ptr> m_threads;
+        bool m_stop = false;
+        std::atomic<uint64_t> m_submitted = {0};
+        std::atomic<uint64_t> m_completed = {0};
+        std::atomic<uint64_t> m_inlined = {0};
+        std::atomic<uint64_t> m_queueMax = {0};
+        std::atomic<uint64_t> m_waitNs = {0};
+        std::atomic<uint64_t> m_runNs = {0};
+    };
+
+    typedef Singleton<FileIoPool> FileIoMgr;
+}
+
+#endif
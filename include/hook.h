@@ -5,6 +5,9 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
@@ -32,12 +35,39 @@ extern "C"{
     typedef int (*socket_fun)(int domain, int type, int protocol);
     extern socket_fun socket_f;
 
+    typedef int (*socketpair_fun)(int domain, int type, int protocol, int sv[2]);
+    extern socketpair_fun socketpair_f;
+
     typedef int (*connect_fun)(int sockfd, const struct sockaddr *addr,socklen_t addrlen);
     extern connect_fun connect_f;
 
     typedef int (*accept_fun)(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
     extern accept_fun accept_f;
 
+    typedef int (*accept4_fun)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+    extern accept4_fun accept4_f;
+
+    /*dup*/
+    typedef int (*dup_fun)(int oldfd);
+    extern dup_fun dup_f;
+
+    typedef int (*dup2_fun)(int oldfd, int newfd);
+    extern dup2_fun dup2_f;
+
+    typedef int (*dup3_fun)(int oldfd, int newfd, int flags);
+    extern dup3_fun dup3_f;
+
+    /*poll*/
+    typedef int (*poll_fun)(struct pollfd *fds, nfds_t nfds, int timeout);
+    extern poll_fun poll_f;
+
+    typedef int (*select_fun)(int nfds, fd_set *readfds, fd_set *writefds,
+                              fd_set *exceptfds, struct timeval *timeout);
+    extern select_fun select_f;
+
+    typedef int (*epoll_wait_fun)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+    extern epoll_wait_fun epoll_wait_f;
+
     /* socket operator*/
     typedef int (*fcntl_fun)(int fd, int cmd, ... /* arg */ );
     extern fcntl_fun fcntl_f;
@@ -70,6 +100,9 @@ extern "C"{
     typedef ssize_t (*recvmsg_fun)(int sockfd, struct msghdr *msg, int flags);
     extern recvmsg_fun recvmsg_f;
 
+    typedef ssize_t (*pread_fun)(int fd, void *buf, size_t count, off_t offset);
+    extern pread_fun pread_f;
+
     /*write*/
     typedef ssize_t (*write_fun)(int fd, const void *buf, size_t count);
     extern write_fun write_f;
@@ -87,6 +120,19 @@ extern "C"{
     typedef ssize_t (*sendmsg_fun)(int sockfd, const struct msghdr *msg, int flags);
     extern sendmsg_fun sendmsg_f;
 
+    typedef ssize_t (*pwrite_fun)(int fd, const void *buf, size_t count, off_t offset);
+    extern pwrite_fun pwrite_f;
+
+    /*file*/
+    typedef int (*open_fun)(const char *pathname, int flags, ...);
+    extern open_fun open_f;
+
+    typedef int (*fsync_fun)(int fd);
+    extern fsync_fun fsync_f;
+
+    typedef int (*fdatasync_fun)(int fd);
+    extern fdatasync_fun fdatasync_f;
+
     /*close*/
     typedef int (*close_fun)(int fd);
     extern close_fun close_f;
@@ -3,6 +3,11 @@
 
 #include "scheduler.h"
 #include "timer.h"
+#include "iouring.h"
+#include <deque>
+#include <list>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 namespace sylar
 {
@@ -17,8 +22,114 @@ namespace sylar
             READ = 0x1,  // 读事件  EPOLLIN
             WRITE = 0x4, // 写事件  EPOLLOUT
         };
+        // 统计中的分布都按 2 的幂分桶
+        static const int EPOLL_HIST_BUCKETS = 18;
 
     private:
+        /**
+         * @brief io_uring 后端中挂起在 multishot 请求上的协程
+         */
+        struct UringWaiter
+        {
+            typedef std::shared_ptr<UringWaiter> ptr;
+            Fiber::ptr fiber;
+            int res = 0;       // 0 可以重试, < 0 为 -errno, accept 时为新连接
+            bool done = false; // 已经被唤醒(完成或者超时)
+        };
+
+        /**
+         * @brief io_uring 后端中句柄的 multishot accept/recv 状态, 按需创建
+         */
+        struct UringContext
+        {
+            struct Chunk
+            {
+                uint16_t bid; // provided buffer 的 id
+                uint32_t len;
+                uint32_t off;
+            };
+            uint32_t seq = 0;      // cancelAll 时递增, 之前的 cqe 全部作废
+            uint32_t inflight = 0; // 直接提交的读写请求数量
+            // 直接提交的读写请求的 user_data, 0 读 1 写, cancelEvent 按方向取消
+            std::vector<uint64_t> requests[2];
+            int sockType = -1;
+            bool acceptArmed = false;
+            std::deque<int> accepted; // 已经建立但还没有被取走的连接
+            std::list<UringWaiter::ptr> acceptWaiters;
+            bool recvArmed = false;
+            // 缓存的数据达到上限, multishot recv 已经请求取消
+            bool recvCancelling = false;
+            bool eof = false;
+            int recvError = 0;
+            std::deque<Chunk> chunks; // 已经收到但还没有被读取的数据
+            std::list<UringWaiter::ptr> recvWaiters;
+        };
+
+        /**
+         * @brief 一个事件循环(reactor, 共用 epoll 时为全部线程)的计数器, 只做 relaxed 的原子累加
+         */
+        struct LoopCounters
+        {
+            LoopCounters();
+            std::atomic<uint64_t> waits = {0};
+            std::atomic<uint64_t> blockedNs = {0};
+            std::atomic<uint64_t> events = {0};
+            std::atomic<uint64_t> tickles = {0};
+            std::atomic<uint64_t> timerTicks = {0};
+            std::atomic<uint64_t> timerCbs = {0};
+            std::atomic<uint64_t> resumes = {0};
+            std::atomic<uint64_t> resumeNs = {0};
+            std::atomic<uint64_t> resumeMaxNs = {0};
+            std::atomic<uint64_t> maxIterNs = {0};
+            std::atomic<uint64_t> lagAlerts = {0};
+            std::atomic<uint64_t> eventHist[EPOLL_HIST_BUCKETS];
+            std::atomic<uint64_t> timerHist[EPOLL_HIST_BUCKETS];
+            std::atomic<uint64_t> resumeHist[EPOLL_HIST_BUCKETS];
+        };
+
+        struct FdContext;
+        struct Reactor;
+        /**
+         * @brief 多 reactor 模式下 reactor 所属线程独占的定时器, 增删改不加锁
+         * @details 到期时间在所属线程进入 epoll_wait 之前设置到 reactor 自己的 timerfd,
+         *          加入更早的定时器不需要唤醒; 其他线程的 refresh/reset 通过 tickle 唤醒
+         */
+        class ReactorTimers : public TimerManager
+        {
+        public:
+            ReactorTimers(IOManager *iom, Reactor *reactor)
+                : m_iom(iom), m_reactor(reactor) {}
+
+        protected:
+            void onTimerInsertedAtFront() override {}
+            void onRemoteTimerOp() override;
+
+        private:
+            IOManager *m_iom;
+            Reactor *m_reactor;
+        };
+
+        /**
+         * @brief 多 reactor 模式下每个工作线程独占的 epoll
+         */
+        struct Reactor
+        {
+            int epfd = -1;
+            int tickleFds[2] = {-1, -1};
+            // 认领该 reactor 的线程, 0 表示还没有线程在上面等待
+            int threadId = 0;
+            // 线程阻塞在 epoll_wait 中, tickle 只唤醒这样的 reactor
+            std::atomic<bool> idle = {false};
+            Mutex mutex;
+            // 其他线程转发过来的注册请求, 由所属线程在 idle 中处理
+            std::vector<FdContext *> mailbox;
+            LoopCounters loop;
+            // iomanager.local_timers 开启时所属线程的定时器, 以及只注册在本 epoll 中的 timerfd
+            std::unique_ptr<ReactorTimers> timers;
+            int timerFd = -1;
+            uint64_t timerFdDeadline = 0;
+        };
+
         /**
          * @brief Socket事件上线文类
          */
@@ -33,6 +144,7 @@ namespace sylar
                 Scheduler *scheduler = nullptr; // 表示事件要在哪一个scheduler上执行
                 Fiber::ptr fiber;               // 事件的协程
                 std::function<void()> cb;       // 事件的回调函数
+                uint32_t seq = 0;               // io_uring 后端当前 poll 请求的序号
             };
 
             // 获得当前上下文
@@ -45,17 +157,92 @@ namespace sylar
             /**
              * @brief 触发事件
              * @param[in] event 事件类型
+             * @param[in] wake_ns 观察到就绪的时间, 非 0 时记录到等待的协程上用于统计恢复延迟
              */
-            void triggerEvent(Event event);
+            void triggerEvent(Event event, uint64_t wake_ns = 0);
 
             EventContext read;    // 读事件
             EventContext write;   // 写事件
             int fd = 0;           // 事件关联的句柄
             Event events = NONE; // 事件状态
             MutexType mutex;
+            std::unique_ptr<UringContext> uring;
+            /*
+                epoll 后端的状态机: 句柄第一次被等待时以 EPOLLIN|EPOLLOUT|EPOLLET 注册(registered),
+                直到 cancelAll 才移除. events 中的事件为 armed, 就绪时直接触发;
+                没有等待者时的就绪事件锁存在 ready 中, 下一次 addEvent 消耗掉它而不进入内核.
+                句柄可能不经过本 IOManager 的 cancelAll 被关闭(其他线程, 未 hook 的 close),
+                内核已经移除了注册而 registered 仍为 true. 注册时记下 FdManager 中句柄的 generation,
+                句柄号被 hook 的 socket/accept/dup/open 复用时 generation 改变, addEvent 据此重新注册.
+                在 hook 之外关闭又在 hook 之外创建的句柄无法察觉, 需要先 cancelAll
+            */
+            bool registered = false;
+            int ready = NONE;
+            uint32_t generation = 0;
+            // 多 reactor 模式下句柄所属的 reactor
+            Reactor *reactor = nullptr;
         };
 
     public:
+        /**
+         * @brief epoll_wait 批量的统计
+         */
+        struct EpollStat
+        {
+            uint64_t waits = 0;  // epoll_wait 返回的次数
+            uint64_t events = 0; // 返回的就绪事件总数
+            uint32_t batch = 0;  // 各线程中最大的 maxevents
+            // 每次返回的就绪事件数的分布, 第 0 个桶为 0, 第 i 个桶为 [2^(i-1), 2^i)
+            uint64_t hist[EPOLL_HIST_BUCKETS] = {0};
+        };
+
+        /**
+         * @brief 事件循环的统计, 多 reactor 模式下每个 reactor 一份
+         */
+        struct LoopStat
+        {
+            uint64_t waits = 0;       // epoll_wait 的次数
+            uint64_t blockedNs = 0;   // 阻塞在 epoll_wait 中的时间
+            uint64_t events = 0;      // 返回的就绪事件总数
+            uint64_t tickles = 0;     // 收到的 tickle 次数
+            uint64_t tickleSent = 0;  // 发出的 tickle 次数, 只在汇总中有效
+            uint64_t timerTicks = 0;  // 有定时器到期的轮数
+            uint64_t timerCbs = 0;    // 到期的定时器回调数
+            uint64_t resumes = 0;     // 等待事件的协程被唤醒后恢复执行的次数
+            uint64_t resumeNs = 0;    // 从 epoll_wait 返回到协程恢复执行的总延迟
+            uint64_t resumeMaxNs = 0;
+            uint64_t maxIterNs = 0;   // 最长的一轮: 两次 epoll_wait 之间的时间
+            uint64_t lagAlerts = 0;   // 超过 iomanager.stat.lag_threshold 的轮数
+            uint64_t eventHist[EPOLL_HIST_BUCKETS] = {0};  // 每次唤醒的就绪事件数
+            uint64_t timerHist[EPOLL_HIST_BUCKETS] = {0};  // 每轮到期的定时器回调数
+            uint64_t resumeHist[EPOLL_HIST_BUCKETS] = {0}; // 恢复延迟, 单位 us
+        };
+
+        /**
+         * @brief drain 的结果
+         */
+        struct DrainResult
+        {
+            bool timedOut = false; // 期限内没有排空, 剩余的等待被取消
+            uint64_t usedMs = 0;
+            size_t pending = 0;    // 开始时挂起的事件数
+            // 被取消的句柄和其上等待的事件(READ/WRITE)
+            std::vector<std::pair<int, int>> cancelled;
+            std::string toString() const;
+        };
+
+        /**
+         * @brief 忙轮询模式的 cpu 消耗
+         */
+        struct BusyPollStat
+        {
+            uint64_t polls = 0;      // 轮询的次数
+            uint64_t emptyPolls = 0; // 没有就绪事件也没有到期定时器的次数
+            uint64_t spinNs = 0;     // 空转消耗的时间
+            uint64_t uptimeNs = 0;   // IOManager 创建至今的时间
+            size_t threads = 0;      // 工作线程数(包括 use_caller 的线程)
+        };
+
         /**
          * @brief 构造函数
          * @param[in] threads 线程数量
@@ -67,6 +254,8 @@ namespace sylar
 
         // 0 success -1 error
         int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+        // 与 addEvent 相同, 但是事件已经有等待者时返回 -1 并设置 errno 为 EEXIST, 而不是断言失败
+        int tryAddEvent(int fd, Event event, std::function<void()> cb = nullptr);
         // 删除事件
         bool delEvent(int fd, Event event);
         // 取消事件， 将事件需要一定条件要出发，并将该事件强制触发掉
@@ -75,6 +264,71 @@ namespace sylar
         bool cancelAll(int fd);
         // 获取当前的 IOManager
         static IOManager *GetThis();
+        /**
+         * @brief 排空挂起的事件, 用于有期限的停止: drain 之后再 stop 不会无限等待
+         * @details 等待挂起的事件自然完成, 最多 timeout_ms. 监听句柄上等待 accept 的事件不计入,
+         *          只要没有连接上的等待就算排空. 计数归零时唤醒等待者: 协程中调用只挂起当前协程,
+         *          外部线程阻塞在信号量上. 超时后进入取消状态, 这是单向的:
+         *          之后的 addEvent/submitIo 以 ECANCELED 失败, 仍在等待的句柄通过 cancelAll 唤醒,
+         *          之后只能 stop, 再次 drain 会断言失败. 不会取消定时器
+         * @param[out] result 不为空时返回排空的结果
+         * @return 期限内自然排空返回 true
+         */
+        bool drain(uint64_t timeout_ms, DrainResult *result = nullptr);
+        // drain 超时后进入取消状态
+        bool isCancelling() const { return m_cancelling; }
+
+        // 是否使用 io_uring 后端(iomanager.backend)
+        bool isUring() const { return m_ring != nullptr; }
+        // 获取 epoll_wait 批量的统计
+        void getEpollStat(EpollStat &stat) const;
+        std::string dumpEpollStat() const;
+        /**
+         * @brief 获取事件循环的统计
+         * @param[in] reactor 多 reactor 模式下的 reactor 下标, -1 为所有事件循环的汇总
+         * @return reactor 下标无效时返回 false
+         */
+        bool getLoopStat(LoopStat &stat, int reactor = -1) const;
+        // 汇总以及每个 reactor 的统计, 开启 iomanager.stat.dump_interval 时由 idle 周期性输出
+        std::string dumpLoopStat() const;
+        // reactor 的数量, 不是多 reactor 模式时为 0
+        size_t getReactorCount() const { return m_reactors.size(); }
+
+        // 是否每个工作线程一个 epoll(iomanager.multi_reactor)
+        bool isMultiReactor() const { return !m_reactors.empty(); }
+        // 是否为忙轮询模式(iomanager.busy_poll.enable), 工作线程从不阻塞在 epoll_wait 中
+        bool isBusyPoll() const { return m_busyPoll; }
+        // 获取忙轮询消耗的统计
+        void getBusyPollStat(BusyPollStat &stat) const;
+        std::string dumpBusyPollStat() const;
+        // 定时器合并的统计, 包括每个 reactor 独占的定时器
+        void getSlackStat(SlackStat &stat) const override;
+        /**
+         * @brief io_uring 后端: 直接提交读写请求, 挂起当前协程直到完成
+         * @param[in] opcode IORING_OP_READ/WRITE/RECV/SEND/ACCEPT
+         * @param[in] buf 数据地址, ACCEPT 时为 sockaddr*
+         * @param[in] len 数据长度
+         * @param[in] flags RECV/SEND 的 flags
+         * @param[in] timeout_ms 超时时间, ~0ull 表示不超时
+         * @param[in] addr2 ACCEPT 时为 socklen_t*
+         * @return 同系统调用, 失败返回 -1 并设置 errno, 超时 errno 为 ETIMEDOUT
+         */
+        ssize_t submitIo(uint8_t opcode, int fd, void *buf, size_t len, int flags,
+                         uint64_t timeout_ms, void *addr2 = nullptr);
+        /**
+         * @brief io_uring 后端: 从 multishot accept 的结果中取一个连接
+         * @param[out] rt 同 accept 的返回值
+         * @return 没有开启 multishot accept 时返回 false
+         */
+        bool acceptMultishot(int fd, sockaddr *addr, socklen_t *addrlen,
+                             uint64_t timeout_ms, int &rt);
+        /**
+         * @brief io_uring 后端: 从 multishot recv 收到的数据中读取
+         * @param[out] rt 同 readv 的返回值
+         * @return 没有开启 multishot recv, 不是流式 socket 或者缓冲区耗尽时返回 false, 由调用者直接读取
+         */
+        bool recvMultishot(int fd, const iovec *iov, int iovcnt, int flags,
+                           uint64_t timeout_ms, ssize_t &rt);
 
     protected:
         // 实现 父类的 虚方法
@@ -86,21 +340,148 @@ namespace sylar
         void tickle() override;
         bool stopping() override;
         void idle() override;
+        void onFiberWake(uint64_t wake_ns) override;
 
-        void contextResize(size_t size);
+        // 获取句柄的上下文, 不加锁; 不存在时 auto_create 为 true 则创建
+        FdContext *getFdContext(int fd, bool auto_create);
         void onTimerInsertedAtFront() override;
+        // 多 reactor 模式下工作线程的定时器加到所属 reactor 的 ReactorTimers 上
+        TimerManager *getThreadTimerManager() override;
+        // timeout 为距离下一个定时器的时间 us
         bool stopping(uint64_t& timeout);
 
+    private:
+        struct DrainWaiter;
+        // 挂起的事件完成时调用, 代替直接递减 m_pendingEventCount, 降到 drain 的目标时唤醒等待者
+        void pendingDone();
+        // 唤醒所有 drain 的等待者
+        void notifyDrain();
+        void wakeDrainWaiter(std::shared_ptr<DrainWaiter> waiter);
+        // 等到挂起的事件数不超过 target, 最多 timeout_ms
+        void waitPending(size_t target, uint64_t timeout_ms);
+        // 监听句柄上等待 accept 的事件数, drain 不等待它们
+        size_t countListenWaits();
+
+    private:
+        // 记录一次 epoll_wait 返回的就绪事件数
+        void recordBatch(LoopCounters &loop, int n);
+        // 当前线程所在的事件循环的计数器
+        LoopCounters &getThisLoop();
+        // 一轮的时间超过 iomanager.stat.lag_threshold 时告警
+        void checkLoopLag(LoopCounters &loop, uint64_t iter_ns);
+        // 到了 iomanager.stat.dump_interval 时输出 dumpLoopStat, 同一时刻只有一个线程输出
+        void checkDumpLoopStat(uint64_t now_ns);
+        // 把 timerfd 设置为最早的定时器的绝对到期时间, 与已设置的相同时不做系统调用
+        void armTimerFd();
+        // 读掉 timerfd 的到期计数
+        void readTimerFd();
+        // 把 reactor 的 timerfd 设置为其 ReactorTimers 最早的到期时间, 只由所属线程调用
+        void armReactorTimerFd(Reactor *reactor);
+        // 把句柄持久地注册到 epoll(多 reactor 模式下为所属 reactor 的 epoll), 需要持有 fd_ctx->mutex
+        bool registerFd(FdContext *fd_ctx);
+        // 多 reactor 模式
+        void initReactors(size_t count);
+        // 当前线程认领的 reactor, 不是本 IOManager 的工作线程或者还没有进入 idle 时返回 nullptr
+        Reactor *getThisReactor() const;
+        // 句柄第一次被等待时选择 reactor
+        Reactor *pickReactor();
+        // 转发到 reactor 的 mailbox, 由其所属线程完成注册
+        void postReactor(Reactor *reactor, FdContext *fd_ctx);
+        void drainMailbox(Reactor *reactor);
+        void tickleReactor(Reactor *reactor);
+
+        // io_uring 后端
+        bool initUring();
+        io_uring_sqe *uringGetSqe(uint32_t count = 1);
+        // 新的 sqe 入队后调用, 决定立即提交还是等待批量提交
+        void uringQueued();
+        void uringSubmit();
+        void uringArmPoll(FdContext *fd_ctx, Event event);
+        void uringRemovePoll(FdContext *fd_ctx, Event event);
+        // sub 0 为 accept, 1 为 recv
+        void uringArmMultishot(FdContext *fd_ctx, int sub);
+        void uringCancelFd(FdContext *fd_ctx);
+        // 取消进行中的 multishot 请求, 之后由最后一个 cqe 清除 armed 标记
+        void uringCancelMultishot(FdContext *fd_ctx, int sub);
+        // try_add 为 true 时事件已经有等待者返回 EEXIST
+        int doAddEvent(int fd, Event event, std::function<void()> &cb, bool try_add);
+        // 取消一个方向上直接提交的读写请求, 没有请求时返回 false
+        bool uringCancelRequests(FdContext *fd_ctx, Event event);
+        void uringReap();
+        void uringComplete(const io_uring_cqe &cqe);
+        void uringWake(UringWaiter::ptr waiter, int res);
+        UringWaiter::ptr uringWait(FdContext *fd_ctx, std::list<UringWaiter::ptr> &waiters,
+                                   uint64_t timeout_ms, Timer::ptr &timer);
+        size_t uringCopyOut(UringContext *uc, const iovec *iov, int iovcnt, bool peek);
+        void uringRecycle(uint16_t bid);
+
     private:
         // epoll 文件句柄
         int m_epfd = 0;
         // 分别代表了 pipe(管道通信)中的两端，一般一端用于read一端用于write
         int m_tickleFds[2];
+        // CLOCK_MONOTONIC 的 timerfd, 注册在 epoll 中提供微秒精度的定时器唤醒, 创建失败时为 -1
+        int m_timerFd = -1;
+        // 保护 timerfd 的设置
+        MutexType m_timerFdMutex;
+        // timerfd 当前设置的到期时间(单调时钟 us), 0 为未设置
+        uint64_t m_timerFdDeadline = 0;
         // 记录了当前在等待执行的事件数量
         std::atomic<size_t> m_pendingEventCount = {0};
-        RWMutexType m_mutex;
-        // socket 事件上下文的容器
-        std::vector<FdContext *> m_fdContexts;
+        // socket 事件上下文的容器: 两级分块表, 扩容不移动已有的项, 读取不加锁,
+        // 分块和 FdContext 都在第一次用到时才分配
+        static const int FD_CHUNK_SHIFT = 10;
+        static const int FD_CHUNK_SIZE = 1 << FD_CHUNK_SHIFT;
+        static const int FD_MAX_CHUNKS = 4096; // 最多 4M 个句柄
+        struct FdChunk
+        {
+            std::atomic<FdContext *> ctxs[FD_CHUNK_SIZE];
+        };
+        std::atomic<FdChunk *> m_fdChunks[FD_MAX_CHUNKS];
+
+        // io_uring 后端, 为空时使用 epoll
+        std::unique_ptr<IoUring> m_ring;
+        // 保护提交队列
+        MutexType m_sqMutex;
+        // 保护 provided buffer ring
+        MutexType m_bufMutex;
+        // 同一时刻只有一个线程收割完成队列
+        std::atomic<bool> m_reaping = {false};
+        uint32_t m_submitBatch = 32;
+        bool m_multishotAccept = true;
+        bool m_multishotRecv = true;
+        // 每个句柄最多缓存的 multishot recv 数据块
+        uint32_t m_recvMaxChunks = 4;
+
+        // epoll_wait 批量统计
+        std::atomic<uint32_t> m_epollBatch = {0};
+        // 事件循环统计, 共用 m_epfd 时所有线程都记在这里, 多 reactor 模式下记在各自的 reactor 中
+        LoopCounters m_loop;
+        std::atomic<uint64_t> m_tickleSent = {0};
+        std::atomic<uint64_t> m_lastDumpNs = {0};
+
+        // drain 超时之后为 true, 不再接受新的等待, 不会再被清除
+        std::atomic<bool> m_cancelling = {false};
+        // drain 的等待者, 挂起的事件数降到 m_drainTarget 以下时被唤醒
+        MutexType m_drainMutex;
+        std::list<std::shared_ptr<DrainWaiter>> m_drainWaiters;
+        std::atomic<bool> m_drainWaiting = {false};
+        std::atomic<size_t> m_drainTarget = {0};
+        // 忙轮询模式, 创建时确定
+        bool m_busyPoll = false;
+        std::atomic<uint64_t> m_busyPolls = {0};
+        std::atomic<uint64_t> m_busyEmptyPolls = {0};
+        std::atomic<uint64_t> m_busySpinNs = {0};
+        uint64_t m_busyStartNs = 0;
+
+        // 多 reactor 模式, 为空时所有线程共用 m_epfd
+        std::vector<Reactor *> m_reactors;
+        // 已经被工作线程认领的 reactor 数量, use_caller 时最后一个 reactor 固定属于调用线程
+        std::atomic<size_t> m_reactorClaimed = {0};
+        // 轮询选择 reactor / tickle 的起点
+        std::atomic<size_t> m_reactorNext = {0};
+        // 当前线程在 idle 中认领的 reactor
+        static thread_local Reactor *t_reactor;
     };
 }
 #endif
\ No newline at end of file
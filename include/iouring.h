@@ -0,0 +1,123 @@
+#pragma once
+
+#ifndef __SYLAR_IOURING_H__
+#define __SYLAR_IOURING_H__
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "noncopyable.h"
+
+namespace sylar
+{
+    /**
+     * @brief io_uring 的简单封装, 直接使用系统调用, 不依赖 liburing
+     * @details 只负责 ring 的建立和映射, sqe 的获取与提交, cqe 的遍历,
+     *          以及 provided buffer ring 的管理. 线程安全由使用者(IOManager)保证:
+     *          getSqe/submit 需要在同一把锁下调用, reap 同一时刻只能有一个线程调用,
+     *          getBuf/recycleBuf 需要在同一把锁下调用
+     */
+    class IoUring : Noncopyable
+    {
+    public:
+        IoUring();
+        ~IoUring();
+
+        // 建立 ring, 失败返回 false (内核不支持或者被禁用)
+        bool init(uint32_t entries);
+        bool isValid() const { return m_fd >= 0; }
+        int getFd() const { return m_fd; }
+
+        // 获取一个清零的 sqe, 提交队列满时返回 nullptr
+        io_uring_sqe *getSqe();
+        // 还没有提交给内核的 sqe 数量
+        uint32_t getPending() const { return m_pending; }
+        // 提交队列中空闲的 sqe 数量
+        uint32_t getFree() const
+        {
+            return m_sqEntries - (m_sqLocalTail - m_sqHead->load(std::memory_order_acquire));
+        }
+        // 提交所有未提交的 sqe, 返回提交的数量, 失败返回 -errno
+        int submit();
+
+        // 完成队列中是否有 cqe
+        bool hasCqe() const
+        {
+            return *m_cqHead != m_cqTail->load(std::memory_order_acquire);
+        }
+        /**
+         * @brief 遍历完成队列
+         * @param[in] cb 每个 cqe 调用一次 cb(const io_uring_cqe&)
+         * @return 处理的 cqe 数量
+         */
+        template <class Callback>
+        uint32_t reap(Callback cb)
+        {
+            uint32_t head = *m_cqHead;
+            uint32_t tail = m_cqTail->load(std::memory_order_acquire);
+            uint32_t n = 0;
+            while (head != tail)
+            {
+                // 先拷贝出来再推进 head, cb 里可能会提交新的 sqe
+                io_uring_cqe cqe = m_cqes[head & m_cqMask];
+                ++head;
+                ++n;
+                m_cqHeadAtomic->store(head, std::memory_order_release);
+                cb(cqe);
+                if (head == tail)
+                {
+                    tail = m_cqTail->load(std::memory_order_acquire);
+                }
+            }
+            return n;
+        }
+
+        /**
+         * @brief 注册 provided buffer ring, 供 multishot recv 选择缓冲区
+         * @param[in] bgid 缓冲区组 id
+         * @param[in] count 缓冲区数量, 必须是 2 的幂
+         * @param[in] size 每个缓冲区的大小
+         */
+        bool setupBufRing(uint16_t bgid, uint32_t count, uint32_t size);
+        bool hasBufRing() const { return m_bufRing != nullptr; }
+        uint16_t getBufGroup() const { return m_bgid; }
+        uint32_t getBufSize() const { return m_bufSize; }
+        char *getBuf(uint16_t bid) const { return m_bufs + (size_t)bid * m_bufSize; }
+        // 把缓冲区还给内核
+        void recycleBuf(uint16_t bid);
+
+    private:
+        int m_fd = -1;
+        // 提交队列
+        void *m_sqPtr = nullptr;
+        size_t m_sqSize = 0;
+        void *m_cqPtr = nullptr;
+        size_t m_cqSize = 0;
+        io_uring_sqe *m_sqes = nullptr;
+        size_t m_sqesSize = 0;
+        uint32_t *m_sqArray = nullptr;
+        std::atomic<uint32_t> *m_sqTail = nullptr;
+        std::atomic<uint32_t> *m_sqHead = nullptr;
+        uint32_t m_sqMask = 0;
+        uint32_t m_sqEntries = 0;
+        uint32_t m_sqLocalTail = 0;
+        uint32_t m_pending = 0;
+        // 完成队列
+        uint32_t *m_cqHead = nullptr;
+        std::atomic<uint32_t> *m_cqHeadAtomic = nullptr;
+        std::atomic<uint32_t> *m_cqTail = nullptr;
+        uint32_t m_cqMask = 0;
+        io_uring_cqe *m_cqes = nullptr;
+        // provided buffer ring
+        io_uring_buf_ring *m_bufRing = nullptr;
+        size_t m_bufRingSize = 0;
+        char *m_bufs = nullptr;
+        uint32_t m_bufCount = 0;
+        uint32_t m_bufSize = 0;
+        uint16_t m_bgid = 0;
+        uint16_t m_bufTail = 0;
+    };
+}
+
+#endif
@@ -5,8 +5,10 @@
 #include <memory>
 #include "fiber.h"
 #include "thread.h"
+#include "util.h"
 #include <vector>
 #include <list>
+#include <atomic>
 
 namespace sylar
 {
@@ -25,6 +27,9 @@ namespace sylar
         static Scheduler* GetThis();
         // 得到主协程
         static Fiber* GetMainFiber();
+        // 当前是否在调度循环执行的任务协程中; 调度协程, idle 协程和 use_caller 线程
+        // 在调度之外的主协程不能挂起等待被调度回来
+        static bool InTaskFiber();
 
         void start();
         void stop();
@@ -45,6 +50,42 @@ namespace sylar
             }
         }
 
+        /**
+         * @brief 唤醒任务, 优先放入当前线程的 next 槽位
+         * @details 当前线程属于本调度器, 正在 idle 中分发事件并且槽位为空时,
+         *          任务会在 idle 让出后直接被执行, 不经过全局队列的锁;
+         *          槽位不能被其他线程窃取, 所以在任务协程中唤醒的任务不放入槽位;
+         *          否则放入全局队列, 开启 scheduler.locality 时标记偏好的线程:
+         *          当前线程(观察到事件的线程)或者协程上一次执行的线程.
+         *          偏好的线程正在调度循环中时其他线程不会取走它, 忙或者在 idle 中时才允许窃取
+         */
+        template<class FiberOrCb>
+        void scheduleNext(FiberOrCb fc)
+        {
+            FiberAndThread ft(fc, -1);
+            if (!ft.fiber && !ft.cb)
+            {
+                return;
+            }
+            markReady(ft);
+            if (setNext(ft))
+            {
+                return;
+            }
+            // 由当前线程稍后取走时不需要唤醒其他线程
+            bool local = setPrefer(ft);
+            bool need_tickle = false;
+            {
+                MutexType::Lock lock(m_mutex);
+                need_tickle = m_fibers.empty() && !local;
+                m_fibers.push_back(ft);
+            }
+            if (need_tickle)
+            {
+                tickle();
+            }
+        }
+
         // 多个任务的调度
         template<class InputIterator>
         void schedule(InputIterator begin, InputIterator end)
@@ -68,10 +109,22 @@ namespace sylar
         virtual void tickle();
         virtual bool stopping();
         virtual void idle();
+        // 带有唤醒时间的协程即将恢复执行, wake_ns 为 Fiber::getWakeTime
+        virtual void onFiberWake(uint64_t wake_ns) {}
         void setThis();
         void run();
         // 返回闲置的线程数量, 为true则说明还有空闲的线程
         bool hasIdleThreads(){return m_idleThreadCount > 0;}
+    public:
+        // 唤醒亲和的统计
+        struct LocalityStat
+        {
+            uint64_t preferred = 0; // 带有偏好线程进入全局队列的任务数
+            uint64_t local = 0;     // 在偏好的线程上执行的任务数
+            uint64_t stolen = 0;    // 被其他线程窃取执行的任务数
+        };
+        void getLocalityStat(LocalityStat& stat) const;
+        std::string dumpLocalityStat() const;
     private:
         template<class FiberOrCb>
         bool scheduleNoLock(FiberOrCb fc, int thread)
@@ -80,6 +133,7 @@ namespace sylar
             /*若果为true，则说明当前没有可以执行的任务队列,所有的线程处于内核态或者在wait信号量*/
             bool need_tickle = m_fibers.empty();
             FiberAndThread ft(fc, thread);
+            markReady(ft);
             // 如果传入的fc 是fiber 或者func，则可以将该struct传入list（fiber队列）
             if (ft.thread || ft.cb)
             {
@@ -97,6 +151,10 @@ namespace sylar
             std::function<void()> cb;
             // 线程ID --- 用来判断 当前的任务是否需要在线程上实现
             int thread;
+            // 入队时间, 开启 fiber.accounting 时才记录
+            uint64_t ts = 0;
+            // 偏好的线程ID, 与 thread 不同, 只是提示, 该线程忙时允许其他线程执行
+            int prefer = -1;
 
             FiberAndThread(Fiber::ptr f, int thr)
                 : fiber(f), thread(thr)
@@ -127,8 +185,64 @@ namespace sylar
                 fiber = nullptr;
                 cb = nullptr;
                 thread = -1;
+                ts = 0;
+                prefer = -1;
             }
+
+            void swap(FiberAndThread& o)
+            {
+                fiber.swap(o.fiber);
+                cb.swap(o.cb);
+                std::swap(thread, o.thread);
+                std::swap(ts, o.ts);
+                std::swap(prefer, o.prefer);
+            }
+        };
+
+        static void markReady(FiberAndThread& ft)
+        {
+            if (FiberCpuProfiler::IsEnabled())
+            {
+                // 记录进入队列的时间, 用于统计可运行但在等待的时间
+                ft.ts = GetMonotonicNS();
+                if (ft.fiber)
+                {
+                    ft.fiber->setReadyTime(ft.ts);
+                }
+            }
+        }
+        // 放入当前线程的 next 槽位, 成功返回 true
+        bool setNext(FiberAndThread& ft);
+        // 当前线程的 next 槽位, 指向 run() 中的局部变量
+        static thread_local FiberAndThread* t_next;
+
+        // 工作线程在调度循环中的状态, 决定偏好它的任务能否被其他线程窃取
+        enum ThreadStateType
+        {
+            // 在调度循环中, 马上会扫描全局队列
+            THREAD_SCHEDULING = 0,
+            // 正在执行任务
+            THREAD_BUSY = 1,
+            // 在 idle 协程中等待
+            THREAD_IDLE = 2
+        };
+        struct ThreadState
+        {
+            std::atomic<int> id = {-1};
+            std::atomic<int> state = {THREAD_SCHEDULING};
         };
+        static void setThreadState(ThreadState* state, int v)
+        {
+            if (state)
+            {
+                state->state.store(v, std::memory_order_relaxed);
+            }
+        }
+        // 设置 ft 偏好的线程, 偏好当前线程并且当前线程稍后会扫描队列时返回 true
+        bool setPrefer(FiberAndThread& ft);
+        // 偏好 thread 的任务是否应该留给它自己执行
+        bool keepForPrefer(int thread) const;
+        static thread_local ThreadState* t_state;
 
     private:
         MutexType m_mutex;
@@ -155,6 +269,14 @@ namespace sylar
         bool m_autostop = false;
         // 主线程ID
         int m_rootThreadId = 0;
+    private:
+        // 每个执行 run() 的线程一个状态, start() 时按线程数分配
+        std::unique_ptr<ThreadState[]> m_threadStates;
+        size_t m_threadStateCount = 0;
+        std::atomic<size_t> m_threadStateClaimed = {0};
+        std::atomic<uint64_t> m_preferred = {0};
+        std::atomic<uint64_t> m_localRuns = {0};
+        std::atomic<uint64_t> m_stolenRuns = {0};
     };
 }
 
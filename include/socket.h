@@ -4,6 +4,7 @@
 #include <memory>
 #include "address.h"
 #include "noncopyable.h"
+#include "thread.h"
 
 namespace sylar
 {
@@ -75,6 +76,12 @@ namespace sylar
             bool connect(const Address::ptr addr, uint64_t timeout_ms = -1);
             bool listen(int backlog = SOMAXCONN);
             bool close();
+            /**
+             * @brief 关闭读写方向并唤醒等待在句柄上的协程, 不释放句柄
+             * @details 与 close 互斥, 已经 close 的 socket 返回 false,
+             *          不会作用到被复用的同号句柄上
+             */
+            bool shutdown(int how = SHUT_RDWR);
 
             int send(const void* buffer, size_t length, int flags = 0);
             int send(const iovec* buffer, size_t length, int flags = 0);
@@ -134,6 +141,8 @@ namespace sylar
             int m_type;     // TCP UDP
             int m_protocol; // 协议
             int m_isConnected;
+            // 保护 m_sock 的释放, 使 close 与其他线程的 shutdown 互斥
+            Mutex m_mutex;
 
             Address::ptr m_remoteAddress;
             Address::ptr m_localAddress;
@@ -0,0 +1,368 @@
+#pragma once
+
+#ifndef __SYLAR_TASK_H__
+#define __SYLAR_TASK_H__
+
+/**
+ * C++20 无栈协程
+ * 需要使用 cmake -DSYLAR_COROUTINE=ON 编译, 此时整个工程使用 -std=c++20
+ * Task 的状态保存在编译器生成的协程帧中(通常只有几百字节), 不需要独立的栈,
+ * 挂起/恢复都投递到同一个 Scheduler/IOManager 上, 与 Fiber 可以互相等待
+ */
+#ifdef SYLAR_COROUTINE
+
+#if __cplusplus < 202002L
+#error "sylar::Task requires -std=c++20"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <atomic>
+#include <utility>
+#include <functional>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "iomanager.h"
+#include "log.h"
+#include "macro.h"
+
+namespace sylar
+{
+    /**
+     * @brief 协程帧的内存统计
+     */
+    struct TaskFrameStat
+    {
+        uint64_t frames = 0; // 存活的协程帧数量
+        uint64_t bytes = 0;  // 存活的协程帧字节数
+        uint64_t total = 0;  // 累计创建的协程帧数量
+    };
+
+    TaskFrameStat GetTaskFrameStat();
+
+    template <class T>
+    class Task;
+
+    namespace detail
+    {
+        void *AllocFrame(size_t size);
+        void FreeFrame(void *ptr, size_t size);
+
+        /**
+         * @brief 协程结束时直接切回 co_await 它的协程(对称转移, 不会加深调用栈)
+         */
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            template <class P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+            {
+                if (h.promise().continuation)
+                {
+                    return h.promise().continuation;
+                }
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        struct PromiseBase
+        {
+            // 惰性启动, 第一次 co_await 时才开始执行
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            FinalAwaiter final_suspend() noexcept { return {}; }
+            void unhandled_exception() { exception = std::current_exception(); }
+
+            static void *operator new(size_t size) { return AllocFrame(size); }
+            static void operator delete(void *ptr, size_t size) { FreeFrame(ptr, size); }
+
+            std::coroutine_handle<> continuation;
+            std::exception_ptr exception;
+        };
+
+        template <class T>
+        struct Promise : PromiseBase
+        {
+            template <class U>
+            void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+            T result()
+            {
+                if (exception)
+                {
+                    std::rethrow_exception(exception);
+                }
+                return std::move(*value);
+            }
+            std::optional<T> value;
+        };
+
+        template <>
+        struct Promise<void> : PromiseBase
+        {
+            void return_void() noexcept {}
+            void result()
+            {
+                if (exception)
+                {
+                    std::rethrow_exception(exception);
+                }
+            }
+        };
+
+        /**
+         * @brief 分离运行的协程, 开始即执行, 结束后自动释放协程帧
+         */
+        struct DetachedTask
+        {
+            struct promise_type
+            {
+                DetachedTask get_return_object() noexcept { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() noexcept {}
+                void unhandled_exception() noexcept { std::terminate(); }
+
+                static void *operator new(size_t size) { return AllocFrame(size); }
+                static void operator delete(void *ptr, size_t size) { FreeFrame(ptr, size); }
+            };
+        };
+    }
+
+    /**
+     * @brief 无栈协程任务
+     * @details 用法和普通的协程函数一致, 返回值声明为 Task<T>, 函数体里使用 co_await/co_return.
+     *          Task 只能移动, 析构时释放协程帧. 在其他 Task 中直接 co_await 得到结果,
+     *          在 Fiber 中使用 SyncWait, 或者用 Spawn 投递到调度器上分离运行
+     */
+    template <class T = void>
+    class Task
+    {
+    public:
+        struct promise_type : detail::Promise<T>
+        {
+            Task get_return_object() noexcept
+            {
+                return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+        };
+        typedef std::coroutine_handle<promise_type> handle_type;
+
+        Task() = default;
+        Task(Task &&rhs) noexcept
+            : m_handle(std::exchange(rhs.m_handle, nullptr))
+        {
+        }
+        Task &operator=(Task &&rhs) noexcept
+        {
+            if (this != &rhs)
+            {
+                if (m_handle)
+                {
+                    m_handle.destroy();
+                }
+                m_handle = std::exchange(rhs.m_handle, nullptr);
+            }
+            return *this;
+        }
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+        ~Task()
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+        }
+
+        bool isValid() const { return (bool)m_handle; }
+        bool isDone() const { return !m_handle || m_handle.done(); }
+
+        // 取得结果, 协程必须已经结束, 协程内抛出的异常在这里重新抛出
+        T getResult()
+        {
+            SYLAR_ASSERT(m_handle && m_handle.done());
+            return m_handle.promise().result();
+        }
+
+        // co_await task 启动(或等待)task, 并返回它的结果
+        auto operator co_await() noexcept
+        {
+            struct Awaiter
+            {
+                bool await_ready() noexcept { return !handle || handle.done(); }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+                {
+                    handle.promise().continuation = cont;
+                    return handle;
+                }
+                T await_resume() { return handle.promise().result(); }
+                handle_type handle;
+            };
+            return Awaiter{m_handle};
+        }
+
+        // 只等待 task 结束, 不取结果
+        auto whenReady() noexcept
+        {
+            struct Awaiter
+            {
+                bool await_ready() noexcept { return !handle || handle.done(); }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+                {
+                    handle.promise().continuation = cont;
+                    return handle;
+                }
+                void await_resume() noexcept {}
+                handle_type handle;
+            };
+            return Awaiter{m_handle};
+        }
+
+    private:
+        explicit Task(handle_type h)
+            : m_handle(h)
+        {
+        }
+
+    private:
+        handle_type m_handle = nullptr;
+    };
+
+    /**
+     * @brief co_await ResumeOn(sc) 把当前协程挂起, 之后在 sc 的线程上恢复
+     */
+    class ResumeOn
+    {
+    public:
+        ResumeOn(Scheduler *sc, int thread = -1)
+            : m_scheduler(sc), m_thread(thread)
+        {
+        }
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            m_scheduler->schedule([h]()
+                                  { h.resume(); },
+                                  m_thread);
+        }
+        void await_resume() noexcept {}
+
+    private:
+        Scheduler *m_scheduler;
+        int m_thread;
+    };
+
+    /**
+     * @brief 等待 fd 上的事件(IOManager::addEvent)
+     * @details co_await 的结果: 0 事件就绪(或被 cancelEvent 取消),
+     *          ETIMEDOUT 超时, -1 addEvent 失败
+     */
+    class WaitEvent
+    {
+    public:
+        WaitEvent(int fd, IOManager::Event event, uint64_t timeout_ms = ~0ull);
+        bool await_ready() noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h);
+        int await_resume();
+
+    private:
+        struct State
+        {
+            int cancelled = 0;
+        };
+        IOManager *m_iom;
+        int m_fd;
+        IOManager::Event m_event;
+        uint64_t m_timeout;
+        std::shared_ptr<State> m_state;
+        Timer::ptr m_timer;
+        int m_rt = 0;
+    };
+
+    /**
+     * @brief co_await Sleep(ms) 挂起当前协程 ms 毫秒, 不占用线程
+     */
+    class Sleep
+    {
+    public:
+        Sleep(uint64_t ms);
+        bool await_ready() noexcept { return m_ms == 0; }
+        void await_suspend(std::coroutine_handle<> h);
+        void await_resume() noexcept {}
+
+    private:
+        IOManager *m_iom;
+        uint64_t m_ms;
+    };
+
+    /**
+     * @brief co_await InFiber(cb) 在调度器的协程中执行 cb, 执行完后恢复当前协程
+     * @details cb 中可以调用 hook 过的阻塞函数, 或者其他只能在 Fiber 中运行的代码
+     */
+    class InFiber
+    {
+    public:
+        InFiber(std::function<void()> cb, Scheduler *sc = nullptr);
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        void await_resume();
+
+    private:
+        std::function<void()> m_cb;
+        Scheduler *m_scheduler;
+        std::exception_ptr m_exception;
+    };
+
+    /**
+     * @brief 协程版本的 socket 读写
+     * @details 与 hook 的语义一致: 按 FdCtx 的 SO_RCVTIMEO/SO_SNDTIMEO 超时,
+     *          EAGAIN 时挂起协程等待事件, 结果和 errno 与同名系统调用相同
+     */
+    Task<ssize_t> AsyncRead(int fd, void *buf, size_t count);
+    Task<ssize_t> AsyncWrite(int fd, const void *buf, size_t count);
+    Task<ssize_t> AsyncRecv(int fd, void *buf, size_t len, int flags = 0);
+    Task<ssize_t> AsyncSend(int fd, const void *buf, size_t len, int flags = 0);
+    Task<int> AsyncAccept(int fd, sockaddr *addr = nullptr, socklen_t *addrlen = nullptr);
+
+    /**
+     * @brief 在 sc 上分离运行 task, task 的异常会被记录到日志
+     */
+    void Spawn(Scheduler *sc, Task<void> task);
+
+    namespace detail
+    {
+        template <class T>
+        DetachedTask WakeFiber(Task<T> &task, std::atomic<bool> &parked,
+                               Scheduler *sc, Fiber::ptr fiber)
+        {
+            co_await task.whenReady();
+            // 等待的 Fiber 已经(或即将)挂起, 由这里把它调度回来
+            if (parked.exchange(true))
+            {
+                sc->schedule(std::move(fiber));
+            }
+        }
+    }
+
+    /**
+     * @brief 在 Fiber 中等待 task 执行完毕并返回结果, 等待期间当前 Fiber 挂起
+     */
+    template <class T>
+    T SyncWait(Task<T> task)
+    {
+        Scheduler *sc = Scheduler::GetThis();
+        SYLAR_ASSERT2(sc, "SyncWait must be called in a scheduler fiber");
+        std::atomic<bool> parked{false};
+        detail::WakeFiber(task, parked, sc, Fiber::GetThis());
+        if (!parked.exchange(true))
+        {
+            Fiber::YieldToHold();
+        }
+        return task.getResult();
+    }
+}
+
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <functional>
+#include <set>
 #include "iomanager.h"
 #include "socket.h"
 #include "address.h"
@@ -30,6 +31,16 @@ namespace sylar
             virtual bool start();
             // 服务器的停止
             virtual void stop();
+            /**
+             * @brief 优雅停止: 停止接受新连接, 等待处理中的连接在 timeout_ms 内结束
+             * @details 超时后对剩余的连接 shutdown 读写并 cancelAll, 阻塞在它们上面的协程被唤醒,
+             *          读到 EOF 后自行结束(之后的写会收到 EPIPE, 进程需要忽略 SIGPIPE).
+             *          可以在协程中或者外部线程调用
+             * @return 被强制关闭的连接数
+             */
+            virtual size_t drain(uint64_t timeout_ms);
+            // 正在处理的连接数
+            size_t getClientCount();
 
             uint64_t getRecvTimeout() const {return m_recvTimeout;}
             /**
@@ -61,6 +72,10 @@ namespace sylar
              * @brief 开始接受连接
              */
             virtual void startAccept(Socket::ptr sock);
+            /**
+             * @brief 登记连接后调用 handleClient, 返回后移除
+             */
+            void runClient(Socket::ptr client);
         protected:
             /// 监听Socket数组
             std::vector<Socket::ptr> m_socks;
@@ -80,6 +95,10 @@ namespace sylar
 
             bool m_ssl = false;
 
+            Mutex m_mutex;
+            /// 正在 handleClient 中处理的连接, drain 超时时强制关闭
+            std::set<Socket::ptr> m_clients;
+
             // TcpServerConf::ptr m_conf;
     };
 }
@@ -26,6 +26,8 @@ namespace sylar
         Semaphore(uint32_t count = 0);
         ~Semaphore();
         void wait();
+        // 最多等待 timeout_ms, 超时返回 false
+        bool waitFor(uint64_t timeout_ms);
         void notify();
         // sem_t getSemaphore() const {return m_semaphore;}
 
@@ -7,6 +7,9 @@
 #include <thread.h>
 #include <vector>
 #include <set>
+#include <atomic>
+#include <string>
+#include <functional>
 
 namespace sylar
 {
@@ -21,19 +24,36 @@ namespace sylar
             bool cancel();
             bool refresh();
             bool reset(uint64_t ms, bool from_now);
+            // 与 reset 相同, 间隔单位为微秒
+            bool resetUs(uint64_t us, bool from_now);
         private:
-            Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
+            Timer(uint64_t us, std::function<void()> cb, bool recurring, TimerManager* manager,
+                  uint64_t slack_us = 0);
             Timer(uint64_t next);
+            // 设置精确的到期时间, 按 m_slack 合并得到 m_next
+            void setNext(uint64_t exact);
+            // 在所属线程(或者持有锁时)取消
+            bool doCancel();
 
         private:
             // 是否为循环定时器，若为true，则循环执行函数
             bool m_recurring = false;
-            // 间隔时间
-            uint64_t m_ms = 0;
-            // 下一个执行周期的时间;精确的执行事件
+            // 间隔时间 us
+            uint64_t m_us = 0;
+            // 下一个执行周期的时间, 单调时钟 us; 有 slack 时为合并之后的时间
             uint64_t m_next = 0;
+            // 允许的延迟 us, 以及没有合并之前的精确到期时间
+            uint64_t m_slack = 0;
+            uint64_t m_exact = 0;
             TimerManager* m_manager = nullptr; // Timer是属于哪一个TimerManager
             std::function<void()> m_cb;
+            // 时间轮模式: 所在槽位的双向链表, 在轮中时持有自身, 取消或者到期后释放
+            Timer* m_wheelPrev = nullptr;
+            Timer* m_wheelNext = nullptr;
+            Timer** m_wheelSlot = nullptr;
+            Timer::ptr m_wheelSelf;
+            // 线程独占的管理器: 还可以被取消, 取消和到期时原子地置为 false, 保证两者只有一个成功
+            std::atomic<bool> m_armed = {true};
 
         private:
             struct Comparator
@@ -44,11 +64,70 @@ namespace sylar
             };
     };
 
+    /**
+     * @brief 侵入式定时器节点, 嵌入在使用者的对象中, 加入和取消都不分配内存
+     * @details 到期时由 listExpiredCb 在释放锁之后直接调用 fn, fn 需要很短并且不能阻塞.
+     *          cancelNode 返回之后 fn 不会再被调用, 节点可以被复用或者释放
+     */
+    struct TimerNode
+    {
+        typedef void (*Callback)(TimerNode* node);
+        Callback fn = nullptr;
+        // 到期时间, 单调时钟 us; 有 slack 时为合并之后的时间
+        uint64_t deadline = 0;
+        // 没有合并之前的精确到期时间
+        uint64_t exact = 0;
+        // 在管理器的堆中的下标, -1 表示没有加入
+        int index = -1;
+        // fn 正在执行
+        std::atomic<bool> firing = {false};
+    };
+
+    /**
+     * @brief 定时器管理器的锁, 管理器被一个线程独占之后加解锁都是空操作
+     */
+    class TimerMutex : Noncopyable
+    {
+        public:
+            typedef ReadScopedLockImpl<TimerMutex> ReadLock;
+            typedef WriteScopedLockImpl<TimerMutex> WriteLock;
+
+            void rdlock()
+            {
+                if (!m_owned)
+                {
+                    m_mutex.rdlock();
+                }
+            }
+
+            void wrlock()
+            {
+                if (!m_owned)
+                {
+                    m_mutex.wrlock();
+                }
+            }
+
+            void unlock()
+            {
+                if (!m_owned)
+                {
+                    m_mutex.unlock();
+                }
+            }
+
+            void setOwned(bool v) { m_owned = v; }
+
+        private:
+            RWMutex m_mutex;
+            bool m_owned = false;
+    };
+
     class TimerManager
     {
         friend class Timer;
         public:
-            typedef RWMutex RWMutexType;
+            typedef TimerMutex RWMutexType;
 
             TimerManager();
             virtual ~TimerManager();
@@ -60,25 +139,155 @@ namespace sylar
             Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb
                                         ,std::weak_ptr<void> weak_ptr
                                         ,bool recurring = false);
-            // 得到下一个定时器的执行时间
+            /**
+             * @brief 微秒精度的定时器, 内部统一使用单调时钟微秒计时
+             * @param[in] slack_us 允许晚到期的时间. 到期时间向上取整到不超过 slack_us 的 2 的幂的边界,
+             *            落在同一个边界上的定时器在一次唤醒中一起到期, 不会提前
+             */
+            Timer::ptr addTimerUs(uint64_t us, std::function<void()> cb
+                                 ,bool recurring = false, uint64_t slack_us = 0);
+            Timer::ptr addConditionTimerUs(uint64_t us, std::function<void()> cb
+                                          ,std::weak_ptr<void> weak_ptr
+                                          ,bool recurring = false, uint64_t slack_us = 0);
+            // 是否使用时间轮(timer.wheel.enable, 创建时读取)
+            bool isWheel() const { return m_useWheel; }
+            // 得到下一个定时器的执行时间 ms, 不足 1ms 向上取整
             uint64_t getNextTimer();
+            // 得到下一个定时器的执行时间 us
+            uint64_t getNextTimerUs();
+            // 下一个定时器的绝对到期时间(单调时钟 us), 没有定时器返回 ~0ull
+            uint64_t getNextDeadline();
             // 把已经超时了的定时器 所需要执行的回调函数收集起来，并且执行
             void listExpiredCb(std::vector<std::function<void()> >& cbs);
             bool hasTimer();
+            /**
+             * @brief 加入侵入式定时器, us 之后到期; 节点不能已经在管理器中
+             * @details 总是加在本管理器上, 不转到线程独占的管理器, 可以在任意线程上取消
+             */
+            void addNode(TimerNode* node, uint64_t us, uint64_t slack_us = 0);
+            /**
+             * @brief 取消侵入式定时器, fn 正在执行时等待它结束
+             * @return 到期之前取消返回 true
+             */
+            bool cancelNode(TimerNode* node);
+
+            /**
+             * @brief 定时器合并的统计
+             */
+            struct SlackStat
+            {
+                // 带 slack 加入的定时器(包括侵入式定时器)
+                uint64_t timers = 0;
+                // 有定时器到期的轮数
+                uint64_t rounds = 0;
+                // 合并省下的唤醒: 每一轮到期的精确时间的种类数减去合并之后的种类数
+                uint64_t wakeupsSaved = 0;
+            };
+            virtual void getSlackStat(SlackStat& stat) const;
+            std::string dumpSlackStat() const;
+            /**
+             * @brief 由当前线程独占, 之后定时器的增删改不再加锁
+             * @details 只能由所属线程加入定时器. 其他线程对定时器的 cancel/refresh/reset
+             *          作为消息投递给所属线程, 在它下一次 getNextDeadline/listExpiredCb 时执行
+             */
+            void setOwner();
+            // 解除当前线程与管理器的绑定, 所属线程退出事件循环或者管理器析构时调用,
+            // 之后该线程可以再认领其他管理器
+            void releaseOwner();
+            bool isOwned() const { return m_owned; }
+            // 当前线程是否为所属线程
+            bool isOwnerThread() const;
         protected:
             virtual void onTimerInsertedAtFront() = 0;
+            // 其他线程投递了可能使定时器提前的消息(refresh/reset), 需要唤醒所属线程
+            virtual void onRemoteTimerOp() {}
+            // 当前线程对应的线程独占管理器, 返回非空时 addTimer 转到它上面
+            virtual TimerManager* getThreadTimerManager() { return nullptr; }
             void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
             // 当前是否存在定时器
 
         private:
-            // 检测是否出现修改系统时间的现象，出现了之后使得系统改变措施
-            bool detectClockRollover(uint64_t now_ms);
+            // 以下 wheel 开头的函数需要持有写锁
+            // 按到期时间放入对应层的槽位
+            void wheelAdd(Timer* timer);
+            // 从所在槽位摘下, 返回轮中持有的自身引用
+            Timer::ptr wheelRemove(Timer* timer);
+            // 把高层的一个槽位重新分配到低层
+            void wheelCascade(int level, int slot);
+            // 推进到 now_us 所在的 tick, 收集到期的定时器
+            void wheelAdvance(uint64_t now_us, std::vector<Timer::ptr>& expired);
+            // 下一个需要处理的 tick(槽位到期或者高层需要下放), 没有定时器返回 ~0ull
+            uint64_t wheelNextTick();
+            // 线程独占模式下其他线程的操作
+            enum TimerOpType
+            {
+                OP_CANCEL,
+                OP_REFRESH,
+                OP_RESET
+            };
+            struct TimerOp
+            {
+                Timer::ptr timer;
+                TimerOpType type;
+                uint64_t us;
+                bool fromNow;
+            };
+            void postTimerOp(Timer::ptr timer, TimerOpType type, uint64_t us = 0, bool from_now = false);
+            // 所属线程执行投递过来的操作
+            void applyTimerOps();
+            // 线程独占模式下到期的定时器是否还需要执行
+            bool claimExpired(Timer* timer);
+            // 以下 node 开头的函数需要持有写锁, 按 deadline 的最小堆
+            void nodeUp(int idx);
+            void nodeDown(int idx);
+            void nodeRemove(TimerNode* node);
+            /**
+             * @brief 执行到期的侵入式定时器, 返回到期的数量
+             * @param[out] exact 不为空时收集到期的精确时间, 合并之后的时间收集到 next
+             */
+            size_t expireNodes(uint64_t now_us, std::vector<uint64_t>* exact, std::vector<uint64_t>& next);
+            // 收集到期的 Timer 的回调, 参数同 expireNodes
+            void expireTimers(uint64_t now_us, std::vector<std::function<void()> >& cbs,
+                              std::vector<uint64_t>* exact, std::vector<uint64_t>& next);
+            // 统计一轮到期的定时器的精确时间和合并之后的时间
+            void recordSlack(std::vector<uint64_t>& exact, std::vector<uint64_t>& next);
         private:
             RWMutexType m_mutex;
             // set是有序的 --- hash表来存储ptr
             std::set<Timer::ptr, Timer::Comparator> m_timers;
             bool m_tickled = false;
-            uint64_t m_previouseTime;
+            // 侵入式定时器的最小堆, 只在超过历史最大数量时扩容
+            std::vector<TimerNode*> m_nodes;
+
+            /**
+             * 分层时间轮: 4 层每层 256 个槽位, 第 0 层一个槽位一个 tick,
+             * 第 i 层一个槽位 256^i 个 tick. 加入和取消都是链表操作, O(1),
+             * 第 0 层转满一圈时把上一层对应的槽位下放. 到期时间向上取整到 tick
+             */
+            static const int WHEEL_LEVELS = 4;
+            static const int WHEEL_BITS = 8;
+            static const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+            bool m_useWheel = false;
+            // 一个 tick 的微秒数
+            uint64_t m_tickUs = 1000;
+            // 下一个待处理的 tick
+            uint64_t m_wheelBase = 0;
+            size_t m_wheelCount = 0;
+            // wheelNextTick 的缓存, 取消定时器和推进时失效
+            uint64_t m_wheelNextTick = ~0ull;
+            bool m_wheelNextValid = true;
+            Timer* m_wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+
+            // 线程独占模式
+            bool m_owned = false;
+            Mutex m_opMutex;
+            std::vector<TimerOp> m_ops;
+            std::atomic<bool> m_hasOps = {false};
+
+            // 合并统计, 有带 slack 的定时器之后才统计每一轮的到期时间
+            std::atomic<uint64_t> m_slackTimers = {0};
+            std::atomic<uint64_t> m_expireRounds = {0};
+            std::atomic<uint64_t> m_wakeupsSaved = {0};
     };
 }
 
@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
 #include <sys/syscall.h>
 #include <vector>
 #include <string>
@@ -17,10 +18,32 @@ namespace sylar
     uint32_t GetFiberId();
     void Backtrace(std::vector<std::string>& vec, int size = 64, int skip = 1);
     std::string BacktraceToString(int size = 64, int skip = 2, const std::string& prefix = "");
-    // 时间 毫秒 ms
+    // 墙上时间 毫秒 ms, 会随系统时间的修改而跳变, 计算耗时和超时使用单调时钟
     uint64_t GetCurrentMS();
-    // 时间 微秒 us
+    // 墙上时间 微秒 us
     uint64_t GetCurrentUS();
+    // 单调时钟 纳秒 ns
+    uint64_t GetMonotonicNS();
+    // 单调时钟 微秒 us
+    uint64_t GetMonotonicUS();
+    // 单调时钟 毫秒 ms
+    uint64_t GetMonotonicMS();
+
+    /**
+     * 线程缓存的时钟: IOManager::idle 每次醒来刷新一次, 这一轮中判断定时器到期读取缓存的值,
+     * 不再每次调用 clock_gettime. 缓存的值只会比真实时间早, 用来判断到期只会晚不会早.
+     * 线程一直在执行协程时不会刷新, 所以只用于到期判断, 日志等需要当前时间的地方读取真实时钟.
+     * 没有刷新过(不是事件循环线程)或者已经 Reset 的线程读取真实时钟
+     */
+    // 刷新当前线程缓存的单调时钟, 返回刷新后的值 ns
+    uint64_t UpdateCachedClock();
+    // 当前线程不再使用缓存, 事件循环退出时调用
+    void ResetCachedClock();
+    // 缓存的单调时钟 ns / us
+    uint64_t GetCachedMonotonicNS();
+    uint64_t GetCachedMonotonicUS();
+    // 当前线程的 cpu 时间 纳秒 ns
+    uint64_t GetThreadCpuNS();
 }   
 
 #endif
\ No newline at end of file
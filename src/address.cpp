@@ -8,10 +8,17 @@
 #include <netdb.h>
 #include "sendian.h"
 #include "address.h"
+#include "config.h"
+#include "dns.h"
+#include "hook.h"
 
 namespace sylar
 {
     static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+    static sylar::ConfigVar<bool>::ptr g_dns_async =
+        sylar::Config::Lookup("dns.async", true, "resolve host names with DnsResolver in hooked fibers");
+    static sylar::ConfigVar<bool>::ptr g_dns_fallback =
+        sylar::Config::Lookup("dns.fallback", true, "retry with getaddrinfo when no dns server answered");
     // 创建掩码
     template<class T>
     static T CreateMask(uint32_t bits)
@@ -43,6 +50,18 @@ namespace sylar
         return ss.str();
     }
 
+    // 是否需要通过 DNS 解析: IP 协议族并且不是数字地址
+    static bool IsHostName(const std::string& node, int family)
+    {
+        if (node.empty() || (family != AF_UNSPEC && family != AF_INET && family != AF_INET6))
+        {
+            return false;
+        }
+        in6_addr buf;
+        return inet_pton(AF_INET, node.c_str(), &buf) != 1
+            && inet_pton(AF_INET6, node.c_str(), &buf) != 1;
+    }
+
     Address::ptr Address::LookupAny(const std::string& host, int family, int type, int protocol)
     {
         std::vector<Address::ptr> results;
@@ -134,6 +153,36 @@ namespace sylar
         {
             node = host;
         }
+        // 协程中的域名交给 DnsResolver, 只挂起当前协程; 数字地址和服务名仍由 getaddrinfo 处理
+        if (is_hook_enable() && g_dns_async->getValue() && IsHostName(node, family)
+            && (!service || isdigit(*service)) && DnsResolverMgr::GetInstance()->isAvailable())
+        {
+            std::vector<IPAddress::ptr> addrs;
+            DnsResolver::Status status = DnsResolverMgr::GetInstance()->resolve(node, family, addrs);
+            if (status == DnsResolver::OK)
+            {
+                uint16_t port = service ? atoi(service) : 0;
+                for (auto& i : addrs)
+                {
+                    // 缓存中的地址是共享的, 复制之后再设置端口
+                    IPAddress::ptr addr = std::dynamic_pointer_cast<IPAddress>(
+                            Create(i->getAddr(), i->getAddrLen()));
+                    addr->setPort(port);
+                    result.push_back(addr);
+                }
+                return !result.empty();
+            }
+            SYLAR_LOG_DEBUG(g_logger) << "Address::Lookup resolve(" << host << ", "
+                << family << ") fail status=" << status;
+            // 服务器明确应答了没有地址时, getaddrinfo 查询同样的服务器也不会有结果.
+            // 只有没得到应答时才回退, nsswitch 中的其他来源(ldap, mdns 等)或者 TCP 重试
+            // 只有 getaddrinfo 能做到, 这时会阻塞线程
+            if (status == DnsResolver::NOT_FOUND || !g_dns_fallback->getValue())
+            {
+                return false;
+            }
+        }
+
         // 函数将主机名、主机地址、服务名和端口的字符串表示转换成套接字地址结构体 0 is succeds
         int error = getaddrinfo(node.c_str(), service, &hints, &results);
         if(error) {
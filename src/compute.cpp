@@ -0,0 +1,155 @@
+#include "compute.h"
+#include "config.h"
+#include "hook.h"
+#include "util.h"
+#include <sstream>
+#include <exception>
+
+namespace sylar
+{
+    static ConfigVar<uint32_t>::ptr g_compute_threads =
+        Config::Lookup<uint32_t>("compute.threads", 4, "default compute pool threads");
+
+    struct ComputePool::Task
+    {
+        const std::function<void()> *fn = nullptr;
+        std::exception_ptr error;
+        // 提交任务的调度器和线程, 完成后协程在这里恢复
+        Scheduler *scheduler = nullptr;
+        int thread = -1;
+        Fiber::ptr fiber;
+        uint64_t submitNs = 0;
+    };
+
+    ComputePool::ComputePool(size_t threads, const std::string &name)
+        : Scheduler(threads ? threads : std::max(1u, g_compute_threads->getValue()), false, name)
+    {
+        start();
+    }
+
+    ComputePool::~ComputePool()
+    {
+        stop();
+    }
+
+    void ComputePool::run(const std::function<void()> &fn)
+    {
+        Scheduler *scheduler = Scheduler::GetThis();
+        // 不在调度器的任务协程中(包括调度协程和 idle 协程)没有可以挂起的协程;
+        // 已经在本线程池中时直接执行, 避免占满线程后互相等待
+        if (!scheduler || scheduler == this || !Scheduler::InTaskFiber())
+        {
+            m_inlined.fetch_add(1, std::memory_order_relaxed);
+            fn();
+            return;
+        }
+        Task task;
+        task.fn = &fn;
+        task.scheduler = scheduler;
+        task.thread = GetThreadId();
+        task.fiber = Fiber::GetThis();
+        task.submitNs = GetMonotonicNS();
+        m_submitted.fetch_add(1, std::memory_order_relaxed);
+        if (m_running.load(std::memory_order_relaxed) + m_queued.load(std::memory_order_relaxed) >= m_threadCount)
+        {
+            m_saturated.fetch_add(1, std::memory_order_relaxed);
+        }
+        uint64_t queued = m_queued.fetch_add(1, std::memory_order_relaxed) + 1;
+        uint64_t queue_max = m_queueMax.load(std::memory_order_relaxed);
+        while (queued > queue_max && !m_queueMax.compare_exchange_weak(queue_max, queued, std::memory_order_relaxed))
+        {
+        }
+        Task *ptask = &task;
+        schedule([this, ptask]()
+                 { execute(ptask); });
+        // 完成之后由线程池把协程调度回原来的线程
+        Fiber::YieldToHold();
+        if (task.error)
+        {
+            std::rethrow_exception(task.error);
+        }
+    }
+
+    void ComputePool::execute(Task *task)
+    {
+        uint64_t start = GetMonotonicNS();
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
+        m_running.fetch_add(1, std::memory_order_relaxed);
+        m_waitNs.fetch_add(start - task->submitNs, std::memory_order_relaxed);
+        // Scheduler::run 打开了 hook, 这里没有 IOManager, 阻塞调用不能挂起
+        bool hook = is_hook_enable();
+        set_hook_enable(false);
+        try
+        {
+            (*task->fn)();
+        }
+        catch (...)
+        {
+            task->error = std::current_exception();
+        }
+        set_hook_enable(hook);
+        m_runNs.fetch_add(GetMonotonicNS() - start, std::memory_order_relaxed);
+        m_running.fetch_sub(1, std::memory_order_relaxed);
+        m_completed.fetch_add(1, std::memory_order_relaxed);
+        // task 在协程的栈上, 调度之后协程可能立即返回, 不能再访问 task
+        Scheduler *scheduler = task->scheduler;
+        int thread = task->thread;
+        Fiber::ptr fiber;
+        fiber.swap(task->fiber);
+        scheduler->schedule(fiber, thread);
+    }
+
+    void ComputePool::tickle()
+    {
+        // 信号量会记住提前到达的唤醒, 即将进入 idle 的线程不会错过
+        m_sem.notify();
+    }
+
+    void ComputePool::idle()
+    {
+        while (true)
+        {
+            if (stopping())
+            {
+                // stop 只唤醒一轮, 退出时把唤醒传给还在等待的线程
+                m_sem.notify();
+                break;
+            }
+            m_sem.wait();
+            Fiber::YieldToHold();
+        }
+    }
+
+    void ComputePool::getStat(Stat &stat) const
+    {
+        stat.threads = m_threadCount;
+        stat.submitted = m_submitted.load(std::memory_order_relaxed);
+        stat.completed = m_completed.load(std::memory_order_relaxed);
+        stat.inlined = m_inlined.load(std::memory_order_relaxed);
+        stat.saturated = m_saturated.load(std::memory_order_relaxed);
+        stat.running = m_running.load(std::memory_order_relaxed);
+        stat.queued = m_queued.load(std::memory_order_relaxed);
+        stat.queueMax = m_queueMax.load(std::memory_order_relaxed);
+        stat.waitNs = m_waitNs.load(std::memory_order_relaxed);
+        stat.runNs = m_runNs.load(std::memory_order_relaxed);
+    }
+
+    std::string ComputePool::dumpStat() const
+    {
+        Stat stat;
+        getStat(stat);
+        std::stringstream ss;
+        ss << "[ComputeStat name=" << getName() << " threads=" << stat.threads
+           << " submitted=" << stat.submitted << " completed=" << stat.completed
+           << " inlined=" << stat.inlined << " saturated=" << stat.saturated
+           << " running=" << stat.running << " queued=" << stat.queued
+           << " queue_max=" << stat.queueMax;
+        if (stat.completed)
+        {
+            ss << " avg_wait=" << stat.waitNs / stat.completed / 1000.0 << "us"
+               << " avg_run=" << stat.runNs / stat.completed / 1000.0 << "us";
+        }
+        ss << "]";
+        return ss.str();
+    }
+}
@@ -0,0 +1,721 @@
+#include "dns.h"
+#include "config.h"
+#include "log.h"
+#include "fiber.h"
+#include "scheduler.h"
+#include "hook.h"
+#include "util.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <random>
+#include <string.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace sylar
+{
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static ConfigVar<std::vector<std::string> >::ptr g_dns_servers =
+        Config::Lookup("dns.servers", std::vector<std::string>(), "dns servers, empty to use /etc/resolv.conf");
+    static ConfigVar<std::vector<std::string> >::ptr g_dns_search =
+        Config::Lookup("dns.search", std::vector<std::string>(), "dns search domains, empty to use /etc/resolv.conf");
+    static ConfigVar<int>::ptr g_dns_timeout =
+        Config::Lookup<int>("dns.timeout", 2000, "dns query timeout ms per server");
+    static ConfigVar<int>::ptr g_dns_attempts =
+        Config::Lookup<int>("dns.attempts", 2, "dns query rounds over all servers");
+    static ConfigVar<uint32_t>::ptr g_dns_max_ttl =
+        Config::Lookup<uint32_t>("dns.cache.max_ttl", 300, "max seconds to cache a dns answer");
+    static ConfigVar<uint32_t>::ptr g_dns_negative_ttl =
+        Config::Lookup<uint32_t>("dns.cache.negative_ttl", 5, "seconds to cache a nonexistent name");
+    static ConfigVar<uint32_t>::ptr g_dns_cache_size =
+        Config::Lookup<uint32_t>("dns.cache.max_size", 10000, "max dns cache entries");
+
+    static const uint16_t DNS_TYPE_A = 1;
+    static const uint16_t DNS_TYPE_AAAA = 28;
+    static const uint8_t DNS_RCODE_NXDOMAIN = 3;
+
+    // 解析 ip, ip:port 或者 [ipv6]:port, 只接受数字地址
+    static IPAddress::ptr ParseIp(const std::string &str, uint16_t def_port)
+    {
+        std::string ip = str;
+        uint16_t port = def_port;
+        if (!str.empty() && str[0] == '[')
+        {
+            size_t end = str.find(']');
+            if (end == std::string::npos)
+            {
+                return nullptr;
+            }
+            ip = str.substr(1, end - 1);
+            if (end + 1 < str.size() && str[end + 1] == ':')
+            {
+                port = atoi(str.c_str() + end + 2);
+            }
+        }
+        else if (std::count(str.begin(), str.end(), ':') == 1)
+        {
+            size_t pos = str.find(':');
+            ip = str.substr(0, pos);
+            port = atoi(str.c_str() + pos + 1);
+        }
+        sockaddr_in v4;
+        memset(&v4, 0, sizeof(v4));
+        if (inet_pton(AF_INET, ip.c_str(), &v4.sin_addr) == 1)
+        {
+            v4.sin_family = AF_INET;
+            v4.sin_port = htons(port);
+            return std::make_shared<IPv4Address>(v4);
+        }
+        sockaddr_in6 v6;
+        memset(&v6, 0, sizeof(v6));
+        if (inet_pton(AF_INET6, ip.c_str(), &v6.sin6_addr) == 1)
+        {
+            v6.sin6_family = AF_INET6;
+            v6.sin6_port = htons(port);
+            return std::make_shared<IPv6Address>(v6);
+        }
+        return nullptr;
+    }
+
+    // 域名不区分大小写, 去掉结尾的 '.'
+    static std::string NormalizeName(const std::string &host)
+    {
+        std::string name = host;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (!name.empty() && name.back() == '.')
+        {
+            name.pop_back();
+        }
+        return name;
+    }
+
+    static bool MatchFamily(const IPAddress::ptr &addr, int family)
+    {
+        return family == AF_UNSPEC || addr->getFamily() == family;
+    }
+
+    // 查询 ID 必须不可预测, 否则伪造的应答只要猜中 ID 就会被接受
+    static uint16_t RandomQueryId()
+    {
+        uint16_t id = 0;
+        if (getrandom(&id, sizeof(id), GRND_NONBLOCK) == (ssize_t)sizeof(id))
+        {
+            return id;
+        }
+        static thread_local std::mt19937 s_rng(std::random_device{}());
+        return (uint16_t)s_rng();
+    }
+
+    // 构造一个 RD=1 的查询报文
+    static bool BuildQuery(uint16_t id, const std::string &name, uint16_t qtype, std::string &out)
+    {
+        uint8_t hdr[12] = {(uint8_t)(id >> 8), (uint8_t)id, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0};
+        out.assign((const char *)hdr, sizeof(hdr));
+        size_t start = 0;
+        while (start < name.size())
+        {
+            size_t dot = name.find('.', start);
+            if (dot == std::string::npos)
+            {
+                dot = name.size();
+            }
+            size_t len = dot - start;
+            if (len == 0 || len > 63)
+            {
+                return false;
+            }
+            out.push_back((char)len);
+            out.append(name, start, len);
+            start = dot + 1;
+        }
+        out.push_back(0);
+        out.push_back((char)(qtype >> 8));
+        out.push_back((char)qtype);
+        out.push_back(0);
+        out.push_back(1);
+        return out.size() <= 512;
+    }
+
+    // 跳过报文中的域名(可能是压缩指针)
+    static bool SkipName(const uint8_t *p, size_t len, size_t &pos)
+    {
+        while (pos < len)
+        {
+            uint8_t l = p[pos];
+            if ((l & 0xC0) == 0xC0)
+            {
+                pos += 2;
+                return pos <= len;
+            }
+            if (l == 0)
+            {
+                ++pos;
+                return true;
+            }
+            pos += 1 + l;
+        }
+        return false;
+    }
+
+    static uint16_t Read16(const uint8_t *p)
+    {
+        return (uint16_t)(p[0] << 8 | p[1]);
+    }
+
+    // 应答的问题部分必须与发出的查询一致(域名不区分大小写)
+    static bool MatchQuestion(const uint8_t *p, size_t len, const std::string &name, uint16_t qtype)
+    {
+        if (Read16(p + 4) != 1)
+        {
+            return false;
+        }
+        std::string qname;
+        size_t pos = 12;
+        while (pos < len && p[pos])
+        {
+            // 问题部分是第一个域名, 不会出现压缩指针
+            if ((p[pos] & 0xC0) || pos + 1 + p[pos] > len)
+            {
+                return false;
+            }
+            if (!qname.empty())
+            {
+                qname.push_back('.');
+            }
+            qname.append((const char *)p + pos + 1, p[pos]);
+            pos += 1 + p[pos];
+        }
+        if (pos + 5 > len)
+        {
+            return false;
+        }
+        std::transform(qname.begin(), qname.end(), qname.begin(), ::tolower);
+        return qname == name && Read16(p + pos + 1) == qtype && Read16(p + pos + 3) == 1;
+    }
+
+    /**
+     * @brief 取出应答中的 A/AAAA 记录, CNAME 等其他记录忽略
+     * @return 报文格式错误返回 false
+     */
+    static bool ParseAnswers(const uint8_t *p, size_t len, std::vector<IPAddress::ptr> &v4,
+                             std::vector<IPAddress::ptr> &v6, uint32_t &ttl)
+    {
+        uint16_t qdcount = Read16(p + 4);
+        uint16_t ancount = Read16(p + 6);
+        size_t pos = 12;
+        for (uint16_t i = 0; i < qdcount; ++i)
+        {
+            if (!SkipName(p, len, pos) || pos + 4 > len)
+            {
+                return false;
+            }
+            pos += 4;
+        }
+        for (uint16_t i = 0; i < ancount; ++i)
+        {
+            if (!SkipName(p, len, pos) || pos + 10 > len)
+            {
+                return false;
+            }
+            uint16_t type = Read16(p + pos);
+            uint32_t rttl = (uint32_t)Read16(p + pos + 4) << 16 | Read16(p + pos + 6);
+            uint16_t rdlen = Read16(p + pos + 8);
+            pos += 10;
+            if (pos + rdlen > len)
+            {
+                return false;
+            }
+            if (type == DNS_TYPE_A && rdlen == 4)
+            {
+                sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                memcpy(&addr.sin_addr, p + pos, 4);
+                v4.push_back(std::make_shared<IPv4Address>(addr));
+                ttl = std::min(ttl, rttl);
+            }
+            else if (type == DNS_TYPE_AAAA && rdlen == 16)
+            {
+                sockaddr_in6 addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin6_family = AF_INET6;
+                memcpy(&addr.sin6_addr, p + pos, 16);
+                v6.push_back(std::make_shared<IPv6Address>(addr));
+                ttl = std::min(ttl, rttl);
+            }
+            pos += rdlen;
+        }
+        return true;
+    }
+
+    DnsResolver::DnsResolver()
+    {
+        loadHosts();
+        setServers(g_dns_servers->getValue());
+        setSearch(g_dns_search->getValue());
+        g_dns_servers->addListener([this](const std::vector<std::string> &old_value,
+                                          const std::vector<std::string> &new_value)
+                                   { setServers(new_value); });
+        g_dns_search->addListener([this](const std::vector<std::string> &old_value,
+                                         const std::vector<std::string> &new_value)
+                                  { setSearch(new_value); });
+    }
+
+    void DnsResolver::loadHosts()
+    {
+        std::ifstream ifs("/etc/hosts");
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            size_t pos = line.find('#');
+            if (pos != std::string::npos)
+            {
+                line.resize(pos);
+            }
+            std::istringstream iss(line);
+            std::string ip;
+            if (!(iss >> ip))
+            {
+                continue;
+            }
+            IPAddress::ptr addr = ParseIp(ip, 0);
+            if (!addr)
+            {
+                continue;
+            }
+            std::string name;
+            while (iss >> name)
+            {
+                m_hosts[NormalizeName(name)].push_back(addr);
+            }
+        }
+    }
+
+    void DnsResolver::loadResolvConf(std::vector<std::string> &servers, std::vector<std::string> &search,
+                                     int &ndots)
+    {
+        std::ifstream ifs("/etc/resolv.conf");
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            std::istringstream iss(line);
+            std::string key;
+            std::string value;
+            if (!(iss >> key >> value))
+            {
+                continue;
+            }
+            if (key == "nameserver")
+            {
+                servers.push_back(value);
+            }
+            else if (key == "search" || key == "domain")
+            {
+                // 与 libc 一致, 后出现的 search/domain 覆盖前面的
+                search.clear();
+                do
+                {
+                    search.push_back(value);
+                } while (iss >> value);
+            }
+            else if (key == "options")
+            {
+                do
+                {
+                    if (value.compare(0, 6, "ndots:") == 0)
+                    {
+                        ndots = std::min(15, atoi(value.c_str() + 6));
+                    }
+                } while (iss >> value);
+            }
+        }
+    }
+
+    void DnsResolver::setServers(const std::vector<std::string> &servers)
+    {
+        std::vector<std::string> list = servers;
+        if (list.empty())
+        {
+            std::vector<std::string> search;
+            int ndots = 1;
+            loadResolvConf(list, search, ndots);
+        }
+        std::vector<IPAddress::ptr> addrs;
+        for (auto &i : list)
+        {
+            IPAddress::ptr addr = ParseIp(i, 53);
+            if (addr)
+            {
+                addrs.push_back(addr);
+            }
+            else
+            {
+                SYLAR_LOG_ERROR(g_logger) << "invalid dns server " << i;
+            }
+        }
+        MutexType::Lock lock(m_mutex);
+        m_servers.swap(addrs);
+        // 服务器变了, 之前的结果不再可信
+        m_cache.clear();
+    }
+
+    void DnsResolver::setSearch(const std::vector<std::string> &search)
+    {
+        std::vector<std::string> servers;
+        std::vector<std::string> list;
+        int ndots = 1;
+        loadResolvConf(servers, list, ndots);
+        if (!search.empty())
+        {
+            list = search;
+        }
+        for (auto &i : list)
+        {
+            i = NormalizeName(i);
+        }
+        list.erase(std::remove(list.begin(), list.end(), std::string()), list.end());
+        MutexType::Lock lock(m_mutex);
+        m_search.swap(list);
+        m_ndots = ndots;
+    }
+
+    bool DnsResolver::isAvailable()
+    {
+        MutexType::Lock lock(m_mutex);
+        return !m_servers.empty();
+    }
+
+    void DnsResolver::clearCache()
+    {
+        MutexType::Lock lock(m_mutex);
+        m_cache.clear();
+    }
+
+    DnsResolver::Status DnsResolver::resolve(const std::string &host, int family, std::vector<IPAddress::ptr> &result)
+    {
+        std::string name = NormalizeName(host);
+        std::vector<std::string> names;
+        {
+            MutexType::Lock lock(m_mutex);
+            // /etc/hosts 只按原来的域名查找
+            auto hit = m_hosts.find(name);
+            if (hit != m_hosts.end())
+            {
+                for (auto &i : hit->second)
+                {
+                    if (MatchFamily(i, family))
+                    {
+                        result.push_back(i);
+                    }
+                }
+                if (!result.empty())
+                {
+                    ++m_stat.cacheHits;
+                    return OK;
+                }
+            }
+            // 与 libc 一致: 以 '.' 结尾的是完整域名, 不加搜索域;
+            // 点的个数不少于 ndots 时先查原来的域名, 否则先依次加上搜索域
+            bool absolute = !host.empty() && host.back() == '.';
+            if (!absolute && !m_search.empty())
+            {
+                bool first = std::count(name.begin(), name.end(), '.') >= m_ndots;
+                if (first)
+                {
+                    names.push_back(name);
+                }
+                for (auto &i : m_search)
+                {
+                    names.push_back(name + "." + i);
+                }
+                if (!first)
+                {
+                    names.push_back(name);
+                }
+            }
+            else
+            {
+                names.push_back(name);
+            }
+        }
+        Status status = NOT_FOUND;
+        for (auto &i : names)
+        {
+            Status rt = resolveName(i, family, result);
+            if (rt == OK)
+            {
+                return OK;
+            }
+            if (rt == NO_ANSWER)
+            {
+                status = NO_ANSWER;
+            }
+        }
+        return status;
+    }
+
+    DnsResolver::Status DnsResolver::resolveName(const std::string &name, int family, std::vector<IPAddress::ptr> &result)
+    {
+        std::string key = name + "/" + std::to_string(family);
+        std::shared_ptr<Pending> pending;
+        {
+            MutexType::Lock lock(m_mutex);
+            auto it = m_cache.find(key);
+            if (it != m_cache.end() && it->second.expire > GetMonotonicMS())
+            {
+                ++m_stat.cacheHits;
+                result.insert(result.end(), it->second.addrs.begin(), it->second.addrs.end());
+                return it->second.addrs.empty() ? NOT_FOUND : OK;
+            }
+            auto pit = m_pending.find(key);
+            // 不在协程中(没有开启 hook)时不能挂起, 自己查询
+            if (pit != m_pending.end() && is_hook_enable())
+            {
+                pending = pit->second;
+                pending->waiters.push_back(std::make_pair(Scheduler::GetThis(), Fiber::GetThis()));
+                ++m_stat.coalesced;
+            }
+            else if (pit == m_pending.end())
+            {
+                m_pending[key] = std::make_shared<Pending>();
+            }
+        }
+        if (pending)
+        {
+            // 查询结束之后由发起查询的协程调度回来
+            Fiber::YieldToHold();
+            result.insert(result.end(), pending->addrs.begin(), pending->addrs.end());
+            return pending->status;
+        }
+        return lookup(name, family, key, result);
+    }
+
+    DnsResolver::Status DnsResolver::lookup(const std::string &name, int family, const std::string &key,
+                             std::vector<IPAddress::ptr> &result)
+    {
+        std::vector<IPAddress::ptr> servers;
+        {
+            MutexType::Lock lock(m_mutex);
+            servers = m_servers;
+            ++m_stat.queries;
+        }
+        std::vector<IPAddress::ptr> addrs;
+        uint32_t ttl = ~0u;
+        bool nxdomain = false;
+        bool answered = false;
+        int attempts = std::max(1, g_dns_attempts->getValue());
+        for (int i = 0; i < attempts && !answered; ++i)
+        {
+            for (auto &server : servers)
+            {
+                if (query(server, name, family, addrs, ttl, nxdomain))
+                {
+                    answered = true;
+                    break;
+                }
+            }
+        }
+
+        Status status = !answered ? NO_ANSWER : addrs.empty() ? NOT_FOUND : OK;
+        std::vector<std::pair<Scheduler *, std::shared_ptr<Fiber> > > waiters;
+        {
+            MutexType::Lock lock(m_mutex);
+            if (answered)
+            {
+                if (m_cache.size() >= g_dns_cache_size->getValue())
+                {
+                    uint64_t now = GetMonotonicMS();
+                    for (auto it = m_cache.begin(); it != m_cache.end();)
+                    {
+                        if (it->second.expire <= now)
+                        {
+                            m_cache.erase(it++);
+                        }
+                        else
+                        {
+                            ++it;
+                        }
+                    }
+                    if (m_cache.size() >= g_dns_cache_size->getValue())
+                    {
+                        m_cache.clear();
+                    }
+                }
+                // 没有记录(包括只是没有这个类型的记录)按不存在缓存
+                uint32_t secs = addrs.empty() ? g_dns_negative_ttl->getValue()
+                                              : std::min(ttl, g_dns_max_ttl->getValue());
+                Entry &entry = m_cache[key];
+                entry.addrs = addrs;
+                entry.expire = GetMonotonicMS() + secs * 1000ull;
+                if (nxdomain)
+                {
+                    ++m_stat.nxdomains;
+                }
+            }
+            else
+            {
+                ++m_stat.failures;
+            }
+            auto it = m_pending.find(key);
+            if (it != m_pending.end())
+            {
+                it->second->status = status;
+                it->second->addrs = addrs;
+                waiters.swap(it->second->waiters);
+                m_pending.erase(it);
+            }
+        }
+        for (auto &i : waiters)
+        {
+            i.first->schedule(i.second);
+        }
+        if (!answered)
+        {
+            SYLAR_LOG_WARN(g_logger) << "dns lookup " << name << " family=" << family
+                                     << " failed, servers=" << servers.size();
+        }
+        result.insert(result.end(), addrs.begin(), addrs.end());
+        return status;
+    }
+
+    bool DnsResolver::query(const IPAddress::ptr &server, const std::string &name, int family,
+                            std::vector<IPAddress::ptr> &result, uint32_t &ttl, bool &nxdomain)
+    {
+        uint16_t qtypes[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+        int first = family == AF_INET6 ? 1 : 0;
+        int last = family == AF_INET ? 1 : 2;
+        // hook 之后的 socket, 等待应答时挂起协程
+        int sock = socket(server->getFamily(), SOCK_DGRAM, 0);
+        if (sock < 0)
+        {
+            return false;
+        }
+        if (connect(sock, server->getAddr(), server->getAddrLen()))
+        {
+            close(sock);
+            return false;
+        }
+        uint16_t ids[2] = {0, 0};
+        bool done[2] = {true, true};
+        std::string msg;
+        for (int i = first; i < last; ++i)
+        {
+            ids[i] = RandomQueryId();
+            if (!BuildQuery(ids[i], name, qtypes[i], msg) ||
+                send(sock, msg.data(), msg.size(), 0) != (ssize_t)msg.size())
+            {
+                close(sock);
+                return false;
+            }
+            done[i] = false;
+        }
+
+        std::vector<IPAddress::ptr> v4;
+        std::vector<IPAddress::ptr> v6;
+        int remaining = last - first;
+        int nx = 0;
+        bool failed = false;
+        bool truncated = false;
+        uint64_t deadline = GetMonotonicMS() + g_dns_timeout->getValue();
+        uint8_t buf[4096];
+        while (remaining)
+        {
+            uint64_t now = GetMonotonicMS();
+            if (now >= deadline)
+            {
+                break;
+            }
+            timeval tv = {(time_t)((deadline - now) / 1000), (suseconds_t)((deadline - now) % 1000 * 1000)};
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            ssize_t rt = recv(sock, buf, sizeof(buf), 0);
+            if (rt < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            // 长度不够, 不是应答或者不是我们的查询, 丢弃
+            if (rt < 12 || !(buf[2] & 0x80))
+            {
+                continue;
+            }
+            uint16_t id = Read16(buf);
+            int idx = -1;
+            for (int i = first; i < last; ++i)
+            {
+                // ID 相同但问题不一致的应答可能是伪造的, 丢弃之后继续等待
+                if (!done[i] && ids[i] == id && MatchQuestion(buf, rt, name, qtypes[i]))
+                {
+                    idx = i;
+                }
+            }
+            if (idx < 0)
+            {
+                SYLAR_LOG_DEBUG(g_logger) << "dns query " << name << " drop mismatched answer id=" << id
+                                          << " from " << server->toString();
+                continue;
+            }
+            done[idx] = true;
+            --remaining;
+            uint8_t rcode = buf[3] & 0x0F;
+            // TC: UDP 应答被截断, 里面的记录不完整, 不使用(不支持 TCP 重试)
+            if (buf[2] & 0x02)
+            {
+                truncated = true;
+            }
+            else if (rcode == DNS_RCODE_NXDOMAIN)
+            {
+                ++nx;
+            }
+            else if (rcode != 0 || !ParseAnswers(buf, rt, v4, v6, ttl))
+            {
+                failed = true;
+            }
+        }
+        close(sock);
+
+        if (truncated)
+        {
+            SYLAR_LOG_DEBUG(g_logger) << "dns query " << name << " to " << server->toString() << " truncated";
+            return false;
+        }
+        if (!v4.empty() || !v6.empty())
+        {
+            result.insert(result.end(), v4.begin(), v4.end());
+            result.insert(result.end(), v6.begin(), v6.end());
+            return true;
+        }
+        if (remaining || failed)
+        {
+            SYLAR_LOG_DEBUG(g_logger) << "dns query " << name << " to " << server->toString()
+                                      << (failed ? " error" : " timeout");
+            return false;
+        }
+        nxdomain = nx > 0;
+        return true;
+    }
+
+    void DnsResolver::getStat(Stat &stat)
+    {
+        MutexType::Lock lock(m_mutex);
+        stat = m_stat;
+        stat.cacheSize = m_cache.size();
+    }
+
+    std::string DnsResolver::dumpStat()
+    {
+        Stat stat;
+        getStat(stat);
+        std::stringstream ss;
+        ss << "[DnsStat queries=" << stat.queries << " cache_hits=" << stat.cacheHits
+           << " coalesced=" << stat.coalesced << " failures=" << stat.failures
+           << " nxdomains=" << stat.nxdomains << " cache_size=" << stat.cacheSize << "]";
+        return ss.str();
+    }
+}
@@ -2,7 +2,10 @@
 #include "sys/stat.h"
 #include "sys/types.h"
 #include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
 #include "hook.h"
+#include "log.h"
 
 /*
     判断传进来的句柄fd是否是socket的
@@ -12,11 +15,27 @@
 
 namespace sylar
 {
+    static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    // 超时: 标记之后取消等待的事件, 由 cancelEvent 唤醒等待的协程
+    static void OnIoTimeout(TimerNode *node)
+    {
+        FdCtx::IoTimeout *t = (FdCtx::IoTimeout *)node;
+        t->cancelled = ETIMEDOUT;
+        t->iom->cancelEvent(t->fd, t->event);
+    }
 
     FdCtx::FdCtx(int fd)
-        : m_isInit(false), m_isSocket(false), m_sysNonblock(false), m_userNonblock(false), m_isClosed(false), m_fd(fd), m_recvTimeout(-1), m_sendTimeout(-1)
+        : m_isInit(false), m_isSocket(false), m_isFile(false), m_sysNonblock(false), m_userNonblock(false), m_isClosed(false), m_fd(fd), m_recvTimeout(-1), m_sendTimeout(-1)
     {
-        init();
+        for (int i = 0; i < 2; ++i)
+        {
+            m_ioTimeouts[i].node.fn = &OnIoTimeout;
+            m_ioTimeouts[i].fd = fd;
+        }
+        m_ioTimeouts[0].event = IOManager::READ;
+        m_ioTimeouts[1].event = IOManager::WRITE;
+        // 由 FdManager 在句柄被使用时初始化
     }
     FdCtx::~FdCtx()
     {
@@ -41,11 +60,13 @@ namespace sylar
         {
             m_isInit = false;
             m_isSocket = false;
+            m_isFile = false;
         }
         else
         {
             m_isInit = true;
             m_isSocket = S_ISSOCK(fd_stat.st_mode);
+            m_isFile = S_ISREG(fd_stat.st_mode) || S_ISBLK(fd_stat.st_mode);
         }
 
         // 如果 是socket描述符
@@ -96,55 +117,143 @@ namespace sylar
         }
     }
 
+    struct FdManager::Chunk
+    {
+        FdCtx* ctxs;
+
+        Chunk(int base)
+        {
+            // FdCtx 不能复制, 逐个原地构造
+            ctxs = (FdCtx*)::operator new(sizeof(FdCtx) * CHUNK_SIZE);
+            for (int i = 0; i < CHUNK_SIZE; ++i)
+            {
+                new (&ctxs[i]) FdCtx(base + i);
+            }
+        }
+
+        ~Chunk()
+        {
+            for (int i = 0; i < CHUNK_SIZE; ++i)
+            {
+                ctxs[i].~FdCtx();
+            }
+            ::operator delete(ctxs);
+        }
+    };
+
     FdManager::FdManager()
     {
-        m_datas.resize(64);
+        for (int i = 0; i < MAX_CHUNKS; ++i)
+        {
+            m_chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+        rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (rlim_t)MAX_FDS))
+        {
+            SYLAR_LOG_WARN(g_logger) << "RLIMIT_NOFILE=" << rl.rlim_cur << " exceeds FdManager::MAX_FDS="
+                                     << MAX_FDS << ", hooked calls creating larger fds fail with EMFILE";
+        }
+    }
+
+    FdManager::~FdManager()
+    {
+        for (int i = 0; i < MAX_CHUNKS; ++i)
+        {
+            delete m_chunks[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    FdManager::Chunk* FdManager::getChunk(int idx, bool auto_create)
+    {
+        Chunk* chunk = m_chunks[idx].load(std::memory_order_acquire);
+        if (chunk || !auto_create)
+        {
+            return chunk;
+        }
+        Chunk* fresh = new Chunk(idx << CHUNK_BITS);
+        // 其他线程先分配了就用它的
+        if (!m_chunks[idx].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+        {
+            delete fresh;
+            return chunk;
+        }
+        return fresh;
+    }
+
+    // 超出容量的句柄没有记录, 创建时报错并设置 EMFILE
+    static FdCtx* OverCapacity(int fd)
+    {
+        SYLAR_LOG_ERROR(g_logger) << "fd=" << fd << " exceeds FdManager::MAX_FDS=" << FdManager::MAX_FDS
+                                  << ", it can not be hooked";
+        errno = EMFILE;
+        return nullptr;
     }
 
-    FdCtx::ptr FdManager::get(int fd, bool auto_create)
+    FdCtx* FdManager::get(int fd, bool auto_create)
     {
-        if (fd == -1)
+        if (fd < 0 || fd >= MAX_FDS)
+        {
+            return auto_create && fd >= MAX_FDS ? OverCapacity(fd) : nullptr;
+        }
+        Chunk* chunk = getChunk(fd >> CHUNK_BITS, auto_create);
+        if (!chunk)
         {
             return nullptr;
         }
-        RWMutexType::ReadLock lock(m_mutex);
-        // 说明fd不在m_datas 的范围内 m_datas.resize(64)
-        if ((int)m_datas.size() <= fd)
+        FdCtx* ctx = &chunk->ctxs[fd & (CHUNK_SIZE - 1)];
+        if (ctx->m_inUse.load(std::memory_order_acquire) || !auto_create)
         {
-            // 不需要自动创建FdCtx
-            if (auto_create == false)
-            {
-                return nullptr;
-            }
+            return ctx->m_inUse.load(std::memory_order_relaxed) ? ctx : nullptr;
         }
-        else
-        { // 说明fd在m_datas 的范围内 m_datas.resize(64);并且不需要创建FdCtx
-            if (m_datas[fd] || !auto_create)
-            {
-                return m_datas[fd];
-            }
+        // 需要创建: 句柄号第一次使用或者被复用, 重新初始化记录
+        MutexType::Lock lock(m_mutex);
+        if (!ctx->m_inUse.load(std::memory_order_relaxed))
+        {
+            reinit(ctx);
         }
-        // 需要创建FdCtx并且fd在m_datas的范围内
-        lock.unlock();
+        return ctx;
+    }
 
-        RWMutexType::WriteLock lock2(m_mutex);
-        FdCtx::ptr ctx(new FdCtx(fd));
-        if (fd >= (int)m_datas.size())
+    FdCtx* FdManager::create(int fd)
+    {
+        if (fd < 0 || fd >= MAX_FDS)
+        {
+            return fd >= MAX_FDS ? OverCapacity(fd) : nullptr;
+        }
+        Chunk* chunk = getChunk(fd >> CHUNK_BITS, true);
+        if (!chunk)
         {
-            m_datas.resize(fd * 1.5);
+            return nullptr;
         }
-        m_datas[fd] = ctx;
+        FdCtx* ctx = &chunk->ctxs[fd & (CHUNK_SIZE - 1)];
+        MutexType::Lock lock(m_mutex);
+        reinit(ctx);
         return ctx;
     }
+
+    void FdManager::reinit(FdCtx* ctx)
+    {
+        ctx->m_isInit = false;
+        ctx->init();
+        ctx->m_generation.fetch_add(1, std::memory_order_relaxed);
+        ctx->m_inUse.store(true, std::memory_order_release);
+    }
     
     void FdManager::del(int fd)
     {
-        RWMutexType::WriteLock lock(m_mutex);
-        // 即fd已经不存在于 m_datas中
-        if ((int)m_datas.size() <= fd)
+        if (fd < 0 || fd >= MAX_FDS)
+        {
+            return;
+        }
+        Chunk* chunk = getChunk(fd >> CHUNK_BITS, false);
+        if (!chunk)
         {
             return;
         }
-        m_datas[fd].reset();
+        MutexType::Lock lock(m_mutex);
+        FdCtx* ctx = &chunk->ctxs[fd & (CHUNK_SIZE - 1)];
+        // 还拿着指针的调用者看到的是已经关闭的句柄
+        ctx->m_isClosed = true;
+        ctx->m_inUse.store(false, std::memory_order_release);
     }
-}
\ No newline at end of file
+}
@@ -4,6 +4,10 @@
 #include "log.h"
 #include "scheduler.h"
 #include <atomic>
+#include <execinfo.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace sylar
 {
@@ -42,13 +46,54 @@ namespace sylar
         }
     };
 
+    /**
+     * 栈底带一个 PROT_NONE 保护页的栈, 溢出时直接 SIGSEGV, 不会改写相邻的堆内存.
+     * 自动调整大小的栈比默认值小, 只用这种方式分配
+     */
+    class GuardedStackAllocator
+    {
+    public:
+        static void *Alloc(size_t size)
+        {
+            size_t page = getpagesize();
+            void *vp = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            SYLAR_ASSERT2(vp != MAP_FAILED, "mmap fiber stack size=" << size);
+            // 栈向低地址增长, 保护页放在最低处
+            SYLAR_ASSERT2(mprotect(vp, page, PROT_NONE) == 0, "mprotect fiber stack guard");
+            return (char *)vp + page;
+        }
+        static void Dealloc(void *vp, size_t size)
+        {
+            size_t page = getpagesize();
+            munmap((char *)vp - page, size + page);
+        }
+    };
+
     typedef MallocStackAllocator StackAllocator;
 
+    static void *AllocStack(size_t size, bool guard)
+    {
+        return guard ? GuardedStackAllocator::Alloc(size) : StackAllocator::Alloc(size);
+    }
+
+    static void DeallocStack(void *vp, size_t size, bool guard)
+    {
+        if (guard)
+        {
+            GuardedStackAllocator::Dealloc(vp, size);
+        }
+        else
+        {
+            StackAllocator::Dealloc(vp, size);
+        }
+    }
+
     // private 类型的构造函数， 被当作main协程
     Fiber::Fiber()
     {
         // 正在执行
-        m_state = Fiber::EXEC;
+        setState(Fiber::EXEC);
         // 将当前线程设置为t_fiber
         SetThis(this);
 
@@ -60,6 +105,10 @@ namespace sylar
         }
         // 协程数量+1
         s_fiber_count++;
+        if (FiberRegistry::IsEnabled())
+        {
+            registerTrace();
+        }
 
         SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber main " << m_id;
     }
@@ -67,8 +116,21 @@ namespace sylar
         : m_id(++s_fiber_id), m_cb(cb)
     {
         ++s_fiber_count;
+        m_fixedStack = stacksize != 0;
         m_stacksize = stacksize ? stacksize : g_fiber_fiber_stack->getValue();
-        m_stack = StackAllocator::Alloc(m_stacksize);
+        m_entry = FiberEntry::FromCallback(m_cb);
+        if (!m_fixedStack && FiberStackProfiler::IsAutoSize())
+        {
+            // 根据该入口历史的栈使用量决定栈大小, 可能比默认值小, 需要保护页
+            m_stacksize = FiberStackProfilerMgr::GetInstance()->getStackSize(m_entry, m_stacksize);
+            m_guardStack = true;
+        }
+        m_stack = AllocStack(m_stacksize, m_guardStack);
+        if (FiberStackProfiler::IsEnabled())
+        {
+            FiberStackProfiler::Paint(m_stack, m_stacksize);
+            m_stackPainted = true;
+        }
         if (getcontext(&m_ctx))
         {
             SYLAR_ASSERT2(false, "getcontext");
@@ -80,6 +142,11 @@ namespace sylar
         m_ctx.uc_stack.ss_sp = m_stack;
         m_ctx.uc_stack.ss_size = m_stacksize;
 
+        if (FiberRegistry::IsEnabled())
+        {
+            registerTrace();
+        }
+
         if (!use_caller)
         {
             makecontext(&m_ctx, &Fiber::MainFunc, 0);
@@ -95,11 +162,23 @@ namespace sylar
     {
         // 协程数量-1
         --s_fiber_count;
+        if (m_trace)
+        {
+            FiberRegistryMgr::GetInstance()->del(this);
+        }
         if (m_stack)
         {
             // 如果有栈的空间
             SYLAR_ASSERT(m_state == INIT || m_state == TERM || m_state == EXCEPT);
-            StackAllocator::Dealloc(m_stack, m_stacksize);
+            if (m_stackPainted && m_state != INIT)
+            {
+                FiberStackProfilerMgr::GetInstance()->record(m_entry, getStackUsed(), m_stacksize);
+            }
+            if (m_counter.swaps)
+            {
+                profileCpu();
+            }
+            DeallocStack(m_stack, m_stacksize, m_guardStack);
         }
         else
         {
@@ -122,7 +201,25 @@ namespace sylar
         // 协程结束任务后，不释放内存，将该内存用于新的协程
         SYLAR_ASSERT(m_stack);
         SYLAR_ASSERT(m_state == INIT || m_state == TERM || m_state == EXCEPT);
+        if (m_counter.swaps)
+        {
+            profileCpu();
+        }
         m_cb = cb;
+        if (m_stackPainted || FiberStackProfiler::IsEnabled())
+        {
+            profileStack();
+        }
+        m_entry = FiberEntry::FromCallback(m_cb);
+        // 栈可能是按上一个入口缩小的, 新入口需要更大的栈时重新分配
+        if (growStack())
+        {
+            if (FiberStackProfiler::IsEnabled())
+            {
+                FiberStackProfiler::Paint(m_stack, m_stacksize);
+            }
+            m_stackPainted = FiberStackProfiler::IsEnabled();
+        }
         if (getcontext(&m_ctx))
         {
             SYLAR_ASSERT2(false, "getcontext");
@@ -133,7 +230,137 @@ namespace sylar
 
         makecontext(&m_ctx, &Fiber::MainFunc, 0);
 
-        m_state = INIT;
+        setState(INIT);
+    }
+
+    void Fiber::registerTrace()
+    {
+        m_trace.reset(new FiberTrace);
+        m_trace->createTs = GetMonotonicNS();
+        m_trace->stateTs = m_trace->createTs;
+        int n = ::backtrace(m_trace->create, FiberTrace::MAX_CREATE_FRAMES);
+        // 去掉 registerTrace 自身这一帧
+        if (n > 0)
+        {
+            memmove(m_trace->create, m_trace->create + 1, (n - 1) * sizeof(void *));
+            --n;
+        }
+        m_trace->createSize = n;
+        FiberRegistryMgr::GetInstance()->add(this);
+    }
+
+    const char *Fiber::StateToString(State state)
+    {
+        switch (state)
+        {
+#define XX(name) \
+    case name:   \
+        return #name;
+            XX(INIT);
+            XX(HOLD);
+            XX(EXEC);
+            XX(TERM);
+            XX(READY);
+            XX(EXCEPT);
+#undef XX
+        default:
+            return "UNKNOW";
+        }
+    }
+
+    uint64_t Fiber::getStackUsed() const
+    {
+        if (!m_stackPainted)
+        {
+            return 0;
+        }
+        return FiberStackProfiler::Measure(m_stack, m_stacksize);
+    }
+
+    void Fiber::profileStack()
+    {
+        size_t used = m_stacksize;
+        if (m_stackPainted)
+        {
+            used = getStackUsed();
+            // INIT 状态说明上一个任务没有执行过, 不需要记录
+            if (m_state != INIT)
+            {
+                FiberStackProfilerMgr::GetInstance()->record(m_entry, used, m_stacksize);
+            }
+        }
+        if (!FiberStackProfiler::IsEnabled())
+        {
+            m_stackPainted = false;
+            return;
+        }
+
+        // 栈底未被改写的部分仍然是 canary, 只需要重新填充用过的部分
+        if (!m_stackPainted)
+        {
+            used = m_stacksize;
+        }
+        FiberStackProfiler::Paint((char *)m_stack + m_stacksize - used, used);
+        m_stackPainted = true;
+    }
+
+    bool Fiber::growStack()
+    {
+        if (m_fixedStack)
+        {
+            return false;
+        }
+        // 关闭自动调整之后按默认大小, 之前缩小过的栈同样需要扩大
+        size_t size = g_fiber_fiber_stack->getValue();
+        if (FiberStackProfiler::IsAutoSize())
+        {
+            size = FiberStackProfilerMgr::GetInstance()->getStackSize(m_entry, size);
+        }
+        // 只扩大不缩小, 避免复用的协程在不同入口之间来回重新分配
+        if (size <= m_stacksize)
+        {
+            return false;
+        }
+        DeallocStack(m_stack, m_stacksize, m_guardStack);
+        m_stacksize = size;
+        m_guardStack = true;
+        m_stack = AllocStack(m_stacksize, m_guardStack);
+        return true;
+    }
+
+    void Fiber::profileCpu()
+    {
+        if (m_state != INIT && m_counter.swaps)
+        {
+            m_counter.fibers = 1;
+            FiberCpuProfilerMgr::GetInstance()->record(m_tag, m_entry, m_counter);
+        }
+        m_counter = FiberCpuProfiler::Counter();
+        m_tag.clear();
+        m_readyTs = 0;
+        m_wakeTs = 0;
+    }
+
+    void Fiber::beginAccount(uint64_t &wall, uint64_t &cpu)
+    {
+        wall = GetMonotonicNS();
+        cpu = GetThreadCpuNS();
+        if (m_readyTs)
+        {
+            if (wall > m_readyTs)
+            {
+                m_counter.readyWait += wall - m_readyTs;
+            }
+            m_readyTs = 0;
+        }
+        ++m_counter.swaps;
+    }
+
+    void Fiber::endAccount(uint64_t wall, uint64_t cpu)
+    {
+        // 协程让出执行权后回到调度线程, 与切入时是同一个线程
+        m_counter.exec += GetMonotonicNS() - wall;
+        m_counter.cpu += GetThreadCpuNS() - cpu;
     }
 
     // 等于swapIn();
@@ -141,11 +368,26 @@ namespace sylar
     {
         SetThis(this); // 子协程调用
         // SYLAR_ASSERT(m_state != EXEC);
-        m_state = EXEC;
+        setState(EXEC);
+        if (m_trace)
+        {
+            m_trace->waitFd = -1;
+            m_trace->waitEvent = 0;
+        }
+        bool account = FiberCpuProfiler::IsEnabled();
+        uint64_t wall = 0, cpu = 0;
+        if (account)
+        {
+            beginAccount(wall, cpu);
+        }
         if (swapcontext(&t_threadFiber->m_ctx, &m_ctx))
         {
             SYLAR_ASSERT2(false, "swapcontext");
         }
+        if (account)
+        {
+            endAccount(wall, cpu);
+        }
     }
     // 等于swapOut();
     void Fiber::back()
@@ -167,13 +409,28 @@ namespace sylar
         // 一般来说 目标协程是 子协程
         SetThis(this); // 子协程调用
         SYLAR_ASSERT(m_state != EXEC);
-        m_state = EXEC;
+        setState(EXEC);
+        if (m_trace)
+        {
+            m_trace->waitFd = -1;
+            m_trace->waitEvent = 0;
+        }
+        bool account = FiberCpuProfiler::IsEnabled();
+        uint64_t wall = 0, cpu = 0;
+        if (account)
+        {
+            beginAccount(wall, cpu);
+        }
         // SYLAR_LOG_INFO(g_logger) << "before swapcontext";
         // 交换主协程和 目标协程之间的关系 -- swapcontext(old,new)
         if (swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx))
         {
             SYLAR_ASSERT2(false, "swapcontext");
         }
+        if (account)
+        {
+            endAccount(wall, cpu);
+        }
         // SYLAR_LOG_INFO(g_logger) << "after swapcontext";
     }
     // 当前子协程结束执行，让出执行权，切换回mian fiber
@@ -225,7 +482,7 @@ namespace sylar
         // 操作当前正在执行的协程 设置为 raeady状态，并且切换回主协程上去
         Fiber::ptr cur = GetThis();
         SYLAR_ASSERT(cur->m_state == EXEC);
-        cur->m_state = READY;
+        cur->setState(READY);
         // 切换出去-- 变成主协程
         cur->swapOut();
     }
@@ -234,10 +491,27 @@ namespace sylar
     {
         Fiber::ptr cur = GetThis();
         SYLAR_ASSERT(cur->m_state == EXEC);
-        cur->m_state = HOLD;
+        // 在调度器中由 Scheduler::run 在切换完成之后再置为 HOLD,
+        // 否则上下文还没保存完, 其他线程就可能把事件唤醒的协程切入执行
+        if (!Scheduler::GetThis())
+        {
+            cur->setState(HOLD);
+        }
+        if (cur->m_trace && FiberRegistry::IsCaptureHoldStack())
+        {
+            cur->m_trace->holdSize = ::backtrace(cur->m_trace->hold, FiberTrace::MAX_HOLD_FRAMES);
+        }
         // 切换出去-- 变成主协程
         cur->swapOut();
     }
+    // 设置当前协程的标签
+    void Fiber::SetTag(const std::string &tag)
+    {
+        if (t_fiber)
+        {
+            t_fiber->m_tag = tag;
+        }
+    }
     // 总协程数量
     uint64_t Fiber::TotalFibers()
     {
@@ -255,11 +529,11 @@ namespace sylar
             cur->m_cb();
             // SYLAR_LOG_INFO(g_logger) << "3";
             cur->m_cb = nullptr;
-            cur->m_state = TERM;
+            cur->setState(TERM);
         }
         catch (const std::exception &e)
         {
-            cur->m_state = EXCEPT;
+            cur->setState(EXCEPT);
             SYLAR_LOG_ERROR(g_logger) << "Fiber Except" << e.what()
                                       << " fiber_id=" << cur->getId()
                                       << std::endl
@@ -267,7 +541,7 @@ namespace sylar
         }
         catch (...)
         {
-            cur->m_state = EXCEPT;
+            cur->setState(EXCEPT);
             SYLAR_LOG_ERROR(g_logger) << "Fiber Except"
                                       << " fiber_id=" << cur->getId()
                                       << std::endl
@@ -297,11 +571,11 @@ namespace sylar
         {
             cur->m_cb();
             cur->m_cb = nullptr;
-            cur->m_state = TERM;
+            cur->setState(TERM);
         }
         catch (std::exception &ex)
         {
-            cur->m_state = EXCEPT;
+            cur->setState(EXCEPT);
             SYLAR_LOG_ERROR(g_logger) << "Fiber Except: " << ex.what()
                                       << " fiber_id=" << cur->getId()
                                       << std::endl
@@ -309,7 +583,7 @@ namespace sylar
         }
         catch (...)
         {
-            cur->m_state = EXCEPT;
+            cur->setState(EXCEPT);
             SYLAR_LOG_ERROR(g_logger) << "Fiber Except"
                                       << " fiber_id=" << cur->getId()
                                       << std::endl
@@ -0,0 +1,461 @@
+#include "fiber_profiler.h"
+#include "fiber.h"
+#include "config.h"
+#include "log.h"
+#include <algorithm>
+#include <sstream>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <string.h>
+#include <execinfo.h>
+
+namespace sylar
+{
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static ConfigVar<bool>::ptr g_fiber_stack_profile =
+        Config::Lookup<bool>("fiber.stack_profile", false, "paint fiber stack and record high-water mark");
+    static ConfigVar<bool>::ptr g_fiber_stack_auto_size =
+        Config::Lookup<bool>("fiber.stack_auto_size", false, "size fiber stack by entry max + headroom");
+    static ConfigVar<uint32_t>::ptr g_fiber_stack_headroom =
+        Config::Lookup<uint32_t>("fiber.stack_headroom", 16 * 1024, "fiber stack headroom over max");
+    static ConfigVar<uint32_t>::ptr g_fiber_stack_min_samples =
+        Config::Lookup<uint32_t>("fiber.stack_min_samples", 100, "min samples before auto size fiber stack");
+    static ConfigVar<bool>::ptr g_fiber_accounting =
+        Config::Lookup<bool>("fiber.accounting", false, "account fiber cpu time and swaps");
+    static ConfigVar<bool>::ptr g_fiber_registry =
+        Config::Lookup<bool>("fiber.registry", false, "register live fibers for dump");
+    static ConfigVar<bool>::ptr g_fiber_registry_hold_stack =
+        Config::Lookup<bool>("fiber.registry_hold_stack", true, "capture backtrace when fiber yield to hold");
+
+    // 每个入口保留的样本数量
+    static const size_t s_ring_size = 1024;
+    // 每隔多少个样本重新计算一次 p99
+    static const uint64_t s_recalc_step = 64;
+    // canary 填充值
+    static const uint64_t s_canary = 0xa5a5a5a5a5a5a5a5ull;
+
+    // 配置缓存, 避免每次创建协程都去读配置的读写锁
+    static bool s_stack_profile = false;
+    static bool s_stack_auto_size = false;
+    static uint32_t s_stack_headroom = 16 * 1024;
+    static uint32_t s_stack_min_samples = 100;
+    static bool s_accounting = false;
+    static bool s_registry = false;
+    static bool s_registry_hold_stack = true;
+
+    struct _FiberProfilerIniter
+    {
+        _FiberProfilerIniter()
+        {
+            s_stack_profile = g_fiber_stack_profile->getValue();
+            s_stack_auto_size = g_fiber_stack_auto_size->getValue();
+            s_stack_headroom = g_fiber_stack_headroom->getValue();
+            s_stack_min_samples = g_fiber_stack_min_samples->getValue();
+            s_accounting = g_fiber_accounting->getValue();
+            s_registry = g_fiber_registry->getValue();
+            s_registry_hold_stack = g_fiber_registry_hold_stack->getValue();
+
+            g_fiber_stack_profile->addListener([](const bool &old_value, const bool &new_value)
+                                               { s_stack_profile = new_value; });
+            g_fiber_stack_auto_size->addListener([](const bool &old_value, const bool &new_value)
+                                                 { s_stack_auto_size = new_value; });
+            g_fiber_stack_headroom->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                                { s_stack_headroom = new_value; });
+            g_fiber_stack_min_samples->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                                   { s_stack_min_samples = new_value; });
+            g_fiber_accounting->addListener([](const bool &old_value, const bool &new_value)
+                                            { s_accounting = new_value; });
+            g_fiber_registry->addListener([](const bool &old_value, const bool &new_value)
+                                          { s_registry = new_value; });
+            g_fiber_registry_hold_stack->addListener([](const bool &old_value, const bool &new_value)
+                                                     { s_registry_hold_stack = new_value; });
+        }
+    };
+    static _FiberProfilerIniter s_fiber_profiler_initer;
+
+    static std::string Demangle(const char *name)
+    {
+        int status = 0;
+        char *buf = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+        if (status || !buf)
+        {
+            return name;
+        }
+        std::string rt(buf);
+        free(buf);
+        return rt;
+    }
+
+    bool FiberEntry::operator<(const FiberEntry &rhs) const
+    {
+        if (type != rhs.type)
+        {
+            if (!type || !rhs.type)
+            {
+                return !type;
+            }
+            // 不同动态库中的 type_info 地址可能不同, 需要用 before 比较
+            if (*type != *rhs.type)
+            {
+                return type->before(*rhs.type);
+            }
+        }
+        return fn < rhs.fn;
+    }
+
+    bool FiberEntry::operator==(const FiberEntry &rhs) const
+    {
+        return !(*this < rhs) && !(rhs < *this);
+    }
+
+    std::string FiberEntry::toString() const
+    {
+        if (fn)
+        {
+            Dl_info info;
+            if (dladdr(fn, &info) && info.dli_sname)
+            {
+                return Demangle(info.dli_sname);
+            }
+        }
+        if (!type)
+        {
+            return "unknown";
+        }
+        return Demangle(type->name());
+    }
+
+    FiberEntry FiberEntry::FromCallback(const std::function<void()> &cb)
+    {
+        FiberEntry entry;
+        if (!cb)
+        {
+            return entry;
+        }
+        entry.type = &cb.target_type();
+        // 普通函数指针的类型都一样, 需要加上函数地址来区分
+        auto pfn = cb.target<void (*)()>();
+        if (pfn)
+        {
+            entry.fn = (const void *)*pfn;
+        }
+        return entry;
+    }
+
+    FiberStackProfiler::FiberStackProfiler()
+    {
+    }
+
+    bool FiberStackProfiler::IsEnabled()
+    {
+        return s_stack_profile;
+    }
+
+    bool FiberStackProfiler::IsAutoSize()
+    {
+        return s_stack_profile && s_stack_auto_size;
+    }
+
+    void FiberStackProfiler::Paint(void *stack, size_t size)
+    {
+        memset(stack, (int)(s_canary & 0xff), size);
+    }
+
+    size_t FiberStackProfiler::Measure(const void *stack, size_t size)
+    {
+        // 栈从高地址向低地址增长, 从栈底(低地址)开始查找第一个被改写的位置
+        const uint64_t *begin = (const uint64_t *)stack;
+        const uint64_t *end = begin + size / sizeof(uint64_t);
+        const uint64_t *it = begin;
+        while (it != end && *it == s_canary)
+        {
+            ++it;
+        }
+        return size - (it - begin) * sizeof(uint64_t);
+    }
+
+    void FiberStackProfiler::record(const FiberEntry &entry, size_t used, size_t stacksize)
+    {
+        MutexType::Lock lock(m_mutex);
+        Sample &s = m_entries[entry];
+        ++s.count;
+        ++s.dirty;
+        s.max = std::max<uint64_t>(s.max, used);
+        s.stacksize = stacksize;
+        if (s.ring.size() < s_ring_size)
+        {
+            s.ring.push_back(used);
+        }
+        else
+        {
+            s.ring[s.pos] = used;
+            s.pos = (s.pos + 1) % s_ring_size;
+        }
+        if (used >= stacksize)
+        {
+            SYLAR_LOG_WARN(g_logger) << "fiber stack exhausted entry=" << entry.toString()
+                                     << " stacksize=" << stacksize;
+        }
+    }
+
+    uint64_t FiberStackProfiler::calcP99(Sample &s)
+    {
+        if (s.dirty < s_recalc_step && s.p99)
+        {
+            return s.p99;
+        }
+        std::vector<uint32_t> tmp(s.ring);
+        size_t idx = tmp.size() * 99 / 100;
+        std::nth_element(tmp.begin(), tmp.begin() + idx, tmp.end());
+        s.p99 = tmp[idx];
+        s.dirty = 0;
+        return s.p99;
+    }
+
+    size_t FiberStackProfiler::recommend(Sample &s, size_t def)
+    {
+        if (s.count < s_stack_min_samples || s.ring.empty())
+        {
+            return 0;
+        }
+        // 按最大值而不是 p99: 超过 p99 的调用不能溢出
+        size_t size = s.max + s_stack_headroom;
+        // 按页对齐
+        size = (size + 4095) & ~(size_t)4095;
+        return std::min(size, def);
+    }
+
+    size_t FiberStackProfiler::getStackSize(const FiberEntry &entry, size_t def)
+    {
+        MutexType::Lock lock(m_mutex);
+        auto it = m_entries.find(entry);
+        if (it == m_entries.end())
+        {
+            return def;
+        }
+        size_t size = recommend(it->second, def);
+        return size ? size : def;
+    }
+
+    void FiberStackProfiler::getStats(std::vector<Stat> &stats)
+    {
+        MutexType::Lock lock(m_mutex);
+        for (auto &i : m_entries)
+        {
+            Stat st;
+            st.entry = i.first.toString();
+            st.samples = i.second.count;
+            st.max = i.second.max;
+            st.p99 = i.second.ring.empty() ? 0 : calcP99(i.second);
+            st.stacksize = i.second.stacksize;
+            st.recommended = recommend(i.second, i.second.stacksize);
+            stats.push_back(st);
+        }
+    }
+
+    std::string FiberStackProfiler::toString()
+    {
+        std::vector<Stat> stats;
+        getStats(stats);
+        std::stringstream ss;
+        ss << "[FiberStackProfiler entries=" << stats.size() << "]" << std::endl;
+        for (auto &i : stats)
+        {
+            ss << "    samples=" << i.samples
+               << " max=" << i.max
+               << " p99=" << i.p99
+               << " stacksize=" << i.stacksize
+               << " recommended=" << i.recommended
+               << " entry=" << i.entry << std::endl;
+        }
+        return ss.str();
+    }
+
+    void FiberStackProfiler::clear()
+    {
+        MutexType::Lock lock(m_mutex);
+        m_entries.clear();
+    }
+
+    bool FiberCpuProfiler::IsEnabled()
+    {
+        return s_accounting;
+    }
+
+    void FiberCpuProfiler::Add(Counter &dst, const Counter &src)
+    {
+        dst.fibers += src.fibers;
+        dst.cpu += src.cpu;
+        dst.exec += src.exec;
+        dst.swaps += src.swaps;
+        dst.readyWait += src.readyWait;
+    }
+
+    void FiberCpuProfiler::record(const std::string &tag, const FiberEntry &entry, const Counter &counter)
+    {
+        MutexType::Lock lock(m_mutex);
+        if (tag.empty())
+        {
+            Add(m_entries[entry], counter);
+        }
+        else
+        {
+            Add(m_tags[tag], counter);
+        }
+    }
+
+    void FiberCpuProfiler::getStats(std::vector<Stat> &stats)
+    {
+        std::map<std::string, Counter> all;
+        {
+            MutexType::Lock lock(m_mutex);
+            all = m_tags;
+            for (auto &i : m_entries)
+            {
+                Add(all[i.first.toString()], i.second);
+            }
+        }
+        for (auto &i : all)
+        {
+            Stat st;
+            st.tag = i.first;
+            st.counter = i.second;
+            stats.push_back(st);
+        }
+    }
+
+    std::string FiberCpuProfiler::toString()
+    {
+        std::vector<Stat> stats;
+        getStats(stats);
+        std::stringstream ss;
+        ss << "[FiberCpuProfiler tags=" << stats.size() << "]" << std::endl;
+        for (auto &i : stats)
+        {
+            ss << "    fibers=" << i.counter.fibers
+               << " cpu_us=" << i.counter.cpu / 1000
+               << " exec_us=" << i.counter.exec / 1000
+               << " swaps=" << i.counter.swaps
+               << " ready_wait_us=" << i.counter.readyWait / 1000
+               << " tag=" << i.tag << std::endl;
+        }
+        return ss.str();
+    }
+
+    void FiberCpuProfiler::clear()
+    {
+        MutexType::Lock lock(m_mutex);
+        m_tags.clear();
+        m_entries.clear();
+    }
+
+    bool FiberRegistry::IsEnabled()
+    {
+        return s_registry;
+    }
+
+    bool FiberRegistry::IsCaptureHoldStack()
+    {
+        return s_registry_hold_stack;
+    }
+
+    void FiberRegistry::add(Fiber *fiber)
+    {
+        MutexType::Lock lock(m_mutex);
+        m_fibers.insert(fiber);
+    }
+
+    void FiberRegistry::del(Fiber *fiber)
+    {
+        MutexType::Lock lock(m_mutex);
+        m_fibers.erase(fiber);
+    }
+
+    size_t FiberRegistry::size()
+    {
+        MutexType::Lock lock(m_mutex);
+        return m_fibers.size();
+    }
+
+    static std::string SymbolizeFrames(void *const *frames, int size)
+    {
+        if (size <= 0)
+        {
+            return "";
+        }
+        std::stringstream ss;
+        char **strings = backtrace_symbols(frames, size);
+        for (int i = 0; i < size; ++i)
+        {
+            ss << "        " << (strings ? strings[i] : "?") << std::endl;
+        }
+        free(strings);
+        return ss.str();
+    }
+
+    void FiberRegistry::getInfos(std::vector<Info> &infos, bool with_stack)
+    {
+        uint64_t now = GetMonotonicNS();
+        // 持有锁期间协程不会被析构, 其余字段是其他线程并发修改的, 只做诊断用途
+        MutexType::Lock lock(m_mutex);
+        infos.reserve(infos.size() + m_fibers.size());
+        for (auto f : m_fibers)
+        {
+            Info info;
+            info.id = f->getId();
+            info.state = Fiber::StateToString(f->getState());
+            info.entry = f->getEntry().toString();
+            const FiberTrace *trace = f->m_trace.get();
+            if (trace)
+            {
+                info.ageMs = now > trace->createTs ? (now - trace->createTs) / 1000000 : 0;
+                info.stateMs = now > trace->stateTs ? (now - trace->stateTs) / 1000000 : 0;
+                info.waitFd = trace->waitFd;
+                info.waitEvent = trace->waitEvent;
+                if (with_stack)
+                {
+                    info.createSite = SymbolizeFrames(trace->create, trace->createSize);
+                    if (f->getState() == Fiber::HOLD)
+                    {
+                        info.holdStack = SymbolizeFrames(trace->hold, trace->holdSize);
+                    }
+                }
+            }
+            infos.push_back(info);
+        }
+    }
+
+    std::string FiberRegistry::dump(bool with_stack)
+    {
+        std::vector<Info> infos;
+        getInfos(infos, with_stack);
+        std::stringstream ss;
+        ss << "[FiberRegistry fibers=" << infos.size()
+           << " total=" << Fiber::TotalFibers() << "]" << std::endl;
+        for (auto &i : infos)
+        {
+            ss << "    id=" << i.id
+               << " state=" << i.state
+               << " state_ms=" << i.stateMs
+               << " age_ms=" << i.ageMs;
+            if (i.waitFd != -1)
+            {
+                ss << " wait_fd=" << i.waitFd
+                   << " wait_event=" << i.waitEvent;
+            }
+            ss << " entry=" << i.entry << std::endl;
+            if (!i.createSite.empty())
+            {
+                ss << "      create:" << std::endl
+                   << i.createSite;
+            }
+            if (!i.holdStack.empty())
+            {
+                ss << "      hold:" << std::endl
+                   << i.holdStack;
+            }
+        }
+        return ss.str();
+    }
+}
@@ -0,0 +1,139 @@
+#include "file_io.h"
+#include "config.h"
+#include "fiber.h"
+#include "scheduler.h"
+#include "util.h"
+#include <sstream>
+#include <errno.h>
+
+namespace sylar
+{
+    static ConfigVar<uint32_t>::ptr g_file_io_threads =
+        Config::Lookup<uint32_t>("file_io.threads", 4, "blocking file io threads");
+
+    struct FileIoPool::Task
+    {
+        const std::function<ssize_t()> *fn = nullptr;
+        ssize_t rt = -1;
+        int err = 0;
+        Scheduler *scheduler = nullptr;
+        Fiber::ptr fiber;
+        uint64_t submitNs = 0;
+    };
+
+    FileIoPool::FileIoPool()
+    {
+        uint32_t threads = std::max(1u, g_file_io_threads->getValue());
+        for (uint32_t i = 0; i < threads; ++i)
+        {
+            m_threads.push_back(std::make_shared<Thread>(std::bind(&FileIoPool::worker, this),
+                                                         "file_io_" + std::to_string(i)));
+        }
+    }
+
+    FileIoPool::~FileIoPool()
+    {
+        {
+            MutexType::Lock lock(m_mutex);
+            m_stop = true;
+        }
+        for (size_t i = 0; i < m_threads.size(); ++i)
+        {
+            m_sem.notify();
+        }
+        for (auto &i : m_threads)
+        {
+            i->join();
+        }
+    }
+
+    ssize_t FileIoPool::run(const std::function<ssize_t()> &fn)
+    {
+        Scheduler *scheduler = Scheduler::GetThis();
+        // 调度协程和 idle 协程挂起之后没有人调度回来, 与不在协程中一样直接执行
+        if (!scheduler || !Scheduler::InTaskFiber())
+        {
+            return fn();
+        }
+        Task task;
+        task.fn = &fn;
+        task.scheduler = scheduler;
+        task.fiber = Fiber::GetThis();
+        task.submitNs = GetMonotonicNS();
+        m_submitted.fetch_add(1, std::memory_order_relaxed);
+        {
+            MutexType::Lock lock(m_mutex);
+            m_tasks.push_back(&task);
+            if (m_tasks.size() > m_queueMax.load(std::memory_order_relaxed))
+            {
+                m_queueMax.store(m_tasks.size(), std::memory_order_relaxed);
+            }
+        }
+        m_sem.notify();
+        // 完成之后由线程池把协程调度回来
+        Fiber::YieldToHold();
+        errno = task.err;
+        return task.rt;
+    }
+
+    void FileIoPool::worker()
+    {
+        while (true)
+        {
+            m_sem.wait();
+            Task *task = nullptr;
+            {
+                MutexType::Lock lock(m_mutex);
+                if (m_tasks.empty())
+                {
+                    if (m_stop)
+                    {
+                        return;
+                    }
+                    continue;
+                }
+                task = m_tasks.front();
+                m_tasks.pop_front();
+            }
+            uint64_t start = GetMonotonicNS();
+            m_waitNs.fetch_add(start - task->submitNs, std::memory_order_relaxed);
+            task->rt = (*task->fn)();
+            task->err = errno;
+            m_runNs.fetch_add(GetMonotonicNS() - start, std::memory_order_relaxed);
+            m_completed.fetch_add(1, std::memory_order_relaxed);
+            // task 在协程的栈上, 调度之后协程可能立即返回, 不能再访问 task
+            Scheduler *scheduler = task->scheduler;
+            Fiber::ptr fiber;
+            fiber.swap(task->fiber);
+            scheduler->schedule(fiber);
+        }
+    }
+
+    void FileIoPool::getStat(Stat &stat) const
+    {
+        stat.threads = m_threads.size();
+        stat.submitted = m_submitted.load(std::memory_order_relaxed);
+        stat.completed = m_completed.load(std::memory_order_relaxed);
+        stat.inlined = m_inlined.load(std::memory_order_relaxed);
+        stat.queueMax = m_queueMax.load(std::memory_order_relaxed);
+        stat.waitNs = m_waitNs.load(std::memory_order_relaxed);
+        stat.runNs = m_runNs.load(std::memory_order_relaxed);
+    }
+
+    std::string FileIoPool::dumpStat() const
+    {
+        Stat stat;
+        getStat(stat);
+        std::stringstream ss;
+        ss << "[FileIoStat threads=" << stat.threads << " submitted=" << stat.submitted
+           << " completed=" << stat.completed << " inlined=" << stat.inlined
+           << " queue_max=" << stat.queueMax;
+        if (stat.completed)
+        {
+            ss << " avg_wait=" << stat.waitNs / stat.completed / 1000.0 << "us"
+               << " avg_run=" << stat.runNs / stat.completed / 1000.0 << "us";
+        }
+        ss << "]";
+        return ss.str();
+    }
+}
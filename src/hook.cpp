@@ -1,26 +1,42 @@
 
 #include "hook.h"
 #include <dlfcn.h>
+#include <map>
 #include "config.h"
 #include "log.h"
 #include "fiber.h"
 #include "iomanager.h"
 #include "fd_manager.h"
 #include "macro.h"
+#include "file_io.h"
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 namespace sylar
 {
     static sylar::ConfigVar<int>::ptr g_tcp_connect_timeout =
         sylar::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
+    static sylar::ConfigVar<bool>::ptr g_file_io_enable =
+        sylar::Config::Lookup("file_io.enable", true, "run file open/fsync/large read/write in fibers on file io threads");
+    static sylar::ConfigVar<uint32_t>::ptr g_file_io_threshold =
+        sylar::Config::Lookup<uint32_t>("file_io.threshold", 16 * 1024, "file read/write smaller than this run inline");
+    static sylar::ConfigVar<int>::ptr g_io_timeout_slack =
+        sylar::Config::Lookup("tcp.timeout.slack", 10, "io timeout slack ms, 0 disable");
     static thread_local bool t_hook_enable = false;
 #define HOOK_FUN(XX) \
     XX(sleep)        \
     XX(usleep)       \
     XX(nanosleep)    \
     XX(socket)       \
+    XX(socketpair)   \
     XX(connect)      \
     XX(accept)       \
+    XX(accept4)      \
+    XX(dup)          \
+    XX(dup2)         \
+    XX(dup3)         \
+    XX(poll)         \
+    XX(select)       \
+    XX(epoll_wait)   \
     XX(fcntl)        \
     XX(ioctl)        \
     XX(getsockopt)   \
@@ -30,12 +46,17 @@ namespace sylar
     XX(recv)         \
     XX(recvfrom)     \
     XX(recvmsg)      \
+    XX(pread)        \
     XX(write)        \
     XX(writev)       \
     XX(send)         \
     XX(sendto)       \
     XX(sendmsg)      \
-    XX(close)
+    XX(pwrite)       \
+    XX(close)        \
+    XX(open)         \
+    XX(fsync)        \
+    XX(fdatasync)
 
     // 初始化hook
     void hook_init()
@@ -56,6 +77,9 @@ namespace sylar
     }
 
     static uint64_t s_connect_timout = -1;
+    static uint64_t s_io_timeout_slack_us = 0;
+    static bool s_file_io_enable = true;
+    static uint32_t s_file_io_threshold = 0;
     //  需要 在main函数执行前，将需要替换的函数全都hook掉，那就只能根据编译顺序来操作
     struct _HookIniter
     {
@@ -71,6 +95,15 @@ namespace sylar
                 SYLAR_LOG_INFO(g_logger) << "tcp connect timeout changed from"
                                          <<  old_value << " to " << new_value;
                 s_connect_timout = new_value; });
+            s_io_timeout_slack_us = g_io_timeout_slack->getValue() * 1000;
+            g_io_timeout_slack->addListener([](const int &old_value, const int &new_value)
+                                            { s_io_timeout_slack_us = new_value * 1000; });
+            s_file_io_enable = g_file_io_enable->getValue();
+            g_file_io_enable->addListener([](const bool &old_value, const bool &new_value)
+                                          { s_file_io_enable = new_value; });
+            s_file_io_threshold = g_file_io_threshold->getValue();
+            g_file_io_threshold->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                             { s_file_io_threshold = new_value; });
         }
     };
 
@@ -89,10 +122,47 @@ namespace sylar
         t_hook_enable = flag;
     }
 
-    struct timer_info
+    // 超时允许的延迟, 不超过超时时间的 1/10; 大量连接的超时可以合并到同一次唤醒
+    static uint64_t io_timeout_slack(uint64_t timeout_us)
     {
-        int cancelled = 0;
-    };
+        return std::min(s_io_timeout_slack_us, timeout_us / 10);
+    }
+
+    // 协程中的 open/fsync 是否交给 FileIoPool
+    static bool file_io_enable()
+    {
+        return t_hook_enable && s_file_io_enable;
+    }
+
+    // 协程中对普通文件不小于 file_io.threshold 的读写交给 FileIoPool, 小的直接执行
+    static bool file_io_offload(int fd, size_t count)
+    {
+        if (!file_io_enable())
+        {
+            return false;
+        }
+        FdCtx *ctx = FdMgr::GetInstance()->get(fd);
+        if (!ctx || !ctx->isFile())
+        {
+            return false;
+        }
+        if (count < s_file_io_threshold)
+        {
+            FileIoMgr::GetInstance()->addInline();
+            return false;
+        }
+        return true;
+    }
+
+    static size_t iov_length(const struct iovec *iov, int iovcnt)
+    {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            len += iov[i].iov_len;
+        }
+        return len;
+    }
 
     template <typename OriginFun, typename... Args>
     static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
@@ -106,7 +176,7 @@ namespace sylar
         }
 
         // 获得当前fd是否是socket的并且保存在m_datas中
-        sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+        sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->get(fd);
         // 如果fd不存在于m_datas中,那么就被视为 非socket类型的fd
         if (!ctx)
         {
@@ -125,8 +195,10 @@ namespace sylar
         }
         // 得到ctx的超时时间
         uint64_t to = ctx->getTimeout(timeout_so);
-        // 条件状态， 用于 conditionEvent
-        std::shared_ptr<timer_info> tinfo(new timer_info);
+        // 嵌入在 ctx 中的超时定时器, 挂起时加入, 唤醒后取消, 不分配内存
+        sylar::FdCtx::IoTimeout *tio = ctx->getIoTimeout((sylar::IOManager::Event)event);
+        // 挂起期间句柄可能被关闭, 句柄号还可能被复用, 唤醒后比较代数
+        uint32_t generation = ctx->getGeneration();
     retry:
         ssize_t n = fun(fd, std::forward<Args>(args)...);
         // 如果n = -1,并且errno == EINTR，说明函数被中断异常退出
@@ -139,45 +211,24 @@ namespace sylar
         if (n == -1 && errno == EAGAIN)
         {
             sylar::IOManager *iom = sylar::IOManager::GetThis();
-            sylar::Timer::ptr timer;
-            // weak_ptr指针指向 timer_info类型的对象tinfo
-            std::weak_ptr<timer_info> winfo(tinfo);
             // to 来自于 ctx->getTimeout(timeout_so);
-            if (to != (uint64_t)-1)
+            bool armed = to != (uint64_t)-1;
+            if (armed)
             {
                 // to 不等于-1，那么就说明有超时时间 (在超时时间内完成操作就不会被cancel)
-                timer = iom->addConditionTimer(
-                    to, [winfo, fd, iom, event]()
-                    {
-                    // lock 返回的是一个智能指针
-                    auto t = winfo.lock();
-                    // 如果t不存在并且t被取消了，那么就直接不执行这个函数
-                    if (!t || t->cancelled)
-                    {
-                        return;
-                    }
-                    t->cancelled = ETIMEDOUT;
-                    // 把当前iomanager事件取消掉  --- 有triggerEvent来添加schedul
-                    iom->cancelEvent(fd, (sylar::IOManager::Event)event); },
-                    winfo);
+                // 到期时 OnIoTimeout 把当前iomanager事件取消掉  --- 有triggerEvent来添加schedul
+                tio->iom = iom;
+                tio->cancelled = 0;
+                iom->addNode(&tio->node, to * 1000, io_timeout_slack(to * 1000));
             }
-            int c = 0;
-            uint64_t now = 0;
             // 添加时间到timer中  --- 有triggerEvent来添加schedul
             int rt = iom->addEvent(fd, (sylar::IOManager::Event)event);
             // rt为0表示成功添加event，如果进入下面的if那么就是add失败，就要取消定时器
             if (rt)
             {
-                if (c)
-                {
-                    SYLAR_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
-                                              << fd << ", " << event << ") retry c=" << c
-                                              << " used=" << (sylar::GetCurrentUS() - now);
-                }
-                // 如果timer此时没有超时，那么timer必定存在
-                if (timer)
+                if (armed)
                 {
-                    timer->cancel();
+                    iom->cancelNode(&tio->node);
                 }
                 return -1;
             }
@@ -187,15 +238,20 @@ namespace sylar
                 // event添加成功
                 sylar::Fiber::YieldToHold();
                 // SYLAR_LOG_DEBUG(g_logger) << "do_io<" << hook_fun_name << ">";
-                // 如果fiber 被唤醒回来timer还存在的话，那就取消掉timer
-                if (timer)
+                // 被唤醒回来, 取消还没有到期的定时器; 已经到期时等待回调结束
+                if (armed)
                 {
-                    timer->cancel();
+                    iom->cancelNode(&tio->node);
+                    // 说明当前的fiber是通过cancelevent中的trigger触发唤醒的
+                    if (tio->cancelled)
+                    {
+                        errno = tio->cancelled;
+                        return -1;
+                    }
                 }
-                // 说明当前的fiber是通过cancelevent中的trigger触发唤醒的
-                if (tinfo->cancelled)
+                if (ctx->isClose() || ctx->getGeneration() != generation)
                 {
-                    errno = tinfo->cancelled;
+                    errno = EBADF;
                     return -1;
                 }
 
@@ -207,6 +263,255 @@ namespace sylar
         return n;
     }
 
+    /**
+     * @brief 满足 do_io 挂起条件并且 IOManager 使用 io_uring 后端时返回 IOManager, 否则返回 nullptr
+     */
+    static sylar::IOManager *uring_check(int fd, sylar::FdCtx *&ctx)
+    {
+        if (!sylar::t_hook_enable)
+        {
+            return nullptr;
+        }
+        sylar::IOManager *iom = sylar::IOManager::GetThis();
+        if (!iom || !iom->isUring())
+        {
+            return nullptr;
+        }
+        ctx = sylar::FdMgr::GetInstance()->get(fd);
+        if (!ctx || ctx->isClose() || !ctx->isSocket() || ctx->getUserNonblock())
+        {
+            return nullptr;
+        }
+        return iom;
+    }
+
+    /**
+     * @brief io_uring 后端的读: 先从 multishot recv 的缓冲区读取, 否则直接提交请求
+     * @return 不满足条件时返回 false, 由 do_io 处理
+     */
+    static bool uring_read(int fd, uint8_t opcode, const iovec *iov, int iovcnt, int flags, ssize_t &rt)
+    {
+        sylar::FdCtx *ctx = nullptr;
+        sylar::IOManager *iom = uring_check(fd, ctx);
+        if (!iom)
+        {
+            return false;
+        }
+        uint64_t to = ctx->getTimeout(SO_RCVTIMEO);
+        if (iom->recvMultishot(fd, iov, iovcnt, flags, to, rt))
+        {
+            return true;
+        }
+        // readv/recvmsg 没有对应的直接提交, 走 do_io
+        if (iovcnt != 1 || opcode == IORING_OP_NOP)
+        {
+            return false;
+        }
+        rt = iom->submitIo(opcode, fd, iov->iov_base, iov->iov_len, flags, to);
+        return true;
+    }
+
+    static bool uring_write(int fd, uint8_t opcode, const void *buf, size_t len, int flags, ssize_t &rt)
+    {
+        sylar::FdCtx *ctx = nullptr;
+        sylar::IOManager *iom = uring_check(fd, ctx);
+        if (!iom)
+        {
+            return false;
+        }
+        rt = iom->submitIo(opcode, fd, (void *)buf, len, flags, ctx->getTimeout(SO_SNDTIMEO));
+        return true;
+    }
+
+    /**
+     * @brief poll 挂起时的等待状态, 由事件回调, 超时定时器共享, 先到的一个唤醒协程
+     */
+    struct PollWaiter
+    {
+        // 必须是第一个成员, 回调中由节点转换回 PollWaiter
+        TimerNode node;
+        IOManager *iom = nullptr;
+        Fiber::ptr fiber;
+        std::atomic<bool> woken = {false};
+
+        void wake()
+        {
+            if (!woken.exchange(true))
+            {
+                iom->schedule(fiber);
+            }
+        }
+    };
+
+    static void OnPollTimeout(TimerNode *node)
+    {
+        ((PollWaiter *)node)->wake();
+    }
+
+    /**
+     * @brief 把 fds 关注的事件注册到 IOManager, 挂起当前协程直到其中一个就绪或者超时
+     * @param[in] timeout_us 超时时间, ~0ull 表示不超时
+     * @return 挂起并被唤醒返回 0; 有句柄不能加入 epoll(普通文件等), 或者句柄的这个方向
+     *         已经有其他协程在等待时返回 -1, 此时没有挂起, 由调用者退回到阻塞的 poll
+     * @details 只负责唤醒, 就绪状态由调用者再次非阻塞 poll 得到.
+     *          同一个句柄在 fds 中出现多次时合并关注的事件, 只注册一次
+     */
+    static int poll_wait(pollfd *fds, nfds_t nfds, uint64_t timeout_us)
+    {
+        IOManager *iom = IOManager::GetThis();
+        // 事件回调可能在协程返回之后才执行, 状态由回调共同持有
+        std::shared_ptr<PollWaiter> waiter = std::make_shared<PollWaiter>();
+        waiter->node.fn = &OnPollTimeout;
+        waiter->iom = iom;
+        waiter->fiber = Fiber::GetThis();
+        // 按句柄合并关注的事件
+        std::map<int, int> wanted;
+        for (nfds_t i = 0; i < nfds; ++i)
+        {
+            if (fds[i].fd < 0)
+            {
+                continue;
+            }
+            int &ev = wanted[fds[i].fd];
+            if (fds[i].events & (POLLIN | POLLPRI | POLLRDNORM | POLLRDBAND))
+            {
+                ev |= IOManager::READ;
+            }
+            if (fds[i].events & (POLLOUT | POLLWRNORM | POLLWRBAND))
+            {
+                ev |= IOManager::WRITE;
+            }
+        }
+        std::vector<std::pair<int, IOManager::Event> > added;
+        int rt = 0;
+        for (auto it = wanted.begin(); it != wanted.end() && rt == 0; ++it)
+        {
+            for (int e : {IOManager::READ, IOManager::WRITE})
+            {
+                if (!(it->second & e))
+                {
+                    continue;
+                }
+                // 其他协程正在等待(do_io 或者另一个 poll)时不能再注册
+                rt = iom->tryAddEvent(it->first, (IOManager::Event)e, [waiter]()
+                                      { waiter->wake(); });
+                if (rt)
+                {
+                    break;
+                }
+                added.push_back(std::make_pair(it->first, (IOManager::Event)e));
+            }
+        }
+        if (rt == 0)
+        {
+            if (timeout_us != ~0ull)
+            {
+                iom->addNode(&waiter->node, timeout_us);
+            }
+            Fiber::YieldToHold();
+            if (timeout_us != ~0ull)
+            {
+                iom->cancelNode(&waiter->node);
+            }
+        }
+        // 已经触发的事件已经从 IOManager 中移除, delEvent 返回 false
+        for (auto &i : added)
+        {
+            iom->delEvent(i.first, i.second);
+        }
+        return rt ? -1 : 0;
+    }
+
+    /**
+     * @brief 协程版本的 poll: 先非阻塞 poll, 没有就绪时挂起等待, 唤醒之后再次 poll
+     */
+    static int hook_poll(pollfd *fds, nfds_t nfds, int timeout)
+    {
+        uint64_t deadline = timeout < 0 ? ~0ull : sylar::GetMonotonicUS() + timeout * 1000ull;
+        while (true)
+        {
+            int n = poll_f(fds, nfds, 0);
+            if (n != 0 || timeout == 0)
+            {
+                return n;
+            }
+            uint64_t wait_us = ~0ull;
+            if (deadline != ~0ull)
+            {
+                uint64_t now = sylar::GetMonotonicUS();
+                if (now >= deadline)
+                {
+                    return 0;
+                }
+                wait_us = deadline - now;
+            }
+            if (poll_wait(fds, nfds, wait_us))
+            {
+                // 不能由 epoll 等待的句柄, 退回到阻塞线程的 poll
+                int ms = wait_us == ~0ull ? -1 : (int)((wait_us + 999) / 1000);
+                return poll_f(fds, nfds, ms);
+            }
+        }
+    }
+
+    /**
+     * @brief 为 hook 中新建的句柄创建 FdCtx
+     * @details 句柄号超出 FdManager::MAX_FDS 时没有 FdCtx, 之后的读写不会挂起协程而是阻塞线程,
+     *          这时关闭句柄并以 EMFILE 失败, 与达到 RLIMIT_NOFILE 时一样
+     * @return 成功返回 fd
+     */
+    static int track_fd(int fd)
+    {
+        if (FdMgr::GetInstance()->create(fd))
+        {
+            return fd;
+        }
+        close_f(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    // dup 出来的句柄与原句柄指向同一个 socket, 继承用户设置的非阻塞和超时
+    static int dup_fd_ctx(int oldfd, int newfd)
+    {
+        FdCtx *ctx = FdMgr::GetInstance()->get(oldfd);
+        if (!ctx || ctx->isClose() || !ctx->isSocket())
+        {
+            // newfd 上可能留着在 hook 之外关闭的旧句柄的记录
+            FdMgr::GetInstance()->del(newfd);
+            return newfd;
+        }
+        if (track_fd(newfd) < 0)
+        {
+            return -1;
+        }
+        FdCtx *nctx = FdMgr::GetInstance()->get(newfd);
+        nctx->setUserNonblock(ctx->getUserNonblock());
+        nctx->setTimeout(SO_RCVTIMEO, ctx->getTimeout(SO_RCVTIMEO));
+        nctx->setTimeout(SO_SNDTIMEO, ctx->getTimeout(SO_SNDTIMEO));
+        return newfd;
+    }
+
+    /**
+     * @brief 句柄关闭之前(close, 以及 dup2/dup3 覆盖 newfd)唤醒等待它的协程并删除 FdCtx
+     * @details 不在 FdManager 中的句柄(epoll 句柄, 管道等)也可能被 poll 注册到了 IOManager,
+     *          同样需要 cancelAll, 否则复用这个句柄号时会沿用过期的注册状态
+     */
+    static void release_fd(int fd)
+    {
+        IOManager *iom = IOManager::GetThis();
+        if (iom)
+        {
+            // 取消与这个fd相关的所有事件
+            iom->cancelAll(fd);
+        }
+        if (FdMgr::GetInstance()->get(fd))
+        {
+            // 删除m_datas中的fd
+            FdMgr::GetInstance()->del(fd);
+        }
+    }
+
     extern "C"{
 
         // 对HOOK_FUN里面的所有xx(name)宏 都要初始化 函数指针定义
@@ -243,7 +548,7 @@ namespace sylar
             }
             sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
             sylar::IOManager *iom = sylar::IOManager::GetThis();
-            iom->addTimer(usec / 1000, std::bind((void(sylar::Scheduler::*)(sylar::Fiber::ptr, int thread)) & sylar::IOManager::schedule, iom, fiber, -1));
+            iom->addTimerUs(usec, std::bind((void(sylar::Scheduler::*)(sylar::Fiber::ptr, int thread)) & sylar::IOManager::schedule, iom, fiber, -1));
             sylar::Fiber::YieldToHold();
             return 0;
         }
@@ -254,10 +559,11 @@ namespace sylar
             {
                 return nanosleep_f(req, rem);
             }
-            int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 / 1000;
+            // 不足 1us 的部分向上取整
+            uint64_t timeout_us = req->tv_sec * 1000 * 1000ull + (req->tv_nsec + 999) / 1000;
             sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
             sylar::IOManager *iom = sylar::IOManager::GetThis();
-            iom->addTimer(timeout_ms, std::bind((void(sylar::Scheduler::*)(sylar::Fiber::ptr, int thread)) & sylar::IOManager::schedule, iom, fiber, -1));
+            iom->addTimerUs(timeout_us, std::bind((void(sylar::Scheduler::*)(sylar::Fiber::ptr, int thread)) & sylar::IOManager::schedule, iom, fiber, -1));
             sylar::Fiber::YieldToHold();
             return 0;
         }
@@ -274,9 +580,36 @@ namespace sylar
             {
                 return fd;
             }
-            // 得到fd，如果fd不在m_datas中，那就强制添加到m_datas中
-            sylar::FdMgr::GetInstance()->get(fd, true);
-            return fd;
+            // 新的句柄, 句柄号上旧的记录(在 hook 之外关闭的句柄)作废
+            return sylar::track_fd(fd);
+        }
+
+        int socketpair(int domain, int type, int protocol, int sv[2])
+        {
+            if (!t_hook_enable)
+            {
+                return socketpair_f(domain, type, protocol, sv);
+            }
+            int rt = socketpair_f(domain, type, protocol, sv);
+            if (rt != 0)
+            {
+                return rt;
+            }
+            // 任何一端超出容量时两端一起关闭
+            if (sylar::track_fd(sv[0]) < 0)
+            {
+                close_f(sv[1]);
+                errno = EMFILE;
+                return -1;
+            }
+            if (sylar::track_fd(sv[1]) < 0)
+            {
+                sylar::FdMgr::GetInstance()->del(sv[0]);
+                close_f(sv[0]);
+                errno = EMFILE;
+                return -1;
+            }
+            return rt;
         }
 
         int connect_with_timeout(int sockfd, const struct sockaddr* addr, socklen_t addrlen, uint64_t timeout_ms)
@@ -285,7 +618,7 @@ namespace sylar
             {
                 return connect_f(sockfd, addr, addrlen);
             }
-            sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(sockfd);
+            sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->get(sockfd);
             // 如果ctx不存在或者ctx已经关闭了
             if (!ctx || ctx->isClose())
             {
@@ -315,53 +648,40 @@ namespace sylar
             }
             // 加下来就是 n == -1 && errno == EINPROGRESS 的情况
             sylar::IOManager *iom = sylar::IOManager::GetThis();
-            sylar::Timer::ptr timer;
-            // 设置条件定时器
-            std::shared_ptr<timer_info> tinfo(new timer_info);
-            std::weak_ptr<timer_info> winfo(tinfo);
-
+            // 与 do_io 一样使用嵌入在 ctx 中的写方向超时定时器
+            sylar::FdCtx::IoTimeout *tio = ctx->getIoTimeout(sylar::IOManager::WRITE);
             // 有超时时间
-            if (timeout_ms != (uint64_t)-1)
+            bool armed = timeout_ms != (uint64_t)-1;
+            if (armed)
             {
-                timer = iom->addConditionTimer(
-                    timeout_ms, [winfo, sockfd, iom]()
-                    {
-                        // 创建一个share_ptr指针t，共享winfo指向内存空间的权利
-                        auto t = winfo.lock();
-                        // 如果t不存在亦或者t的cancelled == true (意味着被取消了)
-                        if (!t || t->cancelled)
-                        {
-                            return;
-                        }
-                        // 如果t存在，那么设置条件超时
-                        t->cancelled = ETIMEDOUT;
-                        iom->cancelEvent(sockfd, sylar::IOManager::WRITE);},
-                    winfo);
+                tio->iom = iom;
+                tio->cancelled = 0;
+                iom->addNode(&tio->node, timeout_ms * 1000, io_timeout_slack(timeout_ms * 1000));
             }
             int rt = iom->addEvent(sockfd, sylar::IOManager::WRITE);
             if (rt == 0)
             {
                 sylar::Fiber::YieldToHold();
                 // 如果被唤醒的话 --
-                // timer还存在， 那么就取消定时器
-                if (timer)
+                // 定时器还没有到期， 那么就取消定时器
+                if (armed)
                 {
-                    timer->cancel();
-                }
-                // 如果tinfo条件被取消了
-                if (tinfo->cancelled)
-                {
-                    errno = tinfo->cancelled;
-                    return -1;
+                    iom->cancelNode(&tio->node);
+                    // 如果超时了
+                    if (tio->cancelled)
+                    {
+                        errno = tio->cancelled;
+                        return -1;
+                    }
                 }
             }
             else
             {
                 // 如果添加时间失败了
                 // 还有定时器就取消定时器
-                if (timer)
+                if (armed)
                 {
-                    timer->cancel();
+                    iom->cancelNode(&tio->node);
                 }
                 SYLAR_LOG_ERROR(g_logger) << "connnet addEvent(" << sockfd << ", WRITE) error";
             }
@@ -400,52 +720,305 @@ namespace sylar
                 return accept_f(sockfd, addr, addrlen);
             }
 
-            int fd = do_io(sockfd, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+            int fd = -1;
+            sylar::FdCtx *ctx = nullptr;
+            sylar::IOManager *iom = sylar::uring_check(sockfd, ctx);
+            if (iom)
+            {
+                uint64_t to = ctx->getTimeout(SO_RCVTIMEO);
+                if (!iom->acceptMultishot(sockfd, addr, addrlen, to, fd))
+                {
+                    fd = iom->submitIo(IORING_OP_ACCEPT, sockfd, addr, 0, 0, to, addrlen);
+                }
+            }
+            else
+            {
+                fd = do_io(sockfd, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+            }
+            if (fd >= 0)
+            {
+                fd = sylar::track_fd(fd);
+            }
+            return fd;
+        }
+
+        int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+        {
+            if (!t_hook_enable)
+            {
+                return accept4_f(sockfd, addr, addrlen, flags);
+            }
+            int fd = do_io(sockfd, accept4_f, "accept4", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen, flags);
+            if (fd >= 0)
+            {
+                fd = sylar::track_fd(fd);
+                // 调用者要求非阻塞时不再挂起协程
+                if (fd >= 0 && (flags & SOCK_NONBLOCK))
+                {
+                    sylar::FdMgr::GetInstance()->get(fd)->setUserNonblock(true);
+                }
+            }
+            return fd;
+        }
+
+        int dup(int oldfd)
+        {
+            int fd = dup_f(oldfd);
+            if (t_hook_enable && fd >= 0)
+            {
+                fd = sylar::dup_fd_ctx(oldfd, fd);
+            }
+            return fd;
+        }
+
+        int dup2(int oldfd, int newfd)
+        {
+            if (!t_hook_enable || oldfd == newfd)
+            {
+                return dup2_f(oldfd, newfd);
+            }
+            sylar::release_fd(newfd);
+            int fd = dup2_f(oldfd, newfd);
             if (fd >= 0)
             {
-                sylar::FdMgr::GetInstance()->get(fd, true);
+                fd = sylar::dup_fd_ctx(oldfd, fd);
             }
             return fd;
         }
 
+        int dup3(int oldfd, int newfd, int flags)
+        {
+            if (!t_hook_enable || oldfd == newfd)
+            {
+                return dup3_f(oldfd, newfd, flags);
+            }
+            sylar::release_fd(newfd);
+            int fd = dup3_f(oldfd, newfd, flags);
+            if (fd >= 0)
+            {
+                fd = sylar::dup_fd_ctx(oldfd, fd);
+            }
+            return fd;
+        }
+
+        int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+        {
+            if (!t_hook_enable)
+            {
+                return poll_f(fds, nfds, timeout);
+            }
+            return sylar::hook_poll(fds, nfds, timeout);
+        }
+
+        int select(int nfds, fd_set *readfds, fd_set *writefds,
+                   fd_set *exceptfds, struct timeval *timeout)
+        {
+            if (!t_hook_enable)
+            {
+                return select_f(nfds, readfds, writefds, exceptfds, timeout);
+            }
+            // 转换成 pollfd, 由 hook_poll 等待
+            std::vector<pollfd> pfds;
+            for (int fd = 0; fd < nfds; ++fd)
+            {
+                short events = 0;
+                if (readfds && FD_ISSET(fd, readfds))
+                {
+                    events |= POLLIN;
+                }
+                if (writefds && FD_ISSET(fd, writefds))
+                {
+                    events |= POLLOUT;
+                }
+                if (exceptfds && FD_ISSET(fd, exceptfds))
+                {
+                    events |= POLLPRI;
+                }
+                if (events)
+                {
+                    pfds.push_back({fd, events, 0});
+                }
+            }
+            int ms = timeout ? (int)(timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000) : -1;
+            uint64_t start = sylar::GetMonotonicUS();
+            int rt = sylar::hook_poll(pfds.data(), pfds.size(), ms);
+            if (rt < 0)
+            {
+                return rt;
+            }
+            if (timeout)
+            {
+                // 与 linux 一样把 timeout 改为剩余的时间
+                uint64_t total = timeout->tv_sec * 1000000ull + timeout->tv_usec;
+                uint64_t used = sylar::GetMonotonicUS() - start;
+                uint64_t left = used < total ? total - used : 0;
+                timeout->tv_sec = left / 1000000;
+                timeout->tv_usec = left % 1000000;
+            }
+            int n = 0;
+            for (auto &p : pfds)
+            {
+                // 出错或者挂断的句柄在关注的集合中都报告为就绪
+                bool bad = p.revents & (POLLERR | POLLHUP | POLLNVAL);
+                if (readfds && FD_ISSET(p.fd, readfds) && !(bad || (p.revents & POLLIN)))
+                {
+                    FD_CLR(p.fd, readfds);
+                }
+                if (writefds && FD_ISSET(p.fd, writefds) && !(bad || (p.revents & POLLOUT)))
+                {
+                    FD_CLR(p.fd, writefds);
+                }
+                if (exceptfds && FD_ISSET(p.fd, exceptfds) && !(p.revents & POLLPRI))
+                {
+                    FD_CLR(p.fd, exceptfds);
+                }
+                n += (readfds && FD_ISSET(p.fd, readfds)) + (writefds && FD_ISSET(p.fd, writefds)) + (exceptfds && FD_ISSET(p.fd, exceptfds));
+            }
+            return n;
+        }
+
+        int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+        {
+            if (!t_hook_enable)
+            {
+                return epoll_wait_f(epfd, events, maxevents, timeout);
+            }
+            // epoll 句柄本身可读表示有就绪的事件
+            uint64_t deadline = timeout < 0 ? ~0ull : sylar::GetMonotonicUS() + timeout * 1000ull;
+            while (true)
+            {
+                int n = epoll_wait_f(epfd, events, maxevents, 0);
+                if (n != 0 || timeout == 0)
+                {
+                    return n;
+                }
+                int ms = -1;
+                if (deadline != ~0ull)
+                {
+                    uint64_t now = sylar::GetMonotonicUS();
+                    if (now >= deadline)
+                    {
+                        return 0;
+                    }
+                    ms = (int)((deadline - now + 999) / 1000);
+                }
+                pollfd pfd = {epfd, POLLIN, 0};
+                if (sylar::hook_poll(&pfd, 1, ms) < 0)
+                {
+                    return -1;
+                }
+            }
+        }
+
         ssize_t read(int fd, void *buf, size_t count)
         {
+            if (sylar::file_io_offload(fd, count))
+            {
+                return sylar::FileIoMgr::GetInstance()->run([=]()
+                                                           { return read_f(fd, buf, count); });
+            }
+            ssize_t n = 0;
+            iovec iov = {buf, count};
+            if (sylar::uring_read(fd, IORING_OP_READ, &iov, 1, 0, n))
+            {
+                return n;
+            }
             return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
         }
 
         ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
         {
+            if (sylar::file_io_offload(fd, sylar::iov_length(iov, iovcnt)))
+            {
+                return sylar::FileIoMgr::GetInstance()->run([=]()
+                                                           { return readv_f(fd, iov, iovcnt); });
+            }
+            ssize_t n = 0;
+            if (sylar::uring_read(fd, IORING_OP_NOP, iov, iovcnt, 0, n))
+            {
+                return n;
+            }
             return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
         }
 
         ssize_t recv(int sockfd, void *buf, size_t len, int flags)
         {
+            ssize_t n = 0;
+            iovec iov = {buf, len};
+            if (sylar::uring_read(sockfd, IORING_OP_RECV, &iov, 1, flags, n))
+            {
+                return n;
+            }
             return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
         }
 
         ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                          struct sockaddr *src_addr, socklen_t *addrlen)
         {
+            ssize_t n = 0;
+            iovec iov = {buf, len};
+            // 需要对端地址的(udp)不走 multishot
+            if (!src_addr && sylar::uring_read(sockfd, IORING_OP_RECV, &iov, 1, flags, n))
+            {
+                return n;
+            }
             return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
         }
 
         ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
         {
+            ssize_t n = 0;
+            if (!msg->msg_name && !msg->msg_control &&
+                sylar::uring_read(sockfd, IORING_OP_NOP, msg->msg_iov, msg->msg_iovlen, flags, n))
+            {
+                msg->msg_flags = 0;
+                return n;
+            }
             return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
         }
 
+        ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+        {
+            if (sylar::file_io_offload(fd, count))
+            {
+                return sylar::FileIoMgr::GetInstance()->run([=]()
+                                                           { return pread_f(fd, buf, count, offset); });
+            }
+            return do_io(fd, pread_f, "pread", sylar::IOManager::READ, SO_RCVTIMEO, buf, count, offset);
+        }
+
         ssize_t write(int fd, const void *buf, size_t count)
         {
+            if (sylar::file_io_offload(fd, count))
+            {
+                return sylar::FileIoMgr::GetInstance()->run([=]()
+                                                           { return write_f(fd, buf, count); });
+            }
+            ssize_t n = 0;
+            if (sylar::uring_write(fd, IORING_OP_WRITE, buf, count, 0, n))
+            {
+                return n;
+            }
             return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
         }
 
         ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
         {
+            if (sylar::file_io_offload(fd, sylar::iov_length(iov, iovcnt)))
+            {
+                return sylar::FileIoMgr::GetInstance()->run([=]()
+                                                           { return writev_f(fd, iov, iovcnt); });
+            }
             return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
         }
 
         ssize_t send(int sockfd, const void *buf, size_t len, int flags)
         {
+            ssize_t n = 0;
+            if (sylar::uring_write(sockfd, IORING_OP_SEND, buf, len, flags, n))
+            {
+                return n;
+            }
             return do_io(sockfd, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, len, flags);
         }
 
@@ -460,6 +1033,16 @@ namespace sylar
             return do_io(sockfd, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
         }
 
+        ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+        {
+            if (sylar::file_io_offload(fd, count))
+            {
+                return sylar::FileIoMgr::GetInstance()->run([=]()
+                                                           { return pwrite_f(fd, buf, count, offset); });
+            }
+            return do_io(fd, pwrite_f, "pwrite", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count, offset);
+        }
+
         int close(int fd)
         {
             if (!sylar::t_hook_enable)
@@ -467,19 +1050,58 @@ namespace sylar
                 return close_f(fd);
             }
 
-            sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
-            if (ctx)
+            sylar::release_fd(fd);
+            return close_f(fd);
+        }
+
+        int open(const char *pathname, int flags, ...)
+        {
+            mode_t mode = 0;
+            if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
             {
-                auto iom = sylar::IOManager::GetThis();
-                if (iom)
-                {
-                    // 取消与这个fd相关的所有事件
-                    iom->cancelAll(fd);
-                }
-                // 删除m_datas中的fd
-                sylar::FdMgr::GetInstance()->del(fd);
+                va_list va;
+                va_start(va, flags);
+                mode = va_arg(va, int);
+                va_end(va);
             }
-            return close_f(fd);
+            if (!open_f)
+            {
+                // 其他库的静态初始化可能早于 _HookIniter
+                sylar::hook_init();
+            }
+            if (!sylar::file_io_enable())
+            {
+                return open_f(pathname, flags, mode);
+            }
+            // 打开文件可能阻塞在磁盘或者网络文件系统上
+            int fd = sylar::FileIoMgr::GetInstance()->run([=]()
+                                                         { return (ssize_t)open_f(pathname, flags, mode); });
+            if (fd >= 0)
+            {
+                // 记录句柄类型, 之后的读写按是否为普通文件处理
+                fd = sylar::track_fd(fd);
+            }
+            return fd;
+        }
+
+        int fsync(int fd)
+        {
+            if (!sylar::file_io_enable())
+            {
+                return fsync_f(fd);
+            }
+            return sylar::FileIoMgr::GetInstance()->run([=]()
+                                                       { return (ssize_t)fsync_f(fd); });
+        }
+
+        int fdatasync(int fd)
+        {
+            if (!sylar::file_io_enable())
+            {
+                return fdatasync_f(fd);
+            }
+            return sylar::FileIoMgr::GetInstance()->run([=]()
+                                                       { return (ssize_t)fdatasync_f(fd); });
         }
 
         int fcntl(int fd, int cmd, ... /* arg */)
@@ -496,7 +1118,7 @@ namespace sylar
                 int arg = va_arg(va, int);
                 va_end(va);
                 // FdManager类型的指针调用get返回了fdctx类型的指针
-                sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+                sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->get(fd);
                 // 如果ctx不存在或者ctx存在但是fd已经被关闭了
                 if (!ctx || ctx->isClose() || !ctx->isSocket())
                 {
@@ -520,7 +1142,7 @@ namespace sylar
             {
                 va_end(va);
                 int arg = fcntl_f(fd, cmd);
-                sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+                sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->get(fd);
                 if (!ctx || ctx->isClose() || !ctx->isSocket())
                 {
                     return arg;
@@ -598,7 +1220,7 @@ namespace sylar
             {
                 // arg先强转成 int*类型，然后*是取值，随后！！是将值转化为0或者1
                 bool user_nonblock = !!*(int *)arg;
-                sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+                sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->get(fd);
                 if (!ctx || ctx->isClose() || ctx->isSocket())
                 {
                     return ioctl_f(fd, request, arg);
@@ -626,7 +1248,7 @@ namespace sylar
                 // 判断是否有超时时间--根据超时时间类型进行匹配
                 if (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO)
                 {
-                    sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(sockfd);
+                    sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->get(sockfd);
                     if (ctx)
                     {
                         const timeval *tv = (const timeval *)optval;
@@ -1,15 +1,139 @@
 #include "iomanager.h"
 #include "macro.h"
 #include "log.h"
+#include "config.h"
+#include "hook.h"
+#include "fd_manager.h"
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <algorithm>
+#include <sstream>
 
 namespace sylar
 {
     static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static ConfigVar<std::string>::ptr g_iomanager_backend =
+        Config::Lookup<std::string>("iomanager.backend", "epoll", "iomanager backend, epoll or io_uring");
+    static ConfigVar<bool>::ptr g_iomanager_multi_reactor =
+        Config::Lookup<bool>("iomanager.multi_reactor", false, "one epoll per worker thread, epoll backend only");
+    static ConfigVar<bool>::ptr g_iomanager_local_timers =
+        Config::Lookup<bool>("iomanager.local_timers", true, "in multi reactor mode timers added on a worker thread are owned by its reactor, lock free");
+    static ConfigVar<uint32_t>::ptr g_epoll_batch =
+        Config::Lookup<uint32_t>("iomanager.epoll.batch", 64, "initial epoll_wait maxevents per idle thread");
+    static ConfigVar<uint32_t>::ptr g_epoll_max_batch =
+        Config::Lookup<uint32_t>("iomanager.epoll.max_batch", 4096, "epoll_wait maxevents grows up to this when batches come back full");
+    static ConfigVar<uint32_t>::ptr g_idle_max_timeout =
+        Config::Lookup<uint32_t>("iomanager.idle.max_timeout", 3000, "longest idle wait in ms when no timer is due");
+
+    static ConfigVar<bool>::ptr g_busy_poll =
+        Config::Lookup<bool>("iomanager.busy_poll.enable", false, "workers spin on epoll_wait(0) instead of parking, for dedicated cores");
+    static ConfigVar<uint32_t>::ptr g_busy_poll_socket_usec =
+        Config::Lookup<uint32_t>("iomanager.busy_poll.socket_usec", 50, "SO_BUSY_POLL set on sockets in busy poll mode, 0 to skip");
+
+    static ConfigVar<uint32_t>::ptr g_lag_threshold =
+        Config::Lookup<uint32_t>("iomanager.stat.lag_threshold", 100, "warn when one event loop iteration takes longer than this many ms, 0 to disable");
+    static ConfigVar<uint32_t>::ptr g_stat_dump_interval =
+        Config::Lookup<uint32_t>("iomanager.stat.dump_interval", 0, "log the event loop stats every this many ms, 0 to disable");
+
+    static uint32_t s_epoll_batch = 64;
+    static uint32_t s_epoll_max_batch = 4096;
+    static uint32_t s_idle_max_timeout = 3000;
+    static uint32_t s_busy_poll_socket_usec = 50;
+    static uint64_t s_lag_threshold_ns = 100 * 1000 * 1000ull;
+    static uint64_t s_stat_dump_interval_ns = 0;
+
+    struct _IOManagerIniter
+    {
+        _IOManagerIniter()
+        {
+            s_epoll_batch = std::max(1u, g_epoll_batch->getValue());
+            s_epoll_max_batch = std::max(s_epoll_batch, g_epoll_max_batch->getValue());
+            s_idle_max_timeout = g_idle_max_timeout->getValue();
+            s_busy_poll_socket_usec = g_busy_poll_socket_usec->getValue();
+            s_lag_threshold_ns = g_lag_threshold->getValue() * 1000 * 1000ull;
+            s_stat_dump_interval_ns = g_stat_dump_interval->getValue() * 1000 * 1000ull;
+            g_epoll_batch->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                       { s_epoll_batch = std::max(1u, new_value); });
+            g_epoll_max_batch->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                           { s_epoll_max_batch = new_value; });
+            g_idle_max_timeout->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                            { s_idle_max_timeout = new_value; });
+            g_busy_poll_socket_usec->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                                 { s_busy_poll_socket_usec = new_value; });
+            g_lag_threshold->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                         { s_lag_threshold_ns = new_value * 1000 * 1000ull; });
+            g_stat_dump_interval->addListener([](const uint32_t &old_value, const uint32_t &new_value)
+                                              { s_stat_dump_interval_ns = new_value * 1000 * 1000ull; });
+        }
+    };
+    static _IOManagerIniter s_iomanager_initer;
+
+    // 第 0 个桶为 0, 第 i 个桶为 [2^(i-1), 2^i)
+    static int HistBucket(uint64_t n)
+    {
+        int idx = n ? 64 - __builtin_clzll(n) : 0;
+        return idx < IOManager::EPOLL_HIST_BUCKETS ? idx : IOManager::EPOLL_HIST_BUCKETS - 1;
+    }
+
+    static void AtomicMax(std::atomic<uint64_t> &v, uint64_t n)
+    {
+        uint64_t old = v.load(std::memory_order_relaxed);
+        while (old < n && !v.compare_exchange_weak(old, n, std::memory_order_relaxed))
+            ;
+    }
+
+    static ConfigVar<uint32_t>::ptr g_uring_entries =
+        Config::Lookup<uint32_t>("iomanager.uring.entries", 1024, "io_uring submission queue entries");
+    static ConfigVar<uint32_t>::ptr g_uring_submit_batch =
+        Config::Lookup<uint32_t>("iomanager.uring.submit_batch", 32, "io_uring sqes queued before a forced submit");
+    static ConfigVar<bool>::ptr g_uring_multishot_accept =
+        Config::Lookup<bool>("iomanager.uring.multishot_accept", true, "io_uring multishot accept for hooked accept");
+    static ConfigVar<bool>::ptr g_uring_multishot_recv =
+        Config::Lookup<bool>("iomanager.uring.multishot_recv", true, "io_uring multishot recv for hooked stream reads");
+    static ConfigVar<uint32_t>::ptr g_uring_recv_buffers =
+        Config::Lookup<uint32_t>("iomanager.uring.recv_buffers", 256, "io_uring provided buffers for multishot recv, power of 2");
+    static ConfigVar<uint32_t>::ptr g_uring_recv_buffer_size =
+        Config::Lookup<uint32_t>("iomanager.uring.recv_buffer_size", 4096, "io_uring provided buffer size");
+    static ConfigVar<uint32_t>::ptr g_uring_recv_max_chunks =
+        Config::Lookup<uint32_t>("iomanager.uring.recv_max_chunks", 4, "multishot recv chunks buffered per socket before the recv is cancelled");
+
+    /**
+     * io_uring 请求的 user_data
+     * 低 2 位为类型, 第 2 位为子类型(poll: 0 读 1 写, multishot: 0 accept 1 recv),
+     * 3-31 位为 fd, 高 32 位为序号. URING_IO 类型为 UringRequest 的地址
+     */
+    enum UringKind
+    {
+        URING_IGNORE = 0,
+        URING_POLL = 1,
+        URING_MULTISHOT = 2,
+        URING_IO = 3,
+    };
+
+    static uint64_t UringEncode(uint32_t seq, int fd, int sub, UringKind kind)
+    {
+        return ((uint64_t)seq << 32) | ((uint64_t)(uint32_t)fd << 3) | ((uint64_t)sub << 2) | kind;
+    }
+
+    /**
+     * @brief 直接提交的读写请求, 保存在发起请求的协程栈上
+     */
+    struct UringRequest
+    {
+        Fiber::ptr fiber;
+        Scheduler *scheduler = nullptr;
+        int res = 0;
+        // 被 cancelEvent 取消
+        bool cancelled = false;
+        __kernel_timespec ts;
+    };
 #if 1
     IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event)
     {
@@ -30,18 +154,23 @@ namespace sylar
         ctx.fiber.reset();
         ctx.cb = nullptr;
     }
-    void IOManager::FdContext::triggerEvent(IOManager::Event event)
+    void IOManager::FdContext::triggerEvent(IOManager::Event event, uint64_t wake_ns)
     {
         SYLAR_ASSERT(events & event);
         events = (Event)(events & ~event);
         EventContext &ctx = getContext(event);
+        // 同一线程上的唤醒直接放入 next 槽位, 跳过全局队列
         if (ctx.cb)
         {
-            ctx.scheduler->schedule(&ctx.cb);
+            ctx.scheduler->scheduleNext(&ctx.cb);
         }
         else
         {
-            ctx.scheduler->schedule(&ctx.fiber);
+            if (wake_ns)
+            {
+                ctx.fiber->setWakeTime(wake_ns);
+            }
+            ctx.scheduler->scheduleNext(&ctx.fiber);
         }
 
         ctx.scheduler = nullptr;
@@ -90,8 +219,43 @@ namespace sylar
         // 在文件描述符epfd所引用的epoll实例上注册目标文件描述符fd，并将事件事件与内部文件链接到fd
         rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
         SYLAR_ASSERT(!rt);
-        // 设置 m_fdContexts大小基础为32个
-        contextResize(32);
+        // 定时器由 timerfd 唤醒, epoll_wait 的毫秒超时只作为兜底
+        m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_timerFd < 0)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "timerfd_create errno=" << errno << " errstr=" << strerror(errno)
+                                      << " name=" << name << " fallback to epoll_wait timeout";
+        }
+        else
+        {
+            event.data.fd = m_timerFd;
+            rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_timerFd, &event);
+            SYLAR_ASSERT(!rt);
+        }
+        for (int i = 0; i < FD_MAX_CHUNKS; ++i)
+        {
+            m_fdChunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+        m_epollBatch = s_epoll_batch;
+        m_busyPoll = g_busy_poll->getValue();
+        m_busyStartNs = GetMonotonicNS();
+
+        if (g_iomanager_backend->getValue() == "io_uring" && !initUring())
+        {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring unavailable, name=" << name << " fallback to epoll";
+        }
+        if (g_iomanager_multi_reactor->getValue())
+        {
+            if (m_ring)
+            {
+                SYLAR_LOG_WARN(g_logger) << "iomanager.multi_reactor ignored by io_uring backend, name=" << name;
+            }
+            else
+            {
+                // 每个工作线程(包括 use_caller 的线程)一个 reactor
+                initReactors(m_threadCount + (m_rootThreadId != -1 ? 1 : 0));
+            }
+        }
 
         // Scheduler 中的start()
         start();
@@ -105,52 +269,345 @@ namespace sylar
         close(m_epfd);
         close(m_tickleFds[0]);
         close(m_tickleFds[1]);
+        if (m_timerFd >= 0)
+        {
+            close(m_timerFd);
+        }
+        for (Reactor *r : m_reactors)
+        {
+            close(r->epfd);
+            close(r->tickleFds[0]);
+            close(r->tickleFds[1]);
+            if (r->timerFd >= 0)
+            {
+                close(r->timerFd);
+            }
+            delete r;
+        }
+        // 关闭 ring 时内核取消所有未完成的请求
+        m_ring.reset();
         // 释放内存
-        for (size_t i = 0; i < m_fdContexts.size(); ++i)
+        for (int i = 0; i < FD_MAX_CHUNKS; ++i)
         {
-            if (m_fdContexts[i])
+            FdChunk *chunk = m_fdChunks[i].load(std::memory_order_relaxed);
+            if (!chunk)
+            {
+                continue;
+            }
+            for (int j = 0; j < FD_CHUNK_SIZE; ++j)
             {
-                delete m_fdContexts[i];
+                FdContext *fd_ctx = chunk->ctxs[j].load(std::memory_order_relaxed);
+                if (!fd_ctx)
+                {
+                    continue;
+                }
+                if (fd_ctx->uring)
+                {
+                    for (int fd : fd_ctx->uring->accepted)
+                    {
+                        close_f(fd);
+                    }
+                }
+                delete fd_ctx;
             }
+            delete chunk;
         }
     }
 
-    void IOManager::contextResize(size_t size)
+    thread_local IOManager::Reactor *IOManager::t_reactor = nullptr;
+
+    void IOManager::initReactors(size_t count)
     {
-        m_fdContexts.resize(size);
-        for (size_t i = 0; i < m_fdContexts.size(); ++i)
+        for (size_t i = 0; i < count; ++i)
         {
-            // 为空就要初始化一个fdContext
-            if (!m_fdContexts[i])
+            Reactor *r = new Reactor;
+            r->epfd = epoll_create(5000);
+            SYLAR_ASSERT(r->epfd > 0);
+            int rt = pipe(r->tickleFds);
+            SYLAR_ASSERT(!rt);
+            rt = fcntl(r->tickleFds[0], F_SETFL, O_NONBLOCK);
+            SYLAR_ASSERT(!rt);
+            epoll_event event;
+            memset(&event, 0, sizeof(epoll_event));
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = r->tickleFds[0];
+            rt = epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->tickleFds[0], &event);
+            SYLAR_ASSERT(!rt);
+            if (m_timerFd >= 0)
+            {
+                // 所有 reactor 共用一个 timerfd, 到期时只唤醒一个正在等待的 reactor
+                event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+                event.data.fd = m_timerFd;
+                rt = epoll_ctl(r->epfd, EPOLL_CTL_ADD, m_timerFd, &event);
+                SYLAR_ASSERT(!rt);
+            }
+            if (g_iomanager_local_timers->getValue())
             {
-                m_fdContexts[i] = new FdContext;
-                m_fdContexts[i]->fd = i;
+                // 工作线程自己的定时器只由自己的 timerfd 唤醒, 非工作线程加入的定时器仍在共用的管理器中
+                r->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+                if (r->timerFd < 0)
+                {
+                    SYLAR_LOG_ERROR(g_logger) << "timerfd_create errno=" << errno << " errstr=" << strerror(errno)
+                                              << " name=" << getName() << " reactor timers disabled";
+                }
+                else
+                {
+                    event.events = EPOLLIN | EPOLLET;
+                    event.data.fd = r->timerFd;
+                    rt = epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->timerFd, &event);
+                    SYLAR_ASSERT(!rt);
+                    r->timers.reset(new ReactorTimers(this, r));
+                }
             }
+            m_reactors.push_back(r);
         }
+        SYLAR_LOG_INFO(g_logger) << "iomanager name=" << getName() << " multi_reactor=" << count;
+    }
+
+    IOManager::Reactor *IOManager::getThisReactor() const
+    {
+        return Scheduler::GetThis() == this ? t_reactor : nullptr;
+    }
+
+    TimerManager *IOManager::getThreadTimerManager()
+    {
+        Reactor *r = getThisReactor();
+        return r ? r->timers.get() : nullptr;
+    }
+
+    void IOManager::ReactorTimers::onRemoteTimerOp()
+    {
+        // 所属线程不在 epoll_wait 中时, 会在下一次等待之前的 stopping 里处理
+        if (m_reactor->idle)
+        {
+            m_iom->tickleReactor(m_reactor);
+        }
+    }
+
+    IOManager::Reactor *IOManager::pickReactor()
+    {
+        Reactor *r = getThisReactor();
+        if (r)
+        {
+            return r;
+        }
+        // use_caller 时最后一个 reactor 属于调用线程, 它只在 stop() 中进入 idle, 之前注册在上面的句柄没有线程等待
+        size_t workers = m_reactors.size() - (m_rootThreadId != -1 ? 1 : 0);
+        if (!workers)
+        {
+            return m_reactors[0];
+        }
+        // 不是工作线程, 在已经有线程等待的 reactor 中轮询;
+        // 工作线程都还没进入过 idle 时在工作线程的 reactor 中轮询, 它们马上会被认领
+        size_t claimed = m_reactorClaimed;
+        size_t n = claimed ? std::min(claimed, workers) : workers;
+        return m_reactors[m_reactorNext++ % n];
+    }
+
+    // FdManager 中句柄的创建次数, 不由 FdManager 管理的句柄为 0
+    static uint32_t FdGeneration(int fd)
+    {
+        FdCtx *ctx = FdMgr::GetInstance()->get(fd);
+        return ctx ? ctx->getGeneration() : 0;
+    }
+
+    bool IOManager::registerFd(FdContext *fd_ctx)
+    {
+        int epfd = fd_ctx->reactor ? fd_ctx->reactor->epfd : m_epfd;
+        epoll_event epevent;
+        epevent.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        epevent.data.ptr = fd_ctx;
+        int rt = epoll_ctl(epfd, EPOLL_CTL_ADD, fd_ctx->fd, &epevent);
+        if (rt && errno != EEXIST)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ","
+                                      << EPOLL_CTL_ADD << "," << fd_ctx->fd << "," << epevent.events << "):"
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
+        fd_ctx->registered = true;
+        fd_ctx->generation = FdGeneration(fd_ctx->fd);
+        if (rt)
+        {
+            // 之前的注册仍然有效
+            return true;
+        }
+        if (m_busyPoll && s_busy_poll_socket_usec)
+        {
+            // 让内核在读和 epoll 时忙轮询网卡队列, 不是 socket 或者权限不足时忽略
+            int usec = s_busy_poll_socket_usec;
+            if (setsockopt(fd_ctx->fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) && errno != ENOTSOCK)
+            {
+                SYLAR_LOG_DEBUG(g_logger) << "setsockopt(" << fd_ctx->fd << ", SO_BUSY_POLL, " << usec
+                                          << ") errno=" << errno << " errstr=" << strerror(errno);
+            }
+        }
+        return true;
+    }
+
+    void IOManager::postReactor(Reactor *reactor, FdContext *fd_ctx)
+    {
+        bool wake = false;
+        {
+            MutexType::Lock lock(reactor->mutex);
+            wake = reactor->mailbox.empty();
+            reactor->mailbox.push_back(fd_ctx);
+        }
+        // 只在 mailbox 由空变为非空时写管道, 所属线程忙时管道也不会被写满
+        if (wake)
+        {
+            tickleReactor(reactor);
+        }
+    }
+
+    void IOManager::drainMailbox(Reactor *reactor)
+    {
+        std::vector<FdContext *> mailbox;
+        {
+            MutexType::Lock lock(reactor->mutex);
+            mailbox.swap(reactor->mailbox);
+        }
+        for (FdContext *fd_ctx : mailbox)
+        {
+            FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            // 转发之后句柄可能已经被 cancelAll 并绑定到其他 reactor
+            if (fd_ctx->reactor != reactor || fd_ctx->registered)
+            {
+                continue;
+            }
+            if (!registerFd(fd_ctx))
+            {
+                // 注册失败, 与 addEvent 直接失败一样不再等待, 唤醒等待者由其重试
+                if (fd_ctx->events & READ)
+                {
+                    fd_ctx->triggerEvent(READ);
+                    pendingDone();
+                }
+                if (fd_ctx->events & WRITE)
+                {
+                    fd_ctx->triggerEvent(WRITE);
+                    pendingDone();
+                }
+            }
+        }
+    }
+
+    void IOManager::tickleReactor(Reactor *reactor)
+    {
+        m_tickleSent.fetch_add(1, std::memory_order_relaxed);
+        int rt = write(reactor->tickleFds[1], "T", 1);
+        SYLAR_ASSERT(rt == 1);
+    }
+
+    bool IOManager::initUring()
+    {
+        std::unique_ptr<IoUring> ring(new IoUring);
+        if (!ring->init(g_uring_entries->getValue()))
+        {
+            return false;
+        }
+        // ring 的句柄挂在 epoll 上, 有完成事件时唤醒 idle, 与 tickle 和定时器共用一个等待点
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = ring->getFd();
+        int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, ring->getFd(), &event);
+        if (rt)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", add ring fd "
+                                      << ring->getFd() << ") errno=" << errno;
+            return false;
+        }
+        m_submitBatch = std::max(1u, g_uring_submit_batch->getValue());
+        m_multishotAccept = g_uring_multishot_accept->getValue();
+        m_multishotRecv = g_uring_multishot_recv->getValue();
+        m_recvMaxChunks = std::max(1u, g_uring_recv_max_chunks->getValue());
+        if (m_multishotRecv && !ring->setupBufRing(0, g_uring_recv_buffers->getValue(),
+                                                   g_uring_recv_buffer_size->getValue()))
+        {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring provided buffers unavailable, multishot recv disabled";
+            m_multishotRecv = false;
+        }
+        m_ring.swap(ring);
+        SYLAR_LOG_INFO(g_logger) << "iomanager name=" << getName() << " backend=io_uring fd=" << m_ring->getFd();
+        return true;
+    }
+
+    IOManager::FdContext *IOManager::getFdContext(int fd, bool auto_create)
+    {
+        if (fd < 0 || fd >= FD_MAX_CHUNKS * FD_CHUNK_SIZE)
+        {
+            return nullptr;
+        }
+        std::atomic<FdChunk *> &slot = m_fdChunks[fd >> FD_CHUNK_SHIFT];
+        FdChunk *chunk = slot.load(std::memory_order_acquire);
+        if (!chunk)
+        {
+            if (!auto_create)
+            {
+                return nullptr;
+            }
+            // 多个线程同时扩容时只有一个能装上, 其他的释放自己的分块
+            FdChunk *new_chunk = new FdChunk();
+            if (slot.compare_exchange_strong(chunk, new_chunk, std::memory_order_acq_rel))
+            {
+                chunk = new_chunk;
+            }
+            else
+            {
+                delete new_chunk;
+            }
+        }
+        std::atomic<FdContext *> &item = chunk->ctxs[fd & (FD_CHUNK_SIZE - 1)];
+        FdContext *fd_ctx = item.load(std::memory_order_acquire);
+        if (!fd_ctx && auto_create)
+        {
+            FdContext *new_ctx = new FdContext;
+            new_ctx->fd = fd;
+            if (item.compare_exchange_strong(fd_ctx, new_ctx, std::memory_order_acq_rel))
+            {
+                fd_ctx = new_ctx;
+            }
+            else
+            {
+                delete new_ctx;
+            }
+        }
+        return fd_ctx;
     }
 
-    // 1 success, 0 retry, -1 error
     int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
     {
-        FdContext *fd_ctx = nullptr;
-        RWMutexType::ReadLock lock(m_mutex);
-        if ((int)m_fdContexts.size() > fd)
+        return doAddEvent(fd, event, cb, false);
+    }
+
+    int IOManager::tryAddEvent(int fd, Event event, std::function<void()> cb)
+    {
+        return doAddEvent(fd, event, cb, true);
+    }
+
+    // 1 success, 0 retry, -1 error
+    int IOManager::doAddEvent(int fd, Event event, std::function<void()> &cb, bool try_add)
+    {
+        if (m_cancelling)
         {
-            fd_ctx = m_fdContexts[fd];
-            // 解 读锁
-            lock.unlock();
+            // drain 超时之后不再等待新的事件
+            errno = ECANCELED;
+            return -1;
         }
-        else
+        FdContext *fd_ctx = getFdContext(fd, true);
+        if (!fd_ctx)
         {
-            // 解 读锁
-            lock.unlock();
-            // 上 写锁
-            RWMutexType::WriteLock lock2(m_mutex);
-            contextResize(fd * 1.5);
-            fd_ctx = m_fdContexts[fd];
+            SYLAR_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range";
+            return -1;
         }
 
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+        if ((fd_ctx->events & event) && try_add)
+        {
+            errno = EEXIST;
+            return -1;
+        }
         if (fd_ctx->events & event)
         {
             SYLAR_LOG_ERROR(g_logger) << "addEvent assert fd=" << fd
@@ -159,20 +616,31 @@ namespace sylar
             SYLAR_ASSERT(!(fd_ctx->events & event));
         }
 
-        // 如果是NONE，那就是EPOLL_CTL_ADD(添加事件)，如果不是那就是EPOLL_CTL_MOD(修改事件)
-        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-        epoll_event epevent;
-        epevent.events = EPOLLET | fd_ctx->events | event;
-        epevent.data.ptr = fd_ctx;
-        // epevent.data.fd = fd;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+        // epoll 后端: 句柄第一次被等待时注册一次 EPOLLIN|EPOLLOUT|EPOLLET, 直到 cancelAll
+        bool post = false;
+        if (!m_ring && fd_ctx->registered && fd_ctx->generation != FdGeneration(fd))
         {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ","
-                                      << op << "," << fd << "," << epevent.events << "):"
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return -1;
+            // 句柄在 cancelAll 之外被关闭, 句柄号又被 hook 的 socket/accept/dup/open 复用,
+            // 旧的注册随关闭从 epoll 中移除, 锁存的就绪状态也属于旧句柄
+            SYLAR_LOG_DEBUG(g_logger) << "fd=" << fd << " reused after close outside cancelAll, register again";
+            fd_ctx->registered = false;
+            fd_ctx->ready = NONE;
+        }
+        if (!m_ring && !fd_ctx->registered)
+        {
+            if (!m_reactors.empty() && !fd_ctx->reactor)
+            {
+                // 句柄注册在第一个等待它的线程的 reactor 上
+                fd_ctx->reactor = pickReactor();
+            }
+            if (fd_ctx->reactor && fd_ctx->reactor != getThisReactor())
+            {
+                post = true;
+            }
+            else if (!registerFd(fd_ctx))
+            {
+                return -1;
+            }
         }
 
         // 添加事件
@@ -187,7 +655,7 @@ namespace sylar
         if (cb)
         {
             // 如果是fun，那么就执行fun
-            SYLAR_LOG_INFO(g_logger) << "cb";
+            SYLAR_LOG_DEBUG(g_logger) << "cb";
             event_ctx.cb.swap(cb);
             // sylar::Scheduler::schedule(event_ctx.cb);
         }
@@ -196,6 +664,33 @@ namespace sylar
             // 如果不是fun，那么就执行fiber
             event_ctx.fiber = Fiber::GetThis();
             SYLAR_ASSERT(event_ctx.fiber->getState() == Fiber::EXEC);
+            event_ctx.fiber->setWait(fd, event);
+        }
+        if (post)
+        {
+            // 由所属线程完成注册
+            postReactor(fd_ctx->reactor, fd_ctx);
+        }
+        else if (fd_ctx->ready & event)
+        {
+            // 等待之前已经锁存了就绪状态, 消耗掉并直接唤醒, 不需要进入内核
+            fd_ctx->ready &= ~event;
+            fd_ctx->triggerEvent(event);
+            pendingDone();
+        }
+        if (m_ring)
+        {
+            UringContext *uc = fd_ctx->uring.get();
+            if (event == READ && uc && (!uc->chunks.empty() || uc->eof || uc->recvError))
+            {
+                // 数据已经被 multishot recv 收进缓冲区, poll 不会再触发, 直接唤醒
+                fd_ctx->triggerEvent(READ);
+                pendingDone();
+            }
+            else
+            {
+                uringArmPoll(fd_ctx, event);
+            }
         }
         return 0;
     }
@@ -203,15 +698,12 @@ namespace sylar
     // 删除事件
     bool IOManager::delEvent(int fd, Event event)
     {
-        RWMutexType::ReadLock lock(m_mutex);
-        if ((int)m_fdContexts.size() <= fd)
+        FdContext *fd_ctx = getFdContext(fd, false);
+        if (!fd_ctx)
         {
             return false;
         }
 
-        FdContext *fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
         if (!(fd_ctx->events & event))
         {
@@ -220,21 +712,13 @@ namespace sylar
 
         // ~ 操作是 非
         Event new_events = (Event)(fd_ctx->events & ~event);
-        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event epevent;
-        epevent.events = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+        // epoll 后端的注册是持久的, 只修改用户态的状态
+        if (m_ring)
         {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ","
-                                      << op << "," << fd << "," << epevent.events << "):"
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return false;
+            uringRemovePoll(fd_ctx, event);
         }
 
-        --m_pendingEventCount;
+        pendingDone();
         fd_ctx->events = new_events;
         FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
         fd_ctx->resetContext(event_ctx);
@@ -243,119 +727,365 @@ namespace sylar
     // 取消事件， 将事件需要一定条件要出发，并将该事件强制触发掉
     bool IOManager::cancelEvent(int fd, Event event)
     {
-        RWMutexType::ReadLock lock(m_mutex);
-        if ((int)m_fdContexts.size() <= fd)
+        FdContext *fd_ctx = getFdContext(fd, false);
+        if (!fd_ctx)
         {
             return false;
         }
 
-        FdContext *fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+        // io_uring 后端直接提交的读写不经过 events, 单独取消
+        bool cancelled = m_ring && uringCancelRequests(fd_ctx, event);
         if (!(fd_ctx->events & event))
         {
-            return false;
+            return cancelled;
         }
 
-        // ~ 操作是 非
-        Event new_events = (Event)(fd_ctx->events & ~event);
-        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event epevent;
-        epevent.events = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+        if (m_ring)
         {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ","
-                                      << op << "," << fd << "," << epevent.events << "):"
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return false;
+            uringRemovePoll(fd_ctx, event);
         }
 
         // 触发事件后，取消掉事件
         fd_ctx->triggerEvent(event);
-        --m_pendingEventCount;
+        pendingDone();
         return true;
     }
     // 取消一个句柄下的全部事件
     bool IOManager::cancelAll(int fd)
     {
-        RWMutexType::ReadLock lock(m_mutex);
-        if ((int)m_fdContexts.size() <= fd)
+        FdContext *fd_ctx = getFdContext(fd, false);
+        if (!fd_ctx)
         {
             return false;
         }
 
-        FdContext *fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-        if (!fd_ctx->events)
+        if (m_ring)
         {
-            return false;
+            // 取消句柄上所有的 poll/读写/multishot 请求, 必须在 close 之前完成
+            uringCancelFd(fd_ctx);
         }
-
-        // ~ 操作是 非
-        int op = EPOLL_CTL_DEL;
-        epoll_event epevent;
-        epevent.events = 0;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+        if (fd_ctx->registered)
+        {
+            // 句柄即将关闭, 移除注册并清掉锁存的就绪状态,
+            // 多 reactor 模式下同时解除绑定, 复用该句柄号的新连接重新选择 reactor
+            int epfd = fd_ctx->reactor ? fd_ctx->reactor->epfd : m_epfd;
+            epoll_event epevent;
+            memset(&epevent, 0, sizeof(epevent));
+            int rt = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &epevent);
+            if (rt && errno != ENOENT && errno != EBADF)
+            {
+                SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ","
+                                          << EPOLL_CTL_DEL << "," << fd << "):"
+                                          << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            }
+            fd_ctx->registered = false;
+        }
+        fd_ctx->ready = NONE;
+        fd_ctx->reactor = nullptr;
+        if (!fd_ctx->events)
         {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ","
-                                      << op << "," << fd << "," << epevent.events << "):"
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
             return false;
         }
 
         if (fd_ctx->events & READ)
         {
             fd_ctx->triggerEvent(READ);
-            --m_pendingEventCount;
+            pendingDone();
         }
         if (fd_ctx->events & WRITE)
         {
             fd_ctx->triggerEvent(WRITE);
-            --m_pendingEventCount;
+            pendingDone();
         }
 
         SYLAR_ASSERT(fd_ctx->events == 0);
 
         return true;
     }
-    // 获取当前的 IOManager
-    IOManager *IOManager::GetThis()
+    struct IOManager::DrainWaiter
     {
-        return dynamic_cast<IOManager *>(Scheduler::GetThis());
-    }
+        // 在协程中等待时记下协程和调度器, 否则阻塞在信号量上
+        Fiber::ptr fiber;
+        Scheduler *scheduler = nullptr;
+        Semaphore sem;
+        // 已经被唤醒(计数降到目标或者超时), 只唤醒一次
+        bool done = false;
+    };
 
-    void IOManager::tickle()
+    void IOManager::pendingDone()
     {
-        // 是否还有空闲的线程，如果有则写入数据，并让空闲线程执行
-        if (!hasIdleThreads())
+        size_t n = --m_pendingEventCount;
+        if (m_drainWaiting && n <= m_drainTarget)
         {
-            return;
+            notifyDrain();
         }
-        // int __fd, const void *__buf, size_t __n;  return 实际写入数据的长度
-        int rt = write(m_tickleFds[1], "T", 1);
-        // SYLAR_LOG_INFO(g_logger) << "io tickle";
-        SYLAR_ASSERT(rt == 1);
     }
 
-    bool IOManager::stopping()
+    void IOManager::notifyDrain()
     {
-        // SYLAR_LOG_INFO(g_logger) << "m_pendingEventCount=" << m_pendingEventCount;
-        uint64_t timeout = 0;
-        return stopping(timeout);
+        MutexType::Lock lock(m_drainMutex);
+        for (auto &w : m_drainWaiters)
+        {
+            if (w->done)
+            {
+                continue;
+            }
+            w->done = true;
+            if (w->fiber)
+            {
+                w->scheduler->schedule(w->fiber);
+            }
+            else
+            {
+                w->sem.notify();
+            }
+        }
     }
-    bool IOManager::stopping(uint64_t &timeout)
+
+    void IOManager::wakeDrainWaiter(std::shared_ptr<DrainWaiter> waiter)
+    {
+        MutexType::Lock lock(m_drainMutex);
+        if (!waiter || waiter->done)
+        {
+            return;
+        }
+        waiter->done = true;
+        waiter->scheduler->schedule(waiter->fiber);
+    }
+
+    void IOManager::waitPending(size_t target, uint64_t timeout_ms)
+    {
+        std::shared_ptr<DrainWaiter> waiter(new DrainWaiter);
+        IOManager *iom = IOManager::GetThis();
+        // 和 hook 的 usleep 一样, 只在开启 hook 的协程中挂起协程
+        if (iom && is_hook_enable())
+        {
+            waiter->fiber = Fiber::GetThis();
+            waiter->scheduler = Scheduler::GetThis();
+        }
+        {
+            MutexType::Lock lock(m_drainMutex);
+            m_drainWaiters.push_back(waiter);
+            m_drainTarget = target;
+            m_drainWaiting = true;
+        }
+        bool wait = true;
+        if (m_pendingEventCount <= target)
+        {
+            // 已经满足了; 如果 pendingDone 抢先唤醒过, 仍然要等待以消耗掉那次唤醒
+            MutexType::Lock lock(m_drainMutex);
+            if (!waiter->done)
+            {
+                waiter->done = true;
+                wait = false;
+            }
+        }
+        if (wait)
+        {
+            if (waiter->fiber)
+            {
+                std::weak_ptr<DrainWaiter> weak(waiter);
+                Timer::ptr timer = iom->addConditionTimer(
+                    timeout_ms, [this, weak]()
+                    { wakeDrainWaiter(weak.lock()); },
+                    weak);
+                Fiber::YieldToHold();
+                timer->cancel();
+            }
+            else if (!waiter->sem.waitFor(timeout_ms))
+            {
+                // 超时之后 notifyDrain 不会再投递
+                MutexType::Lock lock(m_drainMutex);
+                waiter->done = true;
+            }
+        }
+        MutexType::Lock lock(m_drainMutex);
+        m_drainWaiters.remove(waiter);
+        m_drainWaiting = !m_drainWaiters.empty();
+    }
+
+    size_t IOManager::countListenWaits()
+    {
+        size_t n = 0;
+        for (int i = 0; i < FD_MAX_CHUNKS; ++i)
+        {
+            FdChunk *chunk = m_fdChunks[i].load(std::memory_order_acquire);
+            if (!chunk)
+            {
+                continue;
+            }
+            for (int j = 0; j < FD_CHUNK_SIZE; ++j)
+            {
+                FdContext *fd_ctx = chunk->ctxs[j].load(std::memory_order_acquire);
+                if (!fd_ctx)
+                {
+                    continue;
+                }
+                FdContext::MutexType::Lock lock(fd_ctx->mutex);
+                if (fd_ctx->uring)
+                {
+                    n += fd_ctx->uring->acceptWaiters.size();
+                }
+                if (fd_ctx->events & READ)
+                {
+                    int val = 0;
+                    socklen_t len = sizeof(val);
+                    if (getsockopt(fd_ctx->fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) == 0 && val)
+                    {
+                        ++n;
+                    }
+                }
+            }
+        }
+        return n;
+    }
+
+    bool IOManager::drain(uint64_t timeout_ms, DrainResult *result)
+    {
+        SYLAR_ASSERT2(!m_cancelling, "drain after a timed out drain, the iomanager can only stop");
+        DrainResult tmp;
+        DrainResult &res = result ? *result : tmp;
+        res = DrainResult();
+        res.pending = m_pendingEventCount;
+        uint64_t start = GetMonotonicMS();
+        SYLAR_LOG_INFO(g_logger) << "drain name=" << getName() << " pending=" << res.pending
+                                 << " timeout=" << timeout_ms << "ms";
+        while (true)
+        {
+            // 监听句柄上的等待随时会重新加入, 每次唤醒后重新统计
+            size_t listen = countListenWaits();
+            if (m_pendingEventCount <= listen)
+            {
+                res.usedMs = GetMonotonicMS() - start;
+                SYLAR_LOG_INFO(g_logger) << res.toString();
+                return true;
+            }
+            uint64_t used = GetMonotonicMS() - start;
+            if (used >= timeout_ms)
+            {
+                break;
+            }
+            waitPending(listen, timeout_ms - used);
+        }
+
+        // 先拒绝新的等待, 再唤醒已有的, 被唤醒的协程重试时不会再挂起
+        m_cancelling = true;
+        res.timedOut = true;
+        std::vector<int> fds;
+        for (int i = 0; i < FD_MAX_CHUNKS; ++i)
+        {
+            FdChunk *chunk = m_fdChunks[i].load(std::memory_order_acquire);
+            if (!chunk)
+            {
+                continue;
+            }
+            for (int j = 0; j < FD_CHUNK_SIZE; ++j)
+            {
+                FdContext *fd_ctx = chunk->ctxs[j].load(std::memory_order_acquire);
+                if (!fd_ctx)
+                {
+                    continue;
+                }
+                FdContext::MutexType::Lock lock(fd_ctx->mutex);
+                int events = fd_ctx->events;
+                if (fd_ctx->uring)
+                {
+                    if (!fd_ctx->uring->acceptWaiters.empty() || !fd_ctx->uring->recvWaiters.empty())
+                    {
+                        events |= READ;
+                    }
+                    if (fd_ctx->uring->inflight)
+                    {
+                        events |= READ | WRITE;
+                    }
+                }
+                if (events)
+                {
+                    res.cancelled.push_back(std::make_pair(fd_ctx->fd, events));
+                    fds.push_back(fd_ctx->fd);
+                }
+            }
+        }
+        for (int fd : fds)
+        {
+            cancelAll(fd);
+        }
+        res.usedMs = GetMonotonicMS() - start;
+        SYLAR_LOG_WARN(g_logger) << res.toString();
+        return false;
+    }
+
+    std::string IOManager::DrainResult::toString() const
+    {
+        std::stringstream ss;
+        ss << "[DrainResult timed_out=" << timedOut << " used=" << usedMs << "ms pending="
+           << pending << " cancelled=" << cancelled.size();
+        for (auto &i : cancelled)
+        {
+            ss << " " << i.first << ":" << (i.second & READ ? "R" : "") << (i.second & WRITE ? "W" : "");
+        }
+        ss << "]";
+        return ss.str();
+    }
+
+    // 获取当前的 IOManager
+    IOManager *IOManager::GetThis()
+    {
+        return dynamic_cast<IOManager *>(Scheduler::GetThis());
+    }
+
+    void IOManager::tickle()
+    {
+        // 忙轮询模式下工作线程从不阻塞, 不需要唤醒
+        if (m_busyPoll)
+        {
+            return;
+        }
+        // 是否还有空闲的线程，如果有则写入数据，并让空闲线程执行
+        if (!hasIdleThreads())
+        {
+            return;
+        }
+        if (!m_reactors.empty())
+        {
+            // 唤醒一个阻塞在 epoll_wait 中的 reactor, 清掉 idle 标记避免连续的 tickle 唤醒同一个
+            size_t n = m_reactors.size();
+            size_t start = m_reactorNext++;
+            for (size_t i = 0; i < n; ++i)
+            {
+                Reactor *r = m_reactors[(start + i) % n];
+                if (r->idle.exchange(false))
+                {
+                    tickleReactor(r);
+                    return;
+                }
+            }
+            return;
+        }
+        m_tickleSent.fetch_add(1, std::memory_order_relaxed);
+        // int __fd, const void *__buf, size_t __n;  return 实际写入数据的长度
+        int rt = write(m_tickleFds[1], "T", 1);
+        // SYLAR_LOG_INFO(g_logger) << "io tickle";
+        SYLAR_ASSERT(rt == 1);
+    }
+
+    bool IOManager::stopping()
+    {
+        // SYLAR_LOG_INFO(g_logger) << "m_pendingEventCount=" << m_pendingEventCount;
+        uint64_t timeout = 0;
+        return stopping(timeout);
+    }
+    bool IOManager::stopping(uint64_t &timeout)
     {
         // 查看是否还有定时器任务未完成
-        timeout = getNextTimer();
+        timeout = getNextTimerUs();
+        Reactor *r = getThisReactor();
+        if (r && r->timers)
+        {
+            timeout = std::min(timeout, r->timers->getNextTimerUs());
+        }
         // 定时器没有了任务，并且当前event也没有了
         return timeout == ~0ull && m_pendingEventCount == 0 && Scheduler::stopping();
     }
@@ -364,41 +1094,105 @@ namespace sylar
     void IOManager::idle()
     {
         SYLAR_LOG_INFO(g_logger) << " in idle";
-        // 创建一个events类型的数组
-        const uint64_t MAX_EVNETS = 64;
-        epoll_event *events = new epoll_event[MAX_EVNETS]();
-        // 让智能指针指向该数组，用于内存释放
-        std::shared_ptr<epoll_event> shared_event(events, [](epoll_event *ptr)
-                                                  { delete[] ptr; });
+        // 每个线程一个 events 数组, 一次 epoll_wait 返回满了就翻倍, 直到 iomanager.epoll.max_batch
+        std::vector<epoll_event> events(s_epoll_batch);
+        // 多 reactor 模式下认领一个 reactor, 之后只等待它的 epoll
+        Reactor *reactor = nullptr;
+        if (!m_reactors.empty())
+        {
+            size_t idx = m_reactors.size() - 1;
+            if (GetThreadId() != m_rootThreadId)
+            {
+                // 工作线程按进入 idle 的顺序认领前面的 reactor
+                idx = m_reactorClaimed++;
+                SYLAR_ASSERT(idx < m_reactors.size() - (m_rootThreadId != -1 ? 1 : 0));
+            }
+            reactor = m_reactors[idx];
+            reactor->threadId = GetThreadId();
+            if (reactor->timers)
+            {
+                reactor->timers->setOwner();
+            }
+            t_reactor = reactor;
+        }
+        int epfd = reactor ? reactor->epfd : m_epfd;
+        int tickle_fd = reactor ? reactor->tickleFds[0] : m_tickleFds[0];
+        LoopCounters &loop = reactor ? reactor->loop : m_loop;
+        // 上一次 epoll_wait 返回的时间, 到下一次调用之间为这一轮处理事件和运行协程的时间
+        uint64_t last_wake = 0;
         while (true)
         {//基于特征空间的递归框架将改善群智能算法在基因选择上的性能
+            // 先标记 idle 再检查是否结束, 保证 stop 时的 tickle 不会丢
+            if (reactor)
+            {
+                reactor->idle = true;
+            }
             // 如果结束
             uint64_t next_timeout = 0;
             if (stopping(next_timeout))
             {
                 SYLAR_LOG_INFO(g_logger) << "name=" << Scheduler::getName()
                                          << "idle stopping exit";
+                if (reactor)
+                {
+                    reactor->idle = false;
+                    if (reactor->timers)
+                    {
+                        reactor->timers->releaseOwner();
+                    }
+                    t_reactor = nullptr;
+                }
+                ResetCachedClock();
+                // 最后一个事件可能在本线程完成, 唤醒其他还在等待的线程检查结束条件, 逐个传递
+                tickle();
                 break;
             }
             int rt = 0;
+            uint64_t wait_start = GetMonotonicNS();
+            if (last_wake)
+            {
+                checkLoopLag(loop, wait_start - last_wake);
+            }
+            if (m_busyPoll)
+            {
+                // 忙轮询: 不阻塞, 定时器在每一轮的 listExpiredCb 中检查
+                next_timeout = 0;
+            }
             // 如果没有结束
             do
             {
-
-                // 定时器，最多等待5000ms
-                static const int MAX_TIMEOUT = 3000;
-                if (next_timeout != ~0ull)
+                if (next_timeout && next_timeout != ~0ull && m_timerFd >= 0)
                 {
-                    next_timeout = (int)next_timeout > MAX_TIMEOUT ? MAX_TIMEOUT : next_timeout;
+                    // 由 timerfd 在定时器到期时唤醒
+                    armTimerFd();
+                    if (reactor && reactor->timers)
+                    {
+                        armReactorTimerFd(reactor);
+                    }
+                    next_timeout = s_idle_max_timeout;
                 }
-                else
+                else if (next_timeout != ~0ull)
+                {
+                    // 没有 timerfd 时退化为 epoll_wait 的毫秒超时, 向上取整避免忙等
+                    next_timeout = (next_timeout + 999) / 1000;
+                }
+                // 定时器，最多等待 iomanager.idle.max_timeout
+                next_timeout = std::min<uint64_t>(next_timeout, s_idle_max_timeout);
+
+                if (m_ring)
                 {
-                    next_timeout = MAX_TIMEOUT;
+                    // 批量提交积攒的 sqe, 已经有完成事件时不阻塞
+                    uringSubmit();
+                    if (m_ring->hasCqe())
+                    {
+                        next_timeout = 0;
+                    }
                 }
 
                 // 等待
                 // int epoll_wait(int __epfd, epoll_event *__events, int __maxevents, int __timeout)
-                rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)next_timeout);
+                // 工作线程开启了 hook, 直接调用原始的 epoll_wait, 否则会挂起 idle 协程自己
+                rt = epoll_wait_f(epfd, &events[0], events.size(), (int)next_timeout);
                 // SYLAR_LOG_INFO(g_logger) << "epoll_wait  rt = " << rt;
                 if (rt < 0 && errno == EINTR)//rt 小于0并且errno==EINTR是异常中断
                 {
@@ -410,12 +1204,46 @@ namespace sylar
                 }
             } while (true);
 
+            // 这一轮判断定时器到期读取缓存的时间
+            uint64_t wake_ns = UpdateCachedClock();
+            last_wake = wake_ns;
+            loop.blockedNs.fetch_add(wake_ns - wait_start, std::memory_order_relaxed);
+            if (rt >= 0)
+            {
+                recordBatch(loop, rt);
+            }
+            if (m_ring)
+            {
+                uringReap();
+            }
+            if (reactor)
+            {
+                reactor->idle = false;
+                drainMailbox(reactor);
+            }
+
             std::vector<std::function<void()>> cbs;
             listExpiredCb(cbs);
+            if (reactor && reactor->timers)
+            {
+                reactor->timers->listExpiredCb(cbs);
+            }
+            if (m_busyPoll)
+            {
+                m_busyPolls.fetch_add(1, std::memory_order_relaxed);
+                if (rt <= 0 && cbs.empty())
+                {
+                    // 空转的一轮计入忙轮询消耗的 cpu
+                    m_busyEmptyPolls.fetch_add(1, std::memory_order_relaxed);
+                    m_busySpinNs.fetch_add(GetMonotonicNS() - wait_start, std::memory_order_relaxed);
+                }
+            }
             // SYLAR_LOG_INFO(g_logger) << " cbs size "<< cbs.size(); 
             if (!cbs.empty())
             {
-                SYLAR_LOG_INFO(g_logger) << "on timer cbs.size=" << cbs.size();
+                loop.timerTicks.fetch_add(1, std::memory_order_relaxed);
+                loop.timerCbs.fetch_add(cbs.size(), std::memory_order_relaxed);
+                loop.timerHist[HistBucket(cbs.size())].fetch_add(1, std::memory_order_relaxed);
                 // 将所有任务都存入到调度器中
                 schedule(cbs.begin(), cbs.end());
                 cbs.clear();
@@ -426,12 +1254,32 @@ namespace sylar
                 epoll_event &event = events[i];
                 // SYLAR_LOG_INFO(g_logger) << "event fd = " << event.data.fd;
                 // 如果是读端
-                if (event.data.fd == m_tickleFds[0])
+                if (event.data.fd == tickle_fd)
                 {
                     uint8_t dummy[256];
-                    while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0)
+                    while (read(tickle_fd, dummy, sizeof(dummy)) > 0)
                         ;
-                    SYLAR_LOG_INFO(g_logger) << dummy;
+                    loop.tickles.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                // 到期的定时器已经在上面的 listExpiredCb 中处理
+                if (event.data.fd == m_timerFd)
+                {
+                    readTimerFd();
+                    continue;
+                }
+                if (reactor && event.data.fd == reactor->timerFd)
+                {
+                    uint64_t expirations = 0;
+                    if (read(reactor->timerFd, &expirations, sizeof(expirations)) > 0)
+                    {
+                        reactor->timerFdDeadline = 0;
+                    }
+                    continue;
+                }
+                // ring 的完成事件已经在 uringReap 中处理
+                if (m_ring && event.data.fd == m_ring->getFd())
+                {
                     continue;
                 }
                 // void* 类型的指针转化为其他类型 需要强制转化
@@ -439,9 +1287,9 @@ namespace sylar
                 FdContext::MutexType::Lock lock(fd_ctx->mutex);
                 if (event.events & (EPOLLERR | EPOLLHUP))
                 {
-                    event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+                    event.events |= EPOLLIN | EPOLLOUT;
                 }
-                
+
                 int real_events = NONE;
                 // 如果event.events 是IN，那么就要READ,因为是&操作，不都为1就为0
                 if (event.events & EPOLLIN)
@@ -453,40 +1301,33 @@ namespace sylar
                 {
                     real_events |= WRITE;
                 }
-                // 什么事件都没有
-                if ((fd_ctx->events & real_events) == NONE)
-                {
-                    continue;
-                }
-
-                int left_events = (fd_ctx->events & ~real_events);
-                int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-                event.events = EPOLLET | left_events;
-
-                int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-                if (rt2)
-                {
-                    SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ","
-                                              << op << "," << fd_ctx->fd << "," << event.events << "):"
-                                              << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
-                    continue;
-                }
-
+                // 注册是持久的, 不再 MOD/DEL. 没有等待者的就绪事件锁存起来, 留给下一次 addEvent
+                fd_ctx->ready |= real_events & ~fd_ctx->events;
+                real_events &= fd_ctx->events;
                 if (real_events & READ)
                 {
                     // 触发读事件
-                    SYLAR_LOG_INFO(g_logger) << "event fd = " << event.data.fd << " read event trigger";
-                    fd_ctx->triggerEvent(READ);
-                    --m_pendingEventCount;
+                    fd_ctx->triggerEvent(READ, wake_ns);
+                    pendingDone();
                 }
                 if (real_events & WRITE)
                 {
                     // 触发写事件
-                    SYLAR_LOG_INFO(g_logger) << "event fd = " << event.data.fd << " write event trigger";
-                    fd_ctx->triggerEvent(WRITE);
-                    --m_pendingEventCount;
+                    fd_ctx->triggerEvent(WRITE, wake_ns);
+                    pendingDone();
                 }
-
+            }
+            // 返回满了说明还有就绪的句柄没有取到, 扩大下一次的批量
+            if (rt == (int)events.size() && events.size() < s_epoll_max_batch)
+            {
+                events.resize(std::min<size_t>(events.size() * 2, s_epoll_max_batch));
+                uint32_t batch = m_epollBatch;
+                while (batch < events.size() && !m_epollBatch.compare_exchange_weak(batch, events.size()))
+                    ;
+            }
+            if (s_stat_dump_interval_ns)
+            {
+                checkDumpLoopStat(wake_ns);
             }
             Fiber::ptr cur = Fiber::GetThis();
             auto raw_cur = cur.get();
@@ -498,9 +1339,1032 @@ namespace sylar
         }
     }
 
-    void IOManager::onTimerInsertedAtFront()
+    IOManager::LoopCounters::LoopCounters()
+    {
+        for (int i = 0; i < EPOLL_HIST_BUCKETS; ++i)
+        {
+            eventHist[i] = 0;
+            timerHist[i] = 0;
+            resumeHist[i] = 0;
+        }
+    }
+
+    void IOManager::recordBatch(LoopCounters &loop, int n)
+    {
+        loop.waits.fetch_add(1, std::memory_order_relaxed);
+        loop.events.fetch_add(n, std::memory_order_relaxed);
+        loop.eventHist[HistBucket(n)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    IOManager::LoopCounters &IOManager::getThisLoop()
+    {
+        Reactor *r = getThisReactor();
+        return r ? r->loop : m_loop;
+    }
+
+    void IOManager::onFiberWake(uint64_t wake_ns)
+    {
+        uint64_t now = GetMonotonicNS();
+        uint64_t lat = now > wake_ns ? now - wake_ns : 0;
+        LoopCounters &loop = getThisLoop();
+        loop.resumes.fetch_add(1, std::memory_order_relaxed);
+        loop.resumeNs.fetch_add(lat, std::memory_order_relaxed);
+        loop.resumeHist[HistBucket(lat / 1000)].fetch_add(1, std::memory_order_relaxed);
+        AtomicMax(loop.resumeMaxNs, lat);
+    }
+
+    void IOManager::checkLoopLag(LoopCounters &loop, uint64_t iter_ns)
+    {
+        AtomicMax(loop.maxIterNs, iter_ns);
+        if (s_lag_threshold_ns && iter_ns > s_lag_threshold_ns)
+        {
+            loop.lagAlerts.fetch_add(1, std::memory_order_relaxed);
+            SYLAR_LOG_WARN(g_logger) << "event loop lag name=" << getName()
+                                     << " iteration=" << iter_ns / 1000000 << "ms threshold="
+                                     << s_lag_threshold_ns / 1000000 << "ms";
+        }
+    }
+
+    void IOManager::checkDumpLoopStat(uint64_t now_ns)
+    {
+        uint64_t last = m_lastDumpNs;
+        if (!last)
+        {
+            // 第一次只记录时间
+            m_lastDumpNs.compare_exchange_strong(last, now_ns);
+            return;
+        }
+        if (now_ns - last < s_stat_dump_interval_ns || !m_lastDumpNs.compare_exchange_strong(last, now_ns))
+        {
+            return;
+        }
+        SYLAR_LOG_INFO(g_logger) << dumpLoopStat();
+    }
+
+    static void AddLoopStat(IOManager::LoopStat &stat, const std::atomic<uint64_t> *event_hist,
+                            const std::atomic<uint64_t> *timer_hist, const std::atomic<uint64_t> *resume_hist)
+    {
+        for (int i = 0; i < IOManager::EPOLL_HIST_BUCKETS; ++i)
+        {
+            stat.eventHist[i] += event_hist[i];
+            stat.timerHist[i] += timer_hist[i];
+            stat.resumeHist[i] += resume_hist[i];
+        }
+    }
+
+    bool IOManager::getLoopStat(LoopStat &stat, int reactor) const
+    {
+        stat = LoopStat();
+        std::vector<const LoopCounters *> loops;
+        if (reactor >= 0)
+        {
+            if (reactor >= (int)m_reactors.size())
+            {
+                return false;
+            }
+            loops.push_back(&m_reactors[reactor]->loop);
+        }
+        else
+        {
+            loops.push_back(&m_loop);
+            for (Reactor *r : m_reactors)
+            {
+                loops.push_back(&r->loop);
+            }
+            stat.tickleSent = m_tickleSent;
+        }
+        for (const LoopCounters *l : loops)
+        {
+            stat.waits += l->waits;
+            stat.blockedNs += l->blockedNs;
+            stat.events += l->events;
+            stat.tickles += l->tickles;
+            stat.timerTicks += l->timerTicks;
+            stat.timerCbs += l->timerCbs;
+            stat.resumes += l->resumes;
+            stat.resumeNs += l->resumeNs;
+            stat.resumeMaxNs = std::max<uint64_t>(stat.resumeMaxNs, l->resumeMaxNs);
+            stat.maxIterNs = std::max<uint64_t>(stat.maxIterNs, l->maxIterNs);
+            stat.lagAlerts += l->lagAlerts;
+            AddLoopStat(stat, l->eventHist, l->timerHist, l->resumeHist);
+        }
+        return true;
+    }
+
+    static void DumpHist(std::ostream &os, const char *title, const uint64_t *hist)
+    {
+        bool first = true;
+        for (int i = 0; i < IOManager::EPOLL_HIST_BUCKETS; ++i)
+        {
+            if (!hist[i])
+            {
+                continue;
+            }
+            if (first)
+            {
+                os << "    " << title << ":";
+                first = false;
+            }
+            if (i == 0)
+            {
+                os << " 0";
+            }
+            else
+            {
+                os << " " << (1u << (i - 1)) << "-" << (1u << i) - 1;
+            }
+            os << "=" << hist[i];
+        }
+        if (!first)
+        {
+            os << std::endl;
+        }
+    }
+
+    static void DumpLoopStat(std::ostream &os, const IOManager::LoopStat &stat)
+    {
+        os << " waits=" << stat.waits << " blocked=" << stat.blockedNs / 1000000 << "ms"
+           << " events=" << stat.events << " tickles=" << stat.tickles
+           << " timer_ticks=" << stat.timerTicks << " timer_cbs=" << stat.timerCbs
+           << " resumes=" << stat.resumes;
+        if (stat.waits)
+        {
+            os << " events/wait=" << (double)stat.events / stat.waits;
+        }
+        if (stat.timerTicks)
+        {
+            os << " cbs/tick=" << (double)stat.timerCbs / stat.timerTicks;
+        }
+        if (stat.resumes)
+        {
+            os << " resume_avg=" << stat.resumeNs / stat.resumes / 1000.0 << "us"
+               << " resume_max=" << stat.resumeMaxNs / 1000 << "us";
+        }
+        os << " max_iter=" << stat.maxIterNs / 1000 << "us lag_alerts=" << stat.lagAlerts << std::endl;
+        DumpHist(os, "events/wait", stat.eventHist);
+        DumpHist(os, "timer cbs/tick", stat.timerHist);
+        DumpHist(os, "resume us", stat.resumeHist);
+    }
+
+    std::string IOManager::dumpLoopStat() const
+    {
+        std::stringstream ss;
+        LoopStat stat;
+        getLoopStat(stat);
+        ss << "[LoopStat name=" << getName() << " reactors=" << m_reactors.size()
+           << " tickle_sent=" << stat.tickleSent << "]" << std::endl;
+        ss << "  total";
+        DumpLoopStat(ss, stat);
+        for (size_t i = 0; i < m_reactors.size(); ++i)
+        {
+            getLoopStat(stat, i);
+            ss << "  reactor " << i << " thread=" << m_reactors[i]->threadId;
+            DumpLoopStat(ss, stat);
+        }
+        return ss.str();
+    }
+
+    void IOManager::getEpollStat(EpollStat &stat) const
+    {
+        LoopStat loop;
+        getLoopStat(loop);
+        stat.waits = loop.waits;
+        stat.events = loop.events;
+        stat.batch = m_epollBatch;
+        for (int i = 0; i < EPOLL_HIST_BUCKETS; ++i)
+        {
+            stat.hist[i] = loop.eventHist[i];
+        }
+    }
+
+    void IOManager::getSlackStat(SlackStat &stat) const
     {
-        tickle();
+        TimerManager::getSlackStat(stat);
+        for (auto r : m_reactors)
+        {
+            if (!r->timers)
+            {
+                continue;
+            }
+            SlackStat rs;
+            r->timers->getSlackStat(rs);
+            stat.timers += rs.timers;
+            stat.rounds += rs.rounds;
+            stat.wakeupsSaved += rs.wakeupsSaved;
+        }
+    }
+
+    void IOManager::getBusyPollStat(BusyPollStat &stat) const
+    {
+        stat.polls = m_busyPolls;
+        stat.emptyPolls = m_busyEmptyPolls;
+        stat.spinNs = m_busySpinNs;
+        stat.uptimeNs = GetMonotonicNS() - m_busyStartNs;
+        stat.threads = m_threadCount + (m_rootThreadId != -1 ? 1 : 0);
+    }
+
+    std::string IOManager::dumpBusyPollStat() const
+    {
+        BusyPollStat stat;
+        getBusyPollStat(stat);
+        std::stringstream ss;
+        ss << "[BusyPollStat name=" << getName() << " busy_poll=" << m_busyPoll
+           << " polls=" << stat.polls << " empty=" << stat.emptyPolls
+           << " spin=" << stat.spinNs / 1000000 << "ms threads=" << stat.threads;
+        if (stat.uptimeNs && stat.threads)
+        {
+            // 空转时间占全部工作线程时间的比例, 即为低延迟付出的 cpu
+            ss << " spin_cpu=" << 100.0 * stat.spinNs / ((double)stat.uptimeNs * stat.threads) << "%";
+        }
+        ss << "]";
+        return ss.str();
+    }
+
+    std::string IOManager::dumpEpollStat() const
+    {
+        EpollStat stat;
+        getEpollStat(stat);
+        std::stringstream ss;
+        ss << "[EpollStat name=" << getName() << " waits=" << stat.waits
+           << " events=" << stat.events << " batch=" << stat.batch;
+        if (stat.waits)
+        {
+            ss << " events/wait=" << (double)stat.events / stat.waits;
+        }
+        ss << "]" << std::endl;
+        for (int i = 0; i < EPOLL_HIST_BUCKETS; ++i)
+        {
+            if (!stat.hist[i])
+            {
+                continue;
+            }
+            if (i == 0)
+            {
+                ss << "    0";
+            }
+            else
+            {
+                ss << "    " << (1u << (i - 1)) << "-" << (1u << i) - 1;
+            }
+            ss << ": " << stat.hist[i] << std::endl;
+        }
+        return ss.str();
+    }
+
+    ssize_t IOManager::submitIo(uint8_t opcode, int fd, void *buf, size_t len, int flags,
+                                uint64_t timeout_ms, void *addr2)
+    {
+        SYLAR_ASSERT(m_ring);
+        if (m_cancelling)
+        {
+            errno = ECANCELED;
+            return -1;
+        }
+        FdContext *fd_ctx = getFdContext(fd, true);
+        if (!fd_ctx)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "submitIo fd=" << fd << " out of range";
+            errno = EBADF;
+            return -1;
+        }
+
+        UringRequest req;
+        req.fiber = Fiber::GetThis();
+        req.scheduler = this;
+        bool has_timeout = timeout_ms != ~0ull;
+        bool is_write = opcode == IORING_OP_WRITE || opcode == IORING_OP_SEND;
+        uint64_t user_data = (uint64_t)&req | URING_IO;
+        req.fiber->setWait(fd, is_write ? WRITE : READ);
+        uint32_t seq = 0;
+        {
+            // 持有句柄的锁直到请求进入提交队列, cancelEvent 的取消请求一定排在它之后
+            FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            if (!fd_ctx->uring)
+            {
+                fd_ctx->uring.reset(new UringContext);
+            }
+            ++fd_ctx->uring->inflight;
+            fd_ctx->uring->requests[is_write].push_back(user_data);
+            seq = fd_ctx->uring->seq;
+
+            MutexType::Lock lock2(m_sqMutex);
+            io_uring_sqe *sqe = uringGetSqe(has_timeout ? 2 : 1);
+            sqe->opcode = opcode;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)buf;
+            sqe->len = len;
+            switch (opcode)
+            {
+            case IORING_OP_READ:
+            case IORING_OP_WRITE:
+                // 使用文件当前的偏移
+                sqe->off = (uint64_t)-1;
+                break;
+            case IORING_OP_RECV:
+            case IORING_OP_SEND:
+                sqe->msg_flags = flags;
+                break;
+            case IORING_OP_ACCEPT:
+                sqe->addr2 = (uint64_t)addr2;
+                sqe->len = 0;
+                break;
+            default:
+                break;
+            }
+            sqe->user_data = user_data;
+            if (has_timeout)
+            {
+                // 超时由内核处理, 超时后请求以 -ECANCELED 结束
+                sqe->flags |= IOSQE_IO_LINK;
+                req.ts.tv_sec = timeout_ms / 1000;
+                req.ts.tv_nsec = timeout_ms % 1000 * 1000 * 1000;
+                io_uring_sqe *tsqe = m_ring->getSqe();
+                tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+                tsqe->addr = (uint64_t)&req.ts;
+                tsqe->len = 1;
+                tsqe->user_data = URING_IGNORE;
+            }
+            ++m_pendingEventCount;
+            uringQueued();
+        }
+        Fiber::YieldToHold();
+
+        {
+            FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            --fd_ctx->uring->inflight;
+            std::vector<uint64_t> &requests = fd_ctx->uring->requests[is_write];
+            requests.erase(std::find(requests.begin(), requests.end(), user_data));
+            if (req.res == -ECANCELED || req.res == -EINTR)
+            {
+                // 被 cancelAll(close) 取消的返回 EBADF, 被 cancelEvent 取消的返回 ECANCELED, 否则是超时
+                if (fd_ctx->uring->seq != seq)
+                {
+                    req.res = -EBADF;
+                }
+                else if (req.cancelled)
+                {
+                    req.res = -ECANCELED;
+                }
+                else if (has_timeout)
+                {
+                    req.res = -ETIMEDOUT;
+                }
+            }
+        }
+        if (req.res < 0)
+        {
+            errno = -req.res;
+            return -1;
+        }
+        return req.res;
+    }
+
+    bool IOManager::acceptMultishot(int fd, sockaddr *addr, socklen_t *addrlen,
+                                    uint64_t timeout_ms, int &rt)
+    {
+        // 取消状态下回退到 submitIo, 由它返回 ECANCELED
+        if (!m_ring || !m_multishotAccept || m_cancelling)
+        {
+            return false;
+        }
+        FdContext *fd_ctx = getFdContext(fd, true);
+        if (!fd_ctx)
+        {
+            return false;
+        }
+        UringWaiter::ptr waiter;
+        Timer::ptr timer;
+        {
+            FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            if (!fd_ctx->uring)
+            {
+                fd_ctx->uring.reset(new UringContext);
+            }
+            UringContext *uc = fd_ctx->uring.get();
+            if (!uc->accepted.empty())
+            {
+                rt = uc->accepted.front();
+                uc->accepted.pop_front();
+            }
+            else
+            {
+                if (!uc->acceptArmed)
+                {
+                    uringArmMultishot(fd_ctx, 0);
+                }
+                waiter = uringWait(fd_ctx, uc->acceptWaiters, timeout_ms, timer);
+            }
+        }
+        if (waiter)
+        {
+            Fiber::YieldToHold();
+            if (timer)
+            {
+                timer->cancel();
+            }
+            rt = waiter->res;
+            if (rt < 0)
+            {
+                errno = -rt;
+                rt = -1;
+                return true;
+            }
+        }
+        // multishot accept 不回填地址, 从连接上取
+        if (addr && addrlen)
+        {
+            getpeername(rt, addr, addrlen);
+        }
+        return true;
+    }
+
+    bool IOManager::recvMultishot(int fd, const iovec *iov, int iovcnt, int flags,
+                                  uint64_t timeout_ms, ssize_t &rt)
+    {
+        if (!m_ring || !m_multishotRecv || m_cancelling)
+        {
+            return false;
+        }
+        FdContext *fd_ctx = getFdContext(fd, true);
+        if (!fd_ctx)
+        {
+            return false;
+        }
+        while (true)
+        {
+            UringWaiter::ptr waiter;
+            Timer::ptr timer;
+            {
+                FdContext::MutexType::Lock lock(fd_ctx->mutex);
+                if (!fd_ctx->uring)
+                {
+                    fd_ctx->uring.reset(new UringContext);
+                }
+                UringContext *uc = fd_ctx->uring.get();
+                if (uc->sockType == -1)
+                {
+                    int type = 0;
+                    socklen_t len = sizeof(type);
+                    if (getsockopt_f(fd, SOL_SOCKET, SO_TYPE, &type, &len))
+                    {
+                        type = 0;
+                    }
+                    uc->sockType = type;
+                }
+                // 只有流式 socket 才能把数据切成任意长度读取
+                if (uc->sockType != SOCK_STREAM)
+                {
+                    return false;
+                }
+                if (!uc->chunks.empty())
+                {
+                    rt = uringCopyOut(uc, iov, iovcnt, flags & MSG_PEEK);
+                    return true;
+                }
+                if (uc->recvError)
+                {
+                    errno = uc->recvError;
+                    uc->recvError = 0;
+                    rt = -1;
+                    return true;
+                }
+                if (uc->eof)
+                {
+                    rt = 0;
+                    return true;
+                }
+                if (flags & MSG_DONTWAIT)
+                {
+                    errno = EAGAIN;
+                    rt = -1;
+                    return true;
+                }
+                if (!uc->recvArmed)
+                {
+                    uringArmMultishot(fd_ctx, 1);
+                }
+                waiter = uringWait(fd_ctx, uc->recvWaiters, timeout_ms, timer);
+            }
+            Fiber::YieldToHold();
+            if (timer)
+            {
+                timer->cancel();
+            }
+            if (waiter->res == -ENOBUFS)
+            {
+                // 缓冲区耗尽, 这一次由调用者直接读取
+                return false;
+            }
+            if (waiter->res < 0)
+            {
+                errno = -waiter->res;
+                rt = -1;
+                return true;
+            }
+        }
+    }
+
+    io_uring_sqe *IOManager::uringGetSqe(uint32_t count)
+    {
+        if (m_ring->getFree() < count)
+        {
+            m_ring->submit();
+        }
+        io_uring_sqe *sqe = m_ring->getSqe();
+        SYLAR_ASSERT2(sqe, "io_uring submission queue full");
+        return sqe;
+    }
+
+    void IOManager::uringQueued()
+    {
+        // 有空闲线程时立即提交, 否则积攒到 submit_batch 或者线程进入 idle 时一起提交
+        if (m_ring->getPending() >= m_submitBatch || hasIdleThreads() || Scheduler::GetThis() != this)
+        {
+            m_ring->submit();
+        }
+    }
+
+    void IOManager::uringSubmit()
+    {
+        MutexType::Lock lock(m_sqMutex);
+        m_ring->submit();
+    }
+
+    void IOManager::uringArmPoll(FdContext *fd_ctx, Event event)
+    {
+        FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
+        ++event_ctx.seq;
+        MutexType::Lock lock(m_sqMutex);
+        io_uring_sqe *sqe = uringGetSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd_ctx->fd;
+        sqe->poll32_events = event == READ ? POLLIN : POLLOUT;
+        sqe->user_data = UringEncode(event_ctx.seq, fd_ctx->fd, event == WRITE, URING_POLL);
+        uringQueued();
+    }
+
+    void IOManager::uringRemovePoll(FdContext *fd_ctx, Event event)
+    {
+        FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
+        MutexType::Lock lock(m_sqMutex);
+        io_uring_sqe *sqe = uringGetSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = UringEncode(event_ctx.seq, fd_ctx->fd, event == WRITE, URING_POLL);
+        sqe->user_data = URING_IGNORE;
+        uringQueued();
+    }
+
+    void IOManager::uringArmMultishot(FdContext *fd_ctx, int sub)
+    {
+        UringContext *uc = fd_ctx->uring.get();
+        MutexType::Lock lock(m_sqMutex);
+        io_uring_sqe *sqe = uringGetSqe();
+        sqe->fd = fd_ctx->fd;
+        if (sub == 0)
+        {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            uc->acceptArmed = true;
+        }
+        else
+        {
+            // 由内核从 provided buffer ring 中选择缓冲区
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = m_ring->getBufGroup();
+            uc->recvArmed = true;
+        }
+        sqe->user_data = UringEncode(uc->seq, fd_ctx->fd, sub, URING_MULTISHOT);
+        uringQueued();
+    }
+
+    void IOManager::uringCancelFd(FdContext *fd_ctx)
+    {
+        UringContext *uc = fd_ctx->uring.get();
+        bool busy = fd_ctx->events != NONE;
+        if (uc)
+        {
+            busy = busy || uc->inflight || uc->acceptArmed || uc->recvArmed;
+            ++uc->seq;
+            uc->acceptArmed = false;
+            uc->recvArmed = false;
+            uc->recvCancelling = false;
+            uc->sockType = -1;
+            uc->eof = false;
+            uc->recvError = 0;
+            for (int fd : uc->accepted)
+            {
+                close_f(fd);
+            }
+            uc->accepted.clear();
+            for (auto &chunk : uc->chunks)
+            {
+                uringRecycle(chunk.bid);
+            }
+            uc->chunks.clear();
+            while (!uc->acceptWaiters.empty())
+            {
+                uringWake(uc->acceptWaiters.front(), -EBADF);
+                uc->acceptWaiters.pop_front();
+            }
+            while (!uc->recvWaiters.empty())
+            {
+                uringWake(uc->recvWaiters.front(), -EBADF);
+                uc->recvWaiters.pop_front();
+            }
+        }
+        if (!busy)
+        {
+            return;
+        }
+        MutexType::Lock lock(m_sqMutex);
+        io_uring_sqe *sqe = uringGetSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd_ctx->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = URING_IGNORE;
+        // 进行中的请求持有文件的引用, 必须在 close 之前取消
+        m_ring->submit();
+    }
+
+    void IOManager::uringCancelMultishot(FdContext *fd_ctx, int sub)
+    {
+        UringContext *uc = fd_ctx->uring.get();
+        MutexType::Lock lock(m_sqMutex);
+        io_uring_sqe *sqe = uringGetSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = UringEncode(uc->seq, fd_ctx->fd, sub, URING_MULTISHOT);
+        sqe->user_data = URING_IGNORE;
+        if (sub)
+        {
+            uc->recvCancelling = true;
+        }
+        uringQueued();
+    }
+
+    bool IOManager::uringCancelRequests(FdContext *fd_ctx, Event event)
+    {
+        UringContext *uc = fd_ctx->uring.get();
+        if (!uc)
+        {
+            return false;
+        }
+        bool cancelled = false;
+        for (int i = 0; i < 2; ++i)
+        {
+            if (!(event & (i ? WRITE : READ)) || uc->requests[i].empty())
+            {
+                continue;
+            }
+            MutexType::Lock lock(m_sqMutex);
+            for (uint64_t ud : uc->requests[i])
+            {
+                // 请求在完成并从列表中移除之前一直有效, 调用者持有句柄的锁
+                ((UringRequest *)(ud & ~7ull))->cancelled = true;
+                io_uring_sqe *sqe = uringGetSqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = ud;
+                sqe->user_data = URING_IGNORE;
+            }
+            m_ring->submit();
+            cancelled = true;
+        }
+        return cancelled;
+    }
+
+    void IOManager::uringReap()
+    {
+        do
+        {
+            bool expect = false;
+            if (!m_reaping.compare_exchange_strong(expect, true))
+            {
+                // 其他线程正在收割, 它会在退出前再检查一次完成队列
+                return;
+            }
+            m_ring->reap([this](const io_uring_cqe &cqe)
+                         { uringComplete(cqe); });
+            m_reaping = false;
+        } while (m_ring->hasCqe());
+    }
+
+    void IOManager::uringComplete(const io_uring_cqe &cqe)
+    {
+        uint64_t ud = cqe.user_data;
+        int kind = ud & 3;
+        if (kind == URING_IGNORE)
+        {
+            return;
+        }
+        if (kind == URING_IO)
+        {
+            UringRequest *req = (UringRequest *)(ud & ~7ull);
+            req->res = cqe.res;
+            Scheduler *scheduler = req->scheduler;
+            Fiber::ptr fiber;
+            fiber.swap(req->fiber);
+            // 之后协程随时可能恢复, 不能再访问 req
+            scheduler->scheduleNext(&fiber);
+            pendingDone();
+            return;
+        }
+
+        int fd = (ud >> 3) & 0x1fffffff;
+        uint32_t seq = ud >> 32;
+        int sub = (ud >> 2) & 1;
+        bool has_buf = cqe.flags & IORING_CQE_F_BUFFER;
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        FdContext *fd_ctx = getFdContext(fd, false);
+        if (!fd_ctx)
+        {
+            if (has_buf)
+            {
+                uringRecycle(bid);
+            }
+            return;
+        }
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        if (kind == URING_POLL)
+        {
+            Event event = sub ? WRITE : READ;
+            FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
+            // 过期的 poll(已经被删除或者取消)直接忽略
+            if ((fd_ctx->events & event) && event_ctx.seq == seq)
+            {
+                fd_ctx->triggerEvent(event);
+                pendingDone();
+            }
+            return;
+        }
+
+        UringContext *uc = fd_ctx->uring.get();
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (!uc || uc->seq != seq)
+        {
+            // 句柄已经 cancelAll, 归还缓冲区, 关闭多余的连接
+            if (has_buf)
+            {
+                uringRecycle(bid);
+            }
+            if (sub == 0 && cqe.res >= 0)
+            {
+                close_f(cqe.res);
+            }
+            return;
+        }
+        if (sub == 0)
+        {
+            if (!more)
+            {
+                uc->acceptArmed = false;
+            }
+            if (cqe.res >= 0)
+            {
+                if (!uc->acceptWaiters.empty())
+                {
+                    uringWake(uc->acceptWaiters.front(), cqe.res);
+                    uc->acceptWaiters.pop_front();
+                }
+                else
+                {
+                    uc->accepted.push_back(cqe.res);
+                }
+                if (!uc->acceptArmed && !uc->acceptWaiters.empty())
+                {
+                    uringArmMultishot(fd_ctx, 0);
+                }
+            }
+            else
+            {
+                while (!uc->acceptWaiters.empty())
+                {
+                    uringWake(uc->acceptWaiters.front(), cqe.res);
+                    uc->acceptWaiters.pop_front();
+                }
+            }
+            return;
+        }
+
+        bool cancelled = uc->recvCancelling;
+        if (!more)
+        {
+            uc->recvArmed = false;
+            uc->recvCancelling = false;
+        }
+        if (cqe.res > 0 && has_buf)
+        {
+            uc->chunks.push_back({bid, (uint32_t)cqe.res, 0});
+            if (!uc->recvWaiters.empty())
+            {
+                uringWake(uc->recvWaiters.front(), 0);
+                uc->recvWaiters.pop_front();
+            }
+            if (!uc->recvArmed && !uc->recvWaiters.empty())
+            {
+                uringArmMultishot(fd_ctx, 1);
+            }
+            // 读的一方跟不上时停止接收, 数据留在 socket 中, 让内核的流控传到对端,
+            // 也避免一个连接占满所有连接共用的 provided buffer. 缓存读完之后再重新开始
+            else if (uc->recvArmed && !uc->recvCancelling && uc->chunks.size() >= m_recvMaxChunks)
+            {
+                uringCancelMultishot(fd_ctx, 1);
+            }
+            return;
+        }
+        if (has_buf)
+        {
+            uringRecycle(bid);
+        }
+        if (cqe.res == -ECANCELED && cancelled)
+        {
+            // 主动取消的结束, 不是错误; 取消期间缓存已经读完的话重新开始接收
+            if (!uc->recvWaiters.empty())
+            {
+                uringArmMultishot(fd_ctx, 1);
+            }
+            return;
+        }
+        if (cqe.res == 0)
+        {
+            uc->eof = true;
+        }
+        else if (cqe.res != -ENOBUFS)
+        {
+            uc->recvError = -cqe.res;
+        }
+        int res = cqe.res == -ENOBUFS ? -ENOBUFS : 0;
+        while (!uc->recvWaiters.empty())
+        {
+            uringWake(uc->recvWaiters.front(), res);
+            uc->recvWaiters.pop_front();
+        }
+    }
+
+    void IOManager::uringWake(UringWaiter::ptr waiter, int res)
+    {
+        waiter->done = true;
+        waiter->res = res;
+        Fiber::ptr fiber;
+        fiber.swap(waiter->fiber);
+        scheduleNext(&fiber);
+        pendingDone();
+    }
+
+    IOManager::UringWaiter::ptr IOManager::uringWait(FdContext *fd_ctx, std::list<UringWaiter::ptr> &waiters,
+                                                     uint64_t timeout_ms, Timer::ptr &timer)
+    {
+        UringWaiter::ptr waiter(new UringWaiter);
+        waiter->fiber = Fiber::GetThis();
+        waiter->fiber->setWait(fd_ctx->fd, READ);
+        waiters.push_back(waiter);
+        ++m_pendingEventCount;
+        if (timeout_ms != ~0ull)
+        {
+            std::weak_ptr<UringWaiter> weak(waiter);
+            timer = addConditionTimer(
+                timeout_ms, [this, fd_ctx, weak]()
+                {
+                    UringWaiter::ptr w = weak.lock();
+                    if (!w)
+                    {
+                        return;
+                    }
+                    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+                    if (w->done || !fd_ctx->uring)
+                    {
+                        return;
+                    }
+                    fd_ctx->uring->acceptWaiters.remove(w);
+                    fd_ctx->uring->recvWaiters.remove(w);
+                    uringWake(w, -ETIMEDOUT); },
+                weak);
+        }
+        return waiter;
+    }
+
+    size_t IOManager::uringCopyOut(UringContext *uc, const iovec *iov, int iovcnt, bool peek)
+    {
+        size_t total = 0;
+        size_t idx = 0;
+        uint32_t off = uc->chunks.empty() ? 0 : uc->chunks.front().off;
+        for (int i = 0; i < iovcnt && idx < uc->chunks.size(); ++i)
+        {
+            char *dst = (char *)iov[i].iov_base;
+            size_t left = iov[i].iov_len;
+            while (left && idx < uc->chunks.size())
+            {
+                UringContext::Chunk &chunk = uc->chunks[idx];
+                size_t n = std::min(left, (size_t)(chunk.len - off));
+                memcpy(dst, m_ring->getBuf(chunk.bid) + off, n);
+                dst += n;
+                left -= n;
+                total += n;
+                off += n;
+                if (off == chunk.len)
+                {
+                    ++idx;
+                    off = idx < uc->chunks.size() ? uc->chunks[idx].off : 0;
+                }
+            }
+        }
+        if (peek)
+        {
+            return total;
+        }
+        // 消费掉读取的数据, 用完的缓冲区还给内核
+        size_t left = total;
+        while (left)
+        {
+            UringContext::Chunk &chunk = uc->chunks.front();
+            size_t n = std::min(left, (size_t)(chunk.len - chunk.off));
+            chunk.off += n;
+            left -= n;
+            if (chunk.off == chunk.len)
+            {
+                uringRecycle(chunk.bid);
+                uc->chunks.pop_front();
+            }
+        }
+        return total;
+    }
+
+    void IOManager::uringRecycle(uint16_t bid)
+    {
+        MutexType::Lock lock(m_bufMutex);
+        m_ring->recycleBuf(bid);
+    }
+
+    void IOManager::onTimerInsertedAtFront()
+    {
+        if (m_busyPoll)
+        {
+            return;
+        }
+        if (m_timerFd < 0)
+        {
+            tickle();
+            return;
+        }
+        // 更早的定时器: 提前 timerfd 的到期时间即可, 正在 epoll_wait 的线程会被它唤醒
+        armTimerFd();
+    }
+
+    void IOManager::armTimerFd()
+    {
+        MutexType::Lock lock(m_timerFdMutex);
+        uint64_t deadline = getNextDeadline();
+        if (deadline == ~0ull || deadline == m_timerFdDeadline)
+        {
+            return;
+        }
+        itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = deadline / 1000000;
+        its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+        if (timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &its, nullptr))
+        {
+            SYLAR_LOG_ERROR(g_logger) << "timerfd_settime(" << m_timerFd << ", " << deadline
+                                      << ") errno=" << errno << " errstr=" << strerror(errno);
+            tickle();
+            return;
+        }
+        m_timerFdDeadline = deadline;
+    }
+
+    void IOManager::armReactorTimerFd(Reactor *reactor)
+    {
+        uint64_t deadline = reactor->timers->getNextDeadline();
+        if (deadline == ~0ull || deadline == reactor->timerFdDeadline)
+        {
+            return;
+        }
+        itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = deadline / 1000000;
+        its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+        if (timerfd_settime(reactor->timerFd, TFD_TIMER_ABSTIME, &its, nullptr))
+        {
+            SYLAR_LOG_ERROR(g_logger) << "timerfd_settime(" << reactor->timerFd << ", " << deadline
+                                      << ") errno=" << errno << " errstr=" << strerror(errno);
+            tickleReactor(reactor);
+            return;
+        }
+        reactor->timerFdDeadline = deadline;
+    }
+
+    void IOManager::readTimerFd()
+    {
+        MutexType::Lock lock(m_timerFdMutex);
+        uint64_t expirations = 0;
+        if (read(m_timerFd, &expirations, sizeof(expirations)) > 0)
+        {
+            // 已经到期, 下一次需要重新设置
+            m_timerFdDeadline = 0;
+        }
     }
 
 #else
@@ -0,0 +1,228 @@
+#include "iouring.h"
+#include "log.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <algorithm>
+
+namespace sylar
+{
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static int sys_io_uring_setup(uint32_t entries, io_uring_params *p)
+    {
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int sys_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    static int sys_io_uring_register(int fd, uint32_t opcode, void *arg, uint32_t nr_args)
+    {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    IoUring::IoUring()
+    {
+    }
+
+    IoUring::~IoUring()
+    {
+        if (m_fd < 0)
+        {
+            return;
+        }
+        // 先关闭 ring, 内核会取消所有未完成的请求, 之后才能释放缓冲区
+        close(m_fd);
+        if (m_sqes)
+        {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if (m_cqPtr && m_cqPtr != m_sqPtr)
+        {
+            munmap(m_cqPtr, m_cqSize);
+        }
+        if (m_sqPtr)
+        {
+            munmap(m_sqPtr, m_sqSize);
+        }
+        if (m_bufRing)
+        {
+            munmap(m_bufRing, m_bufRingSize);
+        }
+        free(m_bufs);
+    }
+
+    bool IoUring::init(uint32_t entries)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        // 完成队列放大一些, 避免 multishot 请求产生的 cqe 溢出
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        int fd = sys_io_uring_setup(entries, &p);
+        if (fd < 0)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring_setup(" << entries << ") errno="
+                                      << errno << " errstr=" << strerror(errno);
+            return false;
+        }
+        m_fd = fd;
+
+        m_sqSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        m_cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+        {
+            m_sqSize = m_cqSize = std::max(m_sqSize, m_cqSize);
+        }
+        m_sqPtr = mmap(nullptr, m_sqSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (m_sqPtr == MAP_FAILED)
+        {
+            m_sqPtr = nullptr;
+            return false;
+        }
+        if (single)
+        {
+            m_cqPtr = m_sqPtr;
+        }
+        else
+        {
+            m_cqPtr = mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (m_cqPtr == MAP_FAILED)
+            {
+                m_cqPtr = nullptr;
+                return false;
+            }
+        }
+        m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = (io_uring_sqe *)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (m_sqes == MAP_FAILED)
+        {
+            m_sqes = nullptr;
+            return false;
+        }
+
+        char *sq = (char *)m_sqPtr;
+        m_sqHead = (std::atomic<uint32_t> *)(sq + p.sq_off.head);
+        m_sqTail = (std::atomic<uint32_t> *)(sq + p.sq_off.tail);
+        m_sqMask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+        m_sqEntries = p.sq_entries;
+        m_sqArray = (uint32_t *)(sq + p.sq_off.array);
+        m_sqLocalTail = m_sqTail->load(std::memory_order_relaxed);
+
+        char *cq = (char *)m_cqPtr;
+        m_cqHead = (uint32_t *)(cq + p.cq_off.head);
+        m_cqHeadAtomic = (std::atomic<uint32_t> *)m_cqHead;
+        m_cqTail = (std::atomic<uint32_t> *)(cq + p.cq_off.tail);
+        m_cqMask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    io_uring_sqe *IoUring::getSqe()
+    {
+        uint32_t head = m_sqHead->load(std::memory_order_acquire);
+        if (m_sqLocalTail - head >= m_sqEntries)
+        {
+            return nullptr;
+        }
+        uint32_t idx = m_sqLocalTail & m_sqMask;
+        io_uring_sqe *sqe = &m_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sqArray[idx] = idx;
+        ++m_sqLocalTail;
+        ++m_pending;
+        return sqe;
+    }
+
+    int IoUring::submit()
+    {
+        if (!m_pending)
+        {
+            return 0;
+        }
+        m_sqTail->store(m_sqLocalTail, std::memory_order_release);
+        uint32_t n = m_pending;
+        int rt = 0;
+        do
+        {
+            rt = sys_io_uring_enter(m_fd, n, 0, 0);
+        } while (rt < 0 && errno == EINTR);
+        if (rt < 0)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring_enter(" << m_fd << ", " << n
+                                      << ") errno=" << errno << " errstr=" << strerror(errno);
+            return -errno;
+        }
+        m_pending -= rt;
+        return rt;
+    }
+
+    bool IoUring::setupBufRing(uint16_t bgid, uint32_t count, uint32_t size)
+    {
+        if (!count || (count & (count - 1)) || count > 32768)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "buf ring count must be power of 2, count=" << count;
+            return false;
+        }
+        m_bufRingSize = count * sizeof(io_uring_buf);
+        void *ring = mmap(nullptr, m_bufRingSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+        {
+            return false;
+        }
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)ring;
+        reg.ring_entries = count;
+        reg.bgid = bgid;
+        if (sys_io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "IORING_REGISTER_PBUF_RING errno=" << errno
+                                      << " errstr=" << strerror(errno);
+            munmap(ring, m_bufRingSize);
+            return false;
+        }
+        m_bufs = (char *)malloc((size_t)count * size);
+        if (!m_bufs)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "malloc provided buffers count=" << count << " size=" << size;
+            sys_io_uring_register(m_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            munmap(ring, m_bufRingSize);
+            return false;
+        }
+        m_bufRing = (io_uring_buf_ring *)ring;
+        m_bufCount = count;
+        m_bufSize = size;
+        m_bgid = bgid;
+        m_bufTail = 0;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            recycleBuf(i);
+        }
+        return true;
+    }
+
+    void IoUring::recycleBuf(uint16_t bid)
+    {
+        // 不通过 bufs 柔性数组下标访问, 高优化级别下编译器会按零长度数组处理
+        io_uring_buf *bufs = (io_uring_buf *)m_bufRing;
+        io_uring_buf *buf = bufs + (m_bufTail & (m_bufCount - 1));
+        buf->addr = (uint64_t)getBuf(bid);
+        buf->len = m_bufSize;
+        buf->bid = bid;
+        ++m_bufTail;
+        // tail 与第一个 io_uring_buf 的 resv 字段重叠
+        __atomic_store_n(&bufs->resv, m_bufTail, __ATOMIC_RELEASE);
+    }
+}
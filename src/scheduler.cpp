@@ -2,7 +2,9 @@
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "config.h"
 #include "functional"
+#include <sstream>
 
 namespace sylar
 {
@@ -12,6 +14,35 @@ namespace sylar
     // 主协程
     static thread_local Fiber *t_scheduler_fiber = nullptr;
 
+    thread_local Scheduler::FiberAndThread *Scheduler::t_next = nullptr;
+    thread_local Scheduler::ThreadState *Scheduler::t_state = nullptr;
+    // 当前线程向全局队列放入了偏好自己的任务, 去执行 next 槽位之前需要通知其他线程来窃取
+    static thread_local bool t_prefer_queued = false;
+
+    static ConfigVar<bool>::ptr g_scheduler_direct_handoff =
+        Config::Lookup<bool>("scheduler.direct_handoff", true, "run same thread wakeups before the global queue");
+    static ConfigVar<bool>::ptr g_scheduler_locality =
+        Config::Lookup<bool>("scheduler.locality", true, "prefer the polling or last thread for wakeups");
+
+    static bool s_direct_handoff = true;
+    static bool s_locality = true;
+    // 连续执行 next 槽位的上限, 超过后先检查一次全局队列, 避免互相唤醒的协程饿死其他任务
+    static const uint32_t s_max_next_runs = 16;
+
+    struct _SchedulerIniter
+    {
+        _SchedulerIniter()
+        {
+            s_direct_handoff = g_scheduler_direct_handoff->getValue();
+            g_scheduler_direct_handoff->addListener([](const bool &old_value, const bool &new_value)
+                                                    { s_direct_handoff = new_value; });
+            s_locality = g_scheduler_locality->getValue();
+            g_scheduler_locality->addListener([](const bool &old_value, const bool &new_value)
+                                              { s_locality = new_value; });
+        }
+    };
+    static _SchedulerIniter s_scheduler_initer;
+
     Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
         : m_name(name)
     {
@@ -70,6 +101,11 @@ namespace sylar
         return t_scheduler_fiber;
     }
 
+    bool Scheduler::InTaskFiber()
+    {
+        return t_state && t_state->state.load(std::memory_order_relaxed) == THREAD_BUSY;
+    }
+
     void Scheduler::start()
     {
         MutexType::Lock lock(m_mutex);
@@ -82,6 +118,9 @@ namespace sylar
         m_stopping = false;
         // 调度器启动前，线程池为空
         SYLAR_ASSERT(m_threads.empty());
+        // 线程启动后马上会认领状态, 需要在创建线程之前分配
+        m_threadStateCount = m_threadCount + (m_rootFiber ? 1 : 0);
+        m_threadStates.reset(new ThreadState[m_threadStateCount]);
         // 为线程池分配内存大小为m_threadCount * Thread::ptr大小的空间,vector::resize()
         m_threads.resize(m_threadCount);
         // 分配线程
@@ -194,17 +233,53 @@ namespace sylar
         Fiber::ptr cb_fiber;
 
         FiberAndThread ft;
+        // 当前线程的 next 槽位, 同线程唤醒的任务优先执行
+        FiberAndThread next;
+        t_next = &next;
+        uint32_t next_runs = 0;
+        int tid = sylar::GetThreadId();
+        ThreadState *state = nullptr;
+        size_t idx = m_threadStateClaimed++;
+        if (idx < m_threadStateCount)
+        {
+            state = &m_threadStates[idx];
+            state->id = tid;
+        }
+        t_state = state;
+        t_prefer_queued = false;
         while (true)
         {
             // 在执行前，将所有内容置位Null
             ft.reset();
             bool tickle_me = false;
             bool is_active = false;
+            if (next.fiber && next.fiber->getState() == Fiber::EXEC)
+            {
+                // 目标协程还没有在其他线程上让出, 交给全局队列
+                schedule(next.fiber);
+                next.reset();
+            }
+            if ((next.fiber || next.cb) && next_runs < s_max_next_runs)
+            {
+                ++next_runs;
+                ft.swap(next);
+                ++m_activeThreadCount;
+                is_active = true;
+                // 本线程要忙了, 让其他线程来窃取留给本线程的任务
+                tickle_me = t_prefer_queued;
+                t_prefer_queued = false;
+            }
+            else
+            {
+                next_runs = 0;
+            }
+            if (!is_active)
             {
                 /*
                     从消息队列中取出 一个 必须要执行的消息
                 */
                 MutexType::Lock lock(m_mutex);
+                t_prefer_queued = false;
                 // 等待执行的协程队列 的开始
                 auto it = m_fibers.begin();
                 while (it != m_fibers.end())
@@ -226,6 +301,23 @@ namespace sylar
                         ++it;
                         continue;
                     }
+                    // 偏好的线程马上会来取, 留给它以保持缓存局部性
+                    if (it->prefer != -1 && it->prefer != tid && keepForPrefer(it->prefer))
+                    {
+                        ++it;
+                        continue;
+                    }
+                    if (it->prefer != -1)
+                    {
+                        if (it->prefer == tid)
+                        {
+                            m_localRuns.fetch_add(1, std::memory_order_relaxed);
+                        }
+                        else
+                        {
+                            m_stolenRuns.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
                     // 处理任务
                     ft = *it;
                     m_fibers.erase(it++);
@@ -235,6 +327,12 @@ namespace sylar
                     break;
                 }
                 tickle_me |= it != m_fibers.end();
+                if (!is_active && (next.fiber || next.cb))
+                {
+                    ft.swap(next);
+                    ++m_activeThreadCount;
+                    is_active = true;
+                }
             }
             // 通知其他线程
             if (tickle_me)
@@ -245,8 +343,16 @@ namespace sylar
 
             if (ft.fiber && (ft.fiber->getState() != Fiber::TERM && ft.fiber->getState() != Fiber::EXCEPT))
             {
+                if (ft.fiber->getWakeTime())
+                {
+                    onFiberWake(ft.fiber->getWakeTime());
+                    ft.fiber->setWakeTime(0);
+                }
+                ft.fiber->setLastThread(tid);
+                setThreadState(state, THREAD_BUSY);
                 // 协程切入
                 ft.fiber->swapIn();
+                setThreadState(state, THREAD_SCHEDULING);
                 --m_activeThreadCount;
                 // 说明 当前fiber通过YieldToReady让出的执行资源，则让该fiber继续回调度器中等待
                 if (ft.fiber->getState() == Fiber::READY)
@@ -255,7 +361,7 @@ namespace sylar
                 }
                 else if (ft.fiber->getState() != Fiber::TERM && ft.fiber->getState() != Fiber::EXCEPT)
                 {
-                    ft.fiber->m_state = Fiber::HOLD;
+                    ft.fiber->setState(Fiber::HOLD);
                 }
                 // 释放掉ft
                 ft.reset();
@@ -275,10 +381,16 @@ namespace sylar
                     // 如果 cb_fiber 是一个空指针，那就新建一个fiber
                     cb_fiber.reset(new Fiber(ft.cb));
                 }
+                if (ft.ts)
+                {
+                    cb_fiber->setReadyTime(ft.ts);
+                }
                 // 释放掉ft
                 ft.reset();
                 // 协程切入执行 （t_scheduler_fiber 所指向的m_rootFiber 与 cb_fiber进行切换）
+                setThreadState(state, THREAD_BUSY);
                 cb_fiber->swapIn();
+                setThreadState(state, THREAD_SCHEDULING);
                 --m_activeThreadCount;
                 if (cb_fiber->getState() == Fiber::READY)
                 {
@@ -295,7 +407,7 @@ namespace sylar
                 else
                 {
                     // 等待执行状态
-                    cb_fiber->m_state = Fiber::HOLD;
+                    cb_fiber->setState(Fiber::HOLD);
                     // ? 为何要释放掉cb_fiber
                     cb_fiber.reset();
                 }
@@ -311,16 +423,22 @@ namespace sylar
                 if (idle_fiber->getState() == Fiber::TERM)
                 {
                     SYLAR_LOG_INFO(g_logger) << "idle fiber term";
+                    t_next = nullptr;
+                    // 线程退出后偏好它的任务都可以被窃取
+                    setThreadState(state, THREAD_IDLE);
+                    t_state = nullptr;
                     break;
                 }
                 ++m_idleThreadCount;
+                setThreadState(state, THREAD_IDLE);
                 // 协程切入执行 （t_scheduler_fiber 所指向的m_rootFiber 与 idle_fiber进行切换） 
                 idle_fiber->swapIn();
+                setThreadState(state, THREAD_SCHEDULING);
                 // SYLAR_LOG_INFO(g_logger) << idle_fiber->getState();
                 --m_idleThreadCount;
                 if (idle_fiber->getState() != Fiber::TERM && idle_fiber->getState() != Fiber::EXCEPT)
                 {
-                    idle_fiber->m_state = Fiber::HOLD;
+                    idle_fiber->setState(Fiber::HOLD);
                 }
             } 
             // SYLAR_LOG_INFO(g_logger) << "while ..";   
@@ -328,6 +446,88 @@ namespace sylar
         SYLAR_LOG_INFO(g_logger) << "run done";
     }
 
+    bool Scheduler::setNext(FiberAndThread &ft)
+    {
+        if (!s_direct_handoff || GetThis() != this || !t_next)
+        {
+            return false;
+        }
+        // 只在 idle 分发事件时使用: 分发完立即回到调度循环执行槽位中的任务.
+        // 任务协程中唤醒的任务要等它让出, 期间其他线程拿不到槽位, 只能放入全局队列
+        if (!t_state || t_state->state.load(std::memory_order_relaxed) == THREAD_BUSY)
+        {
+            return false;
+        }
+        if (t_next->fiber || t_next->cb)
+        {
+            return false;
+        }
+        t_next->swap(ft);
+        return true;
+    }
+
+    bool Scheduler::setPrefer(FiberAndThread &ft)
+    {
+        if (!s_locality)
+        {
+            return false;
+        }
+        if (GetThis() == this && t_state)
+        {
+            // 观察到事件的线程, 连接的数据刚刚经过它的缓存
+            ft.prefer = GetThreadId();
+            m_preferred.fetch_add(1, std::memory_order_relaxed);
+            if (t_state->state.load(std::memory_order_relaxed) == THREAD_BUSY)
+            {
+                // 在任务中唤醒, 本线程还要继续执行, 照常通知其他线程
+                return false;
+            }
+            // 在 idle 中分发事件, 返回调度循环后会先扫描队列
+            t_state->state.store(THREAD_SCHEDULING, std::memory_order_relaxed);
+            t_prefer_queued = true;
+            return true;
+        }
+        if (ft.fiber && ft.fiber->getLastThread() != -1)
+        {
+            ft.prefer = ft.fiber->getLastThread();
+            m_preferred.fetch_add(1, std::memory_order_relaxed);
+        }
+        return false;
+    }
+
+    bool Scheduler::keepForPrefer(int thread) const
+    {
+        size_t n = std::min(m_threadStateClaimed.load(), m_threadStateCount);
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (m_threadStates[i].id.load(std::memory_order_relaxed) == thread)
+            {
+                // 忙或者在 idle 中等待时不等它, 由当前线程窃取
+                return m_threadStates[i].state.load(std::memory_order_relaxed) == THREAD_SCHEDULING;
+            }
+        }
+        // 不是本调度器的线程(协程换过调度器), 不再保留
+        return false;
+    }
+
+    void Scheduler::getLocalityStat(LocalityStat &stat) const
+    {
+        stat.preferred = m_preferred.load(std::memory_order_relaxed);
+        stat.local = m_localRuns.load(std::memory_order_relaxed);
+        stat.stolen = m_stolenRuns.load(std::memory_order_relaxed);
+    }
+
+    std::string Scheduler::dumpLocalityStat() const
+    {
+        LocalityStat stat;
+        getLocalityStat(stat);
+        std::stringstream ss;
+        ss << "[LocalityStat name=" << m_name << " locality=" << s_locality
+           << " preferred=" << stat.preferred << " local=" << stat.local
+           << " stolen=" << stat.stolen << "]";
+        return ss.str();
+    }
+
     void Scheduler::tickle()
     {
         SYLAR_LOG_INFO(g_logger) << "tickle";
@@ -78,7 +78,7 @@ namespace sylar
     // 设置和得到 发送超时时间
     int64_t Socket::getSendTimeout()
     {
-        FdCtx::ptr ctx = FdMgr::GetInstance()->get(m_sock);
+        FdCtx *ctx = FdMgr::GetInstance()->get(m_sock);
         if (ctx)
         {
             return ctx->getTimeout(SO_SNDTIMEO);
@@ -94,7 +94,7 @@ namespace sylar
     // 设置和得到 接受超时时间
     int64_t Socket::getRecvTimeout()
     {
-        FdCtx::ptr ctx = FdMgr::GetInstance()->get(m_sock);
+        FdCtx *ctx = FdMgr::GetInstance()->get(m_sock);
         if (ctx)
         {
             return ctx->getTimeout(SO_RCVTIMEO);
@@ -155,7 +155,7 @@ namespace sylar
     // 对句柄做初始化
     bool Socket::init(int sock)
     {
-        FdCtx::ptr ctx = FdMgr::GetInstance()->get(sock);
+        FdCtx *ctx = FdMgr::GetInstance()->get(sock);
         if (ctx && ctx->isSocket() && !ctx->isClose())
         {
             m_sock = sock;
@@ -262,6 +262,7 @@ namespace sylar
 
     bool Socket::close()
     {
+        Mutex::Lock lock(m_mutex);
         if(!m_isConnected && m_sock == -1)
         {
             return true;
@@ -275,6 +276,22 @@ namespace sylar
         return false;
     }
 
+    bool Socket::shutdown(int how)
+    {
+        Mutex::Lock lock(m_mutex);
+        if (m_sock == -1)
+        {
+            return false;
+        }
+        ::shutdown(m_sock, how);
+        IOManager *iom = IOManager::GetThis();
+        if (iom)
+        {
+            iom->cancelAll(m_sock);
+        }
+        return true;
+    }
+
     int Socket::send(const void* buffer, size_t length, int flags)
     {
         if (isConnected())
@@ -0,0 +1,243 @@
+#include "task.h"
+#include "hook.h"
+#include "fd_manager.h"
+#include "log.h"
+#include "macro.h"
+#include <errno.h>
+
+namespace sylar
+{
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static std::atomic<uint64_t> s_frame_count = {0};
+    static std::atomic<uint64_t> s_frame_bytes = {0};
+    static std::atomic<uint64_t> s_frame_total = {0};
+
+    TaskFrameStat GetTaskFrameStat()
+    {
+        TaskFrameStat stat;
+        stat.frames = s_frame_count;
+        stat.bytes = s_frame_bytes;
+        stat.total = s_frame_total;
+        return stat;
+    }
+
+    namespace detail
+    {
+        void *AllocFrame(size_t size)
+        {
+            ++s_frame_count;
+            ++s_frame_total;
+            s_frame_bytes += size;
+            return ::operator new(size);
+        }
+
+        void FreeFrame(void *ptr, size_t size)
+        {
+            --s_frame_count;
+            s_frame_bytes -= size;
+            ::operator delete(ptr);
+        }
+
+        static DetachedTask RunDetached(Scheduler *sc, Task<void> task)
+        {
+            co_await ResumeOn(sc);
+            try
+            {
+                co_await task;
+            }
+            catch (std::exception &ex)
+            {
+                SYLAR_LOG_ERROR(g_logger) << "Task except: " << ex.what();
+            }
+            catch (...)
+            {
+                SYLAR_LOG_ERROR(g_logger) << "Task except";
+            }
+        }
+    }
+
+    void Spawn(Scheduler *sc, Task<void> task)
+    {
+        SYLAR_ASSERT(sc);
+        detail::RunDetached(sc, std::move(task));
+    }
+
+    WaitEvent::WaitEvent(int fd, IOManager::Event event, uint64_t timeout_ms)
+        : m_iom(IOManager::GetThis()), m_fd(fd), m_event(event), m_timeout(timeout_ms)
+    {
+        SYLAR_ASSERT2(m_iom, "WaitEvent must be awaited on an IOManager thread");
+    }
+
+    bool WaitEvent::await_suspend(std::coroutine_handle<> h)
+    {
+        // 与 hook 的 do_io 一致: 超时定时器通过 cancelEvent 强制触发事件
+        if (m_timeout != ~0ull)
+        {
+            m_state.reset(new State);
+            std::weak_ptr<State> wstate(m_state);
+            IOManager *iom = m_iom;
+            int fd = m_fd;
+            IOManager::Event event = m_event;
+            m_timer = m_iom->addConditionTimer(
+                m_timeout, [wstate, iom, fd, event]()
+                {
+                    auto t = wstate.lock();
+                    if (!t || t->cancelled)
+                    {
+                        return;
+                    }
+                    t->cancelled = ETIMEDOUT;
+                    iom->cancelEvent(fd, event); },
+                wstate);
+        }
+        // addEvent 成功之后协程随时可能在其他线程上恢复, 不能再访问 this
+        Timer::ptr timer = m_timer;
+        int rt = m_iom->addEvent(m_fd, m_event, [h]()
+                                 { h.resume(); });
+        if (rt)
+        {
+            if (timer)
+            {
+                timer->cancel();
+            }
+            m_rt = -1;
+            return false;
+        }
+        return true;
+    }
+
+    int WaitEvent::await_resume()
+    {
+        if (m_timer)
+        {
+            m_timer->cancel();
+            m_timer.reset();
+        }
+        if (m_rt)
+        {
+            return m_rt;
+        }
+        if (m_state && m_state->cancelled)
+        {
+            return m_state->cancelled;
+        }
+        return 0;
+    }
+
+    Sleep::Sleep(uint64_t ms)
+        : m_iom(IOManager::GetThis()), m_ms(ms)
+    {
+        SYLAR_ASSERT2(m_iom, "Sleep must be awaited on an IOManager thread");
+    }
+
+    void Sleep::await_suspend(std::coroutine_handle<> h)
+    {
+        m_iom->addTimer(m_ms, [h]()
+                        { h.resume(); });
+    }
+
+    InFiber::InFiber(std::function<void()> cb, Scheduler *sc)
+        : m_cb(std::move(cb)), m_scheduler(sc ? sc : Scheduler::GetThis())
+    {
+        SYLAR_ASSERT2(m_scheduler, "InFiber needs a scheduler");
+    }
+
+    void InFiber::await_suspend(std::coroutine_handle<> h)
+    {
+        // 协程恢复之前 this 一直有效, 可以把异常写回
+        InFiber *self = this;
+        m_scheduler->schedule([self, h]()
+                              {
+            try
+            {
+                self->m_cb();
+            }
+            catch (...)
+            {
+                self->m_exception = std::current_exception();
+            }
+            h.resume(); });
+    }
+
+    void InFiber::await_resume()
+    {
+        if (m_exception)
+        {
+            std::rethrow_exception(m_exception);
+        }
+    }
+
+    /**
+     * @brief 协程版本的 do_io, 参数按值保存在协程帧中
+     */
+    template <typename OriginFun, typename... Args>
+    static Task<ssize_t> co_io(int fd, OriginFun fun, IOManager::Event event,
+                               int timeout_so, Args... args)
+    {
+        FdCtx *ctx = FdMgr::GetInstance()->get(fd, true);
+        if (!ctx || ctx->isClose())
+        {
+            errno = EBADF;
+            co_return -1;
+        }
+        // 非 socket 或者用户自己设置了非阻塞, 直接调用
+        if (!ctx->isSocket() || ctx->getUserNonblock())
+        {
+            co_return fun(fd, args...);
+        }
+        uint64_t to = ctx->getTimeout(timeout_so);
+        while (true)
+        {
+            ssize_t n = fun(fd, args...);
+            while (n == -1 && errno == EINTR)
+            {
+                n = fun(fd, args...);
+            }
+            if (n != -1 || errno != EAGAIN)
+            {
+                co_return n;
+            }
+            int rt = co_await WaitEvent(fd, event, to);
+            if (rt == -1)
+            {
+                co_return -1;
+            }
+            else if (rt)
+            {
+                errno = rt;
+                co_return -1;
+            }
+        }
+    }
+
+    Task<ssize_t> AsyncRead(int fd, void *buf, size_t count)
+    {
+        return co_io(fd, read_f, IOManager::READ, SO_RCVTIMEO, buf, count);
+    }
+
+    Task<ssize_t> AsyncWrite(int fd, const void *buf, size_t count)
+    {
+        return co_io(fd, write_f, IOManager::WRITE, SO_SNDTIMEO, buf, count);
+    }
+
+    Task<ssize_t> AsyncRecv(int fd, void *buf, size_t len, int flags)
+    {
+        return co_io(fd, recv_f, IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+    }
+
+    Task<ssize_t> AsyncSend(int fd, const void *buf, size_t len, int flags)
+    {
+        return co_io(fd, send_f, IOManager::WRITE, SO_SNDTIMEO, buf, len, flags);
+    }
+
+    Task<int> AsyncAccept(int fd, sockaddr *addr, socklen_t *addrlen)
+    {
+        int client = (int)co_await co_io(fd, accept_f, IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+        if (client >= 0)
+        {
+            FdMgr::GetInstance()->get(client, true);
+        }
+        co_return client;
+    }
+}
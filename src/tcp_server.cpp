@@ -1,6 +1,8 @@
 #include "tcp_server.h"
 #include "log.h"
 #include "config.h"
+#include "util.h"
+#include <sys/socket.h>
 namespace sylar
 {
 
@@ -86,7 +88,7 @@ namespace sylar
             SYLAR_LOG_INFO(g_logger) << client;
             if(client) {
                 client->setRecvTimeout(m_recvTimeout);
-                m_ioWorker->schedule(std::bind(&TcpServer::handleClient,
+                m_ioWorker->schedule(std::bind(&TcpServer::runClient,
                             shared_from_this(), client));
             } else {
                 SYLAR_LOG_ERROR(g_logger) << "accept errno=" << errno
@@ -123,6 +125,47 @@ namespace sylar
         });
     }
 
+    void TcpServer::runClient(Socket::ptr client) {
+        {
+            Mutex::Lock lock(m_mutex);
+            m_clients.insert(client);
+        }
+        handleClient(client);
+        Mutex::Lock lock(m_mutex);
+        m_clients.erase(client);
+    }
+
+    size_t TcpServer::getClientCount() {
+        Mutex::Lock lock(m_mutex);
+        return m_clients.size();
+    }
+
+    size_t TcpServer::drain(uint64_t timeout_ms) {
+        if(!m_isStop) {
+            stop();
+        }
+        uint64_t start = GetMonotonicMS();
+        // 在协程中调用时 usleep 被 hook, 只挂起当前协程
+        while(getClientCount() && GetMonotonicMS() - start < timeout_ms) {
+            usleep(1000);
+        }
+        std::vector<Socket::ptr> clients;
+        {
+            Mutex::Lock lock(m_mutex);
+            clients.assign(m_clients.begin(), m_clients.end());
+        }
+        for(auto& client : clients) {
+            SYLAR_LOG_WARN(g_logger) << "type=" << m_type << " name=" << m_name
+                << " drain timeout, cancel client " << *client;
+            // 关闭读写而不 close, 句柄仍归 handleClient 所有, 它读到 EOF 后自行结束.
+            // 通过 Socket 在其锁内进行, handleClient 已经 close 的句柄不会被误关
+            client->shutdown(SHUT_RDWR);
+        }
+        SYLAR_LOG_INFO(g_logger) << "type=" << m_type << " name=" << m_name
+            << " drain used=" << GetMonotonicMS() - start << "ms cancelled=" << clients.size();
+        return clients.size();
+    }
+
     void TcpServer::handleClient(Socket::ptr client) {
         SYLAR_LOG_INFO(g_logger) << "handleClient: " << *client;
     }
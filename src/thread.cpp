@@ -2,6 +2,8 @@
 #include "log.h"
 #include "util.h"
 #include <iostream>
+#include <errno.h>
+#include <time.h>
 
 namespace sylar
 {
@@ -43,6 +45,32 @@ namespace sylar
             throw std::logic_error("sem_wait error");
         }
     }
+    bool Semaphore::waitFor(uint64_t timeout_ms)
+    {
+        // sem_timedwait 使用 CLOCK_REALTIME 的绝对时间
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ++ts.tv_sec;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&m_semaphore, &ts))
+        {
+            if (errno == ETIMEDOUT)
+            {
+                return false;
+            }
+            if (errno != EINTR)
+            {
+                perror("sem_timedwait");
+                throw std::logic_error("sem_timedwait error");
+            }
+        }
+        return true;
+    }
     void Semaphore::notify()
     {
         if (sem_post(&m_semaphore)) // +1，让当前线程阻塞，并且原先阻塞的线程释放（post），
@@ -1,15 +1,42 @@
 #include "timer.h"
 #include "util.h"
 #include "log.h"
+#include "config.h"
+#include "macro.h"
+#include <string.h>
+#include <sched.h>
+#include <algorithm>
+#include <sstream>
 
 #if 1
 namespace sylar
 {
     static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
-    Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager *manager)
-        : m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager)
+
+    static ConfigVar<bool>::ptr g_timer_wheel_enable =
+        Config::Lookup<bool>("timer.wheel.enable", false, "use a hierarchical timing wheel instead of the ordered set");
+    static ConfigVar<uint32_t>::ptr g_timer_wheel_tick =
+        Config::Lookup<uint32_t>("timer.wheel.tick_us", 1000, "timing wheel tick in us");
+
+    // 当前线程独占的定时器管理器
+    static thread_local TimerManager *t_owned_timers = nullptr;
+
+    // 向上取整到不超过 slack 的 2 的幂的边界, 边界与定时器无关, 相近的定时器落在同一个边界上
+    static uint64_t SlackDeadline(uint64_t deadline, uint64_t slack)
     {
-        m_next = sylar::GetCurrentMS() + m_ms;
+        if (slack < 2)
+        {
+            return deadline;
+        }
+        uint64_t grain = 1ull << (63 - __builtin_clzll(slack));
+        return (deadline + grain - 1) & ~(grain - 1);
+    }
+
+    Timer::Timer(uint64_t us, std::function<void()> cb, bool recurring, TimerManager *manager,
+                 uint64_t slack_us)
+        : m_recurring(recurring), m_us(us), m_slack(slack_us), m_cb(cb), m_manager(manager)
+    {
+        setNext(sylar::GetMonotonicUS() + m_us);
     }
 
     Timer::Timer(uint64_t next)
@@ -17,12 +44,45 @@ namespace sylar
     {
     }
 
+    void Timer::setNext(uint64_t exact)
+    {
+        m_exact = exact;
+        m_next = SlackDeadline(exact, m_slack);
+    }
+
     bool Timer::cancel()
+    {
+        if (m_manager->m_owned)
+        {
+            // 先抢占状态, 与到期互斥; 其他线程只投递消息, 由所属线程从容器中摘下
+            bool armed = true;
+            if (!m_armed.compare_exchange_strong(armed, false))
+            {
+                return false;
+            }
+            if (!m_manager->isOwnerThread())
+            {
+                m_manager->postTimerOp(shared_from_this(), TimerManager::OP_CANCEL);
+                return true;
+            }
+            doCancel();
+            return true;
+        }
+        return doCancel();
+    }
+
+    bool Timer::doCancel()
     {
         TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
         if (m_cb)
         {
             m_cb = nullptr;
+            if (m_manager->m_useWheel)
+            {
+                // 调用者持有 ptr, 释放轮中的引用不会析构自身
+                m_manager->wheelRemove(this);
+                return true;
+            }
             // 用智能指针返回 该timer
             auto it = m_manager->m_timers.find(shared_from_this());
             m_manager->m_timers.erase(it);
@@ -33,11 +93,34 @@ namespace sylar
     // 某些定时器设置时间为5s（实际可能是10:00:05），若10:00:03秒接收到了数据，那么需要重新刷新时间变回10:00:08
     bool Timer::refresh()
     {
+        if (m_manager->m_owned)
+        {
+            if (!m_armed)
+            {
+                return false;
+            }
+            if (!m_manager->isOwnerThread())
+            {
+                m_manager->postTimerOp(shared_from_this(), TimerManager::OP_REFRESH);
+                return true;
+            }
+        }
         TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
         if (!m_cb)
         {
             return false;
         }
+        if (m_manager->m_useWheel)
+        {
+            if (!m_wheelSlot)
+            {
+                return false;
+            }
+            Timer::ptr self = m_manager->wheelRemove(this);
+            setNext(sylar::GetMonotonicUS() + m_us);
+            m_manager->wheelAdd(this);
+            return true;
+        }
 
         auto it = m_manager->m_timers.find(shared_from_this());
         // 如果这个定时器已经不在 m_manager中了，那么返回false
@@ -47,45 +130,74 @@ namespace sylar
         }
         // set 不可以修改key值，所以智能删除(erase)，重新添加新的时间10:00:08（set要根据新的key来排序）
         m_manager->m_timers.erase(it);
-        m_next = sylar::GetCurrentMS() + m_ms;
+        setNext(sylar::GetMonotonicUS() + m_us);
         m_manager->m_timers.insert(shared_from_this());
         return true;
     }
     bool Timer::reset(uint64_t ms, bool from_now)
+    {
+        return resetUs(ms * 1000, from_now);
+    }
+
+    bool Timer::resetUs(uint64_t us, bool from_now)
     {
         // from_now 表示是否需要立马强制改变时间；
-        if (ms == m_ms && !from_now)
+        if (us == m_us && !from_now)
         {
             return true;
         }
+        if (m_manager->m_owned)
+        {
+            if (!m_armed)
+            {
+                return false;
+            }
+            if (!m_manager->isOwnerThread())
+            {
+                m_manager->postTimerOp(shared_from_this(), TimerManager::OP_RESET, us, from_now);
+                return true;
+            }
+        }
 
         TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
         if (!m_cb)
         {
             return false;
         }
-        // 找到该定时器
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if (it == m_manager->m_timers.end())// 找不到就退出
+        Timer::ptr self;
+        if (m_manager->m_useWheel)
         {
-            return false;
+            if (!m_wheelSlot)
+            {
+                return false;
+            }
+            self = m_manager->wheelRemove(this);
+        }
+        else
+        {
+            // 找到该定时器
+            auto it = m_manager->m_timers.find(shared_from_this());
+            if (it == m_manager->m_timers.end())// 找不到就退出
+            {
+                return false;
+            }
+            // set 不可以修改key值，所以智能删除(erase)，重新添加新的
+            m_manager->m_timers.erase(it);
         }
-        // set 不可以修改key值，所以智能删除(erase)，重新添加新的
-        m_manager->m_timers.erase(it);
         uint64_t start = 0;
         // 是否要立即修改
         if (from_now)
         {
-            start = sylar::GetCurrentMS();
+            start = sylar::GetMonotonicUS();
         }
         else
         {
-            start = m_next - m_ms;
+            start = m_exact - m_us;
         }
-        // 更新ms，从外部传进来的ms
-        m_ms = ms;
-        // 基于更新后的ms，来更新下一次执行的时间 m_next
-        m_next = start + m_ms;
+        // 更新间隔，从外部传进来的us
+        m_us = us;
+        // 基于更新后的间隔，来更新下一次执行的时间 m_next
+        setNext(start + m_us);
         m_manager->addTimer(shared_from_this(), lock);
         return true;
     }
@@ -122,17 +234,48 @@ namespace sylar
 
     TimerManager::TimerManager()
     {
-        m_previouseTime = sylar::GetCurrentMS();
         // std::cout << "TimerManager create" << std::endl;
+        memset(m_wheel, 0, sizeof(m_wheel));
+        m_useWheel = g_timer_wheel_enable->getValue();
+        m_tickUs = std::max<uint32_t>(g_timer_wheel_tick->getValue(), 1);
+        m_wheelBase = sylar::GetMonotonicUS() / m_tickUs;
     }
 
     TimerManager::~TimerManager()
     {
+        releaseOwner();
+        // 轮中的定时器持有自身, 需要打断引用
+        std::vector<Timer::ptr> timers;
+        for (int i = 0; i < WHEEL_LEVELS; ++i)
+        {
+            for (int j = 0; j < WHEEL_SLOTS; ++j)
+            {
+                while (m_wheel[i][j])
+                {
+                    timers.push_back(wheelRemove(m_wheel[i][j]));
+                }
+            }
+        }
     }
 
     Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring)
     {
-        Timer::ptr timer(new Timer(ms, cb, recurring, this));
+        return addTimerUs(ms * 1000, cb, recurring);
+    }
+
+    Timer::ptr TimerManager::addTimerUs(uint64_t us, std::function<void()> cb, bool recurring, uint64_t slack_us)
+    {
+        TimerManager *local = getThreadTimerManager();
+        if (local && local != this)
+        {
+            return local->addTimerUs(us, cb, recurring, slack_us);
+        }
+        SYLAR_ASSERT2(!m_owned || isOwnerThread(), "timer added to a manager owned by another thread");
+        if (slack_us)
+        {
+            m_slackTimers.fetch_add(1, std::memory_order_relaxed);
+        }
+        Timer::ptr timer(new Timer(us, cb, recurring, this, slack_us));
         RWMutexType::WriteLock lock(m_mutex);
         // /*
         // std::pair<iterator, bool>
@@ -157,9 +300,19 @@ namespace sylar
 
     void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock &lock)
     {
-        auto it = m_timers.insert(val).first;
-        // 因此，如果insert返回值非常靠前的时候，反应出插入的定时器的事件非常短，是一个马上执行的定时器
-        bool at_front = (it == m_timers.begin()) && !m_tickled;
+        bool at_front = false;
+        if (m_useWheel)
+        {
+            uint64_t front = wheelNextTick();
+            wheelAdd(val.get());
+            at_front = wheelNextTick() < front && !m_tickled;
+        }
+        else
+        {
+            auto it = m_timers.insert(val).first;
+            // 因此，如果insert返回值非常靠前的时候，反应出插入的定时器的事件非常短，是一个马上执行的定时器
+            at_front = (it == m_timers.begin()) && !m_tickled;
+        }
         if (at_front)
         {
             m_tickled = true;
@@ -173,20 +326,6 @@ namespace sylar
         // 可以凭借这个timer，来实现业务上的 取消操作
     }
 
-    // 查看当前系统时间是否被修改
-    bool TimerManager::detectClockRollover(uint64_t now_ms)
-    {
-        bool rollover = false;
-        // 当前时间小于 之前的时间 并且 当前时间和之前的时间差距 大于 1小时
-        if (now_ms < m_previouseTime && now_ms < (m_previouseTime - 60 * 60 * 1000))
-        {
-            // 系统认为时间被修改过
-            rollover = true;
-        }
-        m_previouseTime = now_ms;
-        return rollover;
-    }
-
     // weak_ptr 平不会让引用计数器＋1，并且可以直到所指向的内存空间是否被释放掉
     static void Ontimer(std::weak_ptr<void> weak_cond, std::function<void()> cb)
     {
@@ -203,47 +342,153 @@ namespace sylar
     Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_ptr, bool recurring)
     {
         // bind(func(), arg1, arg2); --- 将func()和其所包含的两个参数一起
-        return addTimer(ms, std::bind(&Ontimer, weak_ptr, cb), recurring);
+        return addTimerUs(ms * 1000, std::bind(&Ontimer, weak_ptr, cb), recurring);
+    }
+
+    Timer::ptr TimerManager::addConditionTimerUs(uint64_t us, std::function<void()> cb, std::weak_ptr<void> weak_ptr, bool recurring, uint64_t slack_us)
+    {
+        return addTimerUs(us, std::bind(&Ontimer, weak_ptr, cb), recurring, slack_us);
     }
 
     uint64_t TimerManager::getNextTimer()
     {
+        uint64_t us = getNextTimerUs();
+        if (us == ~0ull)
+        {
+            return ~0ull;
+        }
+        // 向上取整, 避免不足 1ms 的定时器变成 0 而忙等
+        return (us + 999) / 1000;
+    }
+
+    uint64_t TimerManager::getNextDeadline()
+    {
+        applyTimerOps();
+        uint64_t deadline = ~0ull;
+        if (m_useWheel)
+        {
+            RWMutexType::WriteLock lock(m_mutex);
+            m_tickled = false;
+            uint64_t tick = wheelNextTick();
+            if (tick != ~0ull)
+            {
+                deadline = tick * m_tickUs;
+            }
+            if (!m_nodes.empty())
+            {
+                deadline = std::min(deadline, m_nodes[0]->deadline);
+            }
+            return deadline;
+        }
         RWMutexType::ReadLock lock(m_mutex);
         m_tickled = false;
+        if (!m_timers.empty())
+        {
+            deadline = (*m_timers.begin())->m_next;
+        }
+        if (!m_nodes.empty())
+        {
+            deadline = std::min(deadline, m_nodes[0]->deadline);
+        }
+        return deadline;
+    }
+
+    uint64_t TimerManager::getNextTimerUs()
+    {
+        uint64_t deadline = getNextDeadline();
         // 如果是为 空，则说明没有定时器
-        if (m_timers.empty())
+        if (deadline == ~0ull)
         {
             // 0取反，是一个最大的数
             return ~0ull;
         }
-
-        // 获得m_timers中的第一个定时器，next是引用类型，引用的值是m_times.begin()的值
-        const Timer::ptr &next = *m_timers.begin();
         // 得到当前的时间
-        uint64_t now_ms = sylar::GetCurrentMS();
+        uint64_t now_us = sylar::GetMonotonicUS();
         // 当前时间超过了 定时器序列中的第一个定时器下一次所执行的时间
-        if (now_ms >= next->m_next)
+        if (now_us >= deadline)
         {
             return 0;
         }
-        else
-        {   
-            // 返回还需要等待的时间
-            return next->m_next - now_ms;
-        }
+        // 返回还需要等待的时间
+        return deadline - now_us;
     }
 
     bool TimerManager::hasTimer()
     {
+        applyTimerOps();
         RWMutexType::ReadLock lock(m_mutex);
-        return !m_timers.empty();
+        if (!m_nodes.empty())
+        {
+            return true;
+        }
+        return m_useWheel ? m_wheelCount > 0 : !m_timers.empty();
     }
 
     void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs)
     {
-        uint64_t now_ms = sylar::GetCurrentMS();
+        applyTimerOps();
+        // 事件循环这一轮醒来时的时间, 比真实时间早, 定时器不会提前执行
+        uint64_t now_us = sylar::GetCachedMonotonicUS();
+        // 出现过带 slack 的定时器之后才收集到期时间
+        std::vector<uint64_t> exact;
+        std::vector<uint64_t> next;
+        std::vector<uint64_t> *pexact = m_slackTimers.load(std::memory_order_relaxed) ? &exact : nullptr;
+        size_t before = cbs.size();
+        size_t nodes = expireNodes(now_us, pexact, next);
+        expireTimers(now_us, cbs, pexact, next);
+        if (nodes || cbs.size() > before)
+        {
+            m_expireRounds.fetch_add(1, std::memory_order_relaxed);
+            if (pexact)
+            {
+                recordSlack(exact, next);
+            }
+        }
+    }
+
+    void TimerManager::expireTimers(uint64_t now_us, std::vector<std::function<void()>> &cbs,
+                                    std::vector<uint64_t> *exact, std::vector<uint64_t> &next)
+    {
         // 存放已经超时了的timer
         std::vector<Timer::ptr> expired;
+        if (m_useWheel)
+        {
+            {
+                RWMutexType::ReadLock lock(m_mutex);
+                if (!m_wheelCount || m_wheelBase > now_us / m_tickUs)
+                {
+                    return;
+                }
+            }
+            RWMutexType::WriteLock lock(m_mutex);
+            wheelAdvance(now_us, expired);
+            cbs.reserve(cbs.size() + expired.size());
+            for (auto &timer : expired)
+            {
+                if (exact)
+                {
+                    exact->push_back(timer->m_exact);
+                    next.push_back(timer->m_next);
+                }
+                if (m_owned && !claimExpired(timer.get()))
+                {
+                    continue;
+                }
+                cbs.push_back(timer->m_cb);
+                if (timer->m_recurring)
+                {
+                    timer->setNext(now_us + timer->m_us);
+                    wheelAdd(timer.get());
+                }
+                else
+                {
+                    timer->m_cb = nullptr;
+                }
+            }
+            // 在锁外释放到期的定时器
+            lock.unlock();
+            return;
+        }
 
         {
             RWMutexType::ReadLock lock(m_mutex);
@@ -258,21 +503,16 @@ namespace sylar
         {
             return;
         }
-        // 查看是否被修改时间
-        bool rollover = detectClockRollover(now_ms);
-        // 若没有被修改时间，并且定时器内的所有定时器 都没有超时
-        if (!rollover && ((*m_timers.begin())->m_next > now_ms))
+        // 单调时钟不会回退, 不需要检测系统时间被修改; 定时器都没有超时则直接退出
+        if ((*m_timers.begin())->m_next > now_us)
         {
-            // 直接退出
             return;
         }
-        Timer::ptr now_timer(new Timer(now_ms));
+        Timer::ptr now_timer(new Timer(now_us));
         // lower_bound 是在制定 区域内查找 不小于目标的数据
         // 即，有可能找到的是 大于等于 目标值的数据---所以是下界
-        // 如果系统时间发生了变化，那么就直接结束，将整个timer清理
-        // 如果 修改过时间并且存在超时，那么就所有定时器都需要 被清理；如果 没有修改过时间但是存在超时现象，超时的定时器需要被清理
-        auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-        while (it != m_timers.end() && (*it)->m_next == now_ms)
+        auto it = m_timers.lower_bound(now_timer);
+        while (it != m_timers.end() && (*it)->m_next == now_us)
         {
             ++it;
         }
@@ -285,12 +525,21 @@ namespace sylar
         // 更新cbs，如果有定时器是循环定时器(m_recurring == true)，需要重新定时，并将该定时器放回定时器数组中
         for (auto &timer : expired)
         {
+            if (exact)
+            {
+                exact->push_back(timer->m_exact);
+                next.push_back(timer->m_next);
+            }
+            if (m_owned && !claimExpired(timer.get()))
+            {
+                continue;
+            }
             cbs.push_back(timer->m_cb);
             // 如果timer 是循环定时器；循环定时器是一直更新的
             if (timer->m_recurring)
             {
                 // 重置时间 = 当前时间 + 间隔时间
-                timer->m_next = now_ms + timer->m_ms;
+                timer->setNext(now_us + timer->m_us);
                 // 将定时器重新放回 定时器数组中
                 m_timers.insert(timer);
             }
@@ -301,6 +550,416 @@ namespace sylar
         }
     }
 
+    void TimerManager::setOwner()
+    {
+        SYLAR_ASSERT2(!t_owned_timers || t_owned_timers == this, "a thread owns at most one timer manager");
+        t_owned_timers = this;
+        m_owned = true;
+        m_mutex.setOwned(true);
+    }
+
+    void TimerManager::releaseOwner()
+    {
+        if (t_owned_timers == this)
+        {
+            t_owned_timers = nullptr;
+        }
+    }
+
+    bool TimerManager::isOwnerThread() const
+    {
+        return t_owned_timers == this;
+    }
+
+    bool TimerManager::claimExpired(Timer *timer)
+    {
+        // 单次定时器到期时抢占状态, 已经被其他线程取消的不再执行; 循环定时器只检查
+        bool armed = timer->m_recurring ? timer->m_armed.load() : timer->m_armed.exchange(false);
+        if (!armed)
+        {
+            timer->m_cb = nullptr;
+        }
+        return armed;
+    }
+
+    void TimerManager::postTimerOp(Timer::ptr timer, TimerOpType type, uint64_t us, bool from_now)
+    {
+        {
+            Mutex::Lock lock(m_opMutex);
+            m_ops.push_back({timer, type, us, from_now});
+            m_hasOps = true;
+        }
+        // 取消只会让定时器变晚, 留给所属线程下一次醒来时处理
+        if (type != OP_CANCEL)
+        {
+            onRemoteTimerOp();
+        }
+    }
+
+    void TimerManager::applyTimerOps()
+    {
+        if (!m_hasOps || !isOwnerThread())
+        {
+            return;
+        }
+        std::vector<TimerOp> ops;
+        {
+            Mutex::Lock lock(m_opMutex);
+            ops.swap(m_ops);
+            m_hasOps = false;
+        }
+        for (auto &op : ops)
+        {
+            switch (op.type)
+            {
+            case OP_CANCEL:
+                op.timer->doCancel();
+                break;
+            case OP_REFRESH:
+                op.timer->refresh();
+                break;
+            case OP_RESET:
+                op.timer->resetUs(op.us, op.fromNow);
+                break;
+            }
+        }
+    }
+
+    void TimerManager::addNode(TimerNode *node, uint64_t us, uint64_t slack_us)
+    {
+        SYLAR_ASSERT(node->index == -1);
+        SYLAR_ASSERT2(!m_owned || isOwnerThread(), "timer added to a manager owned by another thread");
+        if (slack_us)
+        {
+            m_slackTimers.fetch_add(1, std::memory_order_relaxed);
+        }
+        node->exact = sylar::GetMonotonicUS() + us;
+        node->deadline = SlackDeadline(node->exact, slack_us);
+        RWMutexType::WriteLock lock(m_mutex);
+        node->index = m_nodes.size();
+        m_nodes.push_back(node);
+        nodeUp(node->index);
+        // 可能仍晚于最早的 Timer, 多一次 onTimerInsertedAtFront 没有影响
+        bool at_front = node->index == 0 && !m_tickled;
+        if (at_front)
+        {
+            m_tickled = true;
+        }
+        lock.unlock();
+        if (at_front)
+        {
+            onTimerInsertedAtFront();
+        }
+    }
+
+    bool TimerManager::cancelNode(TimerNode *node)
+    {
+        {
+            RWMutexType::WriteLock lock(m_mutex);
+            if (node->index >= 0)
+            {
+                nodeRemove(node);
+                return true;
+            }
+        }
+        // 已经到期, 等待正在执行的 fn 结束
+        while (node->firing.load(std::memory_order_acquire))
+        {
+            sched_yield();
+        }
+        return false;
+    }
+
+    void TimerManager::nodeUp(int idx)
+    {
+        TimerNode *node = m_nodes[idx];
+        while (idx > 0)
+        {
+            int parent = (idx - 1) / 2;
+            if (m_nodes[parent]->deadline <= node->deadline)
+            {
+                break;
+            }
+            m_nodes[idx] = m_nodes[parent];
+            m_nodes[idx]->index = idx;
+            idx = parent;
+        }
+        m_nodes[idx] = node;
+        node->index = idx;
+    }
+
+    void TimerManager::nodeDown(int idx)
+    {
+        TimerNode *node = m_nodes[idx];
+        int size = m_nodes.size();
+        while (true)
+        {
+            int child = idx * 2 + 1;
+            if (child >= size)
+            {
+                break;
+            }
+            if (child + 1 < size && m_nodes[child + 1]->deadline < m_nodes[child]->deadline)
+            {
+                ++child;
+            }
+            if (node->deadline <= m_nodes[child]->deadline)
+            {
+                break;
+            }
+            m_nodes[idx] = m_nodes[child];
+            m_nodes[idx]->index = idx;
+            idx = child;
+        }
+        m_nodes[idx] = node;
+        node->index = idx;
+    }
+
+    void TimerManager::nodeRemove(TimerNode *node)
+    {
+        int idx = node->index;
+        TimerNode *last = m_nodes.back();
+        m_nodes.pop_back();
+        if (last != node)
+        {
+            m_nodes[idx] = last;
+            last->index = idx;
+            nodeUp(idx);
+            nodeDown(last->index);
+        }
+        node->index = -1;
+    }
+
+    size_t TimerManager::expireNodes(uint64_t now_us, std::vector<uint64_t> *exact, std::vector<uint64_t> &next)
+    {
+        {
+            RWMutexType::ReadLock lock(m_mutex);
+            if (m_nodes.empty() || m_nodes[0]->deadline > now_us)
+            {
+                return 0;
+            }
+        }
+        std::vector<TimerNode *> expired;
+        {
+            RWMutexType::WriteLock lock(m_mutex);
+            while (!m_nodes.empty() && m_nodes[0]->deadline <= now_us)
+            {
+                TimerNode *node = m_nodes[0];
+                nodeRemove(node);
+                // 在锁内标记, cancelNode 看不到节点时一定能看到 firing
+                node->firing.store(true, std::memory_order_relaxed);
+                expired.push_back(node);
+                if (exact)
+                {
+                    exact->push_back(node->exact);
+                    next.push_back(node->deadline);
+                }
+            }
+        }
+        // fn 可能会加锁(例如 cancelEvent), 在定时器的锁外执行
+        for (TimerNode *node : expired)
+        {
+            node->fn(node);
+            node->firing.store(false, std::memory_order_release);
+        }
+        return expired.size();
+    }
+
+    void TimerManager::recordSlack(std::vector<uint64_t> &exact, std::vector<uint64_t> &next)
+    {
+        if (exact.size() < 2)
+        {
+            return;
+        }
+        // 不合并时每一种精确到期时间都可能需要一次唤醒
+        std::sort(exact.begin(), exact.end());
+        std::sort(next.begin(), next.end());
+        size_t e = std::unique(exact.begin(), exact.end()) - exact.begin();
+        size_t n = std::unique(next.begin(), next.end()) - next.begin();
+        if (e > n)
+        {
+            m_wakeupsSaved.fetch_add(e - n, std::memory_order_relaxed);
+        }
+    }
+
+    void TimerManager::getSlackStat(SlackStat &stat) const
+    {
+        stat.timers = m_slackTimers.load(std::memory_order_relaxed);
+        stat.rounds = m_expireRounds.load(std::memory_order_relaxed);
+        stat.wakeupsSaved = m_wakeupsSaved.load(std::memory_order_relaxed);
+    }
+
+    std::string TimerManager::dumpSlackStat() const
+    {
+        SlackStat stat;
+        getSlackStat(stat);
+        std::stringstream ss;
+        ss << "[TimerSlackStat timers=" << stat.timers << " rounds=" << stat.rounds
+           << " wakeups_saved=" << stat.wakeupsSaved << "]";
+        return ss.str();
+    }
+
+    void TimerManager::wheelAdd(Timer *timer)
+    {
+        // 向上取整, 定时器不会提前到期
+        uint64_t expires = (timer->m_next + m_tickUs - 1) / m_tickUs;
+        if (expires < m_wheelBase)
+        {
+            // 已经过期, 放在下一个处理的槽位
+            expires = m_wheelBase;
+        }
+        uint64_t idx = expires - m_wheelBase;
+        int level = 0;
+        if (idx >= (1ull << (WHEEL_BITS * WHEEL_LEVELS)))
+        {
+            // 超出最高层的范围, 先放在最高层最远的位置, 下放时按真实的到期时间重新分配
+            expires = m_wheelBase + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+            level = WHEEL_LEVELS - 1;
+        }
+        else
+        {
+            while (level < WHEEL_LEVELS - 1 && idx >= (1ull << (WHEEL_BITS * (level + 1))))
+            {
+                ++level;
+            }
+        }
+        int shift = WHEEL_BITS * level;
+        Timer **slot = &m_wheel[level][(expires >> shift) & (WHEEL_SLOTS - 1)];
+        timer->m_wheelSlot = slot;
+        timer->m_wheelPrev = nullptr;
+        timer->m_wheelNext = *slot;
+        if (*slot)
+        {
+            (*slot)->m_wheelPrev = timer;
+        }
+        *slot = timer;
+        if (!timer->m_wheelSelf)
+        {
+            timer->m_wheelSelf = timer->shared_from_this();
+        }
+        ++m_wheelCount;
+        // 第 i 层的槽位在所在块的起点下放
+        uint64_t tick = (expires >> shift) << shift;
+        if (m_wheelNextValid && tick < m_wheelNextTick)
+        {
+            m_wheelNextTick = tick;
+        }
+    }
+
+    Timer::ptr TimerManager::wheelRemove(Timer *timer)
+    {
+        if (!timer->m_wheelSlot)
+        {
+            return nullptr;
+        }
+        if (timer->m_wheelPrev)
+        {
+            timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+        }
+        else
+        {
+            *timer->m_wheelSlot = timer->m_wheelNext;
+        }
+        if (timer->m_wheelNext)
+        {
+            timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+        }
+        timer->m_wheelSlot = nullptr;
+        timer->m_wheelPrev = timer->m_wheelNext = nullptr;
+        --m_wheelCount;
+        m_wheelNextValid = false;
+        Timer::ptr self;
+        self.swap(timer->m_wheelSelf);
+        return self;
+    }
+
+    void TimerManager::wheelCascade(int level, int slot)
+    {
+        Timer *timer = m_wheel[level][slot];
+        m_wheel[level][slot] = nullptr;
+        while (timer)
+        {
+            Timer *next = timer->m_wheelNext;
+            // 摘下时不释放自身, 直接重新放入
+            timer->m_wheelSlot = nullptr;
+            --m_wheelCount;
+            wheelAdd(timer);
+            timer = next;
+        }
+    }
+
+    void TimerManager::wheelAdvance(uint64_t now_us, std::vector<Timer::ptr> &expired)
+    {
+        uint64_t target = now_us / m_tickUs;
+        m_wheelNextValid = false;
+        while (m_wheelBase <= target)
+        {
+            if (!m_wheelCount)
+            {
+                // 没有定时器, 直接跳到当前 tick
+                m_wheelBase = target + 1;
+                break;
+            }
+            int idx = m_wheelBase & (WHEEL_SLOTS - 1);
+            if (!idx)
+            {
+                // 第 0 层转完一圈, 逐层下放, 某一层没有转完就停止
+                for (int level = 1; level < WHEEL_LEVELS; ++level)
+                {
+                    int slot = (m_wheelBase >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+                    wheelCascade(level, slot);
+                    if (slot)
+                    {
+                        break;
+                    }
+                }
+            }
+            while (m_wheel[0][idx])
+            {
+                expired.push_back(wheelRemove(m_wheel[0][idx]));
+            }
+            ++m_wheelBase;
+        }
+    }
+
+    uint64_t TimerManager::wheelNextTick()
+    {
+        if (m_wheelNextValid)
+        {
+            return m_wheelNextTick;
+        }
+        uint64_t next = ~0ull;
+        if (m_wheelCount)
+        {
+            // 第 0 层一个槽位就是一个 tick
+            for (int j = 0; j < WHEEL_SLOTS; ++j)
+            {
+                if (m_wheel[0][(m_wheelBase + j) & (WHEEL_SLOTS - 1)])
+                {
+                    next = m_wheelBase + j;
+                    break;
+                }
+            }
+            // 高层的槽位在所在块的起点下放, 取最早的一个; 已对齐的当前块还没有下放
+            for (int level = 1; level < WHEEL_LEVELS; ++level)
+            {
+                int shift = WHEEL_BITS * level;
+                uint64_t cur = m_wheelBase >> shift;
+                for (uint64_t j = ((cur << shift) == m_wheelBase) ? 0 : 1; j <= WHEEL_SLOTS; ++j)
+                {
+                    if (m_wheel[level][(cur + j) & (WHEEL_SLOTS - 1)])
+                    {
+                        next = std::min(next, (cur + j) << shift);
+                        break;
+                    }
+                }
+            }
+        }
+        m_wheelNextTick = next;
+        m_wheelNextValid = true;
+        return next;
+    }
+
 }
 #else
 
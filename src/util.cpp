@@ -3,6 +3,7 @@
 #include "log.h"
 #include "fiber.h"
 #include <sys/time.h>
+#include <time.h>
 
 namespace sylar
 {
@@ -81,4 +82,60 @@ namespace sylar
         return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
     }
 
+    // 单调时钟 纳秒 ns
+    uint64_t GetMonotonicNS()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+    }
+
+    // 单调时钟 微秒 us
+    uint64_t GetMonotonicUS()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+    }
+
+    // 单调时钟 毫秒 ms
+    uint64_t GetMonotonicMS()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000ul + ts.tv_nsec / 1000 / 1000;
+    }
+
+    // 0 表示没有缓存
+    static thread_local uint64_t t_cached_ns = 0;
+
+    uint64_t UpdateCachedClock()
+    {
+        t_cached_ns = GetMonotonicNS();
+        return t_cached_ns;
+    }
+
+    void ResetCachedClock()
+    {
+        t_cached_ns = 0;
+    }
+
+    uint64_t GetCachedMonotonicNS()
+    {
+        return t_cached_ns ? t_cached_ns : GetMonotonicNS();
+    }
+
+    uint64_t GetCachedMonotonicUS()
+    {
+        return t_cached_ns ? t_cached_ns / 1000 : GetMonotonicUS();
+    }
+
+    // 当前线程的 cpu 时间 纳秒 ns
+    uint64_t GetThreadCpuNS()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+    }
+
 };
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "sylar.h"
+#include "iomanager.h"
+#include "compute.h"
+#include <stdexcept>
+#include <unistd.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+// 耗 CPU 的步骤, 代替压缩/哈希
+static uint64_t hash_rounds(uint64_t seed, int rounds)
+{
+    uint64_t h = seed ^ 0xcbf29ce484222325ULL;
+    for (int i = 0; i < rounds; ++i)
+    {
+        h ^= (uint64_t)i;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static std::atomic<int> s_done = {0};
+static std::atomic<int> s_ticks = {0};
+static std::atomic<bool> s_finished = {false};
+
+void test_offload()
+{
+    static const int N = 8;
+    static const int ROUNDS = 50 * 1000 * 1000;
+    sylar::ComputePool::ptr pool(new sylar::ComputePool(2, "hash"));
+    uint64_t start = sylar::GetMonotonicMS();
+    for (int i = 0; i < N; ++i)
+    {
+        sylar::IOManager::GetThis()->schedule([pool, i]()
+                                              {
+            int thread = sylar::GetThreadId();
+            uint64_t h = pool->offload([i]()
+                                       { return hash_rounds(i, ROUNDS); });
+            // 在原来的线程上恢复, 结果与直接计算一致
+            SYLAR_ASSERT(sylar::GetThreadId() == thread);
+            SYLAR_ASSERT(h == hash_rounds(i, ROUNDS));
+            ++s_done; });
+    }
+    // 计算期间 IOManager 的线程继续运行其他协程
+    sylar::IOManager::GetThis()->schedule([]()
+                                          {
+        while (s_done < N)
+        {
+            ++s_ticks;
+            usleep(1000);
+        } });
+    while (s_done < N)
+    {
+        usleep(10 * 1000);
+    }
+    SYLAR_LOG_INFO(g_logger) << "offload tasks=" << N << " used=" << sylar::GetMonotonicMS() - start
+                             << "ms ticks while computing=" << s_ticks << " " << pool->dumpStat();
+    sylar::ComputePool::Stat stat;
+    pool->getStat(stat);
+    SYLAR_ASSERT(stat.completed == N && stat.saturated > 0 && stat.queueMax > 0 && s_ticks > 10);
+
+    // 异常在调用者的协程中重新抛出
+    bool caught = false;
+    try
+    {
+        pool->offload([]()
+                      { throw std::runtime_error("boom"); });
+    }
+    catch (const std::runtime_error &e)
+    {
+        caught = std::string(e.what()) == "boom";
+    }
+    SYLAR_ASSERT(caught);
+
+    // 默认的计算线程池, 返回值可以只能移动
+    std::unique_ptr<int> p = sylar::Offload([]()
+                                            { return std::unique_ptr<int>(new int(42)); });
+    SYLAR_ASSERT(p && *p == 42);
+    SYLAR_LOG_INFO(g_logger) << sylar::ComputeMgr::GetInstance()->dumpStat();
+    s_finished = true;
+}
+
+int main(int argc, char **argv)
+{
+    {
+        sylar::IOManager iom(1, false, "reactor");
+        iom.schedule(&test_offload);
+        // 挂起在计算线程池上的协程不算 IOManager 的任务, 等它结束再停止
+        while (!s_finished)
+        {
+            usleep(10 * 1000);
+        }
+    }
+    // 不在协程中直接执行
+    SYLAR_ASSERT(sylar::Offload([]()
+                                { return 1; }) == 1);
+    {
+        // use_caller 的线程在 stop 之前运行在主协程中, 挂起之后没有人调度回来, 直接执行
+        sylar::IOManager iom(1, true, "compute_caller");
+        sylar::ComputePool::Stat before;
+        sylar::ComputeMgr::GetInstance()->getStat(before);
+        SYLAR_ASSERT(sylar::Offload([]()
+                                    { return 2; }) == 2);
+        sylar::ComputePool::Stat after;
+        sylar::ComputeMgr::GetInstance()->getStat(after);
+        SYLAR_ASSERT(after.inlined == before.inlined + 1 && after.submitted == before.submitted);
+    }
+    return 0;
+}
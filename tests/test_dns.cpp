@@ -0,0 +1,240 @@
+#include "sylar.h"
+#include "iomanager.h"
+#include "address.h"
+#include "dns.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <thread>
+#include <map>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/**
+ * 本地的 DNS 桩服务器, 运行在普通线程中
+ * a.test: A 10.0.0.1 TTL 1s
+ * slow.test: 100ms 之后应答 A 10.0.0.2
+ * v6.test: AAAA ::2
+ * spoof.test: 先回一个 ID 相同但问题不同的伪造应答 A 6.6.6.6, 再回 A 10.0.0.3
+ * 其他: NXDOMAIN
+ */
+static int s_stub = -1;
+static uint16_t s_stub_port = 0;
+static std::atomic<bool> s_stop = {false};
+static sylar::Mutex s_mutex;
+static std::map<std::string, int> s_queries;
+
+static int queries(const std::string &name)
+{
+    sylar::Mutex::Lock lock(s_mutex);
+    return s_queries[name];
+}
+
+static void stub_server()
+{
+    uint8_t buf[512];
+    while (!s_stop)
+    {
+        pollfd pfd = {s_stub, POLLIN, 0};
+        if (poll(&pfd, 1, 10) <= 0)
+        {
+            continue;
+        }
+        sockaddr_in from;
+        socklen_t len = sizeof(from);
+        ssize_t n = recvfrom(s_stub, buf, sizeof(buf), 0, (sockaddr *)&from, &len);
+        if (n < 12)
+        {
+            continue;
+        }
+        std::string name;
+        size_t pos = 12;
+        while (pos < (size_t)n && buf[pos])
+        {
+            if (!name.empty())
+            {
+                name += ".";
+            }
+            name.append((const char *)buf + pos + 1, buf[pos]);
+            pos += buf[pos] + 1;
+        }
+        pos += 1;
+        uint16_t qtype = buf[pos] << 8 | buf[pos + 1];
+        pos += 4;
+        {
+            sylar::Mutex::Lock lock(s_mutex);
+            // A 和 AAAA 分别计数
+            ++s_queries[name + (qtype == 1 ? "/A" : "/AAAA")];
+        }
+
+        std::string rsp((const char *)buf, pos);
+        std::string rdata;
+        if (name == "spoof.test" && qtype == 1)
+        {
+            std::string fake = rsp;
+            fake[13] = 'x';
+            fake[2] = (char)0x81;
+            fake[3] = (char)0x80;
+            fake[7] = 1;
+            uint8_t rr[16] = {0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 6, 6, 6, 6};
+            fake.append((const char *)rr, sizeof(rr));
+            sendto(s_stub, fake.data(), fake.size(), 0, (sockaddr *)&from, len);
+            rdata.assign("\x0a\x00\x00\x03", 4);
+        }
+        else if (name == "a.test" && qtype == 1)
+        {
+            rdata.assign("\x0a\x00\x00\x01", 4);
+        }
+        else if (name == "slow.test" && qtype == 1)
+        {
+            usleep(100 * 1000);
+            rdata.assign("\x0a\x00\x00\x02", 4);
+        }
+        else if (name == "v6.test" && qtype == 28)
+        {
+            in6_addr addr;
+            inet_pton(AF_INET6, "::2", &addr);
+            rdata.assign((const char *)&addr, 16);
+        }
+        bool exists = name == "a.test" || name == "slow.test" || name == "v6.test" || name == "spoof.test"
+                      || name == "tc.test";
+        // tc.test 的应答带 TC 标记且没有记录, 模拟被截断的大应答
+        rsp[2] = (char)(name == "tc.test" ? 0x83 : 0x81);
+        rsp[3] = (char)(0x80 | (exists ? 0 : 3));
+        rsp[7] = rdata.empty() ? 0 : 1;
+        if (!rdata.empty())
+        {
+            uint32_t ttl = name == "a.test" ? 1 : 60;
+            uint8_t rr[12] = {0xc0, 0x0c, 0, (uint8_t)qtype, 0, 1,
+                              (uint8_t)(ttl >> 24), (uint8_t)(ttl >> 16), (uint8_t)(ttl >> 8), (uint8_t)ttl,
+                              0, (uint8_t)rdata.size()};
+            rsp.append((const char *)rr, sizeof(rr));
+            rsp.append(rdata);
+        }
+        sendto(s_stub, rsp.data(), rsp.size(), 0, (sockaddr *)&from, len);
+    }
+}
+
+static std::atomic<int> s_done = {0};
+static std::atomic<int> s_ticks = {0};
+
+void test_resolve()
+{
+    sylar::DnsResolver *dns = sylar::DnsResolverMgr::GetInstance();
+
+    // 并发解析同一个域名只查询一次, 等待期间线程上的其他协程继续运行
+    static const int N = 10;
+    uint64_t start = sylar::GetMonotonicMS();
+    for (int i = 0; i < N; ++i)
+    {
+        sylar::IOManager::GetThis()->schedule([dns]()
+                                              {
+            std::vector<sylar::IPAddress::ptr> addrs;
+            SYLAR_ASSERT(dns->resolve("slow.test", AF_INET, addrs) == sylar::DnsResolver::OK);
+            SYLAR_ASSERT(addrs.size() == 1 && addrs[0]->toString() == "10.0.0.2:0");
+            ++s_done; });
+    }
+    sylar::IOManager::GetThis()->schedule([]()
+                                          {
+        while (s_done < N)
+        {
+            ++s_ticks;
+            usleep(10 * 1000);
+        } });
+    while (s_done < N)
+    {
+        usleep(10 * 1000);
+    }
+    SYLAR_LOG_INFO(g_logger) << "coalesce resolvers=" << N << " queries=" << queries("slow.test/A")
+                             << " ticks while waiting=" << s_ticks << " used=" << sylar::GetMonotonicMS() - start << "ms";
+    SYLAR_ASSERT(queries("slow.test/A") == 1 && s_ticks >= 5);
+
+    // 按 TTL 缓存
+    std::vector<sylar::IPAddress::ptr> addrs;
+    SYLAR_ASSERT(dns->resolve("a.test", AF_INET, addrs) == sylar::DnsResolver::OK);
+    addrs.clear();
+    SYLAR_ASSERT(dns->resolve("A.TEST.", AF_INET, addrs) == sylar::DnsResolver::OK);
+    SYLAR_ASSERT(queries("a.test/A") == 1 && addrs[0]->toString() == "10.0.0.1:0");
+    usleep(1100 * 1000);
+    addrs.clear();
+    SYLAR_ASSERT(dns->resolve("a.test", AF_INET, addrs) == sylar::DnsResolver::OK);
+    SYLAR_LOG_INFO(g_logger) << "a.test queries after ttl=" << queries("a.test/A");
+    SYLAR_ASSERT(queries("a.test/A") == 2);
+
+    // 不存在的域名也缓存
+    addrs.clear();
+    SYLAR_ASSERT(dns->resolve("none.test", AF_INET, addrs) == sylar::DnsResolver::NOT_FOUND);
+    SYLAR_ASSERT(dns->resolve("none.test", AF_INET, addrs) == sylar::DnsResolver::NOT_FOUND);
+    SYLAR_ASSERT(queries("none.test/A") == 1 && addrs.empty());
+
+    // 被截断的应答不使用也不缓存, 与没有应答一样可以回退到 getaddrinfo
+    SYLAR_ASSERT(dns->resolve("tc.test", AF_INET, addrs) == sylar::DnsResolver::NO_ANSWER);
+    int tc_queries = queries("tc.test/A");
+    SYLAR_ASSERT(dns->resolve("tc.test", AF_INET, addrs) == sylar::DnsResolver::NO_ANSWER);
+    SYLAR_ASSERT(addrs.empty() && queries("tc.test/A") > tc_queries);
+
+    // AF_UNSPEC 同时查询 A 和 AAAA
+    SYLAR_ASSERT(dns->resolve("v6.test", AF_UNSPEC, addrs) == sylar::DnsResolver::OK);
+    SYLAR_ASSERT(addrs.size() == 1 && addrs[0]->getFamily() == AF_INET6);
+    SYLAR_ASSERT(queries("v6.test/A") == 1 && queries("v6.test/AAAA") == 1);
+
+    // 问题部分与查询不一致的应答不接受
+    addrs.clear();
+    SYLAR_ASSERT(dns->resolve("spoof.test", AF_INET, addrs) == sylar::DnsResolver::OK);
+    SYLAR_LOG_INFO(g_logger) << "spoof.test = " << addrs[0]->toString();
+    SYLAR_ASSERT(addrs.size() == 1 && addrs[0]->toString() == "10.0.0.3:0");
+
+    // 短域名加上搜索域查询, 以 '.' 结尾的不加
+    sylar::Config::Lookup<std::vector<std::string> >("dns.search")->setValue({"test"});
+    addrs.clear();
+    SYLAR_ASSERT(dns->resolve("slow", AF_INET, addrs) == sylar::DnsResolver::OK);
+    SYLAR_ASSERT(addrs.size() == 1 && addrs[0]->toString() == "10.0.0.2:0" && queries("slow/A") == 0);
+    addrs.clear();
+    SYLAR_ASSERT(dns->resolve("missing", AF_INET, addrs) == sylar::DnsResolver::NOT_FOUND);
+    SYLAR_ASSERT(queries("missing.test/A") == 1 && queries("missing/A") == 1);
+    SYLAR_ASSERT(dns->resolve("other.", AF_INET, addrs) == sylar::DnsResolver::NOT_FOUND);
+    SYLAR_ASSERT(queries("other.test/A") == 0 && queries("other/A") == 1);
+    // 点的个数达到 ndots(默认 1) 时先按原样查询
+    SYLAR_ASSERT(dns->resolve("v6.test", AF_INET6, addrs) == sylar::DnsResolver::OK);
+    SYLAR_ASSERT(queries("v6.test.test/AAAA") == 0);
+    sylar::Config::Lookup<std::vector<std::string> >("dns.search")->setValue({});
+
+    // Address::Lookup 在协程中使用 DnsResolver, /etc/hosts 中的域名不查询
+    sylar::Address::ptr addr = sylar::Address::LookupAny("a.test:8080");
+    SYLAR_LOG_INFO(g_logger) << "LookupAny a.test:8080 = " << (addr ? addr->toString() : "null");
+    SYLAR_ASSERT(addr && addr->toString() == "10.0.0.1:8080");
+    addr = sylar::Address::LookupAny("localhost:80", AF_INET);
+    SYLAR_ASSERT(addr && addr->toString() == "127.0.0.1:80" && queries("localhost/A") == 0);
+    // 服务器应答了不存在(这里命中缓存)时不回退到 getaddrinfo
+    addr = sylar::Address::LookupAny("none.test:80", AF_INET);
+    SYLAR_ASSERT(!addr && queries("none.test/A") == 1);
+    SYLAR_LOG_INFO(g_logger) << dns->dumpStat();
+}
+
+int main(int argc, char **argv)
+{
+    s_stub = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(s_stub, (sockaddr *)&addr, len);
+    getsockname(s_stub, (sockaddr *)&addr, &len);
+    s_stub_port = ntohs(addr.sin_port);
+    std::thread stub(&stub_server);
+
+    sylar::Config::Lookup<std::vector<std::string> >("dns.servers")
+        ->setValue({"127.0.0.1:" + std::to_string(s_stub_port)});
+    {
+        sylar::IOManager iom(1, false, "dns");
+        iom.schedule(&test_resolve);
+    }
+    s_stop = true;
+    stub.join();
+    close(s_stub);
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "sylar.h"
+#include "iomanager.h"
+#include "fd_manager.h"
+#include <sys/socket.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+// 在栈上使用 n 字节
+static int use_stack(size_t n)
+{
+    volatile char buf[1024];
+    memset((char *)buf, 1, sizeof(buf));
+    if (n <= sizeof(buf))
+    {
+        return buf[0];
+    }
+    return use_stack(n - sizeof(buf)) + buf[1];
+}
+
+void shallow()
+{
+    use_stack(4 * 1024);
+}
+
+void deep()
+{
+    use_stack(64 * 1024);
+}
+
+void test_stack_profile()
+{
+    sylar::Config::Lookup<bool>("fiber.stack_profile")->setValue(true);
+    sylar::Config::Lookup<bool>("fiber.stack_auto_size")->setValue(true);
+    sylar::Config::Lookup<uint32_t>("fiber.stack_min_samples")->setValue(10);
+
+    for (int i = 0; i < 20; ++i)
+    {
+        sylar::Fiber::ptr f1(new sylar::Fiber(&shallow, 0, true));
+        f1->call();
+        sylar::Fiber::ptr f2(new sylar::Fiber(&deep, 0, true));
+        f2->call();
+        SYLAR_LOG_INFO(g_logger) << "shallow used=" << f1->getStackUsed()
+                                 << " deep used=" << f2->getStackUsed();
+    }
+
+    sylar::Fiber::ptr f3(new sylar::Fiber(&shallow, 0, true));
+    sylar::Fiber::ptr f4(new sylar::Fiber(&deep, 0, true));
+    SYLAR_LOG_INFO(g_logger) << "auto size shallow=" << f3->getStackSize()
+                             << " deep=" << f4->getStackSize();
+    SYLAR_ASSERT(f3->getStackSize() < f4->getStackSize());
+    f3->call();
+    f4->call();
+
+    // 复用的协程切换到更深的入口时栈会被扩大
+    sylar::Fiber::ptr f5(new sylar::Fiber(&shallow, 0, true));
+    f5->call();
+    f5->reset(&deep);
+    SYLAR_ASSERT(f5->getStackSize() >= f4->getStackSize());
+
+    SYLAR_LOG_INFO(g_logger) << sylar::FiberStackProfilerMgr::GetInstance()->toString();
+}
+
+static size_t s_depth = 4 * 1024;
+
+void variable()
+{
+    use_stack(s_depth);
+}
+
+// 自动调整的栈按最大使用量确定大小, 超出时碰到保护页, 而不是改写堆
+void test_stack_guard()
+{
+    for (int i = 0; i < 20; ++i)
+    {
+        s_depth = i == 0 ? 32 * 1024 : 4 * 1024;
+        sylar::Fiber::ptr f(new sylar::Fiber(&variable, 0, true));
+        f->call();
+    }
+    sylar::Fiber::ptr f(new sylar::Fiber(&variable, 0, true));
+    SYLAR_LOG_INFO(g_logger) << "auto size variable=" << f->getStackSize();
+    // 只出现过一次的 32K 也要容纳
+    SYLAR_ASSERT(f->getStackSize() >= 32 * 1024 && f->getStackSize() < 1024 * 1024);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        s_depth = 2 * 1024 * 1024;
+        f->call();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    SYLAR_LOG_INFO(g_logger) << "overflow child signaled=" << WIFSIGNALED(status)
+                             << " sig=" << (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    SYLAR_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    s_depth = 4 * 1024;
+    f->call();
+
+    // 关闭 profiler 之后复用缩小过的栈, 按默认大小重新分配
+    sylar::Config::Lookup<bool>("fiber.stack_profile")->setValue(false);
+    f->reset(&deep);
+    SYLAR_LOG_INFO(g_logger) << "reset without profiler stack=" << f->getStackSize();
+    SYLAR_ASSERT(f->getStackSize() == 1024 * 1024);
+    sylar::Config::Lookup<bool>("fiber.stack_profile")->setValue(true);
+}
+
+void heavy()
+{
+    sylar::Fiber::SetTag("heavy");
+    volatile uint64_t sum = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 10000000; ++j)
+        {
+            sum += j;
+        }
+        sylar::Fiber::YieldToReady();
+    }
+    sylar::Fiber::ptr cur = sylar::Fiber::GetThis();
+    SYLAR_LOG_INFO(g_logger) << "heavy cpu_us=" << cur->getCpuTime() / 1000
+                             << " swaps=" << cur->getSwapCount();
+}
+
+void light()
+{
+    sylar::Fiber::SetTag("light");
+}
+
+void test_cpu_accounting()
+{
+    sylar::Config::Lookup<bool>("fiber.accounting")->setValue(true);
+    {
+        sylar::Scheduler sc(2, false, "acct");
+        sc.start();
+        sc.schedule(&heavy);
+        for (int i = 0; i < 100; ++i)
+        {
+            sc.schedule(&light);
+        }
+        sc.stop();
+    }
+    SYLAR_LOG_INFO(g_logger) << sylar::FiberCpuProfilerMgr::GetInstance()->toString();
+}
+
+void test_registry()
+{
+    sylar::Config::Lookup<bool>("fiber.registry")->setValue(true);
+    sylar::IOManager iom(1, false, "registry");
+    static int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    sylar::FdMgr::GetInstance()->get(fds[0], true);
+    sylar::FdMgr::GetInstance()->get(fds[1], true);
+
+    iom.schedule([]()
+                 {
+        char buf[16];
+        // 阻塞在 fds[0] 的读事件上
+        int rt = recv(fds[0], buf, sizeof(buf), 0);
+        SYLAR_LOG_INFO(g_logger) << "recv rt=" << rt; });
+    iom.schedule([]()
+                 {
+        usleep(100 * 1000);
+        SYLAR_LOG_INFO(g_logger) << sylar::FiberRegistryMgr::GetInstance()->dump();
+        send(fds[1], "x", 1, 0);
+        close(fds[0]);
+        close(fds[1]); });
+}
+
+int main(int argc, char **argv)
+{
+    sylar::Thread::SetName("main");
+    sylar::Fiber::GetThis();
+    test_stack_profile();
+    test_stack_guard();
+    test_cpu_accounting();
+    test_registry();
+    return 0;
+}
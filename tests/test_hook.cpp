@@ -9,10 +9,36 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <iostream>
+#include <atomic>
+#include "fd_manager.h"
+#include "macro.h"
+#include "file_io.h"
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
+// 统计堆分配次数
+static std::atomic<uint64_t> s_news = {0};
+void *operator new(size_t size)
+{
+    ++s_news;
+    void *p = malloc(size);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
 void test_sleep()
 {
     sylar::IOManager iom(1);
@@ -67,8 +93,317 @@ void test_sock()
 
 }
 
+// 带超时的阻塞读: 超时返回 ETIMEDOUT, 每次读不因为超时多分配内存
+void test_timeout()
+{
+    static const int N = 10000;
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    sylar::FdMgr::GetInstance()->get(fds[0], true);
+    sylar::FdMgr::GetInstance()->get(fds[1], true);
+
+    char c = 0;
+    timeval tv = {0, 50 * 1000};
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    uint64_t start = sylar::GetMonotonicUS();
+    int rt = recv(fds[0], &c, 1, 0);
+    uint64_t used = sylar::GetMonotonicUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "recv timeout rt=" << rt << " errno=" << errno << " used=" << used << "us";
+    SYLAR_ASSERT(rt == -1 && errno == ETIMEDOUT && used >= 50 * 1000);
+
+    // 对端协程每次先让出再写, 读总是先挂起
+    static int s_fd = fds[1];
+    static uint64_t s_news_per_read[2];
+    for (int timeout = 0; timeout < 2; ++timeout)
+    {
+        sylar::FdMgr::GetInstance()->get(fds[0])->setTimeout(SO_RCVTIMEO, timeout ? 10 * 1000 : -1);
+        sylar::IOManager::GetThis()->schedule([]()
+                                              {
+            char c = 'x';
+            for (int i = 0; i < N; ++i)
+            {
+                sylar::Fiber::YieldToReady();
+                write(s_fd, &c, 1);
+            } });
+        uint64_t news = s_news;
+        for (int i = 0; i < N; ++i)
+        {
+            rt = recv(fds[0], &c, 1, 0);
+            SYLAR_ASSERT(rt == 1);
+        }
+        s_news_per_read[timeout] = (s_news - news) / N;
+        SYLAR_LOG_INFO(g_logger) << "timeout=" << timeout << " reads=" << N
+                                 << " operator new per read=" << s_news_per_read[timeout];
+    }
+    SYLAR_ASSERT(s_news_per_read[1] == s_news_per_read[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// 句柄在 IOManager 之外被关闭(这里是没有 hook 的主线程), 句柄号被复用后等待仍然能被唤醒
+static int s_reuse_fds[2] = {-1, -1};
+static std::atomic<int> s_reuse_step = {0};
+
+void reuse_wait()
+{
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    if (s_reuse_fds[0] != -1)
+    {
+        SYLAR_ASSERT(fds[0] == s_reuse_fds[0] && fds[1] == s_reuse_fds[1]);
+    }
+    s_reuse_fds[0] = fds[0];
+    s_reuse_fds[1] = fds[1];
+    sylar::FdMgr::GetInstance()->get(fds[0], true)->setTimeout(SO_RCVTIMEO, 1000);
+    sylar::FdMgr::GetInstance()->get(fds[1], true);
+    sylar::IOManager::GetThis()->schedule([]()
+                                          {
+        usleep(20 * 1000);
+        write(s_reuse_fds[1], "x", 1); });
+    char c = 0;
+    uint64_t start = sylar::GetMonotonicUS();
+    int rt = recv(fds[0], &c, 1, 0);
+    SYLAR_LOG_INFO(g_logger) << "reuse step=" << s_reuse_step << " fd=" << fds[0] << " recv rt=" << rt
+                             << " errno=" << errno << " used=" << sylar::GetMonotonicUS() - start << "us";
+    SYLAR_ASSERT(rt == 1 && c == 'x');
+    ++s_reuse_step;
+}
+
+void test_fd_reuse()
+{
+    sylar::IOManager iom(1, false, "reuse");
+    iom.schedule(&reuse_wait);
+    while (s_reuse_step < 1)
+    {
+        usleep(1000);
+    }
+    // 主线程没有开启 hook, 不会经过 cancelAll
+    close(s_reuse_fds[0]);
+    close(s_reuse_fds[1]);
+    iom.schedule(&reuse_wait);
+    while (s_reuse_step < 2)
+    {
+        usleep(1000);
+    }
+    close(s_reuse_fds[0]);
+    close(s_reuse_fds[1]);
+}
+
+// 只有一个线程, poll/select/epoll_wait 阻塞线程的话写端协程要等到超时之后才能运行
+void test_poll()
+{
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    static int s_fd = fds[1];
+    auto write_later = []()
+    {
+        sylar::IOManager::GetThis()->schedule([]()
+                                              {
+            usleep(20 * 1000);
+            char c = 'x';
+            write(s_fd, &c, 1); });
+    };
+    char c = 0;
+
+    pollfd pfd = {fds[0], POLLIN, 0};
+    uint64_t start = sylar::GetMonotonicUS();
+    int rt = poll(&pfd, 1, 30);
+    uint64_t used = sylar::GetMonotonicUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "poll timeout rt=" << rt << " used=" << used << "us";
+    SYLAR_ASSERT(rt == 0 && used >= 30 * 1000);
+
+    write_later();
+    start = sylar::GetMonotonicUS();
+    rt = poll(&pfd, 1, 1000);
+    used = sylar::GetMonotonicUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "poll rt=" << rt << " revents=" << pfd.revents << " used=" << used << "us";
+    SYLAR_ASSERT(rt == 1 && (pfd.revents & POLLIN) && used < 500 * 1000);
+    SYLAR_ASSERT(read(fds[0], &c, 1) == 1);
+
+    // 同一个句柄出现两次, 合并之后只注册一次
+    write_later();
+    pollfd twice[2] = {{fds[0], POLLIN, 0}, {fds[0], POLLIN, 0}};
+    rt = poll(twice, 2, 1000);
+    SYLAR_LOG_INFO(g_logger) << "poll same fd twice rt=" << rt;
+    SYLAR_ASSERT(rt == 2 && (twice[0].revents & POLLIN) && (twice[1].revents & POLLIN));
+    SYLAR_ASSERT(read(fds[0], &c, 1) == 1);
+
+    // 其他协程已经在 read 中等待这个句柄, poll 退回到阻塞的 poll_f
+    sylar::FdMgr::GetInstance()->get(fds[0], true)->setTimeout(SO_RCVTIMEO, 1000);
+    static int s_rfd = fds[0];
+    static std::atomic<int> s_read_rt = {-2};
+    sylar::IOManager::GetThis()->schedule([]()
+                                          {
+        char b;
+        s_read_rt = read(s_rfd, &b, 1); });
+    usleep(5 * 1000);
+    rt = poll(&pfd, 1, 30);
+    SYLAR_LOG_INFO(g_logger) << "poll while read waiting rt=" << rt;
+    SYLAR_ASSERT(rt == 0);
+    SYLAR_ASSERT(write(fds[1], "x", 1) == 1);
+    while (s_read_rt == -2)
+    {
+        usleep(1000);
+    }
+    SYLAR_ASSERT(s_read_rt == 1);
+
+    write_later();
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(fds[0], &rfds);
+    timeval tv = {1, 0};
+    start = sylar::GetMonotonicUS();
+    rt = select(fds[0] + 1, &rfds, nullptr, nullptr, &tv);
+    used = sylar::GetMonotonicUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "select rt=" << rt << " used=" << used << "us left=" << tv.tv_sec * 1000 + tv.tv_usec / 1000 << "ms";
+    SYLAR_ASSERT(rt == 1 && FD_ISSET(fds[0], &rfds) && used < 500 * 1000);
+    SYLAR_ASSERT(read(fds[0], &c, 1) == 1);
+
+    write_later();
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[0];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev);
+    start = sylar::GetMonotonicUS();
+    rt = epoll_wait(epfd, &ev, 1, 1000);
+    used = sylar::GetMonotonicUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "epoll_wait rt=" << rt << " used=" << used << "us";
+    SYLAR_ASSERT(rt == 1 && ev.data.fd == fds[0] && used < 500 * 1000);
+    SYLAR_ASSERT(read(fds[0], &c, 1) == 1);
+    close(epfd);
+
+    // dup 出来的句柄继承超时, 读也会挂起协程
+    sylar::FdMgr::GetInstance()->get(fds[0], true)->setTimeout(SO_RCVTIMEO, 1000);
+    int nfd = dup(fds[0]);
+    sylar::FdCtx *nctx = sylar::FdMgr::GetInstance()->get(nfd);
+    SYLAR_ASSERT(nctx && nctx->isSocket() && nctx->getTimeout(SO_RCVTIMEO) == 1000);
+    write_later();
+    start = sylar::GetMonotonicUS();
+    rt = read(nfd, &c, 1);
+    used = sylar::GetMonotonicUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "read dup fd rt=" << rt << " used=" << used << "us";
+    SYLAR_ASSERT(rt == 1 && used < 500 * 1000);
+    close(nfd);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// 协程中打开的普通文件, 大的读写和 fsync 在 FileIoPool 上执行, 小的读写直接执行
+void test_file_io()
+{
+    static const size_t SIZE = 4 * 1024 * 1024;
+    static const size_t CHUNK = 256 * 1024;
+    char path[] = "/tmp/sylar_file_io_XXXXXX";
+    close(mkstemp(path));
+    sylar::FileIoPool::Stat before;
+    sylar::FileIoMgr::GetInstance()->getStat(before);
+
+    // 一直让出的协程, 文件操作挂起时它可以继续运行
+    static std::atomic<bool> s_running = {true};
+    static std::atomic<int> s_ticks = {0};
+    sylar::IOManager::GetThis()->schedule([]()
+                                          {
+        while (s_running)
+        {
+            ++s_ticks;
+            sylar::Fiber::YieldToReady();
+        } });
+
+    int fd = open(path, O_RDWR | O_TRUNC);
+    SYLAR_ASSERT(fd >= 0);
+    sylar::FdCtx *ctx = sylar::FdMgr::GetInstance()->get(fd);
+    SYLAR_ASSERT(ctx && ctx->isFile() && !ctx->isSocket());
+    std::string data(CHUNK, 0);
+    uint64_t start = sylar::GetMonotonicUS();
+    for (size_t off = 0; off < SIZE; off += CHUNK)
+    {
+        memset(&data[0], 'a' + off / CHUNK % 26, CHUNK);
+        SYLAR_ASSERT(write(fd, data.data(), CHUNK) == (ssize_t)CHUNK);
+    }
+    SYLAR_ASSERT(fsync(fd) == 0);
+    std::string buf(CHUNK, 0);
+    SYLAR_ASSERT(pread(fd, &buf[0], CHUNK, CHUNK) == (ssize_t)CHUNK && buf[0] == 'b' && buf[CHUNK - 1] == 'b');
+    SYLAR_ASSERT(pwrite(fd, data.data(), CHUNK, 0) == (ssize_t)CHUNK);
+    lseek(fd, 0, SEEK_SET);
+    SYLAR_ASSERT(read(fd, &buf[0], CHUNK) == (ssize_t)CHUNK && buf == data);
+    // 小于阈值的读直接执行
+    char small[100];
+    SYLAR_ASSERT(read(fd, small, sizeof(small)) == (ssize_t)sizeof(small) && small[0] == 'b');
+    uint64_t used = sylar::GetMonotonicUS() - start;
+    close(fd);
+    s_running = false;
+
+    // 读写出错时 errno 传回协程
+    SYLAR_ASSERT(open("/nonexistent/sylar", O_RDONLY) == -1 && errno == ENOENT);
+    unlink(path);
+
+    sylar::FileIoPool::Stat after;
+    sylar::FileIoMgr::GetInstance()->getStat(after);
+    SYLAR_LOG_INFO(g_logger) << "file io size=" << SIZE << " used=" << used << "us ticks while io=" << s_ticks
+                             << " " << sylar::FileIoMgr::GetInstance()->dumpStat();
+    // open x2, write x16, fsync, pread, pwrite, read
+    SYLAR_ASSERT(after.submitted - before.submitted == 2 + SIZE / CHUNK + 4);
+    SYLAR_ASSERT(after.inlined - before.inlined == 1);
+    SYLAR_ASSERT(s_ticks > 0);
+}
+
+// FdCtx 不会释放, 句柄号复用时原地重新初始化并且代数加一; 查询不加锁
+void test_fd_manager()
+{
+    sylar::FdManager *mgr = sylar::FdMgr::GetInstance();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sylar::FdCtx *ctx = mgr->get(fd, true);
+    SYLAR_ASSERT(ctx && ctx->isSocket() && mgr->get(fd) == ctx);
+    uint32_t generation = ctx->getGeneration();
+    ctx->setTimeout(SO_RCVTIMEO, 1000);
+    mgr->del(fd);
+    SYLAR_ASSERT(!mgr->get(fd) && ctx->isClose());
+    SYLAR_ASSERT(mgr->get(fd, true) == ctx && ctx->getGeneration() == generation + 1);
+    SYLAR_ASSERT(!ctx->isClose() && ctx->getTimeout(SO_RCVTIMEO) == (uint64_t)-1);
+    SYLAR_ASSERT(!mgr->get(-1, true) && !mgr->get(sylar::FdManager::MAX_FDS, true));
+    // 超出容量的句柄不是静默地不 hook, 而是报错并设置 EMFILE
+    errno = 0;
+    SYLAR_ASSERT(!mgr->create(sylar::FdManager::MAX_FDS) && errno == EMFILE);
+
+    static const int N = 10000000;
+    uint64_t start = sylar::GetMonotonicUS();
+    size_t hits = 0;
+    for (int i = 0; i < N; ++i)
+    {
+        hits += mgr->get(fd) != nullptr;
+    }
+    uint64_t used = sylar::GetMonotonicUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "FdManager get x" << N << " used=" << used << "us ("
+                             << used * 1000.0 / N << "ns/op) hits=" << hits;
+    SYLAR_ASSERT(hits == (size_t)N);
+    mgr->del(fd);
+    close(fd);
+}
+
 int main(int argc, char ** argv)
 {
+    test_fd_manager();
+    test_fd_reuse();
+    {
+        sylar::IOManager iom(1, false, "file_io");
+        iom.schedule(test_file_io);
+    }
+    {
+        // use_caller 的线程在 stop 之前运行在主协程中, 挂起之后没有人调度回来, 直接执行
+        sylar::IOManager iom(1, true, "file_io_caller");
+        SYLAR_ASSERT(sylar::FileIoMgr::GetInstance()->run([]()
+                                                          { return (ssize_t)1; }) == 1);
+    }
+    {
+        sylar::IOManager iom(1, false, "poll");
+        iom.schedule(test_poll);
+    }
+    {
+        sylar::IOManager iom(1, false, "timeout");
+        iom.schedule(test_timeout);
+    }
     // test_sleep();
     sylar::IOManager iom;
     iom.schedule(test_sock);
@@ -1,8 +1,10 @@
 #include "sylar.h"
 #include "iomanager.h"
+#include "fd_manager.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <string.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -84,9 +86,701 @@ void test_timer()
         true);
 }
 
+// 同一线程上两个协程通过 socketpair 互相唤醒, 对比 scheduler.direct_handoff 开关的耗时
+void test_handoff(bool direct)
+{
+    static const int N = 100000;
+    sylar::Config::Lookup<bool>("scheduler.direct_handoff")->setValue(direct);
+    static int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    sylar::FdMgr::GetInstance()->get(fds[0], true);
+    sylar::FdMgr::GetInstance()->get(fds[1], true);
+    uint64_t start = sylar::GetCurrentMS();
+    {
+        sylar::IOManager iom(1, false, "handoff");
+        iom.schedule([]()
+                     {
+            char c = 0;
+            for (int i = 0; i < N; ++i)
+            {
+                recv(fds[0], &c, 1, 0);
+                send(fds[0], &c, 1, 0);
+            } });
+        iom.schedule([]()
+                     {
+            char c = 0;
+            for (int i = 0; i < N; ++i)
+            {
+                send(fds[1], &c, 1, 0);
+                recv(fds[1], &c, 1, 0);
+            }
+            close(fds[0]);
+            close(fds[1]); });
+    }
+    SYLAR_LOG_INFO(g_logger) << "direct_handoff=" << direct << " round trips=" << N
+                             << " used=" << sylar::GetCurrentMS() - start << "ms";
+}
+
+// 任务协程唤醒的协程不能留在本线程的 next 槽位, 否则要等唤醒者执行完, 其他线程只能空闲
+void test_handoff_busy_waker()
+{
+    sylar::Config::Lookup<bool>("scheduler.direct_handoff")->setValue(true);
+    static int fds[2];
+    static std::atomic<uint64_t> s_delay = {0};
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    {
+        sylar::IOManager iom(2, false, "busy_waker");
+        iom.schedule([]()
+                     {
+            sylar::IOManager *iom = sylar::IOManager::GetThis();
+            static uint64_t s_woken = 0;
+            // 唤醒者固定在本线程上, 本协程让出之后才会执行
+            iom->schedule([iom]()
+                          {
+                s_woken = sylar::GetMonotonicMS();
+                iom->cancelEvent(fds[0], sylar::IOManager::READ);
+                while (sylar::GetMonotonicMS() - s_woken < 300)
+                {
+                } }, sylar::GetThreadId());
+            iom->addEvent(fds[0], sylar::IOManager::READ);
+            sylar::Fiber::YieldToHold();
+            s_delay = sylar::GetMonotonicMS() - s_woken;
+            close(fds[0]);
+            close(fds[1]); });
+    }
+    SYLAR_LOG_INFO(g_logger) << "woken by busy fiber, resumed after " << s_delay << "ms";
+    SYLAR_ASSERT(s_delay < 200);
+}
+
+// use_caller 的调用线程在 stop() 之前不等待它的 reactor, 工作线程还没认领 reactor 时注册的句柄也不能放在上面
+void test_reactor_before_claim()
+{
+    static const int PAIRS = 4;
+    static int fds[PAIRS][2];
+    static std::atomic<int> s_got = {0};
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(true);
+    {
+        sylar::IOManager iom(2, true, "claim");
+        // 工作线程先忙一会, 之后的协程在它进入 idle 之前注册句柄
+        iom.schedule([]()
+                     {
+            uint64_t start = sylar::GetMonotonicMS();
+            while (sylar::GetMonotonicMS() - start < 50)
+            {
+            } });
+        for (int i = 0; i < PAIRS; ++i)
+        {
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+            sylar::FdMgr::GetInstance()->get(fds[i][0], true);
+            iom.schedule([i]()
+                         {
+                char c;
+                if (recv(fds[i][0], &c, 1, 0) == 1)
+                {
+                    ++s_got;
+                } });
+        }
+        usleep(100 * 1000);
+        for (int i = 0; i < PAIRS; ++i)
+        {
+            SYLAR_ASSERT(write(fds[i][1], "x", 1) == 1);
+        }
+        uint64_t start = sylar::GetMonotonicMS();
+        while (s_got < PAIRS && sylar::GetMonotonicMS() - start < 1000)
+        {
+            usleep(10 * 1000);
+        }
+        SYLAR_LOG_INFO(g_logger) << "reads served before stop=" << s_got << "/" << PAIRS;
+        SYLAR_ASSERT(s_got == PAIRS);
+    }
+    for (int i = 0; i < PAIRS; ++i)
+    {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(false);
+}
+
+// 多个连接在 4 个线程上同时 ping-pong, 对比共用一个 epoll 和每线程一个 epoll
+void test_reactor(bool multi)
+{
+    static const int PAIRS = 32;
+    static const int N = 5000;
+    static std::atomic<int> s_done;
+    s_done = 0;
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(multi);
+    uint64_t start = sylar::GetCurrentMS();
+    {
+        sylar::IOManager iom(4, false, "reactor");
+        SYLAR_ASSERT(iom.isMultiReactor() == multi);
+        for (int i = 0; i < PAIRS; ++i)
+        {
+            int fds[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+            sylar::FdMgr::GetInstance()->get(fds[0], true);
+            sylar::FdMgr::GetInstance()->get(fds[1], true);
+            int a = fds[0];
+            int b = fds[1];
+            iom.schedule([a]()
+                         {
+                char c = 0;
+                for (int i = 0; i < N; ++i)
+                {
+                    recv(a, &c, 1, 0);
+                    send(a, &c, 1, 0);
+                }
+                close(a); });
+            iom.schedule([b]()
+                         {
+                char c = 0;
+                for (int i = 0; i < N; ++i)
+                {
+                    send(b, &c, 1, 0);
+                    SYLAR_ASSERT(recv(b, &c, 1, 0) == 1);
+                }
+                close(b);
+                ++s_done; });
+        }
+    }
+    SYLAR_ASSERT(s_done == PAIRS);
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "multi_reactor=" << multi << " pairs=" << PAIRS << " round trips=" << N
+                             << " used=" << sylar::GetCurrentMS() - start << "ms";
+}
+
+// 多个连接在 2 个线程上 ping-pong, 统计协程被唤醒后换了线程的次数
+void test_locality(bool on)
+{
+    static const int PAIRS = 16;
+    static const int N = 2000;
+    static std::atomic<uint64_t> s_migrations;
+    s_migrations = 0;
+    sylar::Config::Lookup<bool>("scheduler.locality")->setValue(on);
+    uint64_t start = sylar::GetCurrentMS();
+    sylar::Scheduler::LocalityStat stat;
+    {
+        sylar::IOManager iom(2, false, "locality");
+        for (int i = 0; i < PAIRS; ++i)
+        {
+            int fds[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+            sylar::FdMgr::GetInstance()->get(fds[0], true);
+            sylar::FdMgr::GetInstance()->get(fds[1], true);
+            for (int j = 0; j < 2; ++j)
+            {
+                int fd = fds[j];
+                bool first = j == 0;
+                iom.schedule([fd, first]()
+                             {
+                    char c = 0;
+                    int tid = sylar::GetThreadId();
+                    uint64_t migrations = 0;
+                    for (int i = 0; i < N; ++i)
+                    {
+                        if (first)
+                        {
+                            send(fd, &c, 1, 0);
+                        }
+                        recv(fd, &c, 1, 0);
+                        if (!first)
+                        {
+                            send(fd, &c, 1, 0);
+                        }
+                        int cur = sylar::GetThreadId();
+                        migrations += cur != tid;
+                        tid = cur;
+                    }
+                    s_migrations += migrations;
+                    close(fd); });
+            }
+        }
+        iom.schedule([]()
+                     {
+            usleep(10 * 1000);
+            SYLAR_LOG_INFO(g_logger) << sylar::IOManager::GetThis()->dumpLocalityStat(); });
+        iom.getLocalityStat(stat);
+    }
+    sylar::Config::Lookup<bool>("scheduler.locality")->setValue(true);
+    SYLAR_LOG_INFO(g_logger) << "locality=" << on << " pairs=" << PAIRS << " round trips=" << N
+                             << " migrations=" << s_migrations
+                             << " used=" << sylar::GetCurrentMS() - start << "ms";
+    SYLAR_ASSERT(on || stat.preferred == 0);
+}
+
+// 大量句柄同时就绪, epoll_wait 的批量从 4 开始翻倍增长
+void test_epoll_batch()
+{
+    static const int PAIRS = 256;
+    static int fds[PAIRS][2];
+    sylar::Config::Lookup<uint32_t>("iomanager.epoll.batch")->setValue(4);
+    sylar::Config::Lookup<uint32_t>("iomanager.epoll.max_batch")->setValue(128);
+    sylar::IOManager iom(1, false, "batch");
+    for (int i = 0; i < PAIRS; ++i)
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+        sylar::FdMgr::GetInstance()->get(fds[i][0], true);
+        sylar::FdMgr::GetInstance()->get(fds[i][1], true);
+        int fd = fds[i][0];
+        iom.schedule([fd]()
+                     {
+            char c = 0;
+            for (int i = 0; i < 10; ++i)
+            {
+                recv(fd, &c, 1, 0);
+            }
+            close(fd); });
+    }
+    iom.schedule([]()
+                 {
+        // 等所有接收方都挂起之后一起写
+        usleep(50 * 1000);
+        char c = 'x';
+        for (int n = 0; n < 10; ++n)
+        {
+            for (int i = 0; i < PAIRS; ++i)
+            {
+                send(fds[i][1], &c, 1, 0);
+            }
+            usleep(10 * 1000);
+        }
+        usleep(50 * 1000);
+        for (int i = 0; i < PAIRS; ++i)
+        {
+            close(fds[i][1]);
+        }
+        sylar::IOManager::EpollStat stat;
+        sylar::IOManager::GetThis()->getEpollStat(stat);
+        SYLAR_LOG_INFO(g_logger) << sylar::IOManager::GetThis()->dumpEpollStat();
+        SYLAR_ASSERT(stat.batch == 128);
+        sylar::Config::Lookup<uint32_t>("iomanager.epoll.batch")->setValue(64);
+        sylar::Config::Lookup<uint32_t>("iomanager.epoll.max_batch")->setValue(4096); });
+}
+
+// 微秒级的 usleep 由 timerfd 唤醒, 不再变成 0ms 定时器忙等
+void test_usleep(bool multi)
+{
+    static const int FIBERS = 8;
+    static const int N = 500;
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(multi);
+    {
+        sylar::IOManager iom(2, false, "usleep");
+        for (int f = 0; f < FIBERS; ++f)
+        {
+            iom.schedule([f, multi]()
+                         {
+                useconds_t us = 100 + f * 50;
+                uint64_t start = sylar::GetMonotonicUS();
+                for (int i = 0; i < N; ++i)
+                {
+                    usleep(us);
+                }
+                uint64_t avg = (sylar::GetMonotonicUS() - start) / N;
+                SYLAR_LOG_INFO(g_logger) << "multi_reactor=" << multi << " usleep(" << us
+                                         << ") avg=" << avg << "us";
+                SYLAR_ASSERT(avg >= us && avg < us + 1000); });
+        }
+    }
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(false);
+}
+
+// 大量带超时的等待: 加入后一半被取消, 对比有序集合和时间轮
+void test_timer_wheel(bool wheel)
+{
+    static const int N = 100000;
+    static std::atomic<int> s_fired;
+    static std::atomic<int> s_early;
+    s_fired = 0;
+    s_early = 0;
+    sylar::Config::Lookup<bool>("timer.wheel.enable")->setValue(wheel);
+    {
+        sylar::IOManager iom(1, false, "wheel");
+        SYLAR_ASSERT(iom.isWheel() == wheel);
+        iom.schedule([wheel]()
+                     {
+            sylar::IOManager *iom = sylar::IOManager::GetThis();
+            std::vector<sylar::Timer::ptr> timers(N);
+            uint64_t start = sylar::GetMonotonicUS();
+            for (int i = 0; i < N; ++i)
+            {
+                uint64_t us = 1000 + (i * 7919) % 100000;
+                uint64_t deadline = sylar::GetMonotonicUS() + us;
+                timers[i] = iom->addTimerUs(us, [deadline]()
+                                            {
+                    ++s_fired;
+                    if (sylar::GetMonotonicUS() < deadline)
+                    {
+                        ++s_early;
+                    } });
+            }
+            for (int i = 0; i < N; i += 2)
+            {
+                timers[i]->cancel();
+            }
+            uint64_t used = sylar::GetMonotonicUS() - start;
+            // 超出最高层范围的定时器和循环定时器
+            sylar::Timer::ptr far = iom->addTimer(100ull * 24 * 3600 * 1000, []() {});
+            static int s_ticks = 0;
+            static sylar::Timer::ptr s_recurring;
+            s_recurring = iom->addTimer(10, []()
+                                        {
+                if (++s_ticks == 5)
+                {
+                    s_recurring->cancel();
+                } }, true);
+            timers.clear();
+            // 回调都在这一个线程上执行, 等它们跑完
+            while ((s_fired < N / 2 || s_ticks < 5) && sylar::GetMonotonicUS() - start < 3000 * 1000)
+            {
+                usleep(10 * 1000);
+            }
+            SYLAR_ASSERT(far->cancel());
+            SYLAR_LOG_INFO(g_logger) << "wheel=" << wheel << " timers=" << N
+                                     << " add+cancel used=" << used << "us fired=" << s_fired
+                                     << " early=" << s_early << " recurring ticks=" << s_ticks;
+            SYLAR_ASSERT(s_fired == N / 2 && s_early == 0 && s_ticks == 5);
+            s_ticks = 0;
+            s_recurring.reset(); });
+    }
+    sylar::Config::Lookup<bool>("timer.wheel.enable")->setValue(false);
+}
+
+// 多 reactor 模式下工作线程各自加入取消定时器, 以及其他线程取消和重置 reactor 的定时器
+void test_local_timers(bool local)
+{
+    static const int FIBERS = 4;
+    static const int N = 50000;
+    static std::atomic<int> s_fired;
+    static std::atomic<uint64_t> s_used;
+    s_fired = 0;
+    s_used = 0;
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(true);
+    sylar::Config::Lookup<bool>("iomanager.local_timers")->setValue(local);
+    {
+        sylar::IOManager iom(2, false, "local_timers");
+        for (int f = 0; f < FIBERS; ++f)
+        {
+            iom.schedule([]()
+                         {
+                sylar::IOManager *iom = sylar::IOManager::GetThis();
+                uint64_t start = sylar::GetMonotonicUS();
+                for (int i = 0; i < N; ++i)
+                {
+                    iom->addTimer(1000 + i % 1000, []() {})->cancel();
+                }
+                s_used += sylar::GetMonotonicUS() - start; });
+        }
+        iom.schedule([local]()
+                     {
+            sylar::IOManager *iom = sylar::IOManager::GetThis();
+            // 等工作线程进入 idle 认领 reactor
+            usleep(10 * 1000);
+            sylar::Timer::ptr cancelled = iom->addTimer(50, []()
+                                                        { ++s_fired; });
+            sylar::Timer::ptr reset = iom->addTimer(10 * 1000, []()
+                                                    { ++s_fired; });
+            // 工作线程的定时器不在共用的管理器中
+            SYLAR_ASSERT(iom->hasTimer() == !local);
+            bool cancel_rt = false;
+            bool reset_rt = false;
+            std::thread t([&]()
+                          {
+                cancel_rt = cancelled->cancel();
+                reset_rt = reset->reset(20, true); });
+            t.join();
+            SYLAR_ASSERT(cancel_rt && reset_rt);
+            // 已经被取消的定时器不能再取消
+            SYLAR_ASSERT(!cancelled->cancel());
+            uint64_t start = sylar::GetMonotonicUS();
+            while (s_fired < 1 && sylar::GetMonotonicUS() - start < 1000 * 1000)
+            {
+                usleep(5 * 1000);
+            }
+            uint64_t used = sylar::GetMonotonicUS() - start;
+            usleep(60 * 1000);
+            SYLAR_LOG_INFO(g_logger) << "local_timers=" << local << " remote reset fired after "
+                                     << used << "us fired=" << s_fired;
+            SYLAR_ASSERT(s_fired == 1 && used < 500 * 1000); });
+    }
+    SYLAR_LOG_INFO(g_logger) << "local_timers=" << local << " fibers=" << FIBERS << " add+cancel="
+                             << N << " avg used=" << s_used / FIBERS << "us";
+    sylar::Config::Lookup<bool>("iomanager.local_timers")->setValue(true);
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(false);
+}
+
+// use_caller 的线程先后认领两个 IOManager 的 reactor 定时器, 前一个退出时必须解除绑定
+void test_local_timers_reuse_caller()
+{
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(true);
+    sylar::Config::Lookup<bool>("iomanager.local_timers")->setValue(true);
+    static std::atomic<int> s_fired;
+    s_fired = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+        // 第二个的 reactor 更多, 调用线程认领的最后一个 reactor 的定时器不会复用第一个释放的内存
+        sylar::IOManager iom(1 + 2 * i, true, "reuse_caller");
+        iom.schedule([]()
+                     { sylar::IOManager::GetThis()->addTimer(5, []()
+                                                             { ++s_fired; }); });
+    }
+    SYLAR_LOG_INFO(g_logger) << "local timers reuse caller fired=" << s_fired;
+    SYLAR_ASSERT(s_fired == 2);
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(false);
+}
+
+// 大量到期时间错开的超时, 对比不合并和带 slack 合并时的到期轮数, 合并后不会提前到期
+void test_timer_slack(uint64_t slack_ms)
+{
+    static const int N = 20000;
+    static std::atomic<int> s_fired;
+    static std::atomic<int> s_early;
+    static std::atomic<uint64_t> s_late;
+    s_fired = 0;
+    s_early = 0;
+    s_late = 0;
+    sylar::IOManager iom(1, false, "slack");
+    iom.schedule([slack_ms]()
+                 {
+        sylar::IOManager *iom = sylar::IOManager::GetThis();
+        for (int i = 0; i < N; ++i)
+        {
+            // 200ms 内每 10us 一个到期时间, 模拟大量连接各自的读超时
+            uint64_t us = 5000 + (i * 7919) % N * 10;
+            uint64_t deadline = sylar::GetMonotonicUS() + us;
+            iom->addTimerUs(us, [deadline]()
+                            {
+                uint64_t now = sylar::GetMonotonicUS();
+                ++s_fired;
+                if (now < deadline)
+                {
+                    ++s_early;
+                }
+                else
+                {
+                    s_late += now - deadline;
+                } }, false, slack_ms * 1000);
+        }
+        uint64_t start = sylar::GetMonotonicUS();
+        while (s_fired < N && sylar::GetMonotonicUS() - start < 3000 * 1000)
+        {
+            usleep(10 * 1000);
+        } });
+    iom.stop();
+    sylar::IOManager::SlackStat stat;
+    iom.getSlackStat(stat);
+    SYLAR_LOG_INFO(g_logger) << "slack=" << slack_ms << "ms timers=" << N << " fired=" << s_fired
+                             << " early=" << s_early << " avg late=" << s_late / std::max(1, (int)s_fired)
+                             << "us " << iom.dumpSlackStat();
+    SYLAR_ASSERT(s_fired == N && s_early == 0);
+    SYLAR_ASSERT(slack_ms == 0 || stat.timers == (uint64_t)N);
+}
+
+// ping-pong, 对比阻塞在 epoll_wait 和忙轮询的唤醒延迟
+// 忙轮询的线程会占满一个核, 只用一个工作线程, 线程数超过空闲核数时只会更慢
+void test_busy_poll(bool busy)
+{
+    static const int N = 20000;
+    sylar::Config::Lookup<bool>("iomanager.busy_poll.enable")->setValue(busy);
+    {
+        sylar::IOManager iom(1, false, "busy");
+        SYLAR_ASSERT(iom.isBusyPoll() == busy);
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        int a = fds[0];
+        int b = fds[1];
+        iom.schedule([a]()
+                     {
+            char c = 0;
+            while (recv(a, &c, 1, 0) == 1)
+            {
+                send(a, &c, 1, 0);
+            }
+            close(a); });
+        sylar::IOManager *piom = &iom;
+        iom.schedule([b, busy, piom]()
+                     {
+            char c = 0;
+            uint64_t start = sylar::GetMonotonicNS();
+            for (int i = 0; i < N; ++i)
+            {
+                send(b, &c, 1, 0);
+                SYLAR_ASSERT(recv(b, &c, 1, 0) == 1);
+            }
+            uint64_t used = sylar::GetMonotonicNS() - start;
+            close(b);
+            SYLAR_LOG_INFO(g_logger) << "busy_poll=" << busy << " round trips=" << N
+                                     << " avg=" << used / N / 1000.0 << "us";
+            SYLAR_LOG_INFO(g_logger) << piom->dumpBusyPollStat(); });
+    }
+    sylar::Config::Lookup<bool>("iomanager.busy_poll.enable")->setValue(false);
+}
+
+// 事件循环统计: 唤醒延迟, 定时器, 以及一轮中占用线程太久时的告警
+void test_loop_stat(bool multi)
+{
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(multi);
+    sylar::Config::Lookup<uint32_t>("iomanager.stat.lag_threshold")->setValue(20);
+    sylar::Config::Lookup<uint32_t>("iomanager.stat.dump_interval")->setValue(50);
+    {
+        sylar::IOManager iom(2, false, "loop");
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        int a = fds[0];
+        int b = fds[1];
+        iom.schedule([a]()
+                     {
+            char c = 0;
+            while (recv(a, &c, 1, 0) == 1)
+            {
+                send(a, &c, 1, 0);
+            }
+            close(a); });
+        iom.schedule([b]()
+                     {
+            char c = 0;
+            for (int i = 0; i < 1000; ++i)
+            {
+                send(b, &c, 1, 0);
+                recv(b, &c, 1, 0);
+                if (i % 100 == 0)
+                {
+                    usleep(1000);
+                }
+            }
+            // 不让出的计算占住线程 30ms
+            uint64_t start = sylar::GetMonotonicNS();
+            while (sylar::GetMonotonicNS() - start < 30 * 1000 * 1000)
+                ;
+            usleep(100 * 1000);
+            close(b);
+            sylar::IOManager *iom = sylar::IOManager::GetThis();
+            sylar::IOManager::LoopStat stat;
+            iom->getLoopStat(stat);
+            SYLAR_LOG_INFO(g_logger) << iom->dumpLoopStat();
+            SYLAR_ASSERT(stat.resumes > 0 && stat.timerCbs >= 10 && stat.lagAlerts >= 1);
+            SYLAR_ASSERT(iom->getLoopStat(stat, 0) == iom->isMultiReactor()); });
+    }
+    sylar::Config::Lookup<bool>("iomanager.multi_reactor")->setValue(false);
+    sylar::Config::Lookup<uint32_t>("iomanager.stat.lag_threshold")->setValue(100);
+    sylar::Config::Lookup<uint32_t>("iomanager.stat.dump_interval")->setValue(0);
+}
+
+// 有期限的排空: 一个等待及时完成, 一个一直没有数据, 超时后被取消
+void test_drain()
+{
+    sylar::IOManager iom(2, false, "drain");
+    static int fds[2][2];
+    for (int i = 0; i < 2; ++i)
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+        sylar::FdMgr::GetInstance()->get(fds[i][0], true);
+        sylar::FdMgr::GetInstance()->get(fds[i][1], true);
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        iom.schedule([i]()
+                     {
+            char c = 0;
+            int rt = recv(fds[i][0], &c, 1, 0);
+            SYLAR_LOG_INFO(g_logger) << "drain recv " << i << " rt=" << rt << " errno=" << errno;
+            SYLAR_ASSERT(i == 0 ? rt == 1 : (rt == -1 && errno == ECANCELED)); });
+    }
+    iom.schedule([]()
+                 {
+        usleep(20 * 1000);
+        send(fds[0][1], "x", 1, 0);
+        sylar::IOManager::DrainResult res;
+        bool ok = sylar::IOManager::GetThis()->drain(100, &res);
+        SYLAR_LOG_INFO(g_logger) << res.toString();
+        SYLAR_ASSERT(!ok && res.timedOut && res.cancelled.size() == 1
+                     && res.cancelled[0].first == fds[1][0]);
+        // 等被取消的协程重试返回后再关闭句柄
+        usleep(10 * 1000);
+        for (int i = 0; i < 2; ++i)
+        {
+            close(fds[i][0]);
+            close(fds[i][1]);
+        } });
+}
+
+// 监听句柄上的 accept 不计入 drain, 连接上的等待完成时外部线程立即被唤醒而不是等到超时
+void test_drain_listener()
+{
+    sylar::IOManager iom(2, false, "drain_listen");
+    static int lfd = -1;
+    static int sv[2];
+    static sockaddr_in addr;
+    sylar::Semaphore ready;
+    iom.schedule([&ready]()
+                 {
+        lfd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        socklen_t len = sizeof(addr);
+        SYLAR_ASSERT(bind(lfd, (sockaddr *)&addr, len) == 0 && listen(lfd, 16) == 0);
+        getsockname(lfd, (sockaddr *)&addr, &len);
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        ready.notify();
+        int c = accept(lfd, nullptr, nullptr);
+        SYLAR_ASSERT(c >= 0);
+        close(c);
+        close(lfd); });
+    ready.wait();
+    iom.schedule([]()
+                 {
+        char c = 0;
+        int rt = recv(sv[0], &c, 1, 0);
+        SYLAR_ASSERT(rt == 1);
+        close(sv[0]);
+        close(sv[1]); });
+    iom.schedule([]()
+                 {
+        usleep(50 * 1000);
+        send(sv[1], "x", 1, 0); });
+    usleep(10 * 1000);
+    sylar::IOManager::DrainResult res;
+    bool ok = iom.drain(1000, &res);
+    SYLAR_LOG_INFO(g_logger) << "drain with listener ok=" << ok << " " << res.toString();
+    SYLAR_ASSERT(ok && res.usedMs >= 30 && res.usedMs < 500);
+    iom.schedule([]()
+                 {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        connect(fd, (sockaddr *)&addr, sizeof(addr));
+        close(fd); });
+}
+
 int main(int argc, char **argv)
 {
+    test_drain();
+    test_drain_listener();
+    test_timer_slack(0);
+    test_timer_slack(10);
+    test_local_timers(false);
+    test_local_timers(true);
+    test_timer_wheel(false);
+    test_timer_wheel(true);
+    test_locality(false);
+    test_locality(true);
+    test_loop_stat(false);
+    test_loop_stat(true);
+    test_busy_poll(false);
+    test_busy_poll(true);
+    test_usleep(false);
+    test_usleep(true);
+    test_epoll_batch();
     // test1();
+    test_handoff(false);
+    test_handoff(true);
+    test_handoff_busy_waker();
+    test_reactor(false);
+    test_reactor(true);
+    test_reactor_before_claim();
+    // 调度结束之后调用线程仍然开启着 hook, 之后在主线程上直接调用 usleep 等的测试要放在前面
+    test_local_timers_reuse_caller();
     test_timer(); // 40:02
     return 0;
 }
\ No newline at end of file
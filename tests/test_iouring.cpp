@@ -0,0 +1,239 @@
+#include "sylar.h"
+#include "iomanager.h"
+#include "fd_manager.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const int CLIENTS = 8;
+static const int ROUNDS = 2000;
+static sockaddr_in s_addr;
+static int s_listen = -1;
+static std::atomic<int> s_done = {0};
+
+void echo(int fd)
+{
+    char buf[256];
+    while (true)
+    {
+        int rt = recv(fd, buf, sizeof(buf), 0);
+        if (rt <= 0)
+        {
+            break;
+        }
+        send(fd, buf, rt, 0);
+    }
+    close(fd);
+}
+
+void server()
+{
+    while (true)
+    {
+        int fd = accept(s_listen, nullptr, nullptr);
+        if (fd < 0)
+        {
+            SYLAR_LOG_INFO(g_logger) << "accept rt=" << fd << " errno=" << errno;
+            break;
+        }
+        sylar::IOManager::GetThis()->schedule(std::bind(&echo, fd));
+    }
+}
+
+void client(int id)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int rt = connect(fd, (sockaddr *)&s_addr, sizeof(s_addr));
+    SYLAR_ASSERT(rt == 0);
+    char out[64];
+    char in[64];
+    for (int i = 0; i < ROUNDS; ++i)
+    {
+        int len = snprintf(out, sizeof(out), "client %d round %d", id, i);
+        SYLAR_ASSERT(write(fd, out, len) == len);
+        int got = 0;
+        while (got < len)
+        {
+            rt = read(fd, in + got, len - got);
+            SYLAR_ASSERT(rt > 0);
+            got += rt;
+        }
+        SYLAR_ASSERT(memcmp(in, out, len) == 0);
+    }
+    close(fd);
+    if (++s_done == CLIENTS)
+    {
+        // 关闭监听句柄, 阻塞在 accept 上的协程返回 EBADF
+        close(s_listen);
+    }
+}
+
+void test_echo(const std::string &backend)
+{
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue(backend);
+    s_done = 0;
+    uint64_t start = sylar::GetCurrentMS();
+    {
+        sylar::IOManager iom(2, false, backend);
+        iom.schedule([]()
+                     {
+            s_listen = socket(AF_INET, SOCK_STREAM, 0);
+            memset(&s_addr, 0, sizeof(s_addr));
+            s_addr.sin_family = AF_INET;
+            s_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t len = sizeof(s_addr);
+            bind(s_listen, (sockaddr *)&s_addr, len);
+            getsockname(s_listen, (sockaddr *)&s_addr, &len);
+            listen(s_listen, 128);
+            sylar::IOManager::GetThis()->schedule(&server);
+            for (int i = 0; i < CLIENTS; ++i)
+            {
+                sylar::IOManager::GetThis()->schedule(std::bind(&client, i));
+            } });
+    }
+    SYLAR_LOG_INFO(g_logger) << "backend=" << backend << " clients=" << CLIENTS
+                             << " rounds=" << ROUNDS << " used=" << sylar::GetCurrentMS() - start << "ms";
+}
+
+// 超时, cancelEvent, close 唤醒在 io_uring 后端下与 epoll 语义一致
+void test_semantics()
+{
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("io_uring");
+    sylar::IOManager iom(1, false, "uring");
+    SYLAR_ASSERT(iom.isUring());
+    iom.schedule([]()
+                 {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+
+        timeval tv = {0, 50 * 1000};
+        setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char c;
+        uint64_t start = sylar::GetCurrentMS();
+        int rt = recv(fds[0], &c, 1, 0);
+        SYLAR_LOG_INFO(g_logger) << "recv timeout rt=" << rt << " errno=" << errno
+                                 << " used=" << sylar::GetCurrentMS() - start << "ms";
+        SYLAR_ASSERT(rt == -1 && errno == ETIMEDOUT);
+
+        static bool s_triggered = false;
+        sylar::IOManager::GetThis()->addEvent(fds[1], sylar::IOManager::READ, []()
+                                              { s_triggered = true; });
+        sylar::IOManager::GetThis()->cancelEvent(fds[1], sylar::IOManager::READ);
+        usleep(10 * 1000);
+        SYLAR_LOG_INFO(g_logger) << "cancelEvent triggered=" << s_triggered;
+        SYLAR_ASSERT(s_triggered);
+
+        // 没有超时的读, 由 close 唤醒
+        sylar::FdMgr::GetInstance()->get(fds[0])->setTimeout(SO_RCVTIMEO, -1);
+        static int s_fd = fds[0];
+        sylar::IOManager::GetThis()->schedule([]()
+                                              {
+            usleep(20 * 1000);
+            close(s_fd); });
+        rt = recv(fds[0], &c, 1, 0);
+        SYLAR_LOG_INFO(g_logger) << "recv after close rt=" << rt << " errno=" << errno;
+        SYLAR_ASSERT(rt == -1 && errno == EBADF);
+        close(fds[1]); });
+}
+
+// 直接提交的 recv 也可以被 cancelEvent 取消
+void test_cancel_direct()
+{
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("io_uring");
+    sylar::IOManager iom(1, false, "uring");
+    iom.schedule([]()
+                 {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        static int s_fd = fds[0];
+        static bool s_cancelled = false;
+        sylar::IOManager::GetThis()->schedule([]()
+                                              {
+            usleep(20 * 1000);
+            s_cancelled = sylar::IOManager::GetThis()->cancelEvent(s_fd, sylar::IOManager::READ); });
+        char c;
+        uint64_t start = sylar::GetCurrentMS();
+        int rt = recv(fds[0], &c, 1, 0);
+        SYLAR_LOG_INFO(g_logger) << "recv cancelEvent rt=" << rt << " errno=" << errno
+                                 << " cancelled=" << s_cancelled << " used=" << sylar::GetCurrentMS() - start << "ms";
+        SYLAR_ASSERT(rt == -1 && errno == ECANCELED && s_cancelled);
+        // 取消之后句柄照常可用
+        SYLAR_ASSERT(send(fds[1], "x", 1, 0) == 1);
+        SYLAR_ASSERT(recv(fds[0], &c, 1, 0) == 1 && c == 'x');
+        close(fds[0]);
+        close(fds[1]); });
+}
+
+// 读的一方不读取时 multishot recv 只缓存 recv_max_chunks 块, 其余的数据留在 socket 中, 对端的写被流控挡住
+static size_t test_recv_backpressure(uint32_t max_chunks)
+{
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue("io_uring");
+    sylar::Config::Lookup<uint32_t>("iomanager.uring.recv_max_chunks")->setValue(max_chunks);
+    static size_t s_written;
+    s_written = 0;
+    sylar::IOManager iom(1, false, "uring");
+    iom.schedule([]()
+                 {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        sylar::FdMgr::GetInstance()->get(fds[0], true);
+        sylar::FdMgr::GetInstance()->get(fds[1], true);
+        // 读一个字节, 开始 multishot recv
+        char c;
+        SYLAR_ASSERT(send(fds[1], "x", 1, 0) == 1);
+        SYLAR_ASSERT(recv(fds[0], &c, 1, 0) == 1);
+        // 不读取, 一直写到写不进去为止
+        char buf[1024];
+        memset(buf, 'a', sizeof(buf));
+        int stalls = 0;
+        while (stalls < 5)
+        {
+            ssize_t n = send(fds[1], buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0)
+            {
+                s_written += n;
+                stalls = 0;
+                continue;
+            }
+            ++stalls;
+            usleep(10 * 1000);
+        }
+        // 缓存读完之后重新开始接收, 数据完整
+        size_t total = 0;
+        while (total < s_written)
+        {
+            ssize_t n = recv(fds[0], buf, sizeof(buf), 0);
+            SYLAR_ASSERT(n > 0 && buf[0] == 'a' && buf[n - 1] == 'a');
+            total += n;
+        }
+        SYLAR_ASSERT(total == s_written);
+        close(fds[0]);
+        close(fds[1]); });
+    iom.stop();
+    SYLAR_LOG_INFO(g_logger) << "recv_max_chunks=" << max_chunks << " written before backpressure=" << s_written;
+    return s_written;
+}
+
+int main(int argc, char **argv)
+{
+    test_semantics();
+    test_echo("epoll");
+    test_echo("io_uring");
+    // 每次写 1K, 一块 1K, 64 块的缓存比 2 块多接收 62K
+    size_t capped = test_recv_backpressure(2);
+    size_t uncapped = test_recv_backpressure(64);
+    SYLAR_ASSERT(capped + 32 * 1024 < uncapped);
+    sylar::Config::Lookup<uint32_t>("iomanager.uring.recv_max_chunks")->setValue(4);
+    sylar::Config::Lookup<bool>("iomanager.uring.multishot_recv")->setValue(false);
+    test_cancel_direct();
+    test_echo("io_uring");
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "sylar.h"
+#include "iomanager.h"
+#include "fd_manager.h"
+#include "task.h"
+#include <sys/socket.h>
+#include <unistd.h>
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static int new_pair(int fds[2])
+{
+    int rt = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    sylar::FdMgr::GetInstance()->get(fds[0], true);
+    sylar::FdMgr::GetInstance()->get(fds[1], true);
+    return rt;
+}
+
+// 回显 n 次后关闭
+sylar::Task<> echo(int fd, int n)
+{
+    char buf[64];
+    for (int i = 0; i < n; ++i)
+    {
+        ssize_t rt = co_await sylar::AsyncRecv(fd, buf, sizeof(buf));
+        if (rt <= 0)
+        {
+            break;
+        }
+        co_await sylar::AsyncSend(fd, buf, rt);
+    }
+    close(fd);
+}
+
+sylar::Task<int> ping(int fd, int n)
+{
+    char c = 'x';
+    int ok = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        co_await sylar::AsyncSend(fd, &c, 1);
+        if (co_await sylar::AsyncRecv(fd, &c, 1) == 1)
+        {
+            ++ok;
+        }
+    }
+    close(fd);
+    co_return ok;
+}
+
+sylar::Task<uint64_t> sleep_ms(uint64_t ms)
+{
+    uint64_t start = sylar::GetCurrentMS();
+    co_await sylar::Sleep(ms);
+    co_return sylar::GetCurrentMS() - start;
+}
+
+sylar::Task<> test_in_task()
+{
+    int fds[2];
+    new_pair(fds);
+    sylar::Spawn(sylar::Scheduler::GetThis(), echo(fds[0], 1000));
+    int ok = co_await ping(fds[1], 1000);
+    SYLAR_LOG_INFO(g_logger) << "ping ok=" << ok;
+    SYLAR_ASSERT(ok == 1000);
+
+    uint64_t used = co_await sleep_ms(50);
+    SYLAR_LOG_INFO(g_logger) << "sleep used=" << used << "ms";
+    SYLAR_ASSERT(used >= 50);
+
+    // 没有数据可读, 等待超时
+    new_pair(fds);
+    int rt = co_await sylar::WaitEvent(fds[0], sylar::IOManager::READ, 20);
+    SYLAR_LOG_INFO(g_logger) << "wait event rt=" << rt;
+    SYLAR_ASSERT(rt == ETIMEDOUT);
+    close(fds[0]);
+    close(fds[1]);
+
+    // 在 Fiber 中执行阻塞代码
+    co_await sylar::InFiber([]()
+                            { usleep(10 * 1000); });
+    SYLAR_LOG_INFO(g_logger) << "in fiber done";
+}
+
+void test_fiber_interop()
+{
+    sylar::SyncWait(test_in_task());
+    // Fiber 中等待 Task 的返回值
+    uint64_t used = sylar::SyncWait(sleep_ms(10));
+    SYLAR_LOG_INFO(g_logger) << "SyncWait sleep used=" << used << "ms";
+}
+
+// 大量空闲连接时每个连接的内存
+void test_many()
+{
+    static const int N = 1000;
+    static int fds[N][2];
+    for (int i = 0; i < N; ++i)
+    {
+        new_pair(fds[i]);
+        sylar::Spawn(sylar::IOManager::GetThis(), echo(fds[i][0], 1));
+    }
+    usleep(100 * 1000);
+    sylar::TaskFrameStat stat = sylar::GetTaskFrameStat();
+    SYLAR_LOG_INFO(g_logger) << "connections=" << N << " frames=" << stat.frames
+                             << " bytes=" << stat.bytes
+                             << " bytes/conn=" << stat.bytes / N;
+    for (int i = 0; i < N; ++i)
+    {
+        char c = 'x';
+        send(fds[i][1], &c, 1, 0);
+        recv(fds[i][1], &c, 1, 0);
+        close(fds[i][1]);
+    }
+    usleep(100 * 1000);
+    stat = sylar::GetTaskFrameStat();
+    SYLAR_LOG_INFO(g_logger) << "after close frames=" << stat.frames
+                             << " total=" << stat.total;
+}
+
+int main(int argc, char **argv)
+{
+    sylar::IOManager iom(2, false, "task");
+    iom.schedule(&test_fiber_interop);
+    iom.schedule(&test_many);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "tcp_server.h"
 #include "iomanager.h"
 #include "log.h"
+#include "macro.h"
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -33,8 +34,64 @@ void run()
     // tcp_server->start();
 }
 
+// 处理到对方关闭为止的连接
+class DrainServer : public sylar::TcpServer
+{
+public:
+    typedef std::shared_ptr<DrainServer> ptr;
+    int getPort() { return ((sylar::IPAddress *)m_socks[0]->getLocalAddress().get())->getPort(); }
+
+protected:
+    void handleClient(sylar::Socket::ptr client) override
+    {
+        char buf[64];
+        while (client->recv(buf, sizeof(buf)) > 0)
+            ;
+        client->close();
+    }
+};
+
+// 三个连接中两个在期限内结束, 一个一直空闲, 被 drain 强制关闭
+void test_drain()
+{
+    DrainServer::ptr server(new DrainServer);
+    bool ok = server->bind(sylar::Address::LookupAny("127.0.0.1:0"));
+    SYLAR_ASSERT(ok);
+    server->start();
+    int port = server->getPort();
+    std::vector<sylar::Socket::ptr> socks;
+    for (int i = 0; i < 3; ++i)
+    {
+        auto addr = sylar::Address::LookupAnyIPAddress("127.0.0.1");
+        addr->setPort(port);
+        sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+        ok = sock->connect(addr);
+        SYLAR_ASSERT(ok);
+        socks.push_back(sock);
+    }
+    usleep(20 * 1000);
+    SYLAR_ASSERT(server->getClientCount() == 3);
+    sylar::IOManager::GetThis()->schedule([socks]()
+                                          {
+        usleep(30 * 1000);
+        socks[0]->close();
+        socks[1]->close(); });
+    uint64_t start = sylar::GetCurrentMS();
+    size_t cancelled = server->drain(200);
+    SYLAR_LOG_INFO(g_logger) << "drain cancelled=" << cancelled << " used="
+                             << sylar::GetCurrentMS() - start << "ms";
+    SYLAR_ASSERT(cancelled == 1);
+    usleep(20 * 1000);
+    SYLAR_ASSERT(server->getClientCount() == 0);
+    socks[2]->close();
+}
+
 int main(int argc, char** argv)
 {
+    {
+        sylar::IOManager iom(2, false, "drain");
+        iom.schedule(test_drain);
+    }
 
     sylar::IOManager iom(2);
     iom.schedule(run);
@@ -10,8 +10,39 @@ void test_assert()
     SYLAR_ASSERT2(1 == 2, "ac");
 }
 
+// 缓存的时钟: 刷新之后保持不变, 墙上时间与 time(0) 一致
+void test_cached_clock()
+{
+    static const int N = 1000000;
+    uint64_t start = sylar::GetMonotonicNS();
+    uint64_t sum = 0;
+    for (int i = 0; i < N; ++i)
+    {
+        sum += sylar::GetMonotonicUS();
+    }
+    uint64_t real_ns = sylar::GetMonotonicNS() - start;
+
+    uint64_t now = sylar::UpdateCachedClock();
+    start = sylar::GetMonotonicNS();
+    for (int i = 0; i < N; ++i)
+    {
+        sum += sylar::GetCachedMonotonicUS();
+    }
+    uint64_t cached_ns = sylar::GetMonotonicNS() - start;
+    SYLAR_LOG_INFO(g_logger) << "GetMonotonicUS " << real_ns / N << "ns/call, GetCachedMonotonicUS "
+                             << cached_ns / N << "ns/call sum=" << sum;
+
+    usleep(10 * 1000);
+    SYLAR_ASSERT(sylar::GetCachedMonotonicNS() == now);
+    SYLAR_ASSERT(sylar::GetMonotonicNS() >= now + 10 * 1000 * 1000);
+
+    sylar::ResetCachedClock();
+    SYLAR_ASSERT(sylar::GetCachedMonotonicNS() > now);
+}
+
 int main(int argc, char** argv)
 {
+    test_cached_clock();
     // 如果是assert(0),将会把 相对应文件中代码的行号打印出来
     // assert(0);
     test_assert();